@@ -0,0 +1,402 @@
+// Microbenchmarks of the hot paths of araneid. Every benchmark is repeated
+// and the median is reported, the results are written as JSON so they can
+// be compared between releases:
+//
+//   araneid_bench [--filter=<substring>] [--repetitions=<n>]
+//                 [--output=<path>]
+//
+// The JSON goes to stdout unless an output path is given, a readable
+// summary always goes to stderr.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/log.hpp"
+#include "base/simulator.hpp"
+#include "base/thread-pool.hpp"
+#include "base/units.hpp"
+#include "network/device.hpp"
+#include "network/flow-analyzer.hpp"
+#include "network/flow-classifier.hpp"
+#include "network/packet.hpp"
+#include "network/traffic.hpp"
+#include "network/transmission.hpp"
+
+namespace araneid {
+namespace {
+
+// Keeps the compiler from dropping a computation whose result is unused.
+template <typename T>
+inline void KeepAlive(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Result {
+  std::string name;
+  uint64_t operations;
+  int repetitions;
+  double median_ns;  // per operation
+  double min_ns;
+  double max_ns;
+};
+
+// A benchmark runs `operations` operations once and returns how long they
+// took, so setup and teardown can be left out of the measurement.
+using Benchmark = std::function<std::chrono::nanoseconds(uint64_t operations)>;
+
+struct Case {
+  std::string name;
+  uint64_t operations;
+  Benchmark run;
+};
+
+using SteadyClock = std::chrono::steady_clock;
+
+void WaitFor(const std::atomic<uint64_t>& counter, uint64_t target) {
+  while (counter.load(std::memory_order_acquire) < target) {
+    std::this_thread::yield();
+  }
+}
+
+class Counter {
+ public:
+  void Tick() { count_.fetch_add(1, std::memory_order_acq_rel); }
+  const std::atomic<uint64_t>& Count() const { return count_; }
+
+ private:
+  std::atomic<uint64_t> count_{0};
+};
+
+// The end of a link, counts what it receives.
+class CountingDevice : public Device {
+ public:
+  void Send(std::shared_ptr<Packet>) override {}
+  void Receive(std::shared_ptr<Packet>) override { counter_.Tick(); }
+  void AddTransmission(const Ipv4Address&,
+                       std::shared_ptr<Transmission>) override {}
+  Counter& GetCounter() { return counter_; }
+
+ private:
+  Counter counter_;
+};
+
+// A transmission that only counts what is sent to it, so the device lookup
+// is measured on its own.
+class CountingTransmission : public Transmission {
+ public:
+  void SendToNetwork(std::shared_ptr<Packet>) override { counter_.Tick(); }
+  void ReceiveFromNetwork(std::shared_ptr<Packet>) override {}
+  Counter& GetCounter() { return counter_; }
+
+ private:
+  Counter counter_;
+};
+
+std::vector<uint8_t> UdpFrame(const Ipv4Address& src, const Ipv4Address& dst,
+                              size_t frame_bytes) {
+  FrameTemplate frame(src, dst);
+  auto packet = frame.Build(frame_bytes, 0, ProbeHeader{});
+  const uint8_t* data = packet->GetData();
+  return std::vector<uint8_t>(data, data + packet->GetSize().Bytes());
+}
+
+// Runs the due tasks of the simulator and waits for all of them.
+void Drain(const Counter& counter, uint64_t operations) {
+  Simulator::Instance().Start(TimeDelta::Hours(24));
+  WaitFor(counter.Count(), operations);
+  Simulator::Instance().Stop();
+}
+
+std::chrono::nanoseconds SimulatorSchedule(uint64_t operations) {
+  Counter counter;
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    Simulator::Instance().Schedule(TimeDelta::Zero(), &Counter::Tick,
+                                   &counter);
+  }
+  auto elapsed = SteadyClock::now() - start;
+  Drain(counter, operations);
+  return elapsed;
+}
+
+std::chrono::nanoseconds SimulatorScheduleContended(uint64_t operations) {
+  // Four threads scheduling at once, as the links of a busy scenario do.
+  constexpr uint64_t kProducers = 4;
+  Counter counter;
+  std::vector<std::thread> producers;
+  auto start = SteadyClock::now();
+  for (uint64_t p = 0; p < kProducers; p++) {
+    producers.emplace_back([&counter, operations]() {
+      for (uint64_t i = 0; i < operations / kProducers; i++) {
+        Simulator::Instance().Schedule(TimeDelta::Zero(), &Counter::Tick,
+                                       &counter);
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  auto elapsed = SteadyClock::now() - start;
+  Drain(counter, operations / kProducers * kProducers);
+  return elapsed;
+}
+
+std::chrono::nanoseconds SimulatorDispatch(uint64_t operations) {
+  // From a queue of due tasks to all of them executed on the pool.
+  Counter counter;
+  for (uint64_t i = 0; i < operations; i++) {
+    Simulator::Instance().Schedule(TimeDelta::Zero(), &Counter::Tick,
+                                   &counter);
+  }
+  auto start = SteadyClock::now();
+  Drain(counter, operations);
+  return SteadyClock::now() - start;
+}
+
+std::chrono::nanoseconds ThreadPoolEnqueue(uint64_t operations) {
+  // From the first task enqueued to the last one executed.
+  ThreadPool pool(
+      std::max(1u, std::min(4u, std::thread::hardware_concurrency())));
+  Counter counter;
+  auto task = std::make_shared<Callback<Counter, void (Counter::*)()>>(
+      &Counter::Tick, &counter);
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    pool.Enqueue(task);
+  }
+  WaitFor(counter.Count(), operations);
+  return SteadyClock::now() - start;
+}
+
+std::chrono::nanoseconds BufferRecycle(uint64_t operations) {
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    Buffer buffer(DataSize::Bytes(1514 + Packet::kHeadroomBytes));
+    KeepAlive(buffer.Data());
+  }
+  return SteadyClock::now() - start;
+}
+
+std::chrono::nanoseconds PacketCreate(uint64_t operations) {
+  std::vector<uint8_t> frame = UdpFrame("10.0.0.1", "10.0.0.2", 1514);
+  DataSize size = DataSize::Bytes(frame.size());
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    auto packet = Packet::Create(frame.data(), size);
+    KeepAlive(packet->GetDstIpv4());
+  }
+  return SteadyClock::now() - start;
+}
+
+std::chrono::nanoseconds DeviceSend(uint64_t operations) {
+  // A device routing to 256 neighbors.
+  constexpr int kNeighbors = 256;
+  CommonDevice device;
+  std::vector<std::shared_ptr<Packet>> packets;
+  std::vector<std::shared_ptr<CountingTransmission>> transmissions;
+  for (int i = 0; i < kNeighbors; i++) {
+    Ipv4Address address = "10.0." + std::to_string(i / 250) + "." +
+                          std::to_string(i % 250 + 2);
+    transmissions.push_back(std::make_shared<CountingTransmission>());
+    device.AddTransmission(address, transmissions.back());
+    std::vector<uint8_t> frame = UdpFrame("10.0.0.1", address, 128);
+    packets.push_back(
+        Packet::Create(frame.data(), DataSize::Bytes(frame.size())));
+  }
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    device.Send(packets[i % kNeighbors]);
+  }
+  return SteadyClock::now() - start;
+}
+
+std::chrono::nanoseconds TransmissionEndToEnd(uint64_t operations) {
+  // Through a lossless link without delay, limited by the simulator only.
+  auto receiver = std::make_shared<CountingDevice>();
+  CommonTransmission transmission(std::make_unique<RandomPacketLoss>(0),
+                                  TimeDelta::Zero(),
+                                  DataRate::GigaBitsPerSecond(1000),
+                                  DataSize::GigaBytes(4));
+  transmission.SetReceiver(receiver);
+  transmission.SwitchOn();
+  std::vector<uint8_t> frame = UdpFrame("10.0.0.1", "10.0.0.2", 1514);
+  auto packet = Packet::Create(frame.data(), DataSize::Bytes(frame.size()));
+  Simulator::Instance().Start(TimeDelta::Hours(24));
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    transmission.SendToNetwork(packet);
+  }
+  WaitFor(receiver->GetCounter().Count(), operations);
+  auto elapsed = SteadyClock::now() - start;
+  Simulator::Instance().Stop();
+  return elapsed;
+}
+
+std::chrono::nanoseconds FlowClassifierHit(uint64_t operations) {
+  // A known flow behind thousands of rules, parsed from the frame and looked
+  // up like ClassifiedTransmission does.
+  FlowClassifier<int> classifier;
+  for (int i = 0; i < 4096; i++) {
+    FlowMatch match;
+    match.src_port_min = match.src_port_max = i + 1;
+    classifier.AddRule(match, i);
+  }
+  FlowMatch quic;
+  quic.protocol = 17;
+  quic.dst_port_min = quic.dst_port_max = 9;
+  classifier.AddRule(quic, 4096);
+  std::vector<uint8_t> frame = UdpFrame("10.0.0.1", "10.0.0.2", 1514);
+  int action = 0;
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    FlowKey key;
+    FlowKey::FromFrame(frame.data(), frame.size(), &key);
+    classifier.Classify(key, &action);
+    KeepAlive(action);
+  }
+  return SteadyClock::now() - start;
+}
+
+std::chrono::nanoseconds FlowAnalyzerObserve(uint64_t operations) {
+  // Twice as many UDP flows as the table holds, so frames keep evicting
+  // flows like under a flood.
+  FlowAnalyzer analyzer(4096);
+  std::vector<std::shared_ptr<Packet>> packets;
+  std::vector<uint8_t> frame = UdpFrame("10.0.0.1", "10.0.0.2", 1514);
+  for (int port = 0; port < 8192; port++) {
+    frame[34] = static_cast<uint8_t>(port >> 8);
+    frame[35] = static_cast<uint8_t>(port);
+    packets.push_back(
+        Packet::Create(frame.data(), DataSize::Bytes(frame.size())));
+  }
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    analyzer.Observe(*packets[i % packets.size()]);
+  }
+  return SteadyClock::now() - start;
+}
+
+std::chrono::nanoseconds FilteredLog(uint64_t operations) {
+  LogLevel level = Logger::GetInstance().GetLogLevel();
+  Logger::GetInstance().SetLogLevel(LOG_WARNING);
+  auto start = SteadyClock::now();
+  for (uint64_t i = 0; i < operations; i++) {
+    ALOG_DEBUG << "Filtered message " << i;
+  }
+  auto elapsed = SteadyClock::now() - start;
+  Logger::GetInstance().SetLogLevel(level);
+  return elapsed;
+}
+
+Result Measure(const Case& bench, int repetitions) {
+  // One unmeasured run warms up caches, pools and free lists.
+  bench.run(std::max<uint64_t>(bench.operations / 10, 1));
+  std::vector<double> per_operation;
+  for (int i = 0; i < repetitions; i++) {
+    std::chrono::nanoseconds elapsed = bench.run(bench.operations);
+    per_operation.push_back(static_cast<double>(elapsed.count()) /
+                            bench.operations);
+  }
+  std::sort(per_operation.begin(), per_operation.end());
+  return {bench.name,          bench.operations,
+          repetitions,         per_operation[per_operation.size() / 2],
+          per_operation.front(), per_operation.back()};
+}
+
+std::string ToJson(const std::vector<Result>& results) {
+  std::ostringstream json;
+  json << "{\n  \"version\": \"" << ARANEID_VERSION << "\",\n"
+       << "  \"timestamp\": \"" << Clock::Now().ToString() << "\",\n"
+       << "  \"threads\": " << std::thread::hardware_concurrency() << ",\n"
+       << "  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& result = results[i];
+    json << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << result.name
+         << "\", \"operations\": " << result.operations
+         << ", \"repetitions\": " << result.repetitions
+         << ", \"ns_per_op\": " << result.median_ns
+         << ", \"min_ns_per_op\": " << result.min_ns
+         << ", \"max_ns_per_op\": " << result.max_ns
+         << ", \"ops_per_second\": " << 1e9 / result.median_ns << "}";
+  }
+  json << "\n  ]\n}\n";
+  return json.str();
+}
+
+bool ParseFlag(const char* arg, const char* flag, std::string* value) {
+  size_t length = std::strlen(flag);
+  if (std::strncmp(arg, flag, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+}  // namespace
+}  // namespace araneid
+
+int main(int argc, char** argv) {
+  using namespace araneid;
+  std::string filter;
+  std::string output;
+  std::string repetitions = "5";
+  for (int i = 1; i < argc; i++) {
+    if (!ParseFlag(argv[i], "--filter", &filter) &&
+        !ParseFlag(argv[i], "--output", &output) &&
+        !ParseFlag(argv[i], "--repetitions", &repetitions)) {
+      std::cerr << "usage: " << argv[0]
+                << " [--filter=<substring>] [--repetitions=<n>]"
+                   " [--output=<path>]"
+                << std::endl;
+      return std::strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  int runs = std::max(1, std::atoi(repetitions.c_str()));
+
+  const std::vector<Case> cases = {
+      {"simulator/schedule", 200000, SimulatorSchedule},
+      {"simulator/schedule_contended", 200000, SimulatorScheduleContended},
+      {"simulator/dispatch", 200000, SimulatorDispatch},
+      {"thread_pool/enqueue", 200000, ThreadPoolEnqueue},
+      {"buffer/allocate_recycle", 2000000, BufferRecycle},
+      {"packet/create", 500000, PacketCreate},
+      {"device/send", 2000000, DeviceSend},
+      {"transmission/end_to_end", 100000, TransmissionEndToEnd},
+      {"flow_classifier/hit", 2000000, FlowClassifierHit},
+      {"flow_analyzer/observe", 2000000, FlowAnalyzerObserve},
+      {"log/filtered", 500000, FilteredLog},
+  };
+  std::vector<Result> results;
+  for (const Case& bench : cases) {
+    if (bench.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    results.push_back(Measure(bench, runs));
+    const Result& result = results.back();
+    std::cerr << bench.name << ": " << result.median_ns << " ns/op ("
+              << result.min_ns << " - " << result.max_ns << ")" << std::endl;
+  }
+
+  std::string json = ToJson(results);
+  if (output.empty()) {
+    std::cout << json;
+  } else {
+    std::ofstream file(output);
+    file << json;
+    if (!file) {
+      std::cerr << "Failed to write " << output << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
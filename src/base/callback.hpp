@@ -28,14 +28,15 @@ class Callback<T, R (T::*)(Args...)> : public CallbackBase {
   Callback(MemFuncPtr func, T* instance, Ts&&... args)
       : func_(func), instance_(instance), args_(std::forward<Ts>(args)...) {}
 
+  // Arguments are passed as lvalues, so periodic callbacks can be executed
+  // more than once with the same bound arguments.
   void Execute() override {
     std::apply(
-        [this](Args&&... args) {
+        [this](auto&... args) {
           if constexpr (std::is_void_v<R>) {  // C++17 起支持
-            (instance_->*func_)(std::forward<Args>(args)...);
+            (instance_->*func_)(args...);
           } else {
-            [[maybe_unused]] auto&& result =
-                (instance_->*func_)(std::forward<Args>(args)...);
+            [[maybe_unused]] auto&& result = (instance_->*func_)(args...);
           }
         },
         args_);
@@ -44,7 +45,7 @@ class Callback<T, R (T::*)(Args...)> : public CallbackBase {
  private:
   MemFuncPtr func_;
   T* instance_;
-  std::tuple<Args...> args_;
+  std::tuple<std::decay_t<Args>...> args_;
 };
 
 // Specialization for const member functions
@@ -59,9 +60,12 @@ class Callback<T, R (T::*)(Args...) const> : public CallbackBase {
 
   void Execute() override {
     std::apply(
-        [this](Args&&... args) {
-          [[maybe_unused]] auto&& result =
-              (instance_->*func_)(std::forward<Args>(args)...);
+        [this](auto&... args) {
+          if constexpr (std::is_void_v<R>) {
+            (instance_->*func_)(args...);
+          } else {
+            [[maybe_unused]] auto&& result = (instance_->*func_)(args...);
+          }
         },
         args_);
   }
@@ -69,7 +73,7 @@ class Callback<T, R (T::*)(Args...) const> : public CallbackBase {
  private:
   MemFuncPtr func_;
   T* instance_;
-  std::tuple<Args...> args_;
+  std::tuple<std::decay_t<Args>...> args_;
 };
 
 // Deduction guides (simplify template parameter deduction)
@@ -0,0 +1,87 @@
+#include "hdr-histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace araneid {
+
+HdrHistogram::HdrHistogram() { Reset(); }
+
+size_t HdrHistogram::IndexOf(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  // Above the exact range, every power of two is split into half as many
+  // sub-buckets, indexed by the bits below the highest one.
+  int highest_bit = 63 - __builtin_clzll(value);
+  int shift = highest_bit - kSubBucketBits + 1;
+  return kSubBuckets + (shift - 1) * kHalfSubBuckets +
+         ((value >> shift) - kHalfSubBuckets);
+}
+
+uint64_t HdrHistogram::HighestValueAt(size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  size_t shift = (index - kSubBuckets) / kHalfSubBuckets + 1;
+  uint64_t sub_bucket = (index - kSubBuckets) % kHalfSubBuckets;
+  return ((kHalfSubBuckets + sub_bucket + 1) << shift) - 1;
+}
+
+void HdrHistogram::Record(uint64_t value) {
+  value = std::min(value, kMaxValue);
+  counts_[IndexOf(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  uint64_t min = min_.load(std::memory_order_relaxed);
+  while (value < min && !min_.compare_exchange_weak(
+                            min, value, std::memory_order_relaxed)) {
+  }
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max && !max_.compare_exchange_weak(
+                            max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void HdrHistogram::Reset() {
+  for (auto& count : counts_) {
+    count.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  min_.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t HdrHistogram::Min() const {
+  return Count() == 0 ? 0 : min_.load(std::memory_order_relaxed);
+}
+
+double HdrHistogram::Mean() const {
+  uint64_t count = Count();
+  return count == 0 ? 0 : static_cast<double>(sum_.load()) / count;
+}
+
+uint64_t HdrHistogram::Percentile(double percentile) const {
+  uint64_t total = 0;
+  for (const auto& count : counts_) {
+    total += count.load(std::memory_order_relaxed);
+  }
+  if (total == 0) {
+    return 0;
+  }
+  double clamped = std::min(std::max(percentile, 0.0), 100.0);
+  uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(clamped / 100 * total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kCounts; i++) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(HighestValueAt(i), Max());
+    }
+  }
+  return Max();
+}
+
+}  // namespace araneid
@@ -0,0 +1,57 @@
+#ifndef ARANEID_BASE_HDR_HISTOGRAM_HPP
+#define ARANEID_BASE_HDR_HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace araneid {
+
+// A high dynamic range histogram of non-negative values, like latencies in
+// nanoseconds. Values below 2^kSubBucketBits are counted exactly, larger
+// ones in buckets less than 1% wide, up to kMaxValue, which larger values
+// are clamped to. Recording is lock-free and can be done from any thread,
+// reads are consistent once the recording threads are quiet.
+class HdrHistogram {
+ public:
+  static constexpr int kSubBucketBits = 8;
+  // About 18 minutes in nanoseconds.
+  static constexpr uint64_t kMaxValue = (uint64_t{1} << 40) - 1;
+
+  HdrHistogram();
+  HdrHistogram(const HdrHistogram&) = delete;
+  HdrHistogram& operator=(const HdrHistogram&) = delete;
+
+  void Record(uint64_t value);
+  void Reset();
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  // 0 if nothing was recorded.
+  uint64_t Min() const;
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  double Mean() const;
+  // The value `percentile` (0 to 100) of the recorded values are at most,
+  // rounded up to the end of its bucket.
+  uint64_t Percentile(double percentile) const;
+
+ private:
+  static constexpr uint64_t kSubBuckets = uint64_t{1} << kSubBucketBits;
+  static constexpr uint64_t kHalfSubBuckets = kSubBuckets / 2;
+  static constexpr int kMaxValueBits = 40;
+  static constexpr size_t kCounts =
+      kSubBuckets + (kMaxValueBits - kSubBucketBits) * kHalfSubBuckets;
+
+  static size_t IndexOf(uint64_t value);
+  // The largest value counted at `index`.
+  static uint64_t HighestValueAt(size_t index);
+
+  std::atomic<uint64_t> counts_[kCounts];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> min_;
+  std::atomic<uint64_t> max_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_BASE_HDR_HISTOGRAM_HPP
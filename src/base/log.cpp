@@ -39,21 +39,19 @@ Logger::Logger() : log_level_(LOG_INFO) {
   }
 }
 
-void Logger::SetLogLevel(LogLevel level) {
-  std::lock_guard<std::mutex> lock(log_mutex_);
-  log_level_ = level;
-}
+void Logger::SetLogLevel(LogLevel level) { log_level_.store(level); }
 
-LogLevel Logger::GetLogLevel() const { return log_level_; }
+LogLevel Logger::GetLogLevel() const { return log_level_.load(); }
 
 void Logger::WriteLog(LogLevel level, const std::string& message) {
+  if (level < log_level_.load(std::memory_order_relaxed)) {
+    return;
+  }
   std::lock_guard<std::mutex> lock(log_mutex_);
-  if (level >= log_level_) {
-    if (log_stream_.is_open()) {
-      log_stream_ << message << std::endl;
-    } else {
-      std::cerr << "Log file is not open." << std::endl;
-    }
+  if (log_stream_.is_open()) {
+    log_stream_ << message << std::endl;
+  } else {
+    std::cerr << "Log file is not open." << std::endl;
   }
 }
 
@@ -1,5 +1,6 @@
 #ifndef ARANEID_BASE_LOG_HPP
 #define ARANEID_BASE_LOG_HPP
+#include <atomic>
 #include <fstream>
 #include <mutex>
 #include <sstream>
@@ -24,7 +25,9 @@ class Logger {
       log_stream_.close();
     }
   }
-  LogLevel log_level_;
+  // Filtered messages are dropped without the lock, so scenarios running
+  // side by side don't queue up on it.
+  std::atomic<LogLevel> log_level_;
   std::ofstream log_stream_;
   std::mutex log_mutex_;
 };
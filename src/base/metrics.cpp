@@ -0,0 +1,116 @@
+#include "metrics.hpp"
+
+#include <sstream>
+
+#include "hdr-histogram.hpp"
+
+namespace araneid {
+
+static std::string EscapeLabel(const std::string& value) {
+  std::string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+std::string MetricsWriter::Sample(const std::string& name,
+                                  const MetricLabels& labels, double value) {
+  std::ostringstream sample;
+  sample << name;
+  if (!labels.empty()) {
+    sample << "{";
+    for (size_t i = 0; i < labels.size(); i++) {
+      sample << (i == 0 ? "" : ",") << labels[i].first << "=\""
+             << EscapeLabel(labels[i].second) << "\"";
+    }
+    sample << "}";
+  }
+  sample.precision(17);
+  sample << " " << value;
+  return sample.str();
+}
+
+void MetricsWriter::Add(const std::string& name, const std::string& help,
+                        const std::string& type, const std::string& sample) {
+  Family& family = families_[name];
+  if (family.type.empty()) {
+    family.help = help;
+    family.type = type;
+  }
+  family.samples.push_back(sample);
+}
+
+void MetricsWriter::Counter(const std::string& name, const std::string& help,
+                            uint64_t value, const MetricLabels& labels) {
+  Add(name, help, "counter",
+      Sample(name, labels, static_cast<double>(value)));
+}
+
+void MetricsWriter::Gauge(const std::string& name, const std::string& help,
+                          double value, const MetricLabels& labels) {
+  Add(name, help, "gauge", Sample(name, labels, value));
+}
+
+void MetricsWriter::Summary(const std::string& name, const std::string& help,
+                            const HdrHistogram& histogram_ns,
+                            const MetricLabels& labels) {
+  for (double quantile : {0.5, 0.9, 0.99, 0.999}) {
+    MetricLabels quantile_labels = labels;
+    std::ostringstream text;
+    text << quantile;
+    quantile_labels.emplace_back("quantile", text.str());
+    Add(name, help, "summary",
+        Sample(name, quantile_labels,
+               histogram_ns.Percentile(quantile * 100) / 1e9));
+  }
+  uint64_t count = histogram_ns.Count();
+  Add(name, help, "summary",
+      Sample(name + "_sum", labels, histogram_ns.Mean() * count / 1e9));
+  Add(name, help, "summary",
+      Sample(name + "_count", labels, static_cast<double>(count)));
+}
+
+std::string MetricsWriter::ToText() const {
+  std::string text;
+  for (const auto& [name, family] : families_) {
+    text += "# HELP " + name + " " + family.help + "\n";
+    text += "# TYPE " + name + " " + family.type + "\n";
+    for (const auto& sample : family.samples) {
+      text += sample + "\n";
+    }
+  }
+  return text;
+}
+
+uint64_t Metrics::AddCollector(Collector collector) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t id = next_id_++;
+  collectors_[id] = std::move(collector);
+  return id;
+}
+
+void Metrics::RemoveCollector(uint64_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  collectors_.erase(id);
+}
+
+std::string Metrics::Render() {
+  MetricsWriter writer;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& [id, collector] : collectors_) {
+      collector(&writer);
+    }
+  }
+  return writer.ToText();
+}
+
+}  // namespace araneid
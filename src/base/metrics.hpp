@@ -0,0 +1,77 @@
+#ifndef ARANEID_BASE_METRICS_HPP
+#define ARANEID_BASE_METRICS_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace araneid {
+class HdrHistogram;
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// Collects the samples of one rendering and writes them in the Prometheus
+// text format, with the samples of a metric grouped under one HELP and TYPE
+// line, whichever collector they come from.
+class MetricsWriter {
+ public:
+  void Counter(const std::string& name, const std::string& help,
+               uint64_t value, const MetricLabels& labels = {});
+  void Gauge(const std::string& name, const std::string& help, double value,
+             const MetricLabels& labels = {});
+  // Quantiles, sum and count of a histogram of nanoseconds, in seconds.
+  void Summary(const std::string& name, const std::string& help,
+               const HdrHistogram& histogram_ns,
+               const MetricLabels& labels = {});
+
+  std::string ToText() const;
+
+ private:
+  struct Family {
+    std::string help;
+    std::string type;
+    std::vector<std::string> samples;
+  };
+  void Add(const std::string& name, const std::string& help,
+           const std::string& type, const std::string& sample);
+  static std::string Sample(const std::string& name,
+                            const MetricLabels& labels, double value);
+
+  std::map<std::string, Family> families_;
+};
+
+// Metrics is the registry of everything araneid exposes for scraping. The
+// components keep their own lock-free counters and register a collector
+// reading them, so rendering never pauses the data path; collectors only
+// run under the lock of the registry.
+class Metrics {
+ public:
+  using Collector = std::function<void(MetricsWriter*)>;
+
+  static Metrics& Instance() {
+    static Metrics instance;
+    return instance;
+  }
+
+  // Returns an id for RemoveCollector(). A collector must be removed before
+  // what it reads is destroyed, and isn't running once it is removed.
+  uint64_t AddCollector(Collector collector);
+  void RemoveCollector(uint64_t id);
+
+  std::string Render();
+
+ private:
+  Metrics() : next_id_(1) {}
+
+  std::mutex mutex_;
+  uint64_t next_id_;
+  std::map<uint64_t, Collector> collectors_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_BASE_METRICS_HPP
@@ -0,0 +1,74 @@
+#ifndef ARANEID_BASE_MPSC_QUEUE_HPP
+#define ARANEID_BASE_MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace araneid {
+
+// An unbounded lock-free queue for any number of producer threads and one
+// consumer thread. Producers push onto a list with a single compare and
+// swap, the consumer takes the whole list at once and hands the values out
+// in the order they were pushed, so it pays one atomic exchange per batch.
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue() : head_(nullptr) {}
+  ~MpscQueue() {
+    Node* node = head_.load();
+    while (node != nullptr) {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  // Producer side.
+  void Push(T value) {
+    Node* node = new Node{std::move(value), head_.load()};
+    while (!head_.compare_exchange_weak(node->next, node)) {
+    }
+  }
+
+  // Either side, the result may be stale by the time it is used.
+  bool Empty() const { return head_.load() == nullptr; }
+
+  // Consumer side. Calls `consume` with every value pushed so far, oldest
+  // first, and returns how many there were.
+  template <typename F>
+  size_t Drain(F&& consume) {
+    Node* node = head_.exchange(nullptr);
+    // The list is newest first.
+    Node* oldest = nullptr;
+    while (node != nullptr) {
+      Node* next = node->next;
+      node->next = oldest;
+      oldest = node;
+      node = next;
+    }
+    size_t count = 0;
+    while (oldest != nullptr) {
+      Node* next = oldest->next;
+      consume(std::move(oldest->value));
+      delete oldest;
+      oldest = next;
+      count++;
+    }
+    return count;
+  }
+
+ private:
+  struct Node {
+    T value;
+    Node* next;
+  };
+
+  std::atomic<Node*> head_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_BASE_MPSC_QUEUE_HPP
@@ -0,0 +1,32 @@
+#include "random.hpp"
+
+#include <random>
+
+namespace araneid {
+
+namespace {
+struct SeedStream {
+  bool seeded = false;
+  uint64_t seed = 0;
+  uint64_t drawn = 0;
+};
+thread_local SeedStream seed_stream;
+}  // namespace
+
+uint64_t RandomSeed() {
+  if (!seed_stream.seeded) {
+    std::random_device device;
+    return (static_cast<uint64_t>(device()) << 32) | device();
+  }
+  return MixSeed(seed_stream.seed + MixSeed(seed_stream.drawn++));
+}
+
+void SetRandomSeed(uint64_t seed) {
+  seed_stream.seeded = true;
+  seed_stream.seed = seed;
+  seed_stream.drawn = 0;
+}
+
+void ClearRandomSeed() { seed_stream.seeded = false; }
+
+}  // namespace araneid
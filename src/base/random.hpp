@@ -0,0 +1,29 @@
+#ifndef ARANEID_BASE_RANDOM_HPP
+#define ARANEID_BASE_RANDOM_HPP
+
+#include <cstdint>
+
+namespace araneid {
+
+// A seed for the random stream of a component, like a loss model or a
+// traffic generator. Seeds come from std::random_device, unless
+// SetRandomSeed() was called on the calling thread; from then on the n-th
+// seed drawn is derived from the seed and n, so a scenario building its
+// components in the same order gets the same streams in every run, whatever
+// other threads do.
+uint64_t RandomSeed();
+void SetRandomSeed(uint64_t seed);
+// Back to std::random_device for the calling thread.
+void ClearRandomSeed();
+
+// SplitMix64, it turns a counter into well mixed seeds.
+constexpr uint64_t MixSeed(uint64_t value) {
+  value += 0x9e3779b97f4a7c15ull;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+  return value ^ (value >> 31);
+}
+
+}  // namespace araneid
+
+#endif  // ARANEID_BASE_RANDOM_HPP
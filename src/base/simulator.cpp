@@ -1,106 +1,449 @@
 #include "simulator.hpp"
 
-#include <condition_variable>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
 #include <mutex>
 
 #include "log.hpp"
+#include "metrics.hpp"
 
 namespace araneid {
 constexpr uint32_t kMaxThreads = 4;
+// The period of automatic dilation by the wall clock, how many of its tasks
+// may be late, and by how many the backlog of the pool may grow in it.
+constexpr TimeDelta kDilationPeriod = TimeDelta::Millis(100);
+constexpr double kLateTasksAllowed = 0.01;
+constexpr uint64_t kMinLateTasks = 10;
+constexpr double kBacklogAllowed = 0.1;
+constexpr int kPunctualPeriodsToShrink = 10;
+// The worker is awake, or waits for a task with no deadline.
+constexpr int64_t kAwake = 0;
+constexpr int64_t kNoDeadline = INT64_MAX;
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "a futex is a plain 32-bit word");
+
+// Sleep while `word` holds `expected`, until `deadline_ns` of the realtime
+// clock, which is the one Clock::Now() reads.
+static void FutexWait(std::atomic<uint32_t>* word, uint32_t expected,
+                      int64_t deadline_ns) {
+  struct timespec deadline;
+  deadline.tv_sec = deadline_ns / 1000000000;
+  deadline.tv_nsec = deadline_ns % 1000000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+          FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME,
+          expected, deadline_ns == kNoDeadline ? nullptr : &deadline, nullptr,
+          FUTEX_BITSET_MATCH_ANY);
+}
+
+static void FutexWake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+          FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, nullptr, nullptr, 0);
+}
+
+static int64_t SinceEpochNanos(TimePoint time) {
+  return (time - TimePoint()).Nanos();
+}
 
 void TimedTask::Repeat() {
   if (is_periodic_) {
     execution_time_ = execution_time_ + interval_;
+    scheduled_at_ns_ = ScheduledAt();
   }
 }
 
-std::shared_ptr<CallbackBase> TimedTask::GetCallback() {
-  return std::move(callback_);
+std::shared_ptr<CallbackBase> TimedTask::GetCallback() { return callback_; }
+
+Simulator::Simulator(SimulatorClock clock)
+    : clock_(clock),
+      virtual_now_ns_(0),
+      next_sequence_(0),
+      sleep_deadline_ns_(kAwake),
+      wake_word_(0),
+      stop_(true),
+      pending_tasks_(0),
+      dispatched_tasks_(0),
+      dilated_(false),
+      anchor_version_(0),
+      anchor_wall_ns_(0),
+      anchor_simulated_ns_(0),
+      anchor_dilation_(1.0),
+      auto_dilation_(false),
+      max_lateness_ns_(0),
+      late_tasks_(0),
+      max_dilation_(1.0),
+      period_dispatched_tasks_(0),
+      period_late_tasks_(0),
+      period_queued_tasks_(0),
+      punctual_periods_(0),
+      settling_(false) {
+  static std::atomic<uint64_t> simulators(0);
+  name_ = "simulator" + std::to_string(simulators.fetch_add(1));
+  // A virtual clock runs its tasks inline, the pool is only for the wall
+  // clock.
+  if (clock_ == SimulatorClock::kWallClock) {
+    thread_pool_ = std::make_shared<ThreadPool>(
+        std::min(kMaxThreads, std::thread::hardware_concurrency()));
+  }
+  metrics_collector_ = Metrics::Instance().AddCollector(
+      [this](MetricsWriter* writer) { Collect(writer); });
+}
+
+TimePoint Simulator::Now() const {
+  if (clock_ == SimulatorClock::kVirtual) {
+    return TimePoint() + TimeDelta::Nanos(virtual_now_ns_.load());
+  }
+  if (!dilated_.load(std::memory_order_acquire)) {
+    return Clock::Now();
+  }
+  return ToSimulated(Clock::Now());
+}
+
+Simulator::Anchor Simulator::LoadAnchor() const {
+  Anchor anchor;
+  uint64_t version;
+  do {
+    version = anchor_version_.load(std::memory_order_acquire);
+    anchor.wall_ns = anchor_wall_ns_.load(std::memory_order_relaxed);
+    anchor.simulated_ns = anchor_simulated_ns_.load(std::memory_order_relaxed);
+    anchor.dilation = anchor_dilation_.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((version & 1) != 0 ||
+           version != anchor_version_.load(std::memory_order_relaxed));
+  return anchor;
+}
+
+TimePoint Simulator::ToSimulated(TimePoint wall) const {
+  Anchor anchor = LoadAnchor();
+  int64_t wall_ns = (wall - TimePoint()).Nanos() - anchor.wall_ns;
+  return TimePoint() +
+         TimeDelta::Nanos(anchor.simulated_ns +
+                          static_cast<int64_t>(wall_ns / anchor.dilation));
+}
+
+TimePoint Simulator::ToWall(TimePoint simulated) const {
+  if (!dilated_.load(std::memory_order_acquire)) {
+    return simulated;
+  }
+  Anchor anchor = LoadAnchor();
+  int64_t simulated_ns =
+      (simulated - TimePoint()).Nanos() - anchor.simulated_ns;
+  return TimePoint() +
+         TimeDelta::Nanos(anchor.wall_ns +
+                          static_cast<int64_t>(simulated_ns * anchor.dilation));
 }
 
-Simulator::Simulator()
-    : stop_(false),
-      thread_pool_(std::make_shared<ThreadPool>(
-          std::min(kMaxThreads, std::thread::hardware_concurrency()))) {}
+double Simulator::GetTimeDilation() const { return LoadAnchor().dilation; }
+
+TimeDelta Simulator::Dilate(TimeDelta simulated) const {
+  if (!dilated_.load(std::memory_order_relaxed)) {
+    return simulated;
+  }
+  return TimeDelta::Nanos(
+      static_cast<int64_t>(simulated.Nanos() * LoadAnchor().dilation));
+}
+
+void Simulator::SetTimeDilation(double factor) {
+  if (clock_ == SimulatorClock::kVirtual) {
+    ALOG_WARNING << "A simulator on the virtual clock is never late, it "
+                    "needs no dilation";
+    return;
+  }
+  if (!(factor >= 1.0)) {
+    ALOG_WARNING << "Invalid time dilation " << factor
+                 << ", simulated time can only run slower";
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(dilation_mutex_);
+    TimePoint wall = Clock::Now();
+    TimePoint simulated = Now();
+    anchor_version_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    anchor_wall_ns_.store((wall - TimePoint()).Nanos(),
+                          std::memory_order_relaxed);
+    anchor_simulated_ns_.store((simulated - TimePoint()).Nanos(),
+                               std::memory_order_relaxed);
+    anchor_dilation_.store(factor, std::memory_order_relaxed);
+    anchor_version_.fetch_add(1, std::memory_order_release);
+    dilated_.store(true, std::memory_order_release);
+  }
+  // The worker sleeps until the next task by the old dilation.
+  Wake();
+}
+
+void Simulator::EnableAutoDilation(TimeDelta max_lateness, double max_factor) {
+  if (clock_ == SimulatorClock::kVirtual) {
+    ALOG_WARNING << "A simulator on the virtual clock is never late, it "
+                    "needs no dilation";
+    return;
+  }
+  std::lock_guard<std::mutex> lock(dilation_mutex_);
+  max_lateness_ns_.store(max_lateness.Nanos());
+  max_dilation_ = std::max(max_factor, 1.0);
+  period_dispatched_tasks_ = dispatched_tasks_.load();
+  period_late_tasks_ = late_tasks_.load();
+  period_queued_tasks_ = thread_pool_->GetQueuedTasks();
+  punctual_periods_ = 0;
+  settling_ = false;
+  auto_dilation_.store(true);
+}
+
+void Simulator::DisableAutoDilation() { auto_dilation_.store(false); }
+
+void Simulator::AdjustDilation() {
+  double factor = 0;
+  {
+    std::lock_guard<std::mutex> lock(dilation_mutex_);
+    double current = GetTimeDilation();
+    uint64_t dispatched = dispatched_tasks_.load();
+    uint64_t late = late_tasks_.load();
+    uint64_t tasks = dispatched - period_dispatched_tasks_;
+    uint64_t late_tasks = late - period_late_tasks_;
+    // Tasks dispatched on time may still wait for a worker, longer and
+    // longer.
+    uint64_t queued = thread_pool_->GetQueuedTasks();
+    uint64_t backlog = queued > period_queued_tasks_
+                           ? queued - period_queued_tasks_
+                           : 0;
+    period_dispatched_tasks_ = dispatched;
+    period_late_tasks_ = late;
+    period_queued_tasks_ = queued;
+    if (settling_) {
+      // Periodic tasks behind by the old dilation have just caught up.
+      settling_ = false;
+      return;
+    }
+    if ((late_tasks > tasks * kLateTasksAllowed &&
+         late_tasks >= kMinLateTasks) ||
+        backlog > tasks * kBacklogAllowed) {
+      punctual_periods_ = 0;
+      factor = std::min(current * 2, max_dilation_);
+    } else if (current > 1.0 &&
+               ++punctual_periods_ >= kPunctualPeriodsToShrink) {
+      punctual_periods_ = 0;
+      factor = std::max(current * 0.75, 1.0);
+    }
+    if (factor == 0 || factor == current) {
+      return;
+    }
+    settling_ = true;
+  }
+  ALOG_INFO << "Simulator " << GetName() << " dilates time by " << factor;
+  SetTimeDilation(factor);
+}
+
+void Simulator::SetName(const std::string& name) {
+  std::lock_guard<std::mutex> lock(name_mutex_);
+  name_ = name;
+}
+
+std::string Simulator::GetName() const {
+  std::lock_guard<std::mutex> lock(name_mutex_);
+  return name_;
+}
+
+void Simulator::Collect(MetricsWriter* writer) const {
+  MetricLabels labels = {{"simulator", GetName()}};
+  writer->Gauge("araneid_scheduler_pending_tasks",
+                "Tasks scheduled on the simulator and not yet dispatched.",
+                pending_tasks_.load(), labels);
+  writer->Counter("araneid_scheduler_dispatched_tasks_total",
+                  "Tasks handed from the simulator to its pool.",
+                  dispatched_tasks_.load(), labels);
+  if (thread_pool_ == nullptr) {
+    return;
+  }
+  writer->Gauge("araneid_scheduler_time_dilation",
+                "How many times slower simulated time runs than the wall "
+                "clock.",
+                GetTimeDilation(), labels);
+  writer->Summary("araneid_scheduler_lateness_seconds",
+                  "How late tasks are handed to the pool.", lateness_, labels);
+  writer->Gauge("araneid_pool_workers", "Threads of the simulator pool.",
+                thread_pool_->GetWorkers(), labels);
+  writer->Gauge("araneid_pool_busy_workers",
+                "Threads of the simulator pool executing a task.",
+                thread_pool_->GetBusyWorkers(), labels);
+  writer->Gauge("araneid_pool_queued_tasks",
+                "Tasks waiting for a thread of the simulator pool.",
+                thread_pool_->GetQueuedTasks(), labels);
+  writer->Counter("araneid_pool_executed_tasks_total",
+                  "Tasks executed by the simulator pool.",
+                  thread_pool_->GetExecutedTasks(), labels);
+}
 
 Simulator::~Simulator() {
+  Metrics::Instance().RemoveCollector(metrics_collector_);
   if (!stop_.load()) {
     Stop();
   }
 }
 
-void Simulator::ProcessExpiredTasks(std::unique_lock<std::mutex>& lock) {
+void Simulator::Push(TimedTask task) {
+  TimePoint execution_time = task.GetExecutionTime();
+  pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+  ingress_.Push(std::move(task));
+  // Pairs with the worker publishing its deadline before it checks the
+  // ingress a last time, so either it sees the task or we see it asleep.
+  // Only the producer claiming the deadline wakes it, the others find it
+  // awake.
+  int64_t deadline_ns = sleep_deadline_ns_.load();
+  if (deadline_ns != kAwake &&
+      SinceEpochNanos(ToWall(execution_time)) < deadline_ns &&
+      sleep_deadline_ns_.compare_exchange_strong(deadline_ns, kAwake)) {
+    Wake();
+  }
+}
+
+void Simulator::Wake() {
+  wake_word_.fetch_add(1);
+  FutexWake(&wake_word_);
+}
+
+void Simulator::DrainIngress() {
+  // The ingress hands the tasks out in the order they were pushed, which
+  // breaks ties between tasks due at the same time.
+  ingress_.Drain([this](TimedTask&& task) {
+    task.SetSequence(next_sequence_++);
+    task_queue_.push(std::move(task));
+  });
+}
+
+void Simulator::ProcessExpiredTasks() {
+  TraceSpan span("dispatch");
+  Tracer& tracer = Tracer::Instance();
+  uint64_t dispatched = 0;
+  // Compared by the wall clock, so a task the worker woke up for is never
+  // left behind by rounding.
   TimePoint now = Clock::Now();
-  while (!task_queue_.empty() && task_queue_.top().GetExecutionTime() <= now) {
+  int64_t max_lateness_ns = auto_dilation_.load(std::memory_order_relaxed)
+                                ? max_lateness_ns_.load()
+                                : -1;
+  while (!task_queue_.empty()) {
+    TimePoint due = ToWall(task_queue_.top().GetExecutionTime());
+    if (due > now) {
+      break;
+    }
     TimedTask task = task_queue_.top();
     task_queue_.pop();
-    lock.unlock();
+    dispatched++;
+    pending_tasks_.fetch_sub(1, std::memory_order_relaxed);
+    dispatched_tasks_.fetch_add(1, std::memory_order_relaxed);
+    int64_t late_ns = (now - due).Nanos();
+    lateness_.Record(late_ns);
+    if (max_lateness_ns >= 0 && late_ns > max_lateness_ns) {
+      late_tasks_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (task.GetScheduledAt() != 0) {
+      // From Schedule() until the task is handed to the pool, and how late
+      // that is.
+      tracer.Async("queue_wait", task.GetScheduledAt(), Tracer::Now(),
+                   "late_ns", late_ns);
+    }
     thread_pool_->Enqueue(task.GetCallback());
-    lock.lock();
     if (task.IsPeriodic()) {
       task.Repeat();
-      task_queue_.push(task);
+      task.SetSequence(next_sequence_++);
+      task_queue_.push(std::move(task));
+      pending_tasks_.fetch_add(1, std::memory_order_relaxed);
     }
   }
-}
-
-template <typename T, typename R, typename... Args>
-void Simulator::Schedule(TimeDelta execution_wait, R (T::*func)(Args...),
-                         T* instance, Args&&... args) {
-  std::unique_lock<std::mutex> lock(queue_mutex_);
-  TimePoint execution_time = simulation_start_time_ + execution_wait;
-  TimedTask task(execution_time, func, instance, std::forward<Args>(args)...);
-  task_queue_.push(task);
-  cv_.notify_one();
-}
-
-template <typename T, typename R, typename... Args>
-void Simulator::Schedule(TimeDelta execution_wait, TimeDelta interval,
-                         R (T::*func)(Args...), T* instance, Args&&... args) {
-  std::unique_lock<std::mutex> lock(queue_mutex_);
-  TimePoint execution_time = simulation_start_time_ + execution_wait;
-  TimedTask task(execution_time, interval, func, instance,
-                 std::forward<Args>(args)...);
-  task_queue_.push(task);
-  cv_.notify_one();
+  span.SetArg("tasks", dispatched);
 }
 
 void Simulator::Start(TimeDelta simulation_duration) {
+  if (clock_ == SimulatorClock::kVirtual) {
+    ALOG_WARNING << "A simulator on the virtual clock is driven by Run()";
+    return;
+  }
   if (simulation_duration <= simulation_least_duration_) {
     ALOG_WARNING << "Simulation duration is less than the least duration, "
                     "there may be some tasks not executed.";
   }
-  simulation_start_time_ = Clock::Now();
-  Simulator::Instance().Schedule(simulation_duration, &Simulator::Stop, this);
   if (!stop_.exchange(false)) {
     return;
   }
+  simulation_start_time_ = Clock::Now();
+  Schedule(simulation_duration, &Simulator::Stop, this);
   worker_thread_ = std::thread([this]() {
+    Tracer::Instance().SetThreadName("simulator");
+    TimePoint next_adjustment = Clock::Now() + kDilationPeriod;
     while (!stop_) {
-      std::unique_lock<std::mutex> lock(queue_mutex_);
-      if (task_queue_.empty()) {
-        cv_.wait(lock, [this] { return stop_ || !task_queue_.empty(); });
+      bool adjusting = auto_dilation_.load();
+      if (adjusting && Clock::Now() >= next_adjustment) {
+        AdjustDilation();
+        next_adjustment = Clock::Now() + kDilationPeriod;
       }
-      if (stop_) {
-        return;
+      DrainIngress();
+      ProcessExpiredTasks();
+      int64_t deadline_ns = kNoDeadline;
+      if (!task_queue_.empty()) {
+        deadline_ns =
+            SinceEpochNanos(ToWall(task_queue_.top().GetExecutionTime()));
       }
-      if (task_queue_.empty()) {
-        continue;
+      if (adjusting) {
+        deadline_ns =
+            std::min(deadline_ns, SinceEpochNanos(next_adjustment));
       }
-      TimePoint next_trigger = task_queue_.top().GetExecutionTime();
-      if (cv_.wait_until(lock, next_trigger.ToChrono()) ==
-          std::cv_status::timeout) {
-        ProcessExpiredTasks(lock);
+      // Read the futex before publishing the deadline, a task pushed after
+      // that changes it and the wait returns at once.
+      uint32_t word = wake_word_.load();
+      sleep_deadline_ns_.store(deadline_ns);
+      if (ingress_.Empty() && !stop_ &&
+          deadline_ns > SinceEpochNanos(Clock::Now())) {
+        FutexWait(&wake_word_, word, deadline_ns);
       }
+      sleep_deadline_ns_.store(kAwake);
     }
   });
 }
 
+void Simulator::Run(TimeDelta duration) {
+  if (clock_ != SimulatorClock::kVirtual) {
+    ALOG_WARNING << "A simulator on the wall clock is driven by Start()";
+    return;
+  }
+  int64_t end_ns = virtual_now_ns_.load() + duration.Nanos();
+  TimePoint end = TimePoint() + TimeDelta::Nanos(end_ns);
+  while (true) {
+    // The tasks may have scheduled more tasks.
+    DrainIngress();
+    if (task_queue_.empty() || task_queue_.top().GetExecutionTime() > end) {
+      break;
+    }
+    TimedTask task = task_queue_.top();
+    task_queue_.pop();
+    pending_tasks_.fetch_sub(1, std::memory_order_relaxed);
+    dispatched_tasks_.fetch_add(1, std::memory_order_relaxed);
+    // Tasks scheduled in the past run now, the clock never goes back.
+    int64_t at_ns = (task.GetExecutionTime() - TimePoint()).Nanos();
+    if (at_ns > virtual_now_ns_.load()) {
+      virtual_now_ns_.store(at_ns);
+    }
+    std::shared_ptr<CallbackBase> callback = task.GetCallback();
+    if (task.IsPeriodic()) {
+      task.Repeat();
+      task.SetSequence(next_sequence_++);
+      task_queue_.push(std::move(task));
+      pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+    }
+    callback->Execute();
+  }
+  virtual_now_ns_.store(end_ns);
+}
+
 void Simulator::Stop() {
   if (stop_.exchange(true)) {
     return;
   }
-  cv_.notify_all();
+  Wake();
   if (worker_thread_.joinable()) {
     worker_thread_.join();
   }
@@ -1,103 +1,243 @@
 #ifndef ARANEID_BASE_SIMULATOR_HPP
 #define ARANEID_BASE_SIMULATOR_HPP
 #include <atomic>
-#include <condition_variable>
+#include <mutex>
+#include <string>
 #include <thread>
 
 #include "callback.hpp"
+#include "hdr-histogram.hpp"
+#include "mpsc-queue.hpp"
 #include "thread-pool.hpp"
 #include "time.hpp"
+#include "tracer.hpp"
 
 namespace araneid {
+class MetricsWriter;
+
 // The core of simulation is timed task scheduling, which is implemented
 // using a priority queue. Every task has an execution time and an optional
 // interval. The task is executed when the current time reaches the
 // execution time. If the task is periodic, it will be rescheduled with
-// the same interval.
+// the same interval. Tasks due at the same time run in the order they were
+// scheduled, so a run on the virtual clock is reproducible.
 class TimedTask {
  public:
-  template <typename T, typename R, typename... Args>
+  template <typename T, typename R, typename... Args, typename... Ts>
   TimedTask(TimePoint execution_time, R (T::*func)(Args...), T* instance,
-            Args&&... args)
+            Ts&&... args)
       : execution_time_(execution_time),
         interval_(TimeDelta::Zero()),
         callback_(std::make_shared<Callback<T, R (T::*)(Args...)>>(
-            func, instance, std::forward<Args>(args)...)),
-        is_periodic_(false) {}
+            func, instance, std::forward<Ts>(args)...)),
+        is_periodic_(false),
+        scheduled_at_ns_(ScheduledAt()) {}
 
-  template <typename T, typename R, typename... Args>
+  template <typename T, typename R, typename... Args, typename... Ts>
   TimedTask(TimePoint execution_time, TimeDelta interval, R (T::*func)(Args...),
-            T* instance, Args&&... args)
+            T* instance, Ts&&... args)
       : execution_time_(execution_time),
         interval_(interval),
         callback_(std::make_shared<Callback<T, R (T::*)(Args...)>>(
-            func, instance, std::forward<Args>(args)...)),
-        is_periodic_(true) {}
+            func, instance, std::forward<Ts>(args)...)),
+        is_periodic_(true),
+        scheduled_at_ns_(ScheduledAt()) {}
 
   TimePoint GetExecutionTime() const { return execution_time_; }
   void Repeat();
   bool IsPeriodic() const { return is_periodic_; }
+  // Set by the simulator whenever the task is queued.
+  void SetSequence(uint64_t sequence) { sequence_ = sequence; }
   bool operator<(const TimedTask& other) const {
-    return execution_time_ < other.execution_time_;
-  }
-  bool operator>(const TimedTask& other) const {
-    return execution_time_ > other.execution_time_;
+    return execution_time_ < other.execution_time_ ||
+           (execution_time_ == other.execution_time_ &&
+            sequence_ < other.sequence_);
   }
+  bool operator>(const TimedTask& other) const { return other < *this; }
   std::shared_ptr<CallbackBase> GetCallback();
+  // When the task was scheduled by the tracer clock, 0 if the tracer was
+  // stopped.
+  int64_t GetScheduledAt() const { return scheduled_at_ns_; }
 
  private:
+  static int64_t ScheduledAt() {
+    return Tracer::Instance().IsEnabled() ? Tracer::Now() : 0;
+  }
+
   TimePoint execution_time_;
   TimeDelta interval_;
   std::shared_ptr<CallbackBase> callback_;
   bool is_periodic_;
+  int64_t scheduled_at_ns_;
+  uint64_t sequence_ = 0;
+};
+
+enum class SimulatorClock {
+  // Tasks run when the wall clock reaches them, so the network can carry
+  // the frames of real machines.
+  kWallClock,
+  // Tasks run one after another on the thread calling Run(), and the clock
+  // jumps to each of them, so a scenario runs as fast as the CPU allows.
+  kVirtual,
 };
 
 // The simulator runs in a separate thread and uses a thread pool to
 // execute tasks. The main thread can schedule tasks and wait for
 // completion. The simulator can be started and stopped, and it will
 // automatically stop when the main thread exits.
-// The simulator uses a singleton pattern to ensure that there is only
-// one instance of the simulator in the program. The singleton instance
-// can be accessed using the Instance() method. The simulator is
-// thread-safe and can be used from multiple threads. The simulator
-// uses a condition variable to wake up the worker thread when there
-// are tasks to be executed. The worker thread will wait for the
-// condition variable to be notified when there are tasks to be
-// executed. The worker thread will also check if the simulation
+// Instance() is the simulator links and generators are bound to unless
+// they are given one of their own, more simulators can be created to run
+// independent scenarios side by side. The simulator is thread-safe and can
+// be used from multiple threads. Scheduling pushes the task onto a lock-free
+// queue, which the worker thread drains in batches into its heap, and only
+// wakes the worker, through a futex, if the task is due before it would
+// wake anyway. The worker thread will also check if the simulation
 // duration has been reached and stop the simulation if it has.
 class Simulator {
  public:
-  // Singleton instance
+  // The default simulator, on the wall clock.
   static Simulator& Instance() {
     static Simulator instance;
     return instance;
   }
+  explicit Simulator(SimulatorClock clock = SimulatorClock::kWallClock);
   ~Simulator();
+  Simulator(const Simulator&) = delete;
+  Simulator& operator=(const Simulator&) = delete;
 
-  template <typename T, typename R, typename... Args>
+  // The time of the simulator's clock, tasks are scheduled relative to it.
+  TimePoint Now() const;
+  SimulatorClock GetClock() const { return clock_; }
+  // The name of the simulator in metrics, "simulator<N>" by default.
+  void SetName(const std::string& name);
+  std::string GetName() const;
+
+  // Schedule `func` to be executed `execution_wait` from now.
+  template <typename T, typename R, typename... Args, typename... Ts>
   void Schedule(TimeDelta execution_wait, R (T::*func)(Args...), T* instance,
-                Args&&... args);
+                Ts&&... args);
 
-  template <typename T, typename R, typename... Args>
+  // Schedule `func` to be executed `execution_wait` from now, and then
+  // every `interval` until the simulator stops.
+  template <typename T, typename R, typename... Args, typename... Ts>
   void Schedule(TimeDelta execution_wait, TimeDelta interval,
-                R (T::*func)(Args...), T* instance, Args&&... args);
+                R (T::*func)(Args...), T* instance, Ts&&... args);
 
+  // For the wall clock, Start() returns at once and the tasks run on the
+  // simulator's threads.
   void Start(TimeDelta simulation_duration);
   void Stop();
+  // For the virtual clock, run the tasks due within `duration` of Now() on
+  // the calling thread, and then advance the clock by `duration`. Only one
+  // thread may run the simulator at a time.
+  void Run(TimeDelta duration);
+
+  // How late tasks are handed to the pool, in nanoseconds of the wall
+  // clock.
+  const HdrHistogram& GetLateness() const { return lateness_; }
+
+  // Time dilation, for the wall clock only. Simulated time runs `factor`
+  // times slower than the wall clock, so a 40 Gbps link still carries 40
+  // Gbit per simulated second, but the host has `factor` seconds to forward
+  // them. Every delay, rate and timer on the simulator stretches alike, and
+  // the clock carries on from where it is when the factor changes.
+  void SetTimeDilation(double factor);
+  double GetTimeDilation() const;
+  // How long `simulated` takes by the wall clock.
+  TimeDelta Dilate(TimeDelta simulated) const;
+  // Let the lateness of the scheduler pick the dilation. Every 100 ms, it
+  // doubles if more than 1%, and at least ten, of the tasks were
+  // dispatched later than `max_lateness` by the wall clock, or the backlog
+  // of the pool grew, up to `max_factor`. It shrinks by a quarter after a
+  // second on time.
+  void EnableAutoDilation(TimeDelta max_lateness = TimeDelta::Micros(200),
+                          double max_factor = 64.0);
+  void DisableAutoDilation();
 
  private:
-  Simulator();
-  void ProcessExpiredTasks(std::unique_lock<std::mutex>& lock);
-  std::priority_queue<TimedTask> task_queue_;
-  std::mutex queue_mutex_;
-  std::condition_variable cv_;
+  // Simulated time is anchored to the wall clock whenever the dilation
+  // changes.
+  struct Anchor {
+    int64_t wall_ns;
+    int64_t simulated_ns;
+    double dilation;
+  };
+  Anchor LoadAnchor() const;
+  TimePoint ToSimulated(TimePoint wall) const;
+  TimePoint ToWall(TimePoint simulated) const;
+  // Run by the worker thread every period of automatic dilation.
+  void AdjustDilation();
+  void Collect(MetricsWriter* writer) const;
+  // Any thread.
+  void Push(TimedTask task);
+  void Wake();
+  // The thread dispatching the tasks, the worker or the caller of Run().
+  void DrainIngress();
+  void ProcessExpiredTasks();
+  // Tasks scheduled and not yet moved to task_queue_.
+  MpscQueue<TimedTask> ingress_;
+  // Earliest task on top, only touched by the thread dispatching the tasks.
+  std::priority_queue<TimedTask, std::vector<TimedTask>,
+                      std::greater<TimedTask>>
+      task_queue_;
+  SimulatorClock clock_;
+  // Nanoseconds since the epoch, only for the virtual clock.
+  std::atomic<int64_t> virtual_now_ns_;
+  mutable std::mutex name_mutex_;
+  std::string name_;
+  // Only touched by the thread dispatching the tasks.
+  uint64_t next_sequence_;
+  // The wall time in nanoseconds the worker sleeps until, 0 while it is
+  // awake and INT64_MAX while it waits for a task.
+  std::atomic<int64_t> sleep_deadline_ns_;
+  // The futex the worker sleeps on, bumped to wake it.
+  std::atomic<uint32_t> wake_word_;
   std::atomic<bool> stop_;
   std::thread worker_thread_;
   std::shared_ptr<ThreadPool> thread_pool_;
   TimePoint simulation_start_time_;
   TimeDelta simulation_least_duration_;
+  std::atomic<uint64_t> pending_tasks_;
+  std::atomic<uint64_t> dispatched_tasks_;
+  HdrHistogram lateness_;
+  uint64_t metrics_collector_;
+
+  std::mutex dilation_mutex_;
+  // Never dilated, the simulated time is the wall time.
+  std::atomic<bool> dilated_;
+  // A sequence lock, odd while the anchor is written, so Now() never
+  // blocks.
+  std::atomic<uint64_t> anchor_version_;
+  std::atomic<int64_t> anchor_wall_ns_;
+  std::atomic<int64_t> anchor_simulated_ns_;
+  std::atomic<double> anchor_dilation_;
+  // Automatic dilation, the rest is guarded by dilation_mutex_.
+  std::atomic<bool> auto_dilation_;
+  std::atomic<int64_t> max_lateness_ns_;
+  std::atomic<uint64_t> late_tasks_;
+  double max_dilation_;
+  uint64_t period_dispatched_tasks_;
+  uint64_t period_late_tasks_;
+  uint64_t period_queued_tasks_;
+  int punctual_periods_;
+  // The dilation just changed, the next period is not judged.
+  bool settling_;
 };
 
+template <typename T, typename R, typename... Args, typename... Ts>
+void Simulator::Schedule(TimeDelta execution_wait, R (T::*func)(Args...),
+                         T* instance, Ts&&... args) {
+  Push(TimedTask(Now() + execution_wait, func, instance,
+                 std::forward<Ts>(args)...));
+}
+
+template <typename T, typename R, typename... Args, typename... Ts>
+void Simulator::Schedule(TimeDelta execution_wait, TimeDelta interval,
+                         R (T::*func)(Args...), T* instance, Ts&&... args) {
+  Push(TimedTask(Now() + execution_wait, interval, func, instance,
+                 std::forward<Ts>(args)...));
+}
+
 }  // namespace araneid
 
 #endif  // ARANEID_BASE_SIMULATOR_HPP
\ No newline at end of file
@@ -0,0 +1,85 @@
+#ifndef ARANEID_BASE_SPSC_RING_HPP
+#define ARANEID_BASE_SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace araneid {
+
+// A bounded lock-free queue for exactly one producer thread and one consumer
+// thread. The capacity is rounded up to a power of two. Each side caches the
+// other side's index, so the shared cache lines are only touched when the
+// cached view says the ring is full or empty.
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity)
+      : mask_(RoundUp(capacity) - 1), slots_(new T[mask_ + 1]) {}
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  size_t Capacity() const { return mask_ + 1; }
+
+  // Producer side. Returns false and leaves `value` untouched if the ring is
+  // full.
+  bool TryPush(T&& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return false;
+      }
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false if the ring is empty.
+  bool TryPop(T* value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return false;
+      }
+    }
+    // Moving out leaves an empty slot, so the ring doesn't keep the value
+    // alive.
+    *value = std::move(slots_[head & mask_]);
+    slots_[head & mask_] = T();
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Either side, the result may be stale by the time it is used.
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  static size_t RoundUp(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  static constexpr size_t kCacheLineBytes = 64;
+  const size_t mask_;
+  std::unique_ptr<T[]> slots_;
+  // Written by the consumer.
+  alignas(kCacheLineBytes) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+  // Written by the producer.
+  alignas(kCacheLineBytes) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_BASE_SPSC_RING_HPP
@@ -1,12 +1,17 @@
 #include "thread-pool.hpp"
 
 #include <mutex>
+#include <string>
 #include <thread>
+
+#include "tracer.hpp"
 namespace araneid {
 
-ThreadPool::ThreadPool(size_t num_threads) : stop_(false) {
+ThreadPool::ThreadPool(size_t num_threads)
+    : stop_(false), busy_workers_(0), queued_tasks_(0), executed_tasks_(0) {
   for (size_t i = 0; i < num_threads; ++i) {
-    workers_.emplace_back([this] {
+    workers_.emplace_back([this, i] {
+      Tracer::Instance().SetThreadName("worker " + std::to_string(i));
       while (true) {
         std::shared_ptr<CallbackBase> task;
 
@@ -18,9 +23,16 @@ ThreadPool::ThreadPool(size_t num_threads) : stop_(false) {
           }
           task = std::move(tasks_.front());
           tasks_.pop();
+          queued_tasks_.fetch_sub(1, std::memory_order_relaxed);
+          busy_workers_.fetch_add(1, std::memory_order_relaxed);
         }
 
-        task->Execute();
+        {
+          TraceSpan span("callback");
+          task->Execute();
+        }
+        busy_workers_.fetch_sub(1, std::memory_order_relaxed);
+        executed_tasks_.fetch_add(1, std::memory_order_relaxed);
       }
     });
   }
@@ -40,6 +52,7 @@ void ThreadPool::Enqueue(std::shared_ptr<CallbackBase> task) {
   {
     std::unique_lock<std::mutex> lock(queue_mutex_);
     tasks_.emplace(std::move(task));
+    queued_tasks_.fetch_add(1, std::memory_order_relaxed);
   }
   condition_.notify_one();
 }
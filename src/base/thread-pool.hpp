@@ -14,12 +14,21 @@ class ThreadPool {
   ~ThreadPool();
   void Enqueue(std::shared_ptr<CallbackBase> task);
 
+  // Occupancy, for metrics.
+  size_t GetWorkers() const { return workers_.size(); }
+  uint64_t GetBusyWorkers() const { return busy_workers_.load(); }
+  uint64_t GetQueuedTasks() const { return queued_tasks_.load(); }
+  uint64_t GetExecutedTasks() const { return executed_tasks_.load(); }
+
  private:
   std::vector<std::thread> workers_;
   std::queue<std::shared_ptr<CallbackBase>> tasks_;
   std::mutex queue_mutex_;
   std::condition_variable condition_;
   std::atomic<bool> stop_;
+  std::atomic<uint64_t> busy_workers_;
+  std::atomic<uint64_t> queued_tasks_;
+  std::atomic<uint64_t> executed_tasks_;
 };
 }  // namespace araneid
 
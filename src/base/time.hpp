@@ -11,87 +11,90 @@ class TimeDelta {
   TimeDelta() = default;
 
   template <typename Rep, typename Period>
-  explicit TimeDelta(const std::chrono::duration<Rep, Period>& duration)
+  constexpr explicit TimeDelta(
+      const std::chrono::duration<Rep, Period>& duration)
       : duration_(duration) {}
 
   template <typename Duration = std::chrono::nanoseconds>
-  Duration ToChrono() const {
+  constexpr Duration ToChrono() const {
     return std::chrono::duration_cast<Duration>(duration_);
   }
 
-  int64_t Hours() const {
+  constexpr int64_t Hours() const {
     return std::chrono::duration_cast<std::chrono::hours>(duration_).count();
   }
-  int64_t Minutes() const {
+  constexpr int64_t Minutes() const {
     return std::chrono::duration_cast<std::chrono::minutes>(duration_).count();
   }
-  int64_t Seconds() const {
+  constexpr int64_t Seconds() const {
     return std::chrono::duration_cast<std::chrono::seconds>(duration_).count();
   }
-  int64_t Millis() const {
+  constexpr int64_t Millis() const {
     return std::chrono::duration_cast<std::chrono::milliseconds>(duration_)
         .count();
   }
-  int64_t Micros() const {
+  constexpr int64_t Micros() const {
     return std::chrono::duration_cast<std::chrono::microseconds>(duration_)
         .count();
   }
-  int64_t Nanos() const {
+  constexpr int64_t Nanos() const {
     return std::chrono::duration_cast<std::chrono::nanoseconds>(duration_)
         .count();
   }
 
-  TimeDelta operator+(const TimeDelta& other) const {
+  constexpr TimeDelta operator+(const TimeDelta& other) const {
     return TimeDelta(duration_ + other.duration_);
   }
-  TimeDelta operator-(const TimeDelta& other) const {
+  constexpr TimeDelta operator-(const TimeDelta& other) const {
     return TimeDelta(duration_ - other.duration_);
   }
-  TimeDelta& operator+=(const TimeDelta& other) {
+  constexpr TimeDelta& operator+=(const TimeDelta& other) {
     duration_ += other.duration_;
     return *this;
   }
-  TimeDelta& operator-=(const TimeDelta& other) {
+  constexpr TimeDelta& operator-=(const TimeDelta& other) {
     duration_ -= other.duration_;
     return *this;
   }
 
-  bool operator==(const TimeDelta& other) const {
+  constexpr bool operator==(const TimeDelta& other) const {
     return duration_ == other.duration_;
   }
-  bool operator<(const TimeDelta& other) const {
+  constexpr bool operator<(const TimeDelta& other) const {
     return duration_ < other.duration_;
   }
-  bool operator>(const TimeDelta& other) const {
+  constexpr bool operator>(const TimeDelta& other) const {
     return duration_ > other.duration_;
   }
-  bool operator<=(const TimeDelta& other) const {
+  constexpr bool operator<=(const TimeDelta& other) const {
     return duration_ <= other.duration_;
   }
-  bool operator>=(const TimeDelta& other) const {
+  constexpr bool operator>=(const TimeDelta& other) const {
     return duration_ >= other.duration_;
   }
   std::string ToString() const;
 
-  static TimeDelta Hours(int64_t hours) {
+  static constexpr TimeDelta Hours(int64_t hours) {
     return TimeDelta(std::chrono::hours(hours));
   }
-  static TimeDelta Minutes(int64_t minutes) {
+  static constexpr TimeDelta Minutes(int64_t minutes) {
     return TimeDelta(std::chrono::minutes(minutes));
   }
-  static TimeDelta Seconds(int64_t seconds) {
+  static constexpr TimeDelta Seconds(int64_t seconds) {
     return TimeDelta(std::chrono::seconds(seconds));
   }
-  static TimeDelta Millis(int64_t ms) {
+  static constexpr TimeDelta Millis(int64_t ms) {
     return TimeDelta(std::chrono::milliseconds(ms));
   }
-  static TimeDelta Micros(int64_t us) {
+  static constexpr TimeDelta Micros(int64_t us) {
     return TimeDelta(std::chrono::microseconds(us));
   }
-  static TimeDelta Nanos(int64_t ns) {
+  static constexpr TimeDelta Nanos(int64_t ns) {
     return TimeDelta(std::chrono::nanoseconds(ns));
   }
-  static TimeDelta Zero() { return TimeDelta(std::chrono::nanoseconds(0)); }
+  static constexpr TimeDelta Zero() {
+    return TimeDelta(std::chrono::nanoseconds(0));
+  }
 
  private:
   std::chrono::nanoseconds duration_{0};
@@ -0,0 +1,188 @@
+#include "tracer.hpp"
+
+#include <time.h>
+
+#include <cinttypes>
+#include <cstdio>
+
+#include "log.hpp"
+
+namespace araneid {
+
+// Events are kept in chunks allocated as a thread needs them, a thread
+// drops events beyond kMaxChunks chunks.
+constexpr size_t kEventsPerChunk = 4096;
+constexpr size_t kMaxChunks = 256;
+
+struct Tracer::ThreadBuffer {
+  int tid;
+  std::string name;
+  std::unique_ptr<Event[]> chunks[kMaxChunks];
+  // Events below are complete, written by the owning thread only.
+  std::atomic<size_t> size{0};
+  std::atomic<uint64_t> dropped{0};
+};
+
+thread_local Tracer::ThreadBuffer* Tracer::thread_buffer_ = nullptr;
+
+Tracer::Tracer() : enabled_(false), start_ns_(0) {
+  // The logger is used when the trace is written at exit, so it must be
+  // destroyed after the tracer.
+  Logger::GetInstance();
+}
+
+Tracer::~Tracer() {
+  if (IsEnabled()) {
+    Stop();
+  }
+}
+
+int64_t Tracer::Now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void Tracer::Start(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (enabled_.load()) {
+    ALOG_WARNING << "Tracer is already recording to " << path_;
+    return;
+  }
+  path_ = path;
+  start_ns_ = Now();
+  // Events of an earlier trace are not written again.
+  for (auto& buffer : buffers_) {
+    buffer->size.store(0);
+    buffer->dropped.store(0);
+  }
+  enabled_.store(true);
+}
+
+bool Tracer::Stop() {
+  if (!enabled_.exchange(false)) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return Write();
+}
+
+Tracer::ThreadBuffer* Tracer::GetThreadBuffer() {
+  if (thread_buffer_ == nullptr) {
+    auto buffer = std::make_unique<ThreadBuffer>();
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer->tid = static_cast<int>(buffers_.size()) + 1;
+    buffer->name = "thread " + std::to_string(buffer->tid);
+    thread_buffer_ = buffer.get();
+    buffers_.push_back(std::move(buffer));
+  }
+  return thread_buffer_;
+}
+
+void Tracer::SetThreadName(const std::string& name) {
+  ThreadBuffer* buffer = GetThreadBuffer();
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffer->name = name;
+}
+
+void Tracer::Record(char phase, const char* name, int64_t start_ns,
+                    int64_t end_ns, const char* arg_name, uint64_t arg) {
+  ThreadBuffer* buffer = GetThreadBuffer();
+  size_t size = buffer->size.load(std::memory_order_relaxed);
+  size_t chunk = size / kEventsPerChunk;
+  if (chunk >= kMaxChunks) {
+    buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (buffer->chunks[chunk] == nullptr) {
+    buffer->chunks[chunk].reset(new Event[kEventsPerChunk]);
+  }
+  buffer->chunks[chunk][size % kEventsPerChunk] = {name,   arg_name, start_ns,
+                                                   end_ns, arg,      phase};
+  buffer->size.store(size + 1, std::memory_order_release);
+}
+
+static void WriteString(FILE* file, const char* text) {
+  std::fputc('"', file);
+  for (const char* c = text; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      std::fputc('\\', file);
+    }
+    std::fputc(*c, file);
+  }
+  std::fputc('"', file);
+}
+
+bool Tracer::Write() {
+  FILE* file = std::fopen(path_.c_str(), "w");
+  if (file == nullptr) {
+    ALOG_WARNING << "Failed to open trace file " << path_;
+    return false;
+  }
+  std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+  bool first = true;
+  uint64_t async_id = 0;
+  for (const auto& buffer : buffers_) {
+    std::fprintf(file,
+                 "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+                 "\"tid\":%d,\"args\":{\"name\":",
+                 first ? "" : ",\n", buffer->tid);
+    WriteString(file, buffer->name.c_str());
+    std::fputs("}}", file);
+    first = false;
+    size_t size = buffer->size.load(std::memory_order_acquire);
+    for (size_t i = 0; i < size; i++) {
+      const Event& event =
+          buffer->chunks[i / kEventsPerChunk][i % kEventsPerChunk];
+      // Microseconds since the start of the trace.
+      double start_us = (event.start_ns - start_ns_) / 1e3;
+      std::fputs(",\n{\"name\":", file);
+      WriteString(file, event.name);
+      std::fprintf(file, ",\"cat\":\"araneid\",\"pid\":1,\"tid\":%d,",
+                   buffer->tid);
+      if (event.arg_name != nullptr) {
+        std::fputs("\"args\":{", file);
+        WriteString(file, event.arg_name);
+        std::fprintf(file, ":%" PRIu64 "},", event.arg);
+      }
+      switch (event.phase) {
+        case 'X':
+          std::fprintf(file, "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f}",
+                       start_us, (event.end_ns - event.start_ns) / 1e3);
+          break;
+        case 'i':
+          std::fprintf(file, "\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f}",
+                       start_us);
+          break;
+        case 'b':
+          async_id++;
+          std::fprintf(file,
+                       "\"ph\":\"b\",\"id\":%" PRIu64 ",\"ts\":%.3f},\n"
+                       "{\"name\":",
+                       async_id, start_us);
+          WriteString(file, event.name);
+          std::fprintf(file,
+                       ",\"cat\":\"araneid\",\"pid\":1,\"tid\":%d,"
+                       "\"ph\":\"e\",\"id\":%" PRIu64 ",\"ts\":%.3f}",
+                       buffer->tid, async_id,
+                       (event.end_ns - start_ns_) / 1e3);
+          break;
+      }
+    }
+    uint64_t dropped = buffer->dropped.load();
+    if (dropped > 0) {
+      ALOG_WARNING << "Tracer dropped " << dropped << " events of "
+                   << buffer->name;
+    }
+  }
+  std::fputs("\n]}\n", file);
+  bool written = std::fclose(file) == 0;
+  if (!written) {
+    ALOG_WARNING << "Failed to write trace file " << path_;
+  } else {
+    ALOG_INFO << "Trace written to " << path_;
+  }
+  return written;
+}
+
+}  // namespace araneid
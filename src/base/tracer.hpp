@@ -0,0 +1,121 @@
+#ifndef ARANEID_BASE_TRACER_HPP
+#define ARANEID_BASE_TRACER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace araneid {
+
+// Tracer records what every thread of araneid was doing, as spans and
+// instant events on a timeline, and writes them in the Chrome trace event
+// format, which chrome://tracing and the Perfetto UI open.
+// Every thread records into a buffer of its own, so recording takes no
+// lock, and the buffers are only read when the trace is written. Names and
+// argument names must be string literals, they are kept as pointers.
+// A stopped tracer costs a relaxed load per event.
+class Tracer {
+ public:
+  static Tracer& Instance() {
+    static Tracer instance;
+    return instance;
+  }
+  ~Tracer();
+
+  // Start recording, the trace is written to `path` by Stop(), or when the
+  // program exits.
+  void Start(const std::string& path);
+  // Stop recording and write the trace, returns false if it couldn't be
+  // written.
+  bool Stop();
+  bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // The clock of the events, monotonic nanoseconds.
+  static int64_t Now();
+  // Name the calling thread on the timeline.
+  void SetThreadName(const std::string& name);
+
+  // A span on the calling thread, spans of one thread must nest.
+  void Complete(const char* name, int64_t start_ns, int64_t end_ns,
+                const char* arg_name = nullptr, uint64_t arg = 0) {
+    if (IsEnabled()) {
+      Record('X', name, start_ns, end_ns, arg_name, arg);
+    }
+  }
+  // A span that may overlap others, like the wait of a task in a queue.
+  void Async(const char* name, int64_t start_ns, int64_t end_ns,
+             const char* arg_name = nullptr, uint64_t arg = 0) {
+    if (IsEnabled()) {
+      Record('b', name, start_ns, end_ns, arg_name, arg);
+    }
+  }
+  void Instant(const char* name, const char* arg_name = nullptr,
+               uint64_t arg = 0) {
+    if (IsEnabled()) {
+      int64_t now = Now();
+      Record('i', name, now, now, arg_name, arg);
+    }
+  }
+
+ private:
+  struct Event {
+    const char* name;
+    const char* arg_name;
+    int64_t start_ns;
+    int64_t end_ns;
+    uint64_t arg;
+    char phase;  // as in the trace event format
+  };
+  struct ThreadBuffer;
+
+  Tracer();
+  void Record(char phase, const char* name, int64_t start_ns, int64_t end_ns,
+              const char* arg_name, uint64_t arg);
+  ThreadBuffer* GetThreadBuffer();
+  bool Write();
+
+  static thread_local ThreadBuffer* thread_buffer_;
+
+  std::atomic<bool> enabled_;
+  std::mutex mutex_;
+  std::string path_;
+  int64_t start_ns_;
+  // Buffers outlive their threads, so the trace keeps finished threads.
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+// Records a span from its construction to its destruction.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name)
+      : name_(name),
+        arg_name_(nullptr),
+        arg_(0),
+        start_ns_(Tracer::Instance().IsEnabled() ? Tracer::Now() : 0) {}
+  ~TraceSpan() {
+    if (start_ns_ != 0) {
+      Tracer::Instance().Complete(name_, start_ns_, Tracer::Now(), arg_name_,
+                                  arg_);
+    }
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  void SetArg(const char* arg_name, uint64_t arg) {
+    arg_name_ = arg_name;
+    arg_ = arg;
+  }
+
+ private:
+  const char* name_;
+  const char* arg_name_;
+  uint64_t arg_;
+  int64_t start_ns_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_BASE_TRACER_HPP
@@ -1,13 +1,117 @@
 #include "units.hpp"
 
 namespace araneid {
+namespace {
 
-DataRate DataSize::operator/(const TimeDelta& time_delta) const {
-  return DataRate(1.0 * bits_ / time_delta.Millis());
+using namespace unit_literals;
+
+static_assert(1500_B / 10_Gbps == TimeDelta::Nanos(1200));
+static_assert(1518_B / 10_Gbps == TimeDelta::Nanos(1215));
+static_assert(64_B / 1_Gbps == TimeDelta::Nanos(512));
+static_assert(1_bit / 3_bps == TimeDelta::Nanos(333333334));
+static_assert(1_Gbps * TimeDelta::Micros(1) == 1000_bit);
+static_assert(100_Mbps * TimeDelta::Nanos(1) == 0_bit);
+static_assert(1500_B / TimeDelta::Nanos(1200) == 10_Gbps);
+static_assert(DataRate::MegaBytesPerSecond(0.5) == 4_MBps / 8);
+static_assert(DataRate::Zero() == 1_bps);
+
+// A reference for the 128-bit arithmetic of the units, built from 32-bit
+// halves instead of the compiler's 128-bit integers.
+struct Wide {
+  uint64_t high;
+  uint64_t low;
+};
+
+constexpr Wide Multiply(uint64_t a, uint64_t b) {
+  uint64_t a_low = a & 0xffffffff, a_high = a >> 32;
+  uint64_t b_low = b & 0xffffffff, b_high = b >> 32;
+  uint64_t low_low = a_low * b_low;
+  uint64_t high_low = a_high * b_low;
+  uint64_t low_high = a_low * b_high;
+  uint64_t middle = (low_low >> 32) + (high_low & 0xffffffff) +
+                    (low_high & 0xffffffff);
+  return {a_high * b_high + (high_low >> 32) + (low_high >> 32) +
+              (middle >> 32),
+          (middle << 32) | (low_low & 0xffffffff)};
+}
+
+constexpr Wide Add(Wide a, uint64_t b) {
+  uint64_t low = a.low + b;
+  return {a.high + (low < a.low ? 1 : 0), low};
+}
+
+// Long division, saturated at the largest 64-bit quotient.
+constexpr uint64_t Divide(Wide n, uint64_t d) {
+  if (n.high >= d) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  uint64_t remainder = n.high;
+  uint64_t quotient = 0;
+  for (int bit = 63; bit >= 0; bit--) {
+    bool carry = remainder >> 63;
+    remainder = (remainder << 1) | ((n.low >> bit) & 1);
+    if (carry || remainder >= d) {
+      remainder -= d;
+      quotient |= uint64_t{1} << bit;
+    }
+  }
+  return quotient;
+}
+
+constexpr uint64_t kNanosPerSecond = 1000000000;
+constexpr uint64_t kMaxNanos = std::numeric_limits<int64_t>::max();
+
+constexpr uint64_t Next(uint64_t* state) {
+  *state = *state * 6364136223846793005 + 1442695040888963407;
+  return *state;
+}
+
+// Random operands of every magnitude.
+constexpr uint64_t Operand(uint64_t* state) {
+  return Next(state) >> (Next(state) >> 58);
 }
-TimeDelta DataSize::operator/(const DataRate& data_rate) const {
-  return TimeDelta::Micros(
-      static_cast<int64_t>(bits_ / data_rate.BitsPerSecond() * 1e6));
+
+// The properties the simulation relies on, checked at compile time for a
+// sample of operands: serialization delays are exact and never short,
+// rates and sizes over time are exact.
+constexpr bool CheckAgainstReference(int samples) {
+  uint64_t state = 0x9e3779b97f4a7c15;
+  for (int i = 0; i < samples; i++) {
+    DataSize size = DataSize::Bits(Operand(&state));
+    DataRate rate = DataRate::BitsPerSecond(Operand(&state));
+    uint64_t nanos = Operand(&state) >> 1;
+    if (nanos == 0) {
+      nanos = 1;
+    }
+    uint64_t bps = rate.BitsPerSecond();
+
+    uint64_t delay = Divide(
+        Add(Multiply(size.Bits(), kNanosPerSecond), bps - 1), bps);
+    delay = delay > kMaxNanos ? kMaxNanos : delay;
+    TimeDelta serialization = size / rate;
+    if (static_cast<uint64_t>(serialization.Nanos()) != delay) {
+      return false;
+    }
+    if (delay < kMaxNanos && rate * serialization < size) {
+      return false;
+    }
+
+    TimeDelta time_delta = TimeDelta::Nanos(static_cast<int64_t>(nanos));
+    if ((rate * time_delta).Bits() !=
+        Divide(Multiply(bps, nanos), kNanosPerSecond)) {
+      return false;
+    }
+    uint64_t average = Divide(
+        Add(Multiply(size.Bits(), kNanosPerSecond), nanos / 2), nanos);
+    if ((size / time_delta).BitsPerSecond() != (average > 0 ? average : 1)) {
+      return false;
+    }
+  }
+  return true;
 }
 
-}  // namespace araneid
\ No newline at end of file
+static_assert(CheckAgainstReference(1000),
+              "units disagree with the wide-integer reference");
+
+}  // namespace
+}  // namespace araneid
@@ -1,60 +1,85 @@
 #ifndef ARANEID_BASE_UNITS_HPP
 #define ARANEID_BASE_UNITS_HPP
 
+#include <cstdint>
 #include <cstdlib>
+#include <limits>
+#include <type_traits>
 
 #include "time.hpp"
 
 namespace araneid {
 class DataRate;
+
+// Sizes are kept in bits and rates in bits per second, both as integers, so
+// serialization delays are exact to the nanosecond: the arithmetic between
+// sizes, rates and time deltas is done in 128 bits without floating point.
+// The byte multiples are binary, a kilobyte is 1024 bytes.
 class DataSize {
  public:
-  explicit DataSize(uint64_t bits) : bits_(bits > 0 ? bits : 1) {}
-
-  uint64_t Bits() const { return bits_; }
-  uint64_t Bytes() const { return bits_ / 8; }
-  uint64_t KiloBytes() const { return bits_ / 8192; }
-  uint64_t MegaBytes() const { return bits_ / 8388608; }
-  uint64_t GigaBytes() const { return bits_ / 8589934592; }
-
-  static DataSize Zero() { return DataSize(0); }
-  static DataSize Bits(uint64_t bits) { return DataSize(bits); }
-  static DataSize Bytes(uint64_t bytes) { return DataSize(bytes * 8); }
-  static DataSize KiloBytes(uint64_t kilobytes) {
+  constexpr explicit DataSize(uint64_t bits) : bits_(bits) {}
+
+  constexpr uint64_t Bits() const { return bits_; }
+  constexpr uint64_t Bytes() const { return bits_ / 8; }
+  constexpr uint64_t KiloBytes() const { return bits_ / 8192; }
+  constexpr uint64_t MegaBytes() const { return bits_ / 8388608; }
+  constexpr uint64_t GigaBytes() const { return bits_ / 8589934592; }
+
+  static constexpr DataSize Zero() { return DataSize(0); }
+  static constexpr DataSize Bits(uint64_t bits) { return DataSize(bits); }
+  static constexpr DataSize Bytes(uint64_t bytes) {
+    return DataSize(bytes * 8);
+  }
+  static constexpr DataSize KiloBytes(uint64_t kilobytes) {
     return DataSize(kilobytes * 8192);
   }
-  static DataSize MegaBytes(uint64_t megabytes) {
+  static constexpr DataSize MegaBytes(uint64_t megabytes) {
     return DataSize(megabytes * 8388608);
   }
-  static DataSize GigaBytes(uint64_t gigabytes) {
+  static constexpr DataSize GigaBytes(uint64_t gigabytes) {
     return DataSize(gigabytes * 8589934592);
   }
 
-  bool operator==(const DataSize& other) const { return bits_ == other.bits_; }
-  bool operator!=(const DataSize& other) const { return bits_ != other.bits_; }
-  bool operator<(const DataSize& other) const { return bits_ < other.bits_; }
-  bool operator>(const DataSize& other) const { return bits_ > other.bits_; }
-  bool operator<=(const DataSize& other) const { return bits_ <= other.bits_; }
-  bool operator>=(const DataSize& other) const { return bits_ >= other.bits_; }
-  DataSize& operator+=(const DataSize& other) {
+  constexpr bool operator==(const DataSize& other) const {
+    return bits_ == other.bits_;
+  }
+  constexpr bool operator!=(const DataSize& other) const {
+    return bits_ != other.bits_;
+  }
+  constexpr bool operator<(const DataSize& other) const {
+    return bits_ < other.bits_;
+  }
+  constexpr bool operator>(const DataSize& other) const {
+    return bits_ > other.bits_;
+  }
+  constexpr bool operator<=(const DataSize& other) const {
+    return bits_ <= other.bits_;
+  }
+  constexpr bool operator>=(const DataSize& other) const {
+    return bits_ >= other.bits_;
+  }
+  constexpr DataSize& operator+=(const DataSize& other) {
     bits_ += other.bits_;
     return *this;
   }
-  DataSize& operator-=(const DataSize& other) {
+  constexpr DataSize& operator-=(const DataSize& other) {
     bits_ -= other.bits_;
     return *this;
   }
-  DataSize operator+(const DataSize& other) const {
+  constexpr DataSize operator+(const DataSize& other) const {
     return DataSize(bits_ + other.bits_);
   }
-  DataSize operator-(const DataSize& other) const {
+  constexpr DataSize operator-(const DataSize& other) const {
     return DataSize(bits_ - other.bits_);
   }
-  DataSize operator*(double factor) const {
+  constexpr DataSize operator*(double factor) const {
     return DataSize(static_cast<uint64_t>(bits_ * factor));
   }
-  DataRate operator/(const TimeDelta& time_delta) const;
-  TimeDelta operator/(const DataRate& data_rate) const;
+  // The average rate, rounded to the nearest bit per second.
+  constexpr DataRate operator/(const TimeDelta& time_delta) const;
+  // The time to serialize this size at `data_rate`, rounded up to the next
+  // nanosecond so a link never sends faster than its rate.
+  constexpr TimeDelta operator/(const DataRate& data_rate) const;
 
  private:
   uint64_t bits_;
@@ -62,83 +87,190 @@ class DataSize {
 
 class DataRate {
  public:
-  explicit DataRate(double bits_per_second)
+  // A rate is at least one bit per second, so a size can always be divided
+  // by it.
+  constexpr explicit DataRate(uint64_t bits_per_second)
       : bits_per_second_(bits_per_second > 0 ? bits_per_second : 1) {}
 
-  double BitsPerSecond() const { return bits_per_second_; }
-  double BytesPerSecond() const { return bits_per_second_ / 8; }
-  double KiloBytesPerSecond() const { return bits_per_second_ / 8192; }
-  double MegaBytesPerSecond() const { return bits_per_second_ / 8388608; }
-  double GigaBytesPerSecond() const { return bits_per_second_ / 8589934592; }
+  constexpr uint64_t BitsPerSecond() const { return bits_per_second_; }
+  constexpr double BytesPerSecond() const { return bits_per_second_ / 8.0; }
+  constexpr double KiloBytesPerSecond() const {
+    return bits_per_second_ / 8192.0;
+  }
+  constexpr double MegaBytesPerSecond() const {
+    return bits_per_second_ / 8388608.0;
+  }
+  constexpr double GigaBytesPerSecond() const {
+    return bits_per_second_ / 8589934592.0;
+  }
 
-  static DataRate Zero() { return DataRate(0); }
-  static DataRate BitsPerSecond(double bps) { return DataRate(bps); }
-  static DataRate BytesPerSecond(double bps) { return DataRate(bps * 8); }
-  static DataRate KiloBytesPerSecond(double kbps) {
-    return DataRate(kbps * 8192);
+  // Integer arguments are exact, fractional ones are rounded to the nearest
+  // bit per second. Bit rates are decimal as link speeds are quoted, byte
+  // rates binary like sizes.
+  static constexpr DataRate Zero() { return DataRate(0); }
+  template <typename T>
+  static constexpr DataRate BitsPerSecond(T bps) {
+    return DataRate(Scale(bps, 1));
+  }
+  template <typename T>
+  static constexpr DataRate KiloBitsPerSecond(T kbps) {
+    return DataRate(Scale(kbps, 1000));
+  }
+  template <typename T>
+  static constexpr DataRate MegaBitsPerSecond(T mbps) {
+    return DataRate(Scale(mbps, 1000000));
+  }
+  template <typename T>
+  static constexpr DataRate GigaBitsPerSecond(T gbps) {
+    return DataRate(Scale(gbps, 1000000000));
+  }
+  template <typename T>
+  static constexpr DataRate BytesPerSecond(T bps) {
+    return DataRate(Scale(bps, 8));
   }
-  static DataRate MegaBytesPerSecond(double mbps) {
-    return DataRate(mbps * 8388608);
+  template <typename T>
+  static constexpr DataRate KiloBytesPerSecond(T kbps) {
+    return DataRate(Scale(kbps, 8192));
   }
-  static DataRate GigaBytesPerSecond(double gbps) {
-    return DataRate(gbps * 8589934592);
+  template <typename T>
+  static constexpr DataRate MegaBytesPerSecond(T mbps) {
+    return DataRate(Scale(mbps, 8388608));
   }
-  DataRate operator+(const DataRate& other) const {
+  template <typename T>
+  static constexpr DataRate GigaBytesPerSecond(T gbps) {
+    return DataRate(Scale(gbps, 8589934592));
+  }
+
+  constexpr DataRate operator+(const DataRate& other) const {
     return DataRate(bits_per_second_ + other.bits_per_second_);
   }
-  DataRate operator-(const DataRate& other) const {
-    return DataRate(bits_per_second_ - other.bits_per_second_);
+  // Saturates at the minimum rate.
+  constexpr DataRate operator-(const DataRate& other) const {
+    return DataRate(bits_per_second_ > other.bits_per_second_
+                        ? bits_per_second_ - other.bits_per_second_
+                        : 0);
   }
-  DataRate operator*(double factor) const {
-    return DataRate(bits_per_second_ * factor);
+  constexpr DataRate operator*(double factor) const {
+    return DataRate(Scale(bits_per_second_ * factor, 1));
   }
-  DataRate operator/(double factor) const {
-    return DataRate(bits_per_second_ / factor);
+  constexpr DataRate operator/(double factor) const {
+    return DataRate(Scale(bits_per_second_ / factor, 1));
   }
-  DataSize operator*(const TimeDelta& time_delta) const {
-    return DataSize(
-        static_cast<uint64_t>(bits_per_second_ * time_delta.Millis()));
+  // The size sent in `time_delta`, rounded down to whole bits.
+  constexpr DataSize operator*(const TimeDelta& time_delta) const {
+    if (time_delta.Nanos() <= 0) {
+      return DataSize::Zero();
+    }
+    return DataSize(Narrow(static_cast<unsigned __int128>(bits_per_second_) *
+                           static_cast<uint64_t>(time_delta.Nanos()) /
+                           kNanosPerSecond));
   }
 
-  bool operator==(const DataRate& other) const {
+  constexpr bool operator==(const DataRate& other) const {
     return bits_per_second_ == other.bits_per_second_;
   }
-  bool operator!=(const DataRate& other) const {
+  constexpr bool operator!=(const DataRate& other) const {
     return bits_per_second_ != other.bits_per_second_;
   }
-  bool operator<(const DataRate& other) const {
+  constexpr bool operator<(const DataRate& other) const {
     return bits_per_second_ < other.bits_per_second_;
   }
-  bool operator>(const DataRate& other) const {
+  constexpr bool operator>(const DataRate& other) const {
     return bits_per_second_ > other.bits_per_second_;
   }
-  bool operator<=(const DataRate& other) const {
+  constexpr bool operator<=(const DataRate& other) const {
     return bits_per_second_ <= other.bits_per_second_;
   }
-  bool operator>=(const DataRate& other) const {
+  constexpr bool operator>=(const DataRate& other) const {
     return bits_per_second_ >= other.bits_per_second_;
   }
-  DataRate& operator+=(const DataRate& other) {
-    bits_per_second_ += other.bits_per_second_;
-    return *this;
+  constexpr DataRate& operator+=(const DataRate& other) {
+    return *this = *this + other;
   }
-  DataRate& operator-=(const DataRate& other) {
-    bits_per_second_ -= other.bits_per_second_;
-    return *this;
+  constexpr DataRate& operator-=(const DataRate& other) {
+    return *this = *this - other;
   }
-  DataRate& operator*=(TimeDelta& time_delta) {
-    bits_per_second_ *= time_delta.Millis();
-    return *this;
+
+ private:
+  friend class DataSize;
+  static constexpr uint64_t kNanosPerSecond = 1000000000;
+
+  template <typename T>
+  static constexpr uint64_t Scale(T value, uint64_t factor) {
+    if constexpr (std::is_integral_v<T>) {
+      return value > 0 ? static_cast<uint64_t>(value) * factor : 0;
+    } else {
+      return value > 0 ? static_cast<uint64_t>(value * factor + 0.5) : 0;
+    }
   }
-  DataRate& operator/=(TimeDelta& time_delta) {
-    bits_per_second_ /= time_delta.Millis();
-    return *this;
+  static constexpr uint64_t Narrow(unsigned __int128 value) {
+    return value > std::numeric_limits<uint64_t>::max()
+               ? std::numeric_limits<uint64_t>::max()
+               : static_cast<uint64_t>(value);
   }
 
- private:
-  double bits_per_second_;
+  uint64_t bits_per_second_;
 };
 
+constexpr DataRate DataSize::operator/(const TimeDelta& time_delta) const {
+  if (time_delta.Nanos() <= 0) {
+    return DataRate(std::numeric_limits<uint64_t>::max());
+  }
+  uint64_t nanos = static_cast<uint64_t>(time_delta.Nanos());
+  return DataRate(DataRate::Narrow(
+      (static_cast<unsigned __int128>(bits_) * DataRate::kNanosPerSecond +
+       nanos / 2) /
+      nanos));
+}
+
+constexpr TimeDelta DataSize::operator/(const DataRate& data_rate) const {
+  uint64_t bps = data_rate.bits_per_second_;
+  unsigned __int128 nanos =
+      (static_cast<unsigned __int128>(bits_) * DataRate::kNanosPerSecond +
+       bps - 1) /
+      bps;
+  return TimeDelta::Nanos(
+      nanos > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())
+          ? std::numeric_limits<int64_t>::max()
+          : static_cast<int64_t>(nanos));
+}
+
+// Literals for sizes and rates, e.g. `1500_B / 10_Gbps`.
+namespace unit_literals {
+
+constexpr DataSize operator""_bit(unsigned long long bits) {
+  return DataSize::Bits(bits);
+}
+constexpr DataSize operator""_B(unsigned long long bytes) {
+  return DataSize::Bytes(bytes);
+}
+constexpr DataSize operator""_KB(unsigned long long kilobytes) {
+  return DataSize::KiloBytes(kilobytes);
+}
+constexpr DataSize operator""_MB(unsigned long long megabytes) {
+  return DataSize::MegaBytes(megabytes);
+}
+constexpr DataSize operator""_GB(unsigned long long gigabytes) {
+  return DataSize::GigaBytes(gigabytes);
+}
+constexpr DataRate operator""_bps(unsigned long long bps) {
+  return DataRate::BitsPerSecond(bps);
+}
+constexpr DataRate operator""_Kbps(unsigned long long kbps) {
+  return DataRate::KiloBitsPerSecond(kbps);
+}
+constexpr DataRate operator""_Mbps(unsigned long long mbps) {
+  return DataRate::MegaBitsPerSecond(mbps);
+}
+constexpr DataRate operator""_Gbps(unsigned long long gbps) {
+  return DataRate::GigaBitsPerSecond(gbps);
+}
+constexpr DataRate operator""_MBps(unsigned long long mbps) {
+  return DataRate::MegaBytesPerSecond(mbps);
+}
+
+}  // namespace unit_literals
+
 }  // namespace araneid
 
-#endif
\ No newline at end of file
+#endif
@@ -1,5 +1,6 @@
 #include "device.hpp"
 
+#include "latency-profiler.hpp"
 #include "packet.hpp"
 #include "transmission.hpp"
 
@@ -9,11 +10,16 @@ void CommonDevice::Send(std::shared_ptr<Packet> packet) {
     ALOG_ERROR << "Packet is null";
     return;
   }
+  LatencyProfiler::Instance().Stamp(packet.get(), PipelineStage::kDeviceSend);
   auto it = out_goings_.find(packet->GetDstIpv4());
   if (it != out_goings_.end()) {
     it->second->SendToNetwork(packet);
+  } else if (packet->GetDstIpv4().empty()) {
+    // Frames without IPv4, like neighbor discovery from a TAP device.
+    ALOG_DEBUG << "Dropping packet without IPv4 destination.";
   } else {
-    ALOG_ERROR << "No outgoing transmission for packet's IP address.";
+    ALOG_WARNING << "No outgoing transmission for " << packet->GetDstIpv4()
+                 << ", dropping packet.";
   }
 }
 
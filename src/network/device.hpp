@@ -9,6 +9,7 @@ namespace araneid {
 
 using Ipv4Address = std::string;  // IPv4 address in string format
 
+class Bridge;
 class Transmission;
 class Packet;
 // Real network device should manage addresses, routes, and other
@@ -39,6 +40,8 @@ class CommonDevice : public Device {
                        std::shared_ptr<Transmission> transmission) override {
     out_goings_[address] = transmission;
   }
+  // Packets received from the network are forwarded to this bridge.
+  void SetBridge(std::shared_ptr<Bridge> bridge) { bridge_ = bridge; }
 
  private:
   std::shared_ptr<Bridge> bridge_;
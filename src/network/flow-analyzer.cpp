@@ -0,0 +1,498 @@
+#include "flow-analyzer.hpp"
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+#include "base/log.hpp"
+#include "base/metrics.hpp"
+
+namespace araneid {
+
+constexpr uint8_t kTcpFin = 0x01;
+constexpr uint8_t kTcpSyn = 0x02;
+constexpr uint8_t kTcpAck = 0x10;
+constexpr int kMaxWindowScale = 14;
+constexpr uint16_t kQuicPort = 443;
+
+static uint16_t Read16(const uint8_t* data) {
+  return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+static uint32_t Read32(const uint8_t* data) {
+  return static_cast<uint32_t>(data[0]) << 24 | data[1] << 16 | data[2] << 8 |
+         data[3];
+}
+
+// Sequence numbers wrap, `a` is before `b` if it is less than 2^31 behind.
+static bool SeqBefore(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) < 0;
+}
+
+static bool SeqAfter(uint32_t a, uint32_t b) { return SeqBefore(b, a); }
+
+static FlowKey Reverse(const FlowKey& key) {
+  FlowKey reversed = key;
+  std::swap(reversed.src_ip, reversed.dst_ip);
+  std::swap(reversed.src_port, reversed.dst_port);
+  return reversed;
+}
+
+// The same key for both directions of a flow.
+static FlowKey Canonical(const FlowKey& key) {
+  if (key.src_ip > key.dst_ip ||
+      (key.src_ip == key.dst_ip && key.src_port > key.dst_port)) {
+    return Reverse(key);
+  }
+  return key;
+}
+
+// Returns -1 if the options of the SYN have no window scale.
+static int ParseWindowScale(const uint8_t* options, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    uint8_t kind = options[i];
+    if (kind == 0) {
+      break;
+    }
+    if (kind == 1) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= length || options[i + 1] < 2 ||
+        i + options[i + 1] > length) {
+      break;
+    }
+    if (kind == 3 && options[i + 1] == 3) {
+      return std::min<int>(options[i + 2], kMaxWindowScale);
+    }
+    i += options[i + 1];
+  }
+  return -1;
+}
+
+static std::string FormatEndpoint(uint32_t ip, uint16_t port) {
+  std::ostringstream text;
+  text << (ip >> 24) << "." << (ip >> 16 & 0xff) << "." << (ip >> 8 & 0xff)
+       << "." << (ip & 0xff) << ":" << port;
+  return text.str();
+}
+
+DataRate FlowStats::GetGoodput(const FlowDirectionStats& direction) const {
+  TimeDelta lifetime = last_seen - first_seen;
+  if (lifetime <= TimeDelta::Zero()) {
+    return DataRate::Zero();
+  }
+  return DataSize::Bytes(direction.acked_bytes) / lifetime;
+}
+
+std::string FlowStats::ToString() const {
+  std::ostringstream text;
+  text << (quic ? "quic" : key.protocol == IPPROTO_TCP ? "tcp" : "udp") << " "
+       << FormatEndpoint(key.src_ip, key.src_port) << " > "
+       << FormatEndpoint(key.dst_ip, key.dst_port) << " frames "
+       << forward.frames << "/" << reverse.frames << " bytes " << forward.bytes
+       << "/" << reverse.bytes;
+  if (key.protocol == IPPROTO_TCP) {
+    text << " retransmissions " << forward.retransmissions << "/"
+         << reverse.retransmissions << " goodput "
+         << GetGoodput(forward).BitsPerSecond() << "/"
+         << GetGoodput(reverse).BitsPerSecond() << " bps cwnd limited "
+         << forward.cwnd_limited.ToString() << "/"
+         << reverse.cwnd_limited.ToString() << " rwnd limited "
+         << forward.rwnd_limited.ToString() << "/"
+         << reverse.rwnd_limited.ToString();
+  }
+  if (rtt_samples > 0) {
+    text << " rtt min " << min_rtt.ToString() << " smoothed "
+         << smoothed_rtt.ToString() << " samples " << rtt_samples;
+  }
+  if (evicted) {
+    text << " evicted";
+  }
+  return text.str();
+}
+
+FlowAnalyzer::FlowAnalyzer(size_t capacity, Simulator& simulator)
+    : simulator_(&simulator),
+      start_(simulator.Now()),
+      export_scheduled_(false),
+      export_interval_(TimeDelta::Zero()),
+      flows_(0),
+      frames_(0),
+      capacity_evictions_(0),
+      idle_evictions_(0),
+      retransmissions_(0) {
+  size_t slots = kProbes;
+  while (slots < capacity) {
+    slots *= 2;
+  }
+  slots_.resize(slots);
+  mask_ = slots - 1;
+  static std::atomic<uint64_t> analyzers(0);
+  name_ = "analyzer" + std::to_string(analyzers.fetch_add(1));
+  metrics_collector_ = Metrics::Instance().AddCollector(
+      [this](MetricsWriter* writer) { Collect(writer); });
+}
+
+FlowAnalyzer::~FlowAnalyzer() {
+  Metrics::Instance().RemoveCollector(metrics_collector_);
+}
+
+void FlowAnalyzer::SetName(const std::string& name) {
+  std::lock_guard<std::mutex> lock(name_mutex_);
+  name_ = name;
+}
+
+std::string FlowAnalyzer::GetName() const {
+  std::lock_guard<std::mutex> lock(name_mutex_);
+  return name_;
+}
+
+void FlowAnalyzer::Observe(const Packet& packet) {
+  const uint8_t* frame = packet.GetData();
+  size_t length = packet.GetSize().Bytes();
+  FlowKey key;
+  size_t transport = 0;
+  if (!FlowKey::FromFrame(frame, length, &key, &transport) ||
+      (key.protocol != IPPROTO_TCP && key.protocol != IPPROTO_UDP) ||
+      (key.src_port == 0 && key.dst_port == 0)) {
+    return;
+  }
+  // Ethernet pads short frames, the IP header knows where the datagram
+  // ends, except for a superframe.
+  size_t ip = Read16(frame + 12) == 0x8100 ? 18 : 14;
+  uint16_t total_length = Read16(frame + ip + 2);
+  size_t end = length;
+  if (!packet.GetOffload().tcp_segmentation && total_length != 0) {
+    end = std::min(length, ip + total_length);
+  }
+  if (end <= transport) {
+    return;
+  }
+  key.dscp = 0;
+  frames_.fetch_add(1, std::memory_order_relaxed);
+  int64_t now_ns = (simulator_->Now() - start_).Nanos();
+  std::lock_guard<std::mutex> lock(mutex_);
+  int direction = 0;
+  Slot* slot = Lookup(key, now_ns, &direction);
+  slot->last_ns = std::max(slot->last_ns, now_ns);
+  if (key.protocol == IPPROTO_TCP) {
+    ObserveTcp(slot, direction, frame + transport, end - transport, now_ns);
+  } else {
+    ObserveUdp(slot, direction, frame + transport, end - transport, now_ns);
+  }
+}
+
+FlowAnalyzer::Slot* FlowAnalyzer::Lookup(const FlowKey& key, int64_t now_ns,
+                                         int* direction) {
+  size_t hash = FlowKeyHash()(Canonical(key));
+  FlowKey reversed = Reverse(key);
+  Slot* free = nullptr;
+  Slot* oldest = nullptr;
+  for (size_t i = 0; i < kProbes; i++) {
+    Slot* slot = &slots_[(hash + i) & mask_];
+    if (!slot->used) {
+      free = free == nullptr ? slot : free;
+      continue;
+    }
+    if (slot->key == key || slot->key == reversed) {
+      *direction = slot->key == key ? 0 : 1;
+      return slot;
+    }
+    if (oldest == nullptr || slot->last_ns < oldest->last_ns) {
+      oldest = slot;
+    }
+  }
+  if (free == nullptr) {
+    free = oldest;
+    Evict(free, now_ns - oldest->last_ns >= kIdleTimeout.Nanos());
+  }
+  *free = Slot();
+  free->used = true;
+  free->key = key;
+  free->first_ns = now_ns;
+  free->last_ns = now_ns;
+  flows_.fetch_add(1, std::memory_order_relaxed);
+  *direction = 0;
+  return free;
+}
+
+void FlowAnalyzer::Evict(Slot* slot, bool idle) {
+  (idle ? idle_evictions_ : capacity_evictions_)
+      .fetch_add(1, std::memory_order_relaxed);
+  flows_.fetch_sub(1, std::memory_order_relaxed);
+  if (exporter_ && evicted_.size() < slots_.size()) {
+    evicted_.push_back(ToStats(*slot, true));
+  }
+  slot->used = false;
+}
+
+void FlowAnalyzer::ObserveTcp(Slot* slot, int direction, const uint8_t* tcp,
+                              size_t length, int64_t now_ns) {
+  if (length < 20) {
+    return;
+  }
+  size_t header = (tcp[12] >> 4) * 4;
+  if (header < 20 || header > length) {
+    return;
+  }
+  uint8_t flags = tcp[13];
+  uint32_t seq = Read32(tcp + 4);
+  uint32_t ack = Read32(tcp + 8);
+  uint16_t window = Read16(tcp + 14);
+  size_t payload = length - header;
+  bool syn = flags & kTcpSyn;
+  Direction& sender = slot->directions[direction];
+  Direction& receiver = slot->directions[1 - direction];
+  sender.stats.frames++;
+  sender.stats.bytes += payload;
+  if (syn) {
+    sender.syn_seen = true;
+    sender.window_scale = ParseWindowScale(tcp + 20, header - 20);
+  } else if (sender.syn_seen && receiver.syn_seen) {
+    // Scaling is on only if both sides offered it, and never for a SYN.
+    int scale = sender.window_scale >= 0 && receiver.window_scale >= 0
+                    ? sender.window_scale
+                    : 0;
+    sender.window_known = true;
+    sender.window = static_cast<uint64_t>(window) << scale;
+  }
+  uint32_t sequence_length = static_cast<uint32_t>(payload) + syn +
+                             ((flags & kTcpFin) ? 1 : 0);
+  if (sequence_length > 0) {
+    uint32_t end = seq + sequence_length;
+    sender.max_segment =
+        std::max(sender.max_segment, static_cast<uint16_t>(std::min<size_t>(
+                                         payload, UINT16_MAX)));
+    if (!sender.seq_valid || SeqAfter(end, sender.next_seq)) {
+      sender.seq_valid = true;
+      sender.next_seq = end;
+      if (!sender.timing) {
+        sender.timing = true;
+        sender.timed_seq = end;
+        sender.timed_at_ns = now_ns;
+      }
+      uint64_t flight =
+          sender.ack_valid ? end - sender.acked_seq : sequence_length;
+      if (!sender.in_round) {
+        sender.in_round = true;
+        sender.round_drained = false;
+        sender.round_end_seq = end;
+        sender.round_max_flight = flight;
+        sender.round_start_ns = now_ns;
+      } else {
+        sender.round_max_flight = std::max(sender.round_max_flight, flight);
+      }
+    } else {
+      sender.stats.retransmissions++;
+      retransmissions_.fetch_add(1, std::memory_order_relaxed);
+      // Karn: the acknowledgement can't tell which copy it is for.
+      sender.timing = false;
+    }
+  }
+  if ((flags & kTcpAck) && receiver.seq_valid) {
+    Acknowledge(slot, 1 - direction, ack, now_ns);
+  }
+}
+
+void FlowAnalyzer::Acknowledge(Slot* slot, int data_direction, uint32_t ack,
+                               int64_t now_ns) {
+  Direction& sender = slot->directions[data_direction];
+  if (!sender.ack_valid) {
+    sender.ack_valid = true;
+    sender.acked_seq = ack;
+  } else if (SeqAfter(ack, sender.acked_seq)) {
+    sender.stats.acked_bytes += ack - sender.acked_seq;
+    sender.acked_seq = ack;
+  } else {
+    return;
+  }
+  if (sender.timing && !SeqBefore(ack, sender.timed_seq)) {
+    sender.timing = false;
+    AddRttSample(slot, now_ns - sender.timed_at_ns);
+  }
+  if (sender.in_round) {
+    if (!SeqBefore(ack, sender.next_seq)) {
+      sender.round_drained = true;
+    }
+    if (!SeqBefore(ack, sender.round_end_seq)) {
+      EndRound(&sender, slot->directions[1 - data_direction], now_ns);
+    }
+  }
+}
+
+void FlowAnalyzer::EndRound(Direction* sender, const Direction& receiver,
+                            int64_t now_ns) {
+  sender->in_round = false;
+  // A sender running out of data in flight was limited by the application.
+  if (sender->round_drained) {
+    return;
+  }
+  TimeDelta round = TimeDelta::Nanos(now_ns - sender->round_start_ns);
+  if (receiver.window_known &&
+      sender->round_max_flight + sender->max_segment > receiver.window) {
+    sender->stats.rwnd_limited += round;
+  } else {
+    sender->stats.cwnd_limited += round;
+  }
+}
+
+void FlowAnalyzer::ObserveUdp(Slot* slot, int direction, const uint8_t* udp,
+                              size_t length, int64_t now_ns) {
+  if (length < 8) {
+    return;
+  }
+  Direction& sender = slot->directions[direction];
+  sender.stats.frames++;
+  sender.stats.bytes += length - 8;
+  if (length < 9) {
+    return;
+  }
+  uint8_t first = udp[8];
+  // A long header with the fixed bit and a version marks a QUIC flow.
+  if (first & 0x80) {
+    if ((first & 0x40) && length >= 13 && Read32(udp + 9) != 0) {
+      slot->quic = true;
+    }
+    return;
+  }
+  if (!(first & 0x40) ||
+      (!slot->quic && slot->key.src_port != kQuicPort &&
+       slot->key.dst_port != kQuicPort)) {
+    return;
+  }
+  slot->quic = true;
+  // The spin bit flips once per round trip in each direction.
+  bool spin = first & 0x20;
+  if (!sender.spin_valid) {
+    sender.spin_valid = true;
+    sender.spin = spin;
+    return;
+  }
+  if (spin == sender.spin) {
+    return;
+  }
+  sender.spin = spin;
+  if (sender.spin_edge_ns >= 0) {
+    AddRttSample(slot, now_ns - sender.spin_edge_ns);
+  }
+  sender.spin_edge_ns = now_ns;
+}
+
+void FlowAnalyzer::AddRttSample(Slot* slot, int64_t rtt_ns) {
+  if (rtt_ns < 0) {
+    return;
+  }
+  slot->smoothed_rtt_ns = slot->rtt_samples == 0
+                              ? rtt_ns
+                              : (slot->smoothed_rtt_ns * 7 + rtt_ns) / 8;
+  slot->min_rtt_ns =
+      slot->rtt_samples == 0 ? rtt_ns : std::min(slot->min_rtt_ns, rtt_ns);
+  slot->latest_rtt_ns = rtt_ns;
+  slot->rtt_samples++;
+  rtt_.Record(static_cast<uint64_t>(rtt_ns));
+}
+
+FlowStats FlowAnalyzer::ToStats(const Slot& slot, bool evicted) const {
+  FlowStats stats;
+  stats.key = slot.key;
+  stats.quic = slot.quic;
+  stats.evicted = evicted;
+  stats.first_seen = TimeDelta::Nanos(slot.first_ns);
+  stats.last_seen = TimeDelta::Nanos(slot.last_ns);
+  stats.forward = slot.directions[0].stats;
+  stats.reverse = slot.directions[1].stats;
+  stats.rtt_samples = slot.rtt_samples;
+  stats.min_rtt = TimeDelta::Nanos(slot.min_rtt_ns);
+  stats.smoothed_rtt = TimeDelta::Nanos(slot.smoothed_rtt_ns);
+  stats.latest_rtt = TimeDelta::Nanos(slot.latest_rtt_ns);
+  return stats;
+}
+
+void FlowAnalyzer::Snapshot(std::vector<FlowStats>* flows) const {
+  // A chunk at a time, so frames wait for one chunk at most however large
+  // the table is. A flow evicted meanwhile shows up with the evicted ones.
+  for (size_t first = 0; first < slots_.size(); first += kSnapshotSlots) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t last = std::min(first + kSnapshotSlots, slots_.size());
+    for (size_t i = first; i < last; i++) {
+      if (slots_[i].used) {
+        flows->push_back(ToStats(slots_[i], false));
+      }
+    }
+  }
+}
+
+std::vector<FlowStats> FlowAnalyzer::GetFlows() const {
+  std::vector<FlowStats> flows;
+  Snapshot(&flows);
+  return flows;
+}
+
+void FlowAnalyzer::StartExport(TimeDelta interval, Exporter exporter) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exporter_ = std::move(exporter);
+    // The periodic task of an earlier export is still there, it only
+    // skipped the intervals without an exporter.
+    if (export_scheduled_) {
+      if (!(interval == export_interval_)) {
+        ALOG_WARNING << "Flows are exported every "
+                     << export_interval_.ToString()
+                     << " already, keeping the interval";
+      }
+      return;
+    }
+    export_scheduled_ = true;
+    export_interval_ = interval;
+  }
+  simulator_->Schedule(interval, interval, &FlowAnalyzer::Export, this);
+}
+
+void FlowAnalyzer::StopExport() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  exporter_ = nullptr;
+  evicted_.clear();
+}
+
+void FlowAnalyzer::Export() {
+  Exporter exporter;
+  std::vector<FlowStats> flows;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!exporter_) {
+      return;
+    }
+    exporter = exporter_;
+    flows.swap(evicted_);
+  }
+  Snapshot(&flows);
+  exporter(flows);
+}
+
+void FlowAnalyzer::Collect(MetricsWriter* writer) const {
+  MetricLabels labels = {{"analyzer", GetName()}};
+  writer->Gauge("araneid_flow_tracked", "Flows tracked by the analyzer.",
+                static_cast<double>(flows_.load()), labels);
+  writer->Counter("araneid_flow_frames_total",
+                  "TCP and UDP frames seen by the analyzer.", frames_.load(),
+                  labels);
+  const char* help = "Flows evicted from the analyzer, by reason.";
+  writer->Counter("araneid_flow_evictions_total", help,
+                  capacity_evictions_.load(),
+                  {labels[0], {"reason", "capacity"}});
+  writer->Counter("araneid_flow_evictions_total", help, idle_evictions_.load(),
+                  {labels[0], {"reason", "idle"}});
+  writer->Counter("araneid_flow_tcp_retransmissions_total",
+                  "TCP segments carrying data sent before.",
+                  retransmissions_.load(), labels);
+  writer->Summary("araneid_flow_rtt_seconds",
+                  "Round trips of the flows, from TCP acknowledgements and "
+                  "the QUIC spin bit.",
+                  rtt_, labels);
+}
+
+}  // namespace araneid
@@ -0,0 +1,195 @@
+#ifndef ARANEID_NETWORK_FLOW_ANALYZER_HPP
+#define ARANEID_NETWORK_FLOW_ANALYZER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/hdr-histogram.hpp"
+#include "base/simulator.hpp"
+#include "base/time.hpp"
+#include "base/units.hpp"
+#include "flow-classifier.hpp"
+#include "packet.hpp"
+
+namespace araneid {
+class MetricsWriter;
+
+struct FlowDirectionStats {
+  uint64_t frames = 0;
+  // Of the transport payload.
+  uint64_t bytes = 0;
+  // TCP segments carrying data that was sent before.
+  uint64_t retransmissions = 0;
+  // TCP data acknowledged by the peer.
+  uint64_t acked_bytes = 0;
+  // Time spent in round trips the sender filled the congestion window, or
+  // the window advertised by the peer.
+  TimeDelta cwnd_limited = TimeDelta::Zero();
+  TimeDelta rwnd_limited = TimeDelta::Zero();
+};
+
+struct FlowStats {
+  // As the first frame of the flow went, with DSCP 0.
+  FlowKey key;
+  bool quic = false;
+  // The flow is no longer tracked, it was idle or made room for another.
+  bool evicted = false;
+  // Since the analyzer was created.
+  TimeDelta first_seen = TimeDelta::Zero();
+  TimeDelta last_seen = TimeDelta::Zero();
+  // Forward is the direction of the first frame.
+  FlowDirectionStats forward;
+  FlowDirectionStats reverse;
+  // From TCP acknowledgements and the QUIC spin bit, in both directions.
+  uint64_t rtt_samples = 0;
+  TimeDelta min_rtt = TimeDelta::Zero();
+  TimeDelta smoothed_rtt = TimeDelta::Zero();
+  TimeDelta latest_rtt = TimeDelta::Zero();
+
+  // Acknowledged TCP data over the lifetime of the flow.
+  DataRate GetGoodput(const FlowDirectionStats& direction) const;
+  std::string ToString() const;
+};
+
+// FlowAnalyzer measures the TCP and QUIC flows through the links it is set
+// on, without help from the applications. It is a tap near the senders:
+// TCP round trips are timed from a segment to the acknowledgement covering
+// it, one segment at a time and never on a retransmission, QUIC ones from
+// the edges of the spin bit. Setting one analyzer on both directions of a
+// link lets it see the acknowledgements.
+//
+// Flows live in a fixed table with open addressing, and a frame only ever
+// probes kProbes slots. When they are all taken, the flow seen least
+// recently is evicted, so a flood of flows costs the analyzer its memory
+// of old flows, but never slows down forwarding.
+class FlowAnalyzer {
+ public:
+  using Exporter = std::function<void(const std::vector<FlowStats>&)>;
+
+  static constexpr size_t kProbes = 8;
+  // Slots copied under the lock at a time by GetFlows() and exports.
+  static constexpr size_t kSnapshotSlots = 256;
+  // Flows idle for this long are evicted as soon as their slot is wanted.
+  static constexpr TimeDelta kIdleTimeout = TimeDelta::Seconds(60);
+
+  // `capacity` is rounded up to a power of two. Flows are timed by the
+  // clock of `simulator`.
+  explicit FlowAnalyzer(size_t capacity = 4096,
+                        Simulator& simulator = Simulator::Instance());
+  ~FlowAnalyzer();
+  FlowAnalyzer(const FlowAnalyzer&) = delete;
+  FlowAnalyzer& operator=(const FlowAnalyzer&) = delete;
+
+  // Thread-safe, frames that are not IPv4 are ignored.
+  void Observe(const Packet& packet);
+
+  // The flows tracked now, the table is read a chunk at a time while
+  // frames go on.
+  std::vector<FlowStats> GetFlows() const;
+  // Hand the flows tracked, and those evicted since the last time, to
+  // `exporter` every `interval` until the simulator stops. The analyzer
+  // must outlive the simulation. Exporting again after StopExport() keeps
+  // the first interval.
+  void StartExport(TimeDelta interval, Exporter exporter);
+  void StopExport();
+  // Invoked by the simulator.
+  void Export();
+
+  // The name of the analyzer in metrics, "analyzer<N>" by default.
+  void SetName(const std::string& name);
+  std::string GetName() const;
+
+ private:
+  struct Direction {
+    FlowDirectionStats stats;
+    // TCP sequence space of the data sent this way.
+    bool seq_valid = false;
+    uint32_t next_seq = 0;
+    bool ack_valid = false;
+    uint32_t acked_seq = 0;
+    uint16_t max_segment = 0;
+    // Window scale from the SYN, -1 without.
+    int window_scale = -1;
+    bool syn_seen = false;
+    // The receive window advertised this way, only known once the
+    // handshake was seen.
+    bool window_known = false;
+    uint64_t window = 0;
+    // The segment being timed.
+    bool timing = false;
+    uint32_t timed_seq = 0;
+    int64_t timed_at_ns = 0;
+    // The round trip the sender is in, it ends when round_end_seq is
+    // acknowledged.
+    bool in_round = false;
+    bool round_drained = false;
+    uint32_t round_end_seq = 0;
+    uint64_t round_max_flight = 0;
+    int64_t round_start_ns = 0;
+    // QUIC spin bit.
+    bool spin_valid = false;
+    bool spin = false;
+    int64_t spin_edge_ns = -1;
+  };
+  struct Slot {
+    bool used = false;
+    FlowKey key;
+    bool quic = false;
+    int64_t first_ns = 0;
+    int64_t last_ns = 0;
+    Direction directions[2];
+    uint64_t rtt_samples = 0;
+    int64_t min_rtt_ns = 0;
+    int64_t smoothed_rtt_ns = 0;
+    int64_t latest_rtt_ns = 0;
+  };
+
+  // Returns the slot of the flow, claiming one for a new flow, and which of
+  // its directions `key` goes.
+  Slot* Lookup(const FlowKey& key, int64_t now_ns, int* direction);
+  void Evict(Slot* slot, bool idle);
+  void ObserveTcp(Slot* slot, int direction, const uint8_t* tcp,
+                  size_t length, int64_t now_ns);
+  void ObserveUdp(Slot* slot, int direction, const uint8_t* udp,
+                  size_t length, int64_t now_ns);
+  // `ack` came from the receiver of the data going `data_direction`.
+  void Acknowledge(Slot* slot, int data_direction, uint32_t ack,
+                   int64_t now_ns);
+  void EndRound(Direction* sender, const Direction& receiver,
+                int64_t now_ns);
+  void AddRttSample(Slot* slot, int64_t rtt_ns);
+  FlowStats ToStats(const Slot& slot, bool evicted) const;
+  void Snapshot(std::vector<FlowStats>* flows) const;
+  void Collect(MetricsWriter* writer) const;
+
+  Simulator* simulator_;
+  TimePoint start_;
+  mutable std::mutex mutex_;
+  std::vector<Slot> slots_;
+  size_t mask_;
+  Exporter exporter_;
+  // The periodic export task outlives StopExport(), it can't be cancelled.
+  bool export_scheduled_;
+  TimeDelta export_interval_;
+  // Kept for the next export, at most as many as the table holds.
+  std::vector<FlowStats> evicted_;
+
+  mutable std::mutex name_mutex_;
+  std::string name_;
+  std::atomic<uint64_t> flows_;
+  std::atomic<uint64_t> frames_;
+  std::atomic<uint64_t> capacity_evictions_;
+  std::atomic<uint64_t> idle_evictions_;
+  std::atomic<uint64_t> retransmissions_;
+  HdrHistogram rtt_;
+  uint64_t metrics_collector_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_NETWORK_FLOW_ANALYZER_HPP
@@ -0,0 +1,125 @@
+#include "flow-classifier.hpp"
+
+#include <arpa/inet.h>  // only for UNIX-like systems
+#include <netinet/in.h>
+
+#include <cstdlib>
+
+namespace araneid {
+
+constexpr size_t kEthernetBytes = 14;
+constexpr size_t kVlanBytes = 4;
+
+static uint16_t Read16(const uint8_t* data) {
+  return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+static uint32_t Read32(const uint8_t* data) {
+  return static_cast<uint32_t>(data[0]) << 24 | data[1] << 16 | data[2] << 8 |
+         data[3];
+}
+
+bool FlowKey::FromFrame(const uint8_t* frame, size_t len, FlowKey* key,
+                        size_t* transport_offset) {
+  if (len < kEthernetBytes) {
+    return false;
+  }
+  size_t offset = kEthernetBytes;
+  uint16_t eth_type = Read16(frame + 12);
+  if (eth_type == 0x8100 && len >= kEthernetBytes + kVlanBytes) {
+    eth_type = Read16(frame + 16);
+    offset += kVlanBytes;
+  }
+  if (eth_type != 0x0800 || len < offset + 20) {
+    return false;
+  }
+  const uint8_t* ip = frame + offset;
+  size_t ip_header_bytes = (ip[0] & 0x0f) * 4;
+  if (ip[0] >> 4 != 4 || ip_header_bytes < 20 ||
+      len < offset + ip_header_bytes) {
+    return false;
+  }
+  *key = FlowKey();
+  key->dscp = ip[1] >> 2;
+  key->protocol = ip[9];
+  key->src_ip = Read32(ip + 12);
+  key->dst_ip = Read32(ip + 16);
+  bool first_fragment = (ip[6] & 0x1f) == 0 && ip[7] == 0;
+  bool has_ports = key->protocol == IPPROTO_TCP ||
+                   key->protocol == IPPROTO_UDP ||
+                   key->protocol == IPPROTO_SCTP;
+  if (has_ports && first_fragment && len >= offset + ip_header_bytes + 4) {
+    key->src_port = Read16(ip + ip_header_bytes);
+    key->dst_port = Read16(ip + ip_header_bytes + 2);
+  }
+  if (transport_offset != nullptr) {
+    *transport_offset = offset + ip_header_bytes;
+  }
+  return true;
+}
+
+size_t FlowKeyHash::operator()(const FlowKey& key) const {
+  // Murmur3 finalizer over the packed fields.
+  uint64_t hash = (static_cast<uint64_t>(key.src_ip) << 32 | key.dst_ip) ^
+                  ((static_cast<uint64_t>(key.src_port) << 48 |
+                    static_cast<uint64_t>(key.dst_port) << 32 |
+                    key.protocol << 8 | key.dscp) *
+                   0x9e3779b97f4a7c15ull);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return static_cast<size_t>(hash);
+}
+
+static bool PrefixMatches(uint32_t address, uint32_t prefix,
+                          int prefix_length) {
+  if (prefix_length <= 0) {
+    return true;
+  }
+  uint32_t mask = prefix_length >= 32 ? ~0u : ~(~0u >> prefix_length);
+  return (address & mask) == (prefix & mask);
+}
+
+bool FlowMatch::Matches(const FlowKey& key) const {
+  return PrefixMatches(key.src_ip, src_ip, src_prefix_length) &&
+         PrefixMatches(key.dst_ip, dst_ip, dst_prefix_length) &&
+         key.src_port >= src_port_min && key.src_port <= src_port_max &&
+         key.dst_port >= dst_port_min && key.dst_port <= dst_port_max &&
+         (!protocol || *protocol == key.protocol) &&
+         (!dscp || *dscp == key.dscp);
+}
+
+static bool ParsePrefix(const std::string& text, uint32_t* address,
+                        int* prefix_length) {
+  size_t slash = text.find('/');
+  int length = 32;
+  if (slash != std::string::npos) {
+    char* end = nullptr;
+    long parsed = std::strtol(text.c_str() + slash + 1, &end, 10);
+    if (end == text.c_str() + slash + 1 || *end != '\0' || parsed < 0 ||
+        parsed > 32) {
+      return false;
+    }
+    length = static_cast<int>(parsed);
+  }
+  struct in_addr parsed_address;
+  if (inet_pton(AF_INET, text.substr(0, slash).c_str(), &parsed_address) !=
+      1) {
+    return false;
+  }
+  *address = ntohl(parsed_address.s_addr);
+  *prefix_length = length;
+  return true;
+}
+
+bool FlowMatch::SetSrcPrefix(const std::string& prefix) {
+  return ParsePrefix(prefix, &src_ip, &src_prefix_length);
+}
+
+bool FlowMatch::SetDstPrefix(const std::string& prefix) {
+  return ParsePrefix(prefix, &dst_ip, &dst_prefix_length);
+}
+
+}  // namespace araneid
@@ -0,0 +1,155 @@
+#ifndef ARANEID_NETWORK_FLOW_CLASSIFIER_HPP
+#define ARANEID_NETWORK_FLOW_CLASSIFIER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace araneid {
+
+// The 5-tuple and DSCP of an IPv4 frame, addresses and ports in host byte
+// order. Ports are 0 for protocols without them and for fragments after
+// the first one.
+struct FlowKey {
+  uint32_t src_ip = 0;
+  uint32_t dst_ip = 0;
+  uint16_t src_port = 0;
+  uint16_t dst_port = 0;
+  uint8_t protocol = 0;
+  uint8_t dscp = 0;
+
+  bool operator==(const FlowKey& other) const {
+    return src_ip == other.src_ip && dst_ip == other.dst_ip &&
+           src_port == other.src_port && dst_port == other.dst_port &&
+           protocol == other.protocol && dscp == other.dscp;
+  }
+  // Parse the ethernet frame, returns false if it isn't IPv4. The offset of
+  // the transport header is stored in `transport_offset` if it is given.
+  static bool FromFrame(const uint8_t* frame, size_t len, FlowKey* key,
+                        size_t* transport_offset = nullptr);
+};
+
+struct FlowKeyHash {
+  size_t operator()(const FlowKey& key) const;
+};
+
+// The flows a rule applies to, a field that is not set matches anything.
+struct FlowMatch {
+  // An address matches if its first `prefix_length` bits are equal.
+  uint32_t src_ip = 0;
+  int src_prefix_length = 0;
+  uint32_t dst_ip = 0;
+  int dst_prefix_length = 0;
+  // Inclusive ranges.
+  uint16_t src_port_min = 0;
+  uint16_t src_port_max = 65535;
+  uint16_t dst_port_min = 0;
+  uint16_t dst_port_max = 65535;
+  std::optional<uint8_t> protocol;
+  std::optional<uint8_t> dscp;
+
+  bool Matches(const FlowKey& key) const;
+  // Set the addresses from "10.1.0.0/16", or a single address. Return false
+  // if it can't be parsed.
+  bool SetSrcPrefix(const std::string& prefix);
+  bool SetDstPrefix(const std::string& prefix);
+};
+
+// FlowClassifier maps flows to the action of the first rule matching them.
+// The rules are only searched for the first frame of a flow, the outcome is
+// cached in a table of exact flow keys, so classifying a frame of a known
+// flow is one hash lookup however many rules there are. Classify() can be
+// called from many threads at once.
+template <typename Action>
+class FlowClassifier {
+ public:
+  // A busy classifier forgets its flows when it knows this many.
+  static constexpr size_t kMaxCachedFlows = 65536;
+
+  // Rules are tried in the order they are added.
+  void AddRule(const FlowMatch& match, Action action);
+  void ClearRules();
+  size_t GetRuleCount() const;
+
+  // Returns false if no rule matches the flow.
+  bool Classify(const FlowKey& key, Action* action);
+
+  uint64_t GetCacheHits() const { return cache_hits_.load(); }
+  uint64_t GetCacheMisses() const { return cache_misses_.load(); }
+
+ private:
+  struct Entry {
+    bool matched;
+    Action action;
+  };
+
+  mutable std::shared_mutex mutex_;
+  std::vector<std::pair<FlowMatch, Action>> rules_;
+  std::unordered_map<FlowKey, Entry, FlowKeyHash> flows_;
+  std::atomic<uint64_t> cache_hits_{0};
+  std::atomic<uint64_t> cache_misses_{0};
+};
+
+template <typename Action>
+void FlowClassifier<Action>::AddRule(const FlowMatch& match, Action action) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  rules_.emplace_back(match, std::move(action));
+  // Cached flows may match the new rule instead of a later one.
+  flows_.clear();
+}
+
+template <typename Action>
+void FlowClassifier<Action>::ClearRules() {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  rules_.clear();
+  flows_.clear();
+}
+
+template <typename Action>
+size_t FlowClassifier<Action>::GetRuleCount() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return rules_.size();
+}
+
+template <typename Action>
+bool FlowClassifier<Action>::Classify(const FlowKey& key, Action* action) {
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = flows_.find(key);
+    if (it != flows_.end()) {
+      cache_hits_.fetch_add(1, std::memory_order_relaxed);
+      if (it->second.matched) {
+        *action = it->second.action;
+      }
+      return it->second.matched;
+    }
+  }
+  cache_misses_.fetch_add(1, std::memory_order_relaxed);
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  Entry entry{false, Action()};
+  for (const auto& rule : rules_) {
+    if (rule.first.Matches(key)) {
+      entry = {true, rule.second};
+      break;
+    }
+  }
+  if (flows_.size() >= kMaxCachedFlows) {
+    flows_.clear();
+  }
+  flows_.emplace(key, entry);
+  if (entry.matched) {
+    *action = entry.action;
+  }
+  return entry.matched;
+}
+
+}  // namespace araneid
+
+#endif  // ARANEID_NETWORK_FLOW_CLASSIFIER_HPP
@@ -0,0 +1,339 @@
+#include "journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "base/log.hpp"
+
+namespace araneid {
+
+constexpr char kJournalMagic[4] = {'A', 'R', 'N', 'J'};
+constexpr uint8_t kJournalVersion = 1;
+constexpr uint8_t kFrameRecord = 1;
+constexpr uint8_t kLossRecord = 2;
+constexpr uint8_t kPartialChecksum = 1;
+constexpr uint8_t kTcpSegmentation = 2;
+
+static void PutVarint(std::string* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Returns false if the input ends in the middle of the varint.
+static bool GetVarint(const uint8_t** in, const uint8_t* end,
+                      uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *in < end; shift += 7) {
+    uint8_t byte = *(*in)++;
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+JournalWriter::JournalWriter(Simulator& simulator)
+    : simulator_(&simulator),
+      file_(nullptr),
+      failed_(false),
+      last_frame_ns_(0) {}
+
+JournalWriter::~JournalWriter() { Close(); }
+
+bool JournalWriter::Open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ != nullptr) {
+    ALOG_WARNING << "Journal is already open";
+    return false;
+  }
+  file_ = std::fopen(path.c_str(), "wb");
+  if (file_ == nullptr) {
+    ALOG_WARNING << "Failed to open journal " << path << ": "
+                 << std::strerror(errno);
+    return false;
+  }
+  failed_ = false;
+  start_ = simulator_->Now();
+  last_frame_ns_ = 0;
+  loss_runs_.clear();
+  std::string header(kJournalMagic, sizeof(kJournalMagic));
+  header.push_back(static_cast<char>(kJournalVersion));
+  Write(header);
+  return true;
+}
+
+bool JournalWriter::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr) {
+    return true;
+  }
+  for (const auto& [link, run] : loss_runs_) {
+    WriteLossRun(link, run);
+  }
+  loss_runs_.clear();
+  bool written = std::fclose(file_) == 0 && !failed_;
+  file_ = nullptr;
+  if (!written) {
+    ALOG_WARNING << "Failed to write journal";
+  }
+  return written;
+}
+
+void JournalWriter::Write(const std::string& record) {
+  if (std::fwrite(record.data(), 1, record.size(), file_) != record.size()) {
+    failed_ = true;
+  }
+}
+
+void JournalWriter::RecordFrame(uint32_t source, const Packet& packet) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr) {
+    return;
+  }
+  // Taken under the lock, so the times of the journal never go back.
+  int64_t at_ns =
+      std::max(last_frame_ns_, (simulator_->Now() - start_).Nanos());
+  std::string record;
+  record.push_back(static_cast<char>(kFrameRecord));
+  PutVarint(&record, source);
+  PutVarint(&record, at_ns - last_frame_ns_);
+  last_frame_ns_ = at_ns;
+  const Offload& offload = packet.GetOffload();
+  uint8_t flags = (offload.partial_checksum ? kPartialChecksum : 0) |
+                  (offload.tcp_segmentation ? kTcpSegmentation : 0);
+  record.push_back(static_cast<char>(flags));
+  if (offload.partial_checksum) {
+    PutVarint(&record, offload.checksum_start);
+    PutVarint(&record, offload.checksum_offset);
+  }
+  if (offload.tcp_segmentation) {
+    PutVarint(&record, offload.segment_bytes);
+    PutVarint(&record, offload.header_bytes);
+  }
+  size_t bytes = packet.GetSize().Bytes();
+  PutVarint(&record, bytes);
+  record.append(reinterpret_cast<const char*>(packet.GetData()), bytes);
+  Write(record);
+}
+
+void JournalWriter::RecordLoss(uint32_t link, bool lost) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr) {
+    return;
+  }
+  auto it = loss_runs_.find(link);
+  if (it == loss_runs_.end()) {
+    loss_runs_[link] = {lost, 1};
+    return;
+  }
+  if (it->second.lost == lost) {
+    it->second.count++;
+    return;
+  }
+  WriteLossRun(link, it->second);
+  it->second = {lost, 1};
+}
+
+void JournalWriter::WriteLossRun(uint32_t link, const LossRun& run) {
+  std::string record;
+  record.push_back(static_cast<char>(kLossRecord));
+  PutVarint(&record, link);
+  record.push_back(static_cast<char>(run.lost));
+  PutVarint(&record, run.count);
+  Write(record);
+}
+
+RecordingDevice::RecordingDevice(std::shared_ptr<Device> device,
+                                 std::shared_ptr<JournalWriter> journal,
+                                 uint32_t source)
+    : device_(device), journal_(journal), source_(source) {}
+
+void RecordingDevice::Send(std::shared_ptr<Packet> packet) {
+  if (packet == nullptr) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(send_mutex_);
+  journal_->RecordFrame(source_, *packet);
+  device_->Send(std::move(packet));
+}
+
+void RecordingDevice::Receive(std::shared_ptr<Packet> packet) {
+  device_->Receive(std::move(packet));
+}
+
+void RecordingDevice::AddTransmission(
+    const Ipv4Address& address, std::shared_ptr<Transmission> transmission) {
+  device_->AddTransmission(address, transmission);
+}
+
+RecordingPacketLoss::RecordingPacketLoss(
+    std::unique_ptr<PacketLoss> packet_loss,
+    std::shared_ptr<JournalWriter> journal, uint32_t link)
+    : packet_loss_(std::move(packet_loss)), journal_(journal), link_(link) {}
+
+bool RecordingPacketLoss::ShouldDropPacket(const Packet& packet) {
+  bool lost = packet_loss_->ShouldDropPacket(packet);
+  journal_->RecordLoss(link_, lost);
+  return lost;
+}
+
+bool JournalReader::Open(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    ALOG_WARNING << "Failed to open journal " << path;
+    return false;
+  }
+  std::vector<uint8_t> content((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+  frames_.clear();
+  loss_runs_.clear();
+  const uint8_t* in = content.data();
+  const uint8_t* end = in + content.size();
+  if (content.size() < sizeof(kJournalMagic) + 1 ||
+      std::memcmp(in, kJournalMagic, sizeof(kJournalMagic)) != 0 ||
+      in[sizeof(kJournalMagic)] != kJournalVersion) {
+    ALOG_WARNING << path << " is not a journal of this version";
+    return false;
+  }
+  in += sizeof(kJournalMagic) + 1;
+  auto truncated = [&path]() {
+    ALOG_WARNING << "Journal " << path << " is truncated";
+    return false;
+  };
+  int64_t at_ns = 0;
+  while (in < end) {
+    uint8_t type = *in++;
+    uint64_t id, value, count;
+    if (type == kFrameRecord) {
+      Frame frame;
+      uint64_t delta_ns = 0;
+      uint8_t flags = 0;
+      bool ok = GetVarint(&in, end, &id) && GetVarint(&in, end, &delta_ns) &&
+                in < end;
+      if (ok) {
+        flags = *in++;
+      }
+      if (ok && (flags & kPartialChecksum)) {
+        frame.offload.partial_checksum = true;
+        ok = GetVarint(&in, end, &value) && GetVarint(&in, end, &count);
+        frame.offload.checksum_start = value;
+        frame.offload.checksum_offset = count;
+      }
+      if (ok && (flags & kTcpSegmentation)) {
+        frame.offload.tcp_segmentation = true;
+        ok = GetVarint(&in, end, &value) && GetVarint(&in, end, &count);
+        frame.offload.segment_bytes = value;
+        frame.offload.header_bytes = count;
+      }
+      uint64_t bytes = 0;
+      if (!ok || !GetVarint(&in, end, &bytes) ||
+          bytes > static_cast<uint64_t>(end - in)) {
+        return truncated();
+      }
+      // Replaying it would be fatal to Packet.
+      if (!Packet::IsWellFormed(in, bytes)) {
+        ALOG_WARNING << "Malformed frame of " << bytes << " bytes in journal "
+                     << path;
+        return false;
+      }
+      at_ns += delta_ns;
+      frame.at = TimeDelta::Nanos(at_ns);
+      frame.source = id;
+      frame.data.assign(in, in + bytes);
+      in += bytes;
+      frames_.push_back(std::move(frame));
+      continue;
+    }
+    if (type == kLossRecord) {
+      if (!GetVarint(&in, end, &id) || in >= end) {
+        return truncated();
+      }
+      bool lost = *in++ != 0;
+      if (!GetVarint(&in, end, &count)) {
+        return truncated();
+      }
+      loss_runs_[id].emplace_back(lost, count);
+      continue;
+    }
+    ALOG_WARNING << "Unknown record " << int(type) << " in journal " << path;
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<PacketLoss> JournalReader::MakePacketLoss(
+    uint32_t link) const {
+  auto it = loss_runs_.find(link);
+  return std::make_unique<ReplayPacketLoss>(
+      it == loss_runs_.end() ? LossRuns() : it->second);
+}
+
+ReplayPacketLoss::ReplayPacketLoss(JournalReader::LossRuns runs)
+    : runs_(std::move(runs)), next_(0), taken_(0) {}
+
+bool ReplayPacketLoss::ShouldDropPacket(const Packet&) {
+  while (next_ < runs_.size() && taken_ >= runs_[next_].second) {
+    next_++;
+    taken_ = 0;
+  }
+  if (next_ >= runs_.size()) {
+    if (next_ == runs_.size()) {
+      ALOG_WARNING << "Journal has no more loss decisions, keeping frames";
+      next_++;
+    }
+    return false;
+  }
+  taken_++;
+  return runs_[next_].first;
+}
+
+JournalReplayer::JournalReplayer(const JournalReader& journal,
+                                 Simulator& simulator)
+    : journal_(&journal), simulator_(&simulator), next_(0) {}
+
+void JournalReplayer::SetDevice(uint32_t source,
+                                std::shared_ptr<Device> device) {
+  devices_[source] = device;
+}
+
+void JournalReplayer::Start() {
+  start_ = simulator_->Now();
+  next_ = 0;
+  if (IsDone()) {
+    return;
+  }
+  simulator_->Schedule(journal_->GetFrames().front().at,
+                       &JournalReplayer::Inject, this);
+}
+
+void JournalReplayer::Inject() {
+  const std::vector<JournalReader::Frame>& frames = journal_->GetFrames();
+  TimeDelta now = simulator_->Now() - start_;
+  // Every frame due by now, a wall clock may be late.
+  while (next_ < frames.size() && frames[next_].at <= now) {
+    const JournalReader::Frame& frame = frames[next_++];
+    auto it = devices_.find(frame.source);
+    if (it == devices_.end()) {
+      ALOG_DEBUG << "No device for source " << frame.source
+                 << " of the journal, dropping frame";
+      continue;
+    }
+    std::shared_ptr<Packet> packet = Packet::Create(
+        frame.data.data(), DataSize::Bytes(frame.data.size()));
+    packet->SetOffload(frame.offload);
+    it->second->Send(std::move(packet));
+  }
+  if (!IsDone()) {
+    simulator_->Schedule(frames[next_].at - now, &JournalReplayer::Inject,
+                         this);
+  }
+}
+
+}  // namespace araneid
@@ -0,0 +1,159 @@
+#ifndef ARANEID_NETWORK_JOURNAL_HPP
+#define ARANEID_NETWORK_JOURNAL_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/simulator.hpp"
+#include "base/time.hpp"
+#include "device.hpp"
+#include "packet.hpp"
+#include "transmission.hpp"
+
+namespace araneid {
+
+// A journal is a compact binary record of what enters a run from outside:
+// the frames handed to devices with the time they arrived, and the
+// decisions of the loss models. Replaying it on the virtual clock feeds the
+// same frames at the same times through the same decisions, so a failing
+// run can be reproduced, and much faster than it took.
+//
+// The file starts with "ARNJ" and a version byte, followed by records that
+// start with a type byte. Numbers are LEB128 varints.
+//   frame: source, nanoseconds since the previous frame, offload, length,
+//          bytes
+//   loss:  link, decision, how many decisions in a row were the same
+class JournalWriter {
+ public:
+  // Frames are timed by the clock of `simulator`, from Open().
+  explicit JournalWriter(Simulator& simulator = Simulator::Instance());
+  ~JournalWriter();
+  JournalWriter(const JournalWriter&) = delete;
+  JournalWriter& operator=(const JournalWriter&) = delete;
+
+  bool Open(const std::string& path);
+  // Returns false if the journal couldn't be written completely.
+  bool Close();
+
+  // Thread-safe, records are kept in the order of the calls.
+  void RecordFrame(uint32_t source, const Packet& packet);
+  void RecordLoss(uint32_t link, bool lost);
+
+ private:
+  struct LossRun {
+    bool lost;
+    uint64_t count;
+  };
+  void WriteLossRun(uint32_t link, const LossRun& run);
+  void Write(const std::string& record);
+
+  Simulator* simulator_;
+  std::mutex mutex_;
+  FILE* file_;
+  bool failed_;
+  TimePoint start_;
+  int64_t last_frame_ns_;
+  // Decisions are written when a link changes its mind, or on Close().
+  std::map<uint32_t, LossRun> loss_runs_;
+};
+
+// Records every frame sent through it under `source`, then hands it to the
+// wrapped device. It goes between a bridge and the device of the bridge.
+class RecordingDevice : public Device {
+ public:
+  RecordingDevice(std::shared_ptr<Device> device,
+                  std::shared_ptr<JournalWriter> journal, uint32_t source);
+  void Send(std::shared_ptr<Packet> packet) override;
+  void Receive(std::shared_ptr<Packet> packet) override;
+  void AddTransmission(const Ipv4Address& address,
+                       std::shared_ptr<Transmission> transmission) override;
+
+ private:
+  std::shared_ptr<Device> device_;
+  std::shared_ptr<JournalWriter> journal_;
+  uint32_t source_;
+  // Frames reach the links in the order they are recorded, even when
+  // several threads read the machine's frames.
+  std::mutex send_mutex_;
+};
+
+// Records the decisions of a loss model under `link`.
+class RecordingPacketLoss : public PacketLoss {
+ public:
+  RecordingPacketLoss(std::unique_ptr<PacketLoss> packet_loss,
+                      std::shared_ptr<JournalWriter> journal, uint32_t link);
+  bool ShouldDropPacket(const Packet& packet) override;
+
+ private:
+  std::unique_ptr<PacketLoss> packet_loss_;
+  std::shared_ptr<JournalWriter> journal_;
+  uint32_t link_;
+};
+
+class JournalReader {
+ public:
+  struct Frame {
+    TimeDelta at;  // since the journal was opened
+    uint32_t source;
+    Offload offload;
+    std::vector<uint8_t> data;
+  };
+  // A decision and how many times in a row it was taken.
+  using LossRuns = std::vector<std::pair<bool, uint64_t>>;
+
+  // Returns false if the journal can't be read or is malformed.
+  bool Open(const std::string& path);
+  const std::vector<Frame>& GetFrames() const { return frames_; }
+  // A loss model taking the decisions recorded for `link`.
+  std::unique_ptr<PacketLoss> MakePacketLoss(uint32_t link) const;
+
+ private:
+  std::vector<Frame> frames_;
+  std::map<uint32_t, LossRuns> loss_runs_;
+};
+
+// Takes recorded decisions in order, and keeps frames once they run out.
+class ReplayPacketLoss : public PacketLoss {
+ public:
+  explicit ReplayPacketLoss(JournalReader::LossRuns runs);
+  bool ShouldDropPacket(const Packet& packet) override;
+
+ private:
+  JournalReader::LossRuns runs_;
+  size_t next_;
+  uint64_t taken_;  // of the run at next_
+};
+
+// Sends the frames of a journal to the devices of their sources at the
+// recorded times. Both the journal and the replayer must outlive the
+// simulation.
+class JournalReplayer {
+ public:
+  JournalReplayer(const JournalReader& journal,
+                  Simulator& simulator = Simulator::Instance());
+
+  void SetDevice(uint32_t source, std::shared_ptr<Device> device);
+  // Frames are sent relative to the time of the simulator now.
+  void Start();
+  bool IsDone() const { return next_ >= journal_->GetFrames().size(); }
+
+  // Invoked by the simulator.
+  void Inject();
+
+ private:
+  const JournalReader* journal_;
+  Simulator* simulator_;
+  std::map<uint32_t, std::shared_ptr<Device>> devices_;
+  TimePoint start_;
+  size_t next_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_NETWORK_JOURNAL_HPP
@@ -0,0 +1,118 @@
+#include "latency-profiler.hpp"
+
+#include <time.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "packet.hpp"
+
+namespace araneid {
+
+int64_t LatencyProfiler::Now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void LatencyProfiler::Stamp(Packet* packet, PipelineStage stage,
+                            int64_t at_ns) {
+  if (!IsEnabled() || packet == nullptr || at_ns == 0) {
+    return;
+  }
+  packet->MutableTrace()->at_ns[static_cast<int>(stage)] = at_ns;
+}
+
+void LatencyProfiler::AddImpairment(Packet* packet, PipelineStage stage,
+                                    TimeDelta wait) {
+  if (!IsEnabled() || packet == nullptr) {
+    return;
+  }
+  packet->MutableTrace()->impairment_ns[static_cast<int>(stage)] +=
+      wait.Nanos();
+}
+
+void LatencyProfiler::Record(const PacketTrace& trace) {
+  int first = -1;
+  int previous = -1;
+  int64_t impairment = 0;
+  for (int stage = 0; stage < PacketTrace::kStages; stage++) {
+    if (trace.at_ns[stage] == 0) {
+      continue;
+    }
+    impairment += trace.impairment_ns[stage];
+    if (previous >= 0) {
+      // The clocks of the simulator and the stamps differ, a task may run a
+      // bit before its time by the stamp clock.
+      int64_t overhead = trace.at_ns[stage] - trace.at_ns[previous] -
+                         trace.impairment_ns[stage];
+      stages_[stage].Record(std::max<int64_t>(overhead, 0));
+    } else {
+      first = stage;
+    }
+    previous = stage;
+  }
+  int written = static_cast<int>(PipelineStage::kWritten);
+  if (first >= 0 && previous == written && first != written) {
+    int64_t overhead = trace.at_ns[written] - trace.at_ns[first] -
+                       (impairment - trace.impairment_ns[first]);
+    end_to_end_.Record(std::max<int64_t>(overhead, 0));
+  }
+}
+
+void LatencyProfiler::Reset() {
+  for (auto& stage : stages_) {
+    stage.Reset();
+  }
+  end_to_end_.Reset();
+}
+
+const char* LatencyProfiler::StageName(PipelineStage stage) {
+  switch (stage) {
+    case PipelineStage::kRead:
+      return "read";
+    case PipelineStage::kCreate:
+      return "create";
+    case PipelineStage::kDeviceSend:
+      return "device_send";
+    case PipelineStage::kSendToNetwork:
+      return "send_to_network";
+    case PipelineStage::kInFlight:
+      return "in_flight";
+    case PipelineStage::kReceiveFromNetwork:
+      return "receive_from_network";
+    case PipelineStage::kWritten:
+      return "written";
+    case PipelineStage::kCount:
+      break;
+  }
+  return "unknown";
+}
+
+std::string LatencyProfiler::Report() const {
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(2);
+  report << std::left << std::setw(22) << "stage (us)" << std::right
+         << std::setw(10) << "count" << std::setw(10) << "mean"
+         << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10)
+         << "p99.9" << std::setw(10) << "max" << "\n";
+  auto row = [&report](const std::string& name,
+                       const HdrHistogram& histogram) {
+    report << std::left << std::setw(22) << name << std::right
+           << std::setw(10) << histogram.Count() << std::setw(10)
+           << histogram.Mean() / 1e3 << std::setw(10)
+           << histogram.Percentile(50) / 1e3 << std::setw(10)
+           << histogram.Percentile(99) / 1e3 << std::setw(10)
+           << histogram.Percentile(99.9) / 1e3 << std::setw(10)
+           << histogram.Max() / 1e3 << "\n";
+  };
+  // The first stage has nothing before it.
+  for (int stage = 1; stage < PacketTrace::kStages; stage++) {
+    row(StageName(static_cast<PipelineStage>(stage)), stages_[stage]);
+  }
+  row("end_to_end", end_to_end_);
+  return report.str();
+}
+
+}  // namespace araneid
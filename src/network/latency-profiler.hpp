@@ -0,0 +1,93 @@
+#ifndef ARANEID_NETWORK_LATENCY_PROFILER_HPP
+#define ARANEID_NETWORK_LATENCY_PROFILER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "base/hdr-histogram.hpp"
+#include "base/time.hpp"
+
+namespace araneid {
+class Packet;
+
+// The stages a frame passes from a machine through the network to another
+// machine, in order.
+enum class PipelineStage {
+  kRead,                // the frame was read from the machine
+  kCreate,              // the packet was created from the frame
+  kDeviceSend,          // CommonDevice::Send
+  kSendToNetwork,       // CommonTransmission::SendToNetwork
+  kInFlight,            // CommonTransmission::InFlight, after the delay
+  kReceiveFromNetwork,  // after the bottleneck
+  kWritten,             // the frame was written to the machine
+  kCount,
+};
+
+// Stage timestamps of one packet, in nanoseconds of LatencyProfiler::Now().
+struct PacketTrace {
+  static constexpr int kStages = static_cast<int>(PipelineStage::kCount);
+  // 0 for a stage the packet didn't pass.
+  int64_t at_ns[kStages] = {};
+  // What the network deliberately waited before each stage, like the link
+  // delay and the serialization delay, which isn't overhead.
+  int64_t impairment_ns[kStages] = {};
+};
+
+// LatencyProfiler measures the latency araneid adds beyond the impairment it
+// is configured with, per stage of the pipeline and end to end, to find the
+// stage that adds more than microseconds.
+// While enabled, packets are stamped at every stage they pass, and when a
+// packet is gone its trace is folded into lock-free histograms: a stage
+// gets the time since the previous stage the packet passed, less the
+// impairment in between, and the end to end histogram the time from the
+// first to the last stage of packets that were written to a machine.
+// Disabled, a stamp costs a relaxed load.
+class LatencyProfiler {
+ public:
+  static LatencyProfiler& Instance() {
+    static LatencyProfiler instance;
+    return instance;
+  }
+
+  void Enable(bool enabled) { enabled_.store(enabled); }
+  bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // The clock of the stamps, monotonic nanoseconds.
+  static int64_t Now();
+  // Now() for a stamp taken before the packet exists, 0 while disabled.
+  int64_t NowIfEnabled() const { return IsEnabled() ? Now() : 0; }
+
+  void Stamp(Packet* packet, PipelineStage stage) {
+    if (IsEnabled()) {
+      Stamp(packet, stage, Now());
+    }
+  }
+  void Stamp(Packet* packet, PipelineStage stage, int64_t at_ns);
+  // The network waits `wait` on purpose before the packet reaches `stage`.
+  void AddImpairment(Packet* packet, PipelineStage stage, TimeDelta wait);
+  // Fold a finished trace into the histograms.
+  void Record(const PacketTrace& trace);
+
+  // The overhead before `stage`, in nanoseconds.
+  const HdrHistogram& GetStageHistogram(PipelineStage stage) const {
+    return stages_[static_cast<int>(stage)];
+  }
+  const HdrHistogram& GetEndToEndHistogram() const { return end_to_end_; }
+  void Reset();
+  // A table of the histograms in microseconds, for logs.
+  std::string Report() const;
+
+  static const char* StageName(PipelineStage stage);
+
+ private:
+  LatencyProfiler() : enabled_(false) {}
+
+  std::atomic<bool> enabled_;
+  HdrHistogram stages_[PacketTrace::kStages];
+  HdrHistogram end_to_end_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_NETWORK_LATENCY_PROFILER_HPP
@@ -3,23 +3,50 @@
 #include <arpa/inet.h>   // only for UNIX-like systems
 #include <netinet/ip.h>  // for struct iphdr
 
+#include <algorithm>
 #include <cstring>
 
 #include "base/log.hpp"
+#include "latency-profiler.hpp"
 namespace araneid {
 
 constexpr size_t kAllocatedPaddingBytes = 50;
 constexpr size_t kMaxReservedChunkSize = 1000;
 
-Buffer::Buffer(DataSize size) {
+thread_local std::unique_ptr<Buffer::FreeChunks> Buffer::free_chunks_;
+thread_local size_t Buffer::recycled_chunk_size_ = 0;
+
+Buffer::Buffer(DataSize size) : external_(nullptr), external_size_(0) {
   if (free_chunks_ == nullptr) {
     recycled_chunk_size_ = 0;
     free_chunks_ = std::make_unique<FreeChunks>();
   }
   data_ = Allocate(size.Bytes());
+  if (data_ != nullptr) {
+    data_->references_ = 1;
+  }
+}
+
+Buffer::Buffer(uint8_t* data, size_t size, std::shared_ptr<void> owner)
+    : data_(nullptr),
+      external_(data),
+      external_size_(size),
+      owner_(std::move(owner)) {}
+
+Buffer::Buffer(const Buffer& other)
+    : data_(other.data_),
+      external_(other.external_),
+      external_size_(other.external_size_),
+      owner_(other.owner_) {
+  if (data_ != nullptr) {
+    data_->references_++;
+  }
 }
 
 Buffer::~Buffer() {
+  if (data_ == nullptr) {
+    return;
+  }
   data_->references_--;
   if (data_->references_ == 0) {
     Recycle(data_);
@@ -28,38 +55,45 @@ Buffer::~Buffer() {
 
 Buffer& Buffer::operator=(const Buffer& other) {
   if (this != &other) {
-    data_->references_--;
-    if (data_->references_ == 0) {
-      Recycle(data_);
+    if (data_ != nullptr) {
+      data_->references_--;
+      if (data_->references_ == 0) {
+        Recycle(data_);
+      }
     }
     data_ = other.data_;
-    data_->references_++;
+    if (data_ != nullptr) {
+      data_->references_++;
+    }
+    external_ = other.external_;
+    external_size_ = other.external_size_;
+    owner_ = other.owner_;
   }
   return *this;
 }
 
-void Buffer::Write(const uint8_t* data, DataSize size) {
-  if (data_ == nullptr) {
+void Buffer::Write(const uint8_t* data, DataSize size, size_t offset) {
+  if (Data() == nullptr) {
     ALOG_ERROR << "Buffer is null";
     return;
   }
-  if (data_->size < size.Bytes()) {
+  if (Size() < offset + size.Bytes()) {
     ALOG_ERROR << "Buffer size is less than data size";
     return;
   }
-  std::memcpy(data_->data, data, size.Bytes());
+  std::memcpy(Data() + offset, data, size.Bytes());
 }
 
-bool Buffer::Copy(uint8_t* data, size_t size) const {
-  if (data_ == nullptr) {
+bool Buffer::Copy(uint8_t* data, size_t size, size_t offset) const {
+  if (Data() == nullptr) {
     ALOG_ERROR << "Buffer is null";
     return false;
   }
-  if (data_->size < size) {
+  if (Size() < offset + size) {
     ALOG_ERROR << "Buffer size is less than data size";
     return false;
   }
-  std::memcpy(data, data_->data, size);
+  std::memcpy(data, Data() + offset, size);
   return true;
 }
 
@@ -91,8 +125,12 @@ void Buffer::Recycle(Chunk* chunk) {
     ALOG_ERROR << "Chunk has references: " << chunk->references_;
     return;
   }
+  // The releasing thread may never have allocated a buffer.
+  if (free_chunks_ == nullptr) {
+    free_chunks_ = std::make_unique<FreeChunks>();
+  }
   recycled_chunk_size_ = std::max(recycled_chunk_size_, chunk->size);
-  if (chunk->size < recycled_chunk_size_ || free_chunks_ == nullptr ||
+  if (chunk->size < recycled_chunk_size_ ||
       free_chunks_->size() > kMaxReservedChunkSize) {
     Destroy(chunk);
     return;
@@ -110,13 +148,79 @@ void Buffer::Destroy(Chunk* chunk) {
 }
 
 Packet::Packet(const uint8_t* data, DataSize size)
-    : buffer_(size), packet_size_(size) {
+    : buffer_(DataSize::Bytes(size.Bytes() + kHeadroomBytes)),
+      packet_size_(size),
+      segment_count_(1),
+      wire_header_bytes_(0) {
   if (data == nullptr || size.Bytes() == 0) {
     ALOG_ERROR << "Invalid data or size";
     return;
   }
-  buffer_.Write(data, size);
+  buffer_.Write(data, size, kHeadroomBytes);
+  Parse();
+  LatencyProfiler::Instance().Stamp(this, PipelineStage::kCreate);
+}
+
+Packet::~Packet() {
+  if (trace_ != nullptr) {
+    LatencyProfiler::Instance().Record(*trace_);
+  }
+}
+
+PacketTrace* Packet::MutableTrace() {
+  if (trace_ == nullptr) {
+    trace_ = std::make_unique<PacketTrace>();
+  }
+  return trace_.get();
+}
+
+std::shared_ptr<Packet> Packet::Wrap(uint8_t* data, DataSize size,
+                                     std::shared_ptr<void> owner) {
+  Buffer buffer(data - kHeadroomBytes, size.Bytes() + kHeadroomBytes,
+                std::move(owner));
+  return std::shared_ptr<Packet>(new Packet(buffer, size));
+}
+
+Packet::Packet(Buffer buffer, DataSize size)
+    : buffer_(buffer),
+      packet_size_(size),
+      segment_count_(1),
+      wire_header_bytes_(0) {
+  if (buffer_.Data() == nullptr || size.Bytes() == 0) {
+    ALOG_ERROR << "Invalid data or size";
+    return;
+  }
+  Parse();
+  LatencyProfiler::Instance().Stamp(this, PipelineStage::kCreate);
+}
 
+bool Packet::IsWellFormed(const uint8_t* data, size_t len) {
+  // The same checks as Parse().
+  if (data == nullptr || len < 14) {
+    return false;
+  }
+  uint16_t eth_type = static_cast<uint16_t>(data[12] << 8 | data[13]);
+  size_t offset = 14;
+  if (eth_type == 0x8100) {
+    if (len < offset + 4) {
+      return false;
+    }
+    eth_type = static_cast<uint16_t>(data[16] << 8 | data[17]);
+    offset += 4;
+  }
+  if (eth_type != 0x0800) {
+    return true;
+  }
+  if (len < offset + 20 || data[offset] >> 4 != 4) {
+    return false;
+  }
+  size_t ip_header_length = (data[offset] & 0x0f) * 4;
+  return ip_header_length >= 20 && ip_header_length <= len - offset;
+}
+
+void Packet::Parse() {
+  const uint8_t* data = GetData();
+  DataSize size = packet_size_;
   // Minimum ethernet frame size is 14 bytes
   // (6 bytes destination MAC, 6 bytes source MAC, 2 bytes type)
   if (size.Bytes() < 14) {
@@ -153,19 +257,222 @@ Packet::Packet(const uint8_t* data, DataSize size)
     if (ip_header_length < 20 || ip_header_length > remaining) {
       ALOG_ERROR << "Invalid IP header length: " << ip_header_length;
     }
-    std::string src_ip(inet_ntoa(*(struct in_addr*)&ip_header->saddr));
-    std::string dst_ip(inet_ntoa(*(struct in_addr*)&ip_header->daddr));
+    // inet_ntoa() returns a static buffer, which is not safe when packets
+    // are created from several threads.
+    char src_ip[INET_ADDRSTRLEN];
+    char dst_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &ip_header->saddr, src_ip, sizeof(src_ip));
+    inet_ntop(AF_INET, &ip_header->daddr, dst_ip, sizeof(dst_ip));
     src_ = Ipv4Address(src_ip);
     dst_ = Ipv4Address(dst_ip);
   } else if (eth_type == 0x86dd) {  // IPv6
-    ALOG_ERROR << "IPv6 is not supported yet";
+    // TAP devices see neighbor discovery and the like, such frames have no
+    // IPv4 addresses and are dropped by the device.
+    ALOG_DEBUG << "IPv6 is not supported yet";
   } else {
-    ALOG_ERROR << "Unknown ethernet type: " << std::hex << eth_type;
+    ALOG_DEBUG << "Unknown ethernet type: " << std::hex << eth_type;
   }
 }
 
 bool Packet::CopyData(uint8_t* data, size_t size) const {
-  return buffer_.Copy(data, size);
+  return buffer_.Copy(data, size, kHeadroomBytes);
+}
+
+static uint16_t Load16(const uint8_t* data) {
+  return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+static void Store16(uint8_t* data, uint16_t value) {
+  data[0] = value >> 8;
+  data[1] = value & 0xff;
+}
+
+static uint16_t Fold(uint64_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return static_cast<uint16_t>(sum);
+}
+
+// Update a ones' complement sum when one of its words changes, RFC 1624.
+static uint16_t AdjustSum(uint16_t sum, uint16_t old_word, uint16_t new_word) {
+  return Fold(uint64_t(sum) + uint16_t(~old_word) + new_word);
+}
+
+Packet::Packet(const Packet& superframe, size_t header_bytes,
+               size_t payload_offset, size_t payload_bytes)
+    : src_(superframe.src_),
+      dst_(superframe.dst_),
+      buffer_(DataSize::Bytes(header_bytes + payload_bytes + kHeadroomBytes)),
+      packet_size_(DataSize::Bytes(header_bytes + payload_bytes)),
+      offload_(superframe.offload_),
+      segment_count_(1),
+      wire_header_bytes_(0) {
+  const uint8_t* data = superframe.GetData();
+  buffer_.Write(data, DataSize::Bytes(header_bytes), kHeadroomBytes);
+  buffer_.Write(data + header_bytes + payload_offset,
+                DataSize::Bytes(payload_bytes), kHeadroomBytes + header_bytes);
+  offload_.tcp_segmentation = false;
+  offload_.segment_bytes = 0;
+  offload_.header_bytes = 0;
+  if (superframe.trace_ != nullptr) {
+    trace_ = std::make_unique<PacketTrace>(*superframe.trace_);
+  }
+}
+
+bool Packet::ParseTcpHeaders(size_t* ip_offset, size_t* tcp_offset,
+                             size_t* header_bytes) const {
+  const uint8_t* data = GetData();
+  size_t size = packet_size_.Bytes();
+  size_t ip = 14;
+  if (size >= 18 && Load16(data + 12) == 0x8100) {  // 802.1Q VLAN
+    ip = 18;
+  }
+  if (size < ip + 20 || Load16(data + ip - 2) != 0x0800 ||
+      data[ip + 9] != IPPROTO_TCP) {
+    return false;
+  }
+  size_t tcp = ip + (data[ip] & 0x0f) * 4;
+  if (size < tcp + 20) {
+    return false;
+  }
+  size_t headers = tcp + (data[tcp + 12] >> 4) * 4;
+  if (size < headers) {
+    return false;
+  }
+  *ip_offset = ip;
+  *tcp_offset = tcp;
+  *header_bytes = headers;
+  return true;
+}
+
+void Packet::SetOffload(const Offload& offload) {
+  offload_ = offload;
+  segment_count_ = 1;
+  if (!offload_.tcp_segmentation) {
+    return;
+  }
+  size_t ip, tcp, headers;
+  if (offload_.segment_bytes == 0 || !ParseTcpHeaders(&ip, &tcp, &headers)) {
+    ALOG_WARNING << "Invalid TCP superframe, sending it as is";
+    offload_.tcp_segmentation = false;
+    return;
+  }
+  offload_.header_bytes = headers;
+  size_t payload = packet_size_.Bytes() - headers;
+  segment_count_ =
+      std::max<size_t>(1, (payload + offload_.segment_bytes - 1) /
+                              offload_.segment_bytes);
+}
+
+std::vector<std::shared_ptr<Packet>> Packet::Segment(
+    std::shared_ptr<Packet> packet) {
+  std::vector<std::shared_ptr<Packet>> segments;
+  if (packet->segment_count_ <= 1) {
+    packet->offload_.tcp_segmentation = false;
+    segments.push_back(std::move(packet));
+    return segments;
+  }
+  size_t ip, tcp, headers;
+  packet->ParseTcpHeaders(&ip, &tcp, &headers);
+  const uint8_t* data = packet->GetData();
+  size_t payload = packet->packet_size_.Bytes() - headers;
+  size_t mss = packet->offload_.segment_bytes;
+  uint16_t super_ip_length = Load16(data + ip + 2);
+  uint16_t super_ip_id = Load16(data + ip + 4);
+  uint32_t super_sequence =
+      uint32_t(Load16(data + tcp + 4)) << 16 | Load16(data + tcp + 6);
+  uint16_t super_tcp_length = packet->packet_size_.Bytes() - tcp;
+  // The sum of the pseudo header of the superframe, the segments only differ
+  // in the TCP length.
+  uint16_t pseudo_sum = Load16(data + tcp + 16);
+  if (!packet->offload_.partial_checksum) {
+    uint64_t sum = IPPROTO_TCP + super_tcp_length;
+    for (size_t i = 12; i < 20; i += 2) {
+      sum += Load16(data + ip + i);
+    }
+    pseudo_sum = Fold(sum);
+  }
+
+  segments.reserve(packet->segment_count_);
+  for (size_t offset = 0, i = 0; offset < payload; offset += mss, ++i) {
+    size_t bytes = std::min(mss, payload - offset);
+    std::shared_ptr<Packet> segment(
+        new Packet(*packet, headers, offset, bytes));
+    uint8_t* frame = segment->GetMutableData();
+
+    // IPv4 header, its checksum is stored inverted.
+    uint16_t ip_length = headers - ip + bytes;
+    uint16_t ip_id = super_ip_id + i;
+    uint16_t ip_sum = ~Load16(frame + ip + 10);
+    ip_sum = AdjustSum(ip_sum, super_ip_length, ip_length);
+    ip_sum = AdjustSum(ip_sum, super_ip_id, ip_id);
+    Store16(frame + ip + 2, ip_length);
+    Store16(frame + ip + 4, ip_id);
+    Store16(frame + ip + 10, ~ip_sum);
+
+    // TCP header, FIN and PSH only on the last segment, CWR only on the
+    // first one. The header is summed when the checksum is finished.
+    uint32_t sequence = super_sequence + offset;
+    Store16(frame + tcp + 4, sequence >> 16);
+    Store16(frame + tcp + 6, sequence & 0xffff);
+    if (offset + bytes < payload) {
+      frame[tcp + 13] &= ~0x09;
+    }
+    if (offset > 0) {
+      frame[tcp + 13] &= ~0x80;
+    }
+    uint16_t tcp_length = headers - tcp + bytes;
+    Store16(frame + tcp + 16,
+            AdjustSum(pseudo_sum, super_tcp_length, tcp_length));
+    segment->offload_.partial_checksum = true;
+    segment->offload_.checksum_start = tcp;
+    segment->offload_.checksum_offset = 16;
+    segment->offload_.header_bytes = 0;
+    segments.push_back(std::move(segment));
+  }
+  // The segments carry on the trace of the superframe.
+  packet->trace_.reset();
+  return segments;
+}
+
+void Packet::FinishChecksum() {
+  if (!offload_.partial_checksum) {
+    return;
+  }
+  size_t start = offload_.checksum_start;
+  size_t field = start + offload_.checksum_offset;
+  size_t size = packet_size_.Bytes();
+  if (field + 2 > size) {
+    ALOG_WARNING << "Invalid partial checksum at " << field;
+    return;
+  }
+  // The field holds the sum of the pseudo header, it's summed with the rest.
+  uint8_t* data = GetMutableData();
+  uint64_t sum = 0;
+  size_t i = start;
+  for (; i + 1 < size; i += 2) {
+    sum += Load16(data + i);
+  }
+  if (i < size) {
+    sum += data[i] << 8;
+  }
+  uint16_t checksum = ~Fold(sum);
+  // A zero UDP checksum means no checksum.
+  if (checksum == 0) {
+    checksum = 0xffff;
+  }
+  Store16(data + field, checksum);
+  offload_.partial_checksum = false;
+}
+
+void Packet::SetWireHeader(const void* header, size_t bytes) {
+  if (bytes > kHeadroomBytes) {
+    ALOG_ERROR << "Wire header of " << bytes << " bytes is too long";
+    return;
+  }
+  std::memcpy(GetMutableData() - bytes, header, bytes);
+  wire_header_bytes_ = bytes;
 }
 
 }  // namespace araneid
\ No newline at end of file
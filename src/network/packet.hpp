@@ -5,19 +5,30 @@
 #include <cstdlib>
 #include <deque>
 #include <memory>
+#include <vector>
 
 #include "device.hpp"
 
 namespace araneid {
+struct PacketTrace;
+
 struct Chunk {
   size_t size;
   size_t references_;
-  uint8_t* data;
+  // The payload is allocated together with the chunk header.
+  uint8_t data[1];
 };
 
+// Buffer is a reference counted view of a pooled chunk. Chunks are recycled
+// into a per-thread free list, so a buffer may be released by a different
+// thread from the one that allocated it.
+// A buffer can also view memory owned by someone else, like a ring mapped
+// from the kernel, which is released along with the last buffer viewing it.
 class Buffer {
  public:
   Buffer(DataSize size);
+  Buffer(uint8_t* data, size_t size, std::shared_ptr<void> owner);
+  Buffer(const Buffer& other);
   ~Buffer();
   static Chunk* Allocate(size_t size);
   static Chunk* AllocateNew(size_t size);
@@ -26,40 +37,123 @@ class Buffer {
 
   Buffer& operator=(const Buffer&);
 
-  // copy data from the given buffer
-  void Write(const uint8_t* data, DataSize size);
+  // copy data from the given buffer, starting `offset` bytes into the chunk
+  void Write(const uint8_t* data, DataSize size, size_t offset = 0);
+
+  bool Copy(uint8_t* data, size_t size, size_t offset = 0) const;
 
-  bool Copy(uint8_t* data, size_t size) const;
+  uint8_t* Data() { return data_ ? data_->data : external_; }
+  const uint8_t* Data() const { return data_ ? data_->data : external_; }
+  size_t Size() const { return data_ ? data_->size : external_size_; }
 
  private:
   using FreeChunks = std::deque<Chunk*>;
-  static std::unique_ptr<FreeChunks> free_chunks_;
+  static thread_local std::unique_ptr<FreeChunks> free_chunks_;
   // The maximum size of the recycled chunk, and chunks smaller than this
   // won't be recycled. This is a performance optimization to avoid allocating
   // too many small chunks.
-  static size_t recycled_chunk_size_;
+  static thread_local size_t recycled_chunk_size_;
   Chunk* data_;
+  uint8_t* external_;
+  size_t external_size_;
+  std::shared_ptr<void> owner_;
+};
+
+// Offload state of a frame, as described by the virtio net header of a TAP
+// device with IFF_VNET_HDR.
+struct Offload {
+  // The L4 checksum field only holds the sum of the pseudo header, the rest
+  // is summed by whoever finishes it, see Packet::FinishChecksum().
+  bool partial_checksum = false;
+  uint16_t checksum_start = 0;   // from the start of the frame
+  uint16_t checksum_offset = 0;  // from checksum_start
+  // A TCP over IPv4 superframe, to be cut into segments carrying at most
+  // `segment_bytes` of payload each.
+  bool tcp_segmentation = false;
+  uint16_t segment_bytes = 0;
+  // Size of all headers of a superframe, a hint for the receiving kernel.
+  uint16_t header_bytes = 0;
 };
 
 class Packet {
  public:
+  // Bytes reserved in front of the frame for a header added on the way out,
+  // like the virtio net header of a TAP device.
+  static constexpr size_t kHeadroomBytes = 16;
+
   // Create a packet by copying the data from the given buffer,
   // so the data is not owned by the packet, remember to free it.
   static std::shared_ptr<Packet> Create(const uint8_t* data, DataSize size) {
     return std::make_shared<Packet>(data, size);
   }
+  // Create a packet viewing the frame in place, without a copy. The frame
+  // must be writable and preceded by kHeadroomBytes of writable memory, and
+  // `owner` is released once the packet and its copies are gone.
+  static std::shared_ptr<Packet> Wrap(uint8_t* data, DataSize size,
+                                      std::shared_ptr<void> owner);
+  // Cut a superframe into the frames it stands for. Lengths, sequence
+  // numbers and IP ids are fixed up and the checksums are adjusted
+  // incrementally, so the payload is only copied, never summed. The
+  // segments keep a partial checksum. Other packets are returned as is.
+  static std::vector<std::shared_ptr<Packet>> Segment(
+      std::shared_ptr<Packet> packet);
+  // Whether a packet can be made of the frame. Frames read from files are
+  // checked first, a header Parse() can't read is fatal.
+  static bool IsWellFormed(const uint8_t* data, size_t len);
+
   DataSize GetSize() const { return packet_size_; }
   Ipv4Address GetSrcIpv4() const { return src_; }
   Ipv4Address GetDstIpv4() const { return dst_; }
   // Copy the data from the packet to the given buffer, return the copied size.
   bool CopyData(uint8_t* data, size_t size) const;
+  // Direct access to the frame, starting at the ethernet header.
+  const uint8_t* GetData() const { return buffer_.Data() + kHeadroomBytes; }
+  uint8_t* GetMutableData() { return buffer_.Data() + kHeadroomBytes; }
+
+  // A superframe that can't be segmented is sent as a plain frame.
+  void SetOffload(const Offload& offload);
+  const Offload& GetOffload() const { return offload_; }
+  // The number of frames on the wire, more than one for a superframe.
+  size_t GetSegmentCount() const { return segment_count_; }
+  // Sum the rest of a partial checksum into the checksum field.
+  void FinishChecksum();
+
+  // What is written to a device, the frame preceded by the wire header.
+  // The header takes at most kHeadroomBytes.
+  void SetWireHeader(const void* header, size_t bytes);
+  const uint8_t* GetWireData() const { return GetData() - wire_header_bytes_; }
+  size_t GetWireBytes() const {
+    return packet_size_.Bytes() + wire_header_bytes_;
+  }
+
+  // Stage timestamps, see LatencyProfiler. Created on first use.
+  PacketTrace* MutableTrace();
+
   Packet(const uint8_t* data, DataSize size);
+  // A traced packet hands its trace to the LatencyProfiler.
+  ~Packet();
 
  private:
+  Packet(Buffer buffer, DataSize size);
+  // Read the addresses from the frame.
+  void Parse();
+  // A segment of `superframe`, with its headers and `payload_bytes` of
+  // payload starting at `payload_offset`.
+  Packet(const Packet& superframe, size_t header_bytes, size_t payload_offset,
+         size_t payload_bytes);
+  // Offsets of the IPv4 and TCP headers of a superframe, and the size of
+  // all headers. Returns false if it isn't TCP over IPv4.
+  bool ParseTcpHeaders(size_t* ip_offset, size_t* tcp_offset,
+                       size_t* header_bytes) const;
+
   Ipv4Address src_;
   Ipv4Address dst_;
   Buffer buffer_;
   DataSize packet_size_;
+  Offload offload_;
+  size_t segment_count_;
+  size_t wire_header_bytes_;
+  std::unique_ptr<PacketTrace> trace_;
 };
 
 }  // namespace araneid
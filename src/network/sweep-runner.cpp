@@ -0,0 +1,52 @@
+#include "sweep-runner.hpp"
+
+#include <algorithm>
+
+#include "device.hpp"
+#include "transmission.hpp"
+
+namespace araneid {
+
+constexpr const char* kSourceAddress = "10.0.0.1";
+constexpr const char* kSinkAddress = "10.0.0.2";
+
+SweepRunner::SweepRunner(size_t threads)
+    : threads_(threads > 0
+                   ? threads
+                   : std::max(1u, std::thread::hardware_concurrency())) {}
+
+std::vector<LinkScenarioResult> SweepRunner::Run(
+    const std::vector<LinkScenario>& scenarios) const {
+  return Run(scenarios.size(), [&scenarios](Simulator& simulator, size_t i) {
+    return RunLink(scenarios[i], simulator);
+  });
+}
+
+LinkScenarioResult SweepRunner::RunLink(const LinkScenario& scenario,
+                                        Simulator& simulator) {
+  auto sink = std::make_shared<TrafficSink>(simulator);
+  auto device = std::make_shared<CommonDevice>();
+  auto link = std::make_shared<CommonTransmission>(
+      std::make_unique<RandomPacketLoss>(scenario.loss_rate, scenario.seed),
+      scenario.delay, scenario.bandwidth, scenario.buffer_size, simulator);
+  link->SetReceiver(sink);
+  link->SwitchOn();
+  device->AddTransmission(kSinkAddress, link);
+  CbrTrafficGenerator generator(device,
+                                FrameTemplate(kSourceAddress, kSinkAddress),
+                                scenario.offered_rate, scenario.frame_bytes,
+                                scenario.seed, simulator);
+  generator.Start(scenario.duration);
+  simulator.Run(scenario.duration);
+  // Let the frames still queued or in flight arrive.
+  simulator.Run(scenario.delay +
+                scenario.buffer_size / scenario.bandwidth);
+
+  LinkScenarioResult result;
+  result.scenario = scenario;
+  result.sent_packets = generator.GetSentPackets();
+  result.stats = sink->GetStats();
+  return result;
+}
+
+}  // namespace araneid
@@ -0,0 +1,87 @@
+#ifndef ARANEID_NETWORK_SWEEP_RUNNER_HPP
+#define ARANEID_NETWORK_SWEEP_RUNNER_HPP
+
+#include <atomic>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "base/simulator.hpp"
+#include "base/time.hpp"
+#include "base/units.hpp"
+#include "traffic.hpp"
+
+namespace araneid {
+
+// One point of a sweep over link parameters: a constant bit rate generator
+// sends frames through a CommonTransmission into a TrafficSink.
+struct LinkScenario {
+  TimeDelta delay = TimeDelta::Millis(10);
+  DataRate bandwidth = DataRate::MegaBitsPerSecond(100);
+  DataSize buffer_size = DataSize::KiloBytes(256);
+  double loss_rate = 0;
+  DataRate offered_rate = DataRate::MegaBitsPerSecond(50);
+  size_t frame_bytes = 1000;
+  // How long the generator sends, in virtual time.
+  TimeDelta duration = TimeDelta::Seconds(10);
+  // Seeds the loss model, so a scenario always gives the same result.
+  uint64_t seed = 1;
+};
+
+struct LinkScenarioResult {
+  LinkScenario scenario;
+  uint64_t sent_packets = 0;
+  TrafficSink::Stats stats;
+};
+
+// SweepRunner runs many independent scenarios across the cores. Every
+// scenario gets a simulator of its own on the virtual clock, so scenarios
+// share no state and each runs as fast as its thread allows.
+class SweepRunner {
+ public:
+  // `threads` scenarios run at a time, 0 for one per core.
+  explicit SweepRunner(size_t threads = 0);
+
+  // Run `scenario(simulator, index)` for every index below `count`, it
+  // builds its network on the simulator, drives it with Run() and returns
+  // what it measured. Results are in index order.
+  template <typename F>
+  auto Run(size_t count, F scenario) const
+      -> std::vector<std::invoke_result_t<F, Simulator&, size_t>>;
+
+  std::vector<LinkScenarioResult> Run(
+      const std::vector<LinkScenario>& scenarios) const;
+  // One link scenario on `simulator`, which must be on the virtual clock.
+  static LinkScenarioResult RunLink(const LinkScenario& scenario,
+                                    Simulator& simulator);
+
+ private:
+  size_t threads_;
+};
+
+template <typename F>
+auto SweepRunner::Run(size_t count, F scenario) const
+    -> std::vector<std::invoke_result_t<F, Simulator&, size_t>> {
+  std::vector<std::invoke_result_t<F, Simulator&, size_t>> results(count);
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+      Simulator simulator(SimulatorClock::kVirtual);
+      results[i] = scenario(simulator, i);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(threads_, count); ++i) {
+    workers.emplace_back(work);
+  }
+  // The calling thread takes scenarios too.
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return results;
+}
+
+}  // namespace araneid
+
+#endif  // ARANEID_NETWORK_SWEEP_RUNNER_HPP
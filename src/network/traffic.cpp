@@ -0,0 +1,426 @@
+#include "traffic.hpp"
+
+#include <arpa/inet.h>  // only for UNIX-like systems
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <sstream>
+
+#include "base/log.hpp"
+#include "base/simulator.hpp"
+#include "packet.hpp"
+
+namespace araneid {
+
+// Wakeups closer than this are merged, frames due in between are sent in
+// one batch.
+const TimeDelta kMinTickInterval = TimeDelta::Micros(50);
+// Upper bound of frames emitted per wakeup, so a generator that can't keep
+// up doesn't starve the thread pool.
+constexpr int kMaxFramesPerTick = 4096;
+
+namespace {
+std::atomic<uint32_t> next_source_id{1};
+
+uint32_t ChecksumAdd(uint32_t sum, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i + 1 < len; i += 2) {
+    sum += (static_cast<uint32_t>(data[i]) << 8) | data[i + 1];
+  }
+  return sum;
+}
+
+uint16_t ChecksumFold(uint32_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return static_cast<uint16_t>(~sum);
+}
+
+void PutUint16(uint8_t* at, uint16_t value) {
+  at[0] = value >> 8;
+  at[1] = value & 0xff;
+}
+}  // namespace
+
+FrameTemplate::FrameTemplate(const Ipv4Address& src, const Ipv4Address& dst,
+                             uint16_t src_port, uint16_t dst_port)
+    : src_port_(src_port), valid_(true) {
+  std::memset(frame_, 0, sizeof(frame_));
+  // Locally administered MAC addresses, the TAP device is promiscuous.
+  const uint8_t dst_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+  const uint8_t src_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+  std::memcpy(frame_, dst_mac, 6);
+  std::memcpy(frame_ + 6, src_mac, 6);
+  PutUint16(frame_ + 12, 0x0800);
+
+  uint8_t* ip = frame_ + 14;
+  ip[0] = 0x45;  // version 4, 20 bytes header
+  ip[6] = 0x40;  // don't fragment
+  ip[8] = 64;    // ttl
+  ip[9] = 17;    // UDP
+  if (inet_pton(AF_INET, src.c_str(), ip + 12) != 1) {
+    ALOG_WARNING << "Invalid source address: " << src;
+    valid_ = false;
+  }
+  if (inet_pton(AF_INET, dst.c_str(), ip + 16) != 1) {
+    ALOG_WARNING << "Invalid destination address: " << dst;
+    valid_ = false;
+  }
+  // Total length and checksum are zero here, so this is the sum of the
+  // fields that never change.
+  ip_checksum_base_ = ChecksumAdd(0, ip, 20);
+
+  uint8_t* udp = ip + 20;
+  PutUint16(udp, src_port);
+  PutUint16(udp + 2, dst_port);
+  // The UDP checksum is optional over IPv4 and left as zero.
+}
+
+std::shared_ptr<Packet> FrameTemplate::Build(size_t frame_bytes,
+                                             uint16_t flow,
+                                             const ProbeHeader& probe) const {
+  frame_bytes = std::clamp(frame_bytes, kMinFrameBytes, kMaxFrameBytes);
+  std::shared_ptr<Packet> packet =
+      Packet::Create(frame_, DataSize::Bytes(frame_bytes));
+  uint8_t* ip = packet->GetMutableData() + 14;
+  uint16_t ip_length = static_cast<uint16_t>(frame_bytes - 14);
+  PutUint16(ip + 2, ip_length);
+  PutUint16(ip + 10, ChecksumFold(ip_checksum_base_ + ip_length));
+  uint8_t* udp = ip + 20;
+  PutUint16(udp, static_cast<uint16_t>(src_port_ + flow));
+  PutUint16(udp + 4, static_cast<uint16_t>(ip_length - 20));
+  std::memcpy(udp + 8, &probe, sizeof(probe));
+  return packet;
+}
+
+TrafficGenerator::TrafficGenerator(std::shared_ptr<Device> device,
+                                   FrameTemplate frame, uint64_t seed,
+                                   Simulator& simulator)
+    : rng_(seed),
+      simulator_(&simulator),
+      device_(device),
+      frame_(frame),
+      source_(next_source_id.fetch_add(1)),
+      running_(false),
+      pending_{TimeDelta::Zero(), 0, 0},
+      valid_(true),
+      sequence_(0),
+      sent_packets_(0),
+      sent_bytes_(0) {
+  if (device_ == nullptr) {
+    Reject("it needs a device");
+  }
+  if (!frame_.IsValid()) {
+    Reject("its frame template has a bad address");
+  }
+}
+
+bool TrafficGenerator::Start(TimeDelta duration) {
+  if (!valid_) {
+    ALOG_WARNING << "Traffic generator " << source_
+                 << " has a bad setting, not starting it";
+    return false;
+  }
+  if (running_.exchange(true)) {
+    ALOG_WARNING << "Traffic generator " << source_ << " is already running";
+    return false;
+  }
+  start_time_ = simulator_->Now();
+  end_time_ = start_time_ + duration;
+  if (!NextEmission(&pending_)) {
+    running_.store(false);
+    return true;
+  }
+  simulator_->Schedule(pending_.offset, &TrafficGenerator::Tick, this);
+  return true;
+}
+
+void TrafficGenerator::Stop() { running_.store(false); }
+
+void TrafficGenerator::Tick() {
+  if (!running_.load()) {
+    return;
+  }
+  TimePoint now = simulator_->Now();
+  for (int i = 0; i < kMaxFramesPerTick; ++i) {
+    TimePoint due = start_time_ + pending_.offset;
+    if (due >= end_time_) {
+      running_.store(false);
+      return;
+    }
+    if (due > now) {
+      break;
+    }
+    Emit(pending_);
+    if (!NextEmission(&pending_)) {
+      running_.store(false);
+      return;
+    }
+  }
+  TimeDelta wait = (start_time_ + pending_.offset) - simulator_->Now();
+  // A virtual clock wakes up exactly when the next frame is due.
+  if (simulator_->GetClock() == SimulatorClock::kWallClock) {
+    wait = std::max(wait, kMinTickInterval);
+  }
+  simulator_->Schedule(wait, &TrafficGenerator::Tick, this);
+}
+
+void TrafficGenerator::Emit(const Emission& emission) {
+  ProbeHeader probe;
+  probe.magic = kProbeMagic;
+  probe.source = source_;
+  probe.sequence = sequence_++;
+  probe.sent_at = (simulator_->Now() - TimePoint()).Nanos();
+  std::shared_ptr<Packet> packet =
+      frame_.Build(emission.frame_bytes, emission.flow, probe);
+  sent_packets_.fetch_add(1, std::memory_order_relaxed);
+  sent_bytes_.fetch_add(packet->GetSize().Bytes(), std::memory_order_relaxed);
+  device_->Send(std::move(packet));
+}
+
+TimeDelta TrafficGenerator::FrameTime(size_t frame_bytes, DataRate rate) {
+  if (rate == DataRate::Zero()) {
+    return TimeDelta::Nanos(std::numeric_limits<int64_t>::max());
+  }
+  return DataSize::Bytes(frame_bytes) / rate;
+}
+
+double TrafficGenerator::Exponential(double mean) {
+  std::exponential_distribution<double> dis(1.0 / mean);
+  return dis(rng_);
+}
+
+double TrafficGenerator::Pareto(double mean, double shape) {
+  // Inverse transform sampling, the scale is chosen to match the mean.
+  double scale = mean * (shape - 1.0) / shape;
+  std::uniform_real_distribution<double> dis(0.0, 1.0);
+  return scale / std::pow(1.0 - dis(rng_), 1.0 / shape);
+}
+
+void TrafficGenerator::Reject(const std::string& reason) {
+  ALOG_WARNING << "Traffic generator " << source_ << " is rejected, "
+               << reason;
+  valid_ = false;
+}
+
+CbrTrafficGenerator::CbrTrafficGenerator(std::shared_ptr<Device> device,
+                                         FrameTemplate frame, DataRate rate,
+                                         size_t frame_bytes, uint64_t seed,
+                                         Simulator& simulator)
+    : TrafficGenerator(device, frame, seed, simulator),
+      interval_(FrameTime(frame_bytes, rate)),
+      frame_bytes_(frame_bytes),
+      offset_(TimeDelta::Zero()) {
+  if (rate == DataRate::Zero()) {
+    Reject("its rate is zero");
+  }
+}
+
+bool CbrTrafficGenerator::NextEmission(Emission* emission) {
+  emission->offset = offset_;
+  emission->frame_bytes = frame_bytes_;
+  emission->flow = 0;
+  offset_ += interval_;
+  return true;
+}
+
+PoissonTrafficGenerator::PoissonTrafficGenerator(
+    std::shared_ptr<Device> device, FrameTemplate frame, DataRate mean_rate,
+    size_t frame_bytes, uint64_t seed, Simulator& simulator)
+    : TrafficGenerator(device, frame, seed, simulator),
+      mean_interval_ns_(FrameTime(frame_bytes, mean_rate).Nanos()),
+      frame_bytes_(frame_bytes),
+      offset_ns_(0) {
+  if (mean_rate == DataRate::Zero()) {
+    Reject("its mean rate is zero");
+  }
+}
+
+bool PoissonTrafficGenerator::NextEmission(Emission* emission) {
+  offset_ns_ += Exponential(mean_interval_ns_);
+  emission->offset = TimeDelta::Nanos(static_cast<int64_t>(offset_ns_));
+  emission->frame_bytes = frame_bytes_;
+  emission->flow = 0;
+  return true;
+}
+
+OnOffParetoTrafficGenerator::OnOffParetoTrafficGenerator(
+    std::shared_ptr<Device> device, FrameTemplate frame, DataRate peak_rate,
+    size_t frame_bytes, TimeDelta mean_on, TimeDelta mean_off, double shape,
+    uint64_t seed, Simulator& simulator)
+    : TrafficGenerator(device, frame, seed, simulator),
+      interval_(FrameTime(frame_bytes, peak_rate)),
+      frame_bytes_(frame_bytes),
+      mean_on_(mean_on),
+      mean_off_(mean_off),
+      shape_(shape),
+      offset_(TimeDelta::Zero()),
+      on_end_(TimeDelta::Zero()) {
+  if (peak_rate == DataRate::Zero()) {
+    Reject("its peak rate is zero");
+  }
+  // An on period must end, or the off periods would be skipped forever.
+  if (mean_on_ <= TimeDelta::Zero()) {
+    Reject("its mean on period is not positive");
+  }
+  if (shape_ <= 1.0) {
+    std::ostringstream reason;
+    reason << "its Pareto shape must be greater than 1, got " << shape_;
+    Reject(reason.str());
+  }
+}
+
+bool OnOffParetoTrafficGenerator::NextEmission(Emission* emission) {
+  // Skip off periods (and on periods too short for a single frame) until
+  // the next frame fits into an on period.
+  while (offset_ >= on_end_) {
+    TimeDelta off = TimeDelta::Nanos(
+        static_cast<int64_t>(Pareto(mean_off_.Nanos(), shape_)));
+    TimeDelta on = TimeDelta::Nanos(
+        static_cast<int64_t>(Pareto(mean_on_.Nanos(), shape_)));
+    offset_ = std::max(offset_, on_end_) + off;
+    on_end_ = offset_ + on;
+  }
+  emission->offset = offset_;
+  emission->frame_bytes = frame_bytes_;
+  emission->flow = 0;
+  offset_ += interval_;
+  return true;
+}
+
+FlowSizeTrafficGenerator::FlowSizeTrafficGenerator(
+    std::shared_ptr<Device> device, FrameTemplate frame,
+    std::vector<DataSize> flow_sizes, TimeDelta mean_flow_interval,
+    DataRate flow_rate, size_t frame_bytes, uint64_t seed,
+    Simulator& simulator)
+    : TrafficGenerator(device, frame, seed, simulator),
+      flow_sizes_(std::move(flow_sizes)),
+      mean_flow_interval_ns_(mean_flow_interval.Nanos()),
+      flow_rate_(flow_rate),
+      frame_bytes_(frame_bytes),
+      next_arrival_(TimeDelta::Zero()),
+      next_flow_id_(0) {
+  if (flow_sizes_.empty()) {
+    Reject("its flow size distribution is empty");
+  }
+  if (flow_rate_ == DataRate::Zero()) {
+    Reject("its flow rate is zero");
+  }
+  if (mean_flow_interval <= TimeDelta::Zero()) {
+    Reject("its mean flow interval is not positive");
+  }
+}
+
+void FlowSizeTrafficGenerator::ArriveFlow() {
+  std::uniform_int_distribution<size_t> pick(0, flow_sizes_.size() - 1);
+  Flow flow;
+  flow.next = next_arrival_;
+  flow.remaining_bytes = flow_sizes_[pick(rng_)].Bytes();
+  flow.id = next_flow_id_++;
+  flows_.push(flow);
+  next_arrival_ += TimeDelta::Nanos(
+      static_cast<int64_t>(Exponential(mean_flow_interval_ns_)));
+}
+
+bool FlowSizeTrafficGenerator::NextEmission(Emission* emission) {
+  while (flows_.empty() || next_arrival_ <= flows_.top().next) {
+    ArriveFlow();
+  }
+  Flow flow = flows_.top();
+  flows_.pop();
+  size_t frame_bytes = std::clamp<uint64_t>(
+      flow.remaining_bytes + FrameTemplate::kHeaderBytes,
+      FrameTemplate::kMinFrameBytes, frame_bytes_);
+  size_t payload = frame_bytes - FrameTemplate::kHeaderBytes;
+  emission->offset = flow.next;
+  emission->frame_bytes = frame_bytes;
+  emission->flow = flow.id;
+  if (flow.remaining_bytes > payload) {
+    flow.remaining_bytes -= payload;
+    flow.next += FrameTime(frame_bytes, flow_rate_);
+    flows_.push(flow);
+  }
+  return true;
+}
+
+void TrafficSink::Send(std::shared_ptr<Packet>) {
+  ALOG_WARNING << "Traffic sink can't send packets, dropping it";
+}
+
+void TrafficSink::Receive(std::shared_ptr<Packet> packet) {
+  if (packet == nullptr) {
+    return;
+  }
+  TimePoint now = simulator_->Now();
+  size_t size = packet->GetSize().Bytes();
+  ProbeHeader probe;
+  bool has_probe = false;
+  if (size >= FrameTemplate::kMinFrameBytes) {
+    std::memcpy(&probe, packet->GetData() + FrameTemplate::kHeaderBytes,
+                sizeof(probe));
+    has_probe = probe.magic == kProbeMagic;
+  }
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  if (packets_ == 0) {
+    first_arrival_ = now;
+  }
+  last_arrival_ = now;
+  packets_++;
+  bytes_ += size;
+  if (!has_probe) {
+    return;
+  }
+  TimeDelta delay = (now - TimePoint()) - TimeDelta::Nanos(probe.sent_at);
+  if (probes_ == 0 || delay < min_delay_) {
+    min_delay_ = delay;
+  }
+  if (probes_ == 0 || delay > max_delay_) {
+    max_delay_ = delay;
+  }
+  probes_++;
+  delay_sum_ns_ += delay.Nanos();
+  auto it = max_sequence_.find(probe.source);
+  if (it == max_sequence_.end()) {
+    max_sequence_[probe.source] = probe.sequence;
+  } else {
+    it->second = std::max(it->second, probe.sequence);
+  }
+}
+
+TrafficSink::Stats TrafficSink::GetStats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  Stats stats;
+  stats.packets = packets_;
+  stats.bytes = bytes_;
+  uint64_t expected = 0;
+  for (const auto& [source, sequence] : max_sequence_) {
+    expected += sequence + 1;
+  }
+  stats.lost = expected > probes_ ? expected - probes_ : 0;
+  if (probes_ > 0) {
+    stats.min_delay = min_delay_;
+    stats.max_delay = max_delay_;
+    stats.mean_delay = TimeDelta::Nanos(delay_sum_ns_ / probes_);
+  }
+  TimeDelta elapsed = last_arrival_ - first_arrival_;
+  if (packets_ > 1 && elapsed > TimeDelta::Zero()) {
+    stats.throughput = DataSize::Bytes(bytes_) / elapsed;
+  }
+  return stats;
+}
+
+void TrafficSink::Reset() {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  packets_ = 0;
+  bytes_ = 0;
+  probes_ = 0;
+  delay_sum_ns_ = 0;
+  min_delay_ = TimeDelta::Zero();
+  max_delay_ = TimeDelta::Zero();
+  max_sequence_.clear();
+}
+
+}  // namespace araneid
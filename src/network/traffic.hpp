@@ -0,0 +1,259 @@
+#ifndef ARANEID_NETWORK_TRAFFIC_HPP
+#define ARANEID_NETWORK_TRAFFIC_HPP
+
+#include <atomic>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/random.hpp"
+#include "base/simulator.hpp"
+#include "base/time.hpp"
+#include "base/units.hpp"
+#include "device.hpp"
+
+namespace araneid {
+class Packet;
+
+// Synthetic frames carry a probe header right after the UDP header, so a
+// TrafficSink can measure one-way delay and loss without any help from the
+// generator.
+struct ProbeHeader {
+  uint32_t magic;
+  uint32_t source;    // id of the generator
+  uint64_t sequence;  // per generator, starting from 0
+  int64_t sent_at;    // nanoseconds since epoch
+} __attribute__((packed));
+constexpr uint32_t kProbeMagic = 0x61726e64;  // "arnd"
+
+// FrameTemplate preformats the ethernet, IPv4 and UDP headers once, so
+// emitting a frame is a single copy into a pooled buffer followed by a few
+// field patches. It is immutable after construction and can be shared.
+class FrameTemplate {
+ public:
+  static constexpr size_t kHeaderBytes = 14 + 20 + 8;
+  static constexpr size_t kMinFrameBytes = kHeaderBytes + sizeof(ProbeHeader);
+  static constexpr size_t kMaxFrameBytes = 1514;
+
+  FrameTemplate(const Ipv4Address& src, const Ipv4Address& dst,
+                uint16_t src_port = 10000, uint16_t dst_port = 9);
+  // False if an address could not be parsed.
+  bool IsValid() const { return valid_; }
+
+  // The frame size is clamped to [kMinFrameBytes, kMaxFrameBytes]. `flow` is
+  // added to the UDP source port, so every flow is a distinct 5-tuple.
+  std::shared_ptr<Packet> Build(size_t frame_bytes, uint16_t flow,
+                                const ProbeHeader& probe) const;
+
+ private:
+  uint8_t frame_[kMaxFrameBytes];
+  uint16_t src_port_;
+  bool valid_;
+  // One's complement sum of the IPv4 header without the total length.
+  uint32_t ip_checksum_base_;
+};
+
+// A traffic generator injects synthetic frames straight into a device, as if
+// they had been read from a TAP device. Subclasses only decide when the
+// next frame is due and how large it is; the base class batches all frames
+// that are due into one simulator wakeup, so the generator is not limited
+// by the scheduler resolution.
+// The generator must outlive the simulation it is scheduled on, and is
+// scheduled on `simulator`.
+class TrafficGenerator {
+ public:
+  TrafficGenerator(std::shared_ptr<Device> device, FrameTemplate frame,
+                   uint64_t seed, Simulator& simulator = Simulator::Instance());
+  virtual ~TrafficGenerator() = default;
+
+  // Start emitting frames for `duration`, the simulator must be running.
+  // Returns false if the generator is already running or was constructed
+  // with a bad setting, like a zero rate.
+  bool Start(TimeDelta duration);
+  void Stop();
+  bool IsRunning() const { return running_.load(); }
+
+  uint32_t GetSourceId() const { return source_; }
+  uint64_t GetSentPackets() const { return sent_packets_.load(); }
+  DataSize GetSentSize() const {
+    return DataSize::Bytes(sent_bytes_.load());
+  }
+
+  // Invoked by the simulator.
+  void Tick();
+
+ protected:
+  struct Emission {
+    TimeDelta offset;    // since the generator was started
+    size_t frame_bytes;  // including the ethernet header
+    uint16_t flow;
+  };
+  // Fill in the next emission, whose offset must not be less than the
+  // previous one. Return false when the source is exhausted.
+  virtual bool NextEmission(Emission* emission) = 0;
+
+  // Helpers for subclasses.
+  // Saturates for a zero rate.
+  static TimeDelta FrameTime(size_t frame_bytes, DataRate rate);
+  double Exponential(double mean);
+  double Pareto(double mean, double shape);
+  // Warn about a bad setting, the generator then refuses to start.
+  void Reject(const std::string& reason);
+  std::mt19937_64 rng_;
+
+ private:
+  void Emit(const Emission& emission);
+  Simulator* simulator_;
+  std::shared_ptr<Device> device_;
+  FrameTemplate frame_;
+  uint32_t source_;
+  std::atomic<bool> running_;
+  TimePoint start_time_;
+  TimePoint end_time_;
+  Emission pending_;
+  bool valid_;
+  uint64_t sequence_;
+  std::atomic<uint64_t> sent_packets_;
+  std::atomic<uint64_t> sent_bytes_;
+};
+
+// Constant bit rate, fixed frame size.
+class CbrTrafficGenerator : public TrafficGenerator {
+ public:
+  CbrTrafficGenerator(std::shared_ptr<Device> device, FrameTemplate frame,
+                      DataRate rate, size_t frame_bytes,
+                      uint64_t seed = RandomSeed(),
+                      Simulator& simulator = Simulator::Instance());
+
+ protected:
+  bool NextEmission(Emission* emission) override;
+
+ private:
+  TimeDelta interval_;
+  size_t frame_bytes_;
+  TimeDelta offset_;
+};
+
+// Poisson arrivals with the given mean rate, fixed frame size.
+class PoissonTrafficGenerator : public TrafficGenerator {
+ public:
+  PoissonTrafficGenerator(std::shared_ptr<Device> device, FrameTemplate frame,
+                          DataRate mean_rate, size_t frame_bytes,
+                          uint64_t seed = RandomSeed(),
+                          Simulator& simulator = Simulator::Instance());
+
+ protected:
+  bool NextEmission(Emission* emission) override;
+
+ private:
+  double mean_interval_ns_;
+  size_t frame_bytes_;
+  double offset_ns_;
+};
+
+// On/off source: during an on period frames are sent at `peak_rate`, and
+// both on and off periods are Pareto distributed with the given means.
+// A shape in (1, 2] gives the heavy tailed bursts seen in aggregated traffic.
+class OnOffParetoTrafficGenerator : public TrafficGenerator {
+ public:
+  OnOffParetoTrafficGenerator(std::shared_ptr<Device> device,
+                              FrameTemplate frame, DataRate peak_rate,
+                              size_t frame_bytes, TimeDelta mean_on,
+                              TimeDelta mean_off, double shape = 1.5,
+                              uint64_t seed = RandomSeed(),
+                              Simulator& simulator = Simulator::Instance());
+
+ protected:
+  bool NextEmission(Emission* emission) override;
+
+ private:
+  TimeDelta interval_;
+  size_t frame_bytes_;
+  TimeDelta mean_on_;
+  TimeDelta mean_off_;
+  double shape_;
+  TimeDelta offset_;
+  TimeDelta on_end_;
+};
+
+// Flows arrive as a Poisson process, their sizes are drawn from the given
+// empirical distribution and each flow is paced at `flow_rate`. Every flow
+// uses its own UDP source port.
+class FlowSizeTrafficGenerator : public TrafficGenerator {
+ public:
+  FlowSizeTrafficGenerator(std::shared_ptr<Device> device, FrameTemplate frame,
+                           std::vector<DataSize> flow_sizes,
+                           TimeDelta mean_flow_interval, DataRate flow_rate,
+                           size_t frame_bytes = FrameTemplate::kMaxFrameBytes,
+                           uint64_t seed = RandomSeed(),
+                           Simulator& simulator = Simulator::Instance());
+
+ protected:
+  bool NextEmission(Emission* emission) override;
+
+ private:
+  struct Flow {
+    TimeDelta next;
+    uint64_t remaining_bytes;
+    uint16_t id;
+    bool operator>(const Flow& other) const { return next > other.next; }
+  };
+  void ArriveFlow();
+  std::vector<DataSize> flow_sizes_;
+  double mean_flow_interval_ns_;
+  DataRate flow_rate_;
+  size_t frame_bytes_;
+  TimeDelta next_arrival_;
+  uint16_t next_flow_id_;
+  std::priority_queue<Flow, std::vector<Flow>, std::greater<Flow>> flows_;
+};
+
+// TrafficSink terminates a link and measures what the generators delivered.
+// Frames without a probe header are counted but don't contribute to the
+// delay statistics. Arrivals are timed by the clock of `simulator`.
+class TrafficSink : public Device {
+ public:
+  struct Stats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    // Estimated from gaps in the probe sequence numbers.
+    uint64_t lost = 0;
+    TimeDelta min_delay = TimeDelta::Zero();
+    TimeDelta max_delay = TimeDelta::Zero();
+    TimeDelta mean_delay = TimeDelta::Zero();
+    // Delivered bytes between the first and the last arrival.
+    DataRate throughput = DataRate::Zero();
+  };
+
+  explicit TrafficSink(Simulator& simulator = Simulator::Instance())
+      : simulator_(&simulator) {}
+  // A sink never originates traffic.
+  void Send(std::shared_ptr<Packet> packet) override;
+  void Receive(std::shared_ptr<Packet> packet) override;
+  void AddTransmission(const Ipv4Address&,
+                       std::shared_ptr<Transmission>) override {}
+
+  Stats GetStats() const;
+  void Reset();
+
+ private:
+  Simulator* simulator_;
+  mutable std::mutex stats_mutex_;
+  uint64_t packets_ = 0;
+  uint64_t bytes_ = 0;
+  uint64_t probes_ = 0;
+  int64_t delay_sum_ns_ = 0;
+  TimeDelta min_delay_ = TimeDelta::Zero();
+  TimeDelta max_delay_ = TimeDelta::Zero();
+  TimePoint first_arrival_;
+  TimePoint last_arrival_;
+  // The highest sequence number seen per generator.
+  std::unordered_map<uint32_t, uint64_t> max_sequence_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_NETWORK_TRAFFIC_HPP
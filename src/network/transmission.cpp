@@ -1,24 +1,29 @@
 #include "transmission.hpp"
 
 #include <random>
+#include <vector>
 
 #include "base/log.hpp"
+#include "base/metrics.hpp"
 #include "base/simulator.hpp"
+#include "base/tracer.hpp"
+#include "flow-analyzer.hpp"
+#include "latency-profiler.hpp"
 
 namespace araneid {
 
-RandomPacketLoss::RandomPacketLoss(double drop_rate) : drop_rate_(drop_rate) {
+RandomPacketLoss::RandomPacketLoss(double drop_rate, uint64_t seed)
+    : drop_rate_(drop_rate), rng_(seed) {
   if (drop_rate < 0.0 || drop_rate > 1.0) {
     ALOG_ERROR << "Invalid drop rate: " << drop_rate;
   }
 }
 
 bool RandomPacketLoss::ShouldDropPacket(const Packet& packet) {
-  // Use a random number generator to determine whether to drop the packet
-  static std::random_device rd;
-  static std::mt19937 gen(rd());
+  // Use a random number generator to determine whether to drop the packet,
+  // every loss model draws from its own, so links don't share one.
   std::uniform_real_distribution<> dis(0.0, 1.0);
-  double random_value = dis(gen);
+  double random_value = dis(rng_);
   return random_value < drop_rate_;
 }
 
@@ -32,35 +37,166 @@ void RandomPacketLoss::SetLossRate(double drop_rate) {
 
 CommonTransmission::CommonTransmission(std::unique_ptr<PacketLoss> packet_loss,
                                        TimeDelta delay, DataRate bandwidth,
-                                       DataSize buffer_size)
-    : packet_loss_(std::move(packet_loss)),
+                                       DataSize buffer_size,
+                                       Simulator& simulator)
+    : simulator_(&simulator),
+      packet_loss_(std::move(packet_loss)),
       delay_(delay),
       bottleneck_bandwidth_(bandwidth),
       bottleneck_buffer_size_(buffer_size),
-      cached_buffer_size_(0) {}
+      cached_buffer_size_(0),
+      delay_line_armed_(false),
+      sent_frames_(0),
+      sent_bytes_(0),
+      delivered_frames_(0),
+      delivered_bytes_(0),
+      disconnected_drops_(0),
+      loss_drops_(0),
+      overflow_drops_(0) {
+  static std::atomic<uint64_t> links(0);
+  name_ = "link" + std::to_string(links.fetch_add(1));
+  metrics_collector_ = Metrics::Instance().AddCollector(
+      [this](MetricsWriter* writer) { Collect(writer); });
+}
+
+CommonTransmission::~CommonTransmission() {
+  Metrics::Instance().RemoveCollector(metrics_collector_);
+}
+
+void CommonTransmission::SetName(const std::string& name) {
+  std::lock_guard<std::mutex> lock(name_mutex_);
+  name_ = name;
+}
+
+std::string CommonTransmission::GetName() const {
+  std::lock_guard<std::mutex> lock(name_mutex_);
+  return name_;
+}
+
+void CommonTransmission::Collect(MetricsWriter* writer) const {
+  std::string name = GetName();
+  writer->Counter("araneid_link_sent_frames_total",
+                  "Frames sent into the link.", sent_frames_.load(),
+                  {{"link", name}});
+  writer->Counter("araneid_link_sent_bytes_total", "Bytes sent into the link.",
+                  sent_bytes_.load(), {{"link", name}});
+  writer->Counter("araneid_link_delivered_frames_total",
+                  "Frames delivered by the link to its receiver.",
+                  delivered_frames_.load(), {{"link", name}});
+  writer->Counter("araneid_link_delivered_bytes_total",
+                  "Bytes delivered by the link to its receiver.",
+                  delivered_bytes_.load(), {{"link", name}});
+  const char* help = "Frames dropped by the link, by reason.";
+  writer->Counter("araneid_link_dropped_frames_total", help,
+                  disconnected_drops_.load(),
+                  {{"link", name}, {"reason", "disconnected"}});
+  writer->Counter("araneid_link_dropped_frames_total", help,
+                  loss_drops_.load(), {{"link", name}, {"reason", "loss"}});
+  writer->Counter("araneid_link_dropped_frames_total", help,
+                  overflow_drops_.load(),
+                  {{"link", name}, {"reason", "overflow"}});
+}
 
 void CommonTransmission::SendToNetwork(std::shared_ptr<Packet> packet) {
+  if (analyzer_) {
+    analyzer_->Observe(*packet);
+  }
+  size_t segments = packet->GetSegmentCount();
+  sent_frames_.fetch_add(segments, std::memory_order_relaxed);
+  sent_bytes_.fetch_add(packet->GetSize().Bytes(), std::memory_order_relaxed);
   if (!IsConnected()) {
+    disconnected_drops_.fetch_add(segments, std::memory_order_relaxed);
     ALOG_INFO << "Not connected, dropping packet";
     return;
   }
+  LatencyProfiler& profiler = LatencyProfiler::Instance();
+  profiler.Stamp(packet.get(), PipelineStage::kSendToNetwork);
+  std::vector<std::shared_ptr<Packet>> survivors;
   {
     std::lock_guard<std::mutex> lock(loss_mutex_);
-    if (packet_loss_->ShouldDropPacket(*packet)) {
+    // Every frame of a superframe is lost on its own, and the superframe is
+    // only cut into segments when some of them are lost.
+    std::vector<bool> lost(segments);
+    size_t lost_count = 0;
+    for (size_t i = 0; i < segments; ++i) {
+      lost[i] = packet_loss_->ShouldDropPacket(*packet);
+      lost_count += lost[i];
+    }
+    if (lost_count > 0) {
+      loss_drops_.fetch_add(lost_count, std::memory_order_relaxed);
+      Tracer::Instance().Instant("drop_loss", "frames", lost_count);
+    }
+    if (lost_count == segments) {
       ALOG_INFO << "Packet dropped by " << packet_loss_->GetName();
       return;
     }
+    if (lost_count > 0) {
+      ALOG_INFO << lost_count << " of " << segments << " segments dropped by "
+                << packet_loss_->GetName();
+      std::vector<std::shared_ptr<Packet>> all = Packet::Segment(packet);
+      for (size_t i = 0; i < all.size(); ++i) {
+        if (!lost[i]) {
+          survivors.push_back(std::move(all[i]));
+        }
+      }
+    } else {
+      survivors.push_back(std::move(packet));
+    }
   }
+  std::lock_guard<std::mutex> lock(delay_mutex_);
+  TimePoint now = simulator_->Now();
+  for (auto& survivor : survivors) {
+    TimePoint due = now + delay_;
+    if (!delay_line_.empty() && due < delay_line_.back().due) {
+      due = delay_line_.back().due;
+    }
+    profiler.AddImpairment(survivor.get(), PipelineStage::kInFlight,
+                           simulator_->Dilate(due - now));
+    delay_line_.push_back({due, std::move(survivor)});
+  }
+  if (!delay_line_armed_ && !delay_line_.empty()) {
+    delay_line_armed_ = true;
+    simulator_->Schedule(delay_line_.front().due - now,
+                         &CommonTransmission::LeaveDelayLine, this);
+  }
+}
+
+void CommonTransmission::LeaveDelayLine() {
+  std::vector<std::shared_ptr<Packet>> due;
   {
     std::lock_guard<std::mutex> lock(delay_mutex_);
-    Simulator::Instance().Schedule(delay_, &CommonTransmission::InFlight, this,
-                                   std::move(packet));
+    TimePoint now = simulator_->Now();
+    while (!delay_line_.empty() && delay_line_.front().due <= now) {
+      due.push_back(std::move(delay_line_.front().packet));
+      delay_line_.pop_front();
+    }
+    if (delay_line_.empty()) {
+      delay_line_armed_ = false;
+    } else {
+      simulator_->Schedule(delay_line_.front().due - now,
+                           &CommonTransmission::LeaveDelayLine, this);
+    }
+  }
+  for (auto& packet : due) {
+    InFlight(std::move(packet));
   }
 }
 
 void CommonTransmission::InFlight(std::shared_ptr<Packet> packet) {
+  LatencyProfiler::Instance().Stamp(packet.get(), PipelineStage::kInFlight);
+  // The bottleneck queues and serializes every frame on its own, so a
+  // superframe is segmented here.
+  if (packet->GetSegmentCount() > 1) {
+    for (auto& segment : Packet::Segment(std::move(packet))) {
+      InFlight(std::move(segment));
+    }
+    return;
+  }
   std::lock_guard<std::mutex> lock(bottleneck_buffer_size_mutex_);
   if (cached_buffer_size_ + packet->GetSize() >= bottleneck_buffer_size_) {
+    overflow_drops_.fetch_add(1, std::memory_order_relaxed);
+    Tracer::Instance().Instant("drop_overflow", "bytes",
+                               packet->GetSize().Bytes());
     ALOG_INFO << "Buffer overflow, dropping packet";
     return;
   }
@@ -69,13 +205,18 @@ void CommonTransmission::InFlight(std::shared_ptr<Packet> packet) {
     std::lock_guard<std::mutex> lock(bottleneck_bandwidth_mutex_);
     TimeDelta bottleneck_cached_delay =
         packet->GetSize() / bottleneck_bandwidth_;
-    Simulator::Instance().Schedule(bottleneck_cached_delay,
-                                   &CommonTransmission::ReceiveFromNetwork,
-                                   this, std::move(packet));
+    LatencyProfiler::Instance().AddImpairment(
+        packet.get(), PipelineStage::kReceiveFromNetwork,
+        simulator_->Dilate(bottleneck_cached_delay));
+    simulator_->Schedule(bottleneck_cached_delay,
+                         &CommonTransmission::ReceiveFromNetwork, this,
+                         std::move(packet));
   }
 }
 
 void CommonTransmission::ReceiveFromNetwork(std::shared_ptr<Packet> packet) {
+  LatencyProfiler::Instance().Stamp(packet.get(),
+                                    PipelineStage::kReceiveFromNetwork);
   std::lock_guard<std::mutex> lock(bottleneck_buffer_size_mutex_);
   if (cached_buffer_size_ < packet->GetSize()) {
     ALOG_ERROR
@@ -85,6 +226,9 @@ void CommonTransmission::ReceiveFromNetwork(std::shared_ptr<Packet> packet) {
   // Simulate the packet being received by the receiver device
   // and update the cached buffer size.
   cached_buffer_size_ -= packet->GetSize();
+  delivered_frames_.fetch_add(1, std::memory_order_relaxed);
+  delivered_bytes_.fetch_add(packet->GetSize().Bytes(),
+                             std::memory_order_relaxed);
   if (receiver_) {
     receiver_->Receive(packet);
   } else {
@@ -113,4 +257,75 @@ void CommonTransmission::SetBottleneckBufferSize(DataSize buffer_size) {
   bottleneck_buffer_size_ = buffer_size;
 }
 
-}  // namespace araneid
\ No newline at end of file
+ClassifiedTransmission::ClassifiedTransmission(
+    std::shared_ptr<Transmission> default_transmission)
+    : default_transmission_(default_transmission) {
+  if (default_transmission_ == nullptr) {
+    ALOG_ERROR << "Classified transmission needs a default transmission";
+  }
+}
+
+void ClassifiedTransmission::AddRule(
+    const FlowMatch& match, std::shared_ptr<Transmission> transmission) {
+  {
+    std::lock_guard<std::mutex> lock(transmissions_mutex_);
+    transmissions_.push_back(transmission);
+    if (receiver_ != nullptr) {
+      transmission->SetReceiver(receiver_);
+    }
+    if (IsConnected()) {
+      transmission->SwitchOn();
+    } else {
+      transmission->SwitchOff();
+    }
+  }
+  classifier_.AddRule(match, transmission);
+}
+
+void ClassifiedTransmission::SendToNetwork(std::shared_ptr<Packet> packet) {
+  if (analyzer_) {
+    analyzer_->Observe(*packet);
+  }
+  std::shared_ptr<Transmission> transmission;
+  FlowKey key;
+  if (!FlowKey::FromFrame(packet->GetData(), packet->GetSize().Bytes(),
+                          &key) ||
+      !classifier_.Classify(key, &transmission)) {
+    transmission = default_transmission_;
+  }
+  transmission->SendToNetwork(std::move(packet));
+}
+
+void ClassifiedTransmission::ReceiveFromNetwork(
+    std::shared_ptr<Packet> packet) {
+  default_transmission_->ReceiveFromNetwork(std::move(packet));
+}
+
+void ClassifiedTransmission::SwitchOn() {
+  std::lock_guard<std::mutex> lock(transmissions_mutex_);
+  Transmission::SwitchOn();
+  default_transmission_->SwitchOn();
+  for (auto& transmission : transmissions_) {
+    transmission->SwitchOn();
+  }
+}
+
+void ClassifiedTransmission::SwitchOff() {
+  std::lock_guard<std::mutex> lock(transmissions_mutex_);
+  Transmission::SwitchOff();
+  default_transmission_->SwitchOff();
+  for (auto& transmission : transmissions_) {
+    transmission->SwitchOff();
+  }
+}
+
+void ClassifiedTransmission::SetReceiver(std::shared_ptr<Device> receiver) {
+  std::lock_guard<std::mutex> lock(transmissions_mutex_);
+  Transmission::SetReceiver(receiver);
+  default_transmission_->SetReceiver(receiver);
+  for (auto& transmission : transmissions_) {
+    transmission->SetReceiver(receiver);
+  }
+}
+
+}  // namespace araneid
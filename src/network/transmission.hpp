@@ -2,13 +2,21 @@
 #define ARANEID_NETWORK_TRANSMISSION_HPP
 
 #include <atomic>
+#include <deque>
 #include <queue>
+#include <random>
+#include <string>
 
+#include "base/random.hpp"
+#include "base/simulator.hpp"
 #include "base/units.hpp"
 #include "device.hpp"
+#include "flow-classifier.hpp"
 #include "packet.hpp"
 
 namespace araneid {
+class FlowAnalyzer;
+class MetricsWriter;
 
 class PacketLoss {
  public:
@@ -20,13 +28,14 @@ class PacketLoss {
 
 class RandomPacketLoss : public PacketLoss {
  public:
-  RandomPacketLoss(double drop_rate);
+  RandomPacketLoss(double drop_rate, uint64_t seed = RandomSeed());
   bool ShouldDropPacket(const Packet& packet) override;
   void SetLossRate(double drop_rate);
   static std::string GetName() { return "RandomPacketLoss"; }
 
  private:
   double drop_rate_;
+  std::mt19937_64 rng_;
 };
 
 class Transmission {
@@ -43,23 +52,39 @@ class Transmission {
   }
   virtual std::shared_ptr<Device> GetReceiver() const { return receiver_; }
 
+  // Frames sent into the transmission are shown to `analyzer` first, set
+  // it before the transmission is switched on.
+  void SetAnalyzer(std::shared_ptr<FlowAnalyzer> analyzer) {
+    analyzer_ = analyzer;
+  }
+
  protected:
   std::atomic<bool> connected_;
   std::shared_ptr<Device> receiver_;
+  std::shared_ptr<FlowAnalyzer> analyzer_;
 };
 
 // CommonTransmission has three features:
 // 1. random packet loss
 // 2. constant delay
 // 3. bandwidth bottleneck with a cached buffer
+// Frames in flight are scheduled on `simulator`, which must outlive the
+// transmission. The delay and rates are in simulated time, so they stretch
+// with the dilation of the simulator.
 class CommonTransmission : public Transmission {
  public:
   CommonTransmission(std::unique_ptr<PacketLoss> packet_loss, TimeDelta delay,
-                     DataRate bandwidth, DataSize buffer_size);
+                     DataRate bandwidth, DataSize buffer_size,
+                     Simulator& simulator = Simulator::Instance());
+  ~CommonTransmission();
   void SendToNetwork(std::shared_ptr<Packet> packet) override;
+  // Invoked by the simulator when the head of the delay line is due.
+  void LeaveDelayLine();
   void InFlight(std::shared_ptr<Packet> packet);
   void ReceiveFromNetwork(std::shared_ptr<Packet> packet) override;
 
+  // Frames never overtake each other, frames sent after the delay is cut
+  // leave after those sent before.
   void SetDelay(TimeDelta delay);
   void SetPacketLoss(std::unique_ptr<PacketLoss> packet_loss);
 
@@ -70,17 +95,77 @@ class CommonTransmission : public Transmission {
   // the current packets in flight are received.
   void SetBottleneckBufferSize(DataSize buffer_size);
 
+  // The name of the link in metrics, "link<N>" by default.
+  void SetName(const std::string& name);
+  std::string GetName() const;
+
  private:
+  void Collect(MetricsWriter* writer) const;
+
+  Simulator* simulator_;
   std::unique_ptr<PacketLoss> packet_loss_;
   TimeDelta delay_;
   DataRate bottleneck_bandwidth_;
   DataSize bottleneck_buffer_size_;
   DataSize cached_buffer_size_;
 
+  // Frames leave the delay in the order they entered it, so they wait in a
+  // FIFO and only the head has a task on the simulator, however many
+  // frames are in flight. Guarded by delay_mutex_.
+  struct DelayedPacket {
+    TimePoint due;
+    std::shared_ptr<Packet> packet;
+  };
+  std::deque<DelayedPacket> delay_line_;
+  bool delay_line_armed_;
+
   std::mutex delay_mutex_;
   std::mutex bottleneck_bandwidth_mutex_;
   std::mutex bottleneck_buffer_size_mutex_;
   std::mutex loss_mutex_;
+
+  mutable std::mutex name_mutex_;
+  std::string name_;
+  // Frames and bytes, a superframe counts as its segments.
+  std::atomic<uint64_t> sent_frames_;
+  std::atomic<uint64_t> sent_bytes_;
+  std::atomic<uint64_t> delivered_frames_;
+  std::atomic<uint64_t> delivered_bytes_;
+  std::atomic<uint64_t> disconnected_drops_;
+  std::atomic<uint64_t> loss_drops_;
+  std::atomic<uint64_t> overflow_drops_;
+  uint64_t metrics_collector_;
+};
+
+// ClassifiedTransmission impairs flows differently, like QUIC on UDP/443 or
+// the subnet of one tenant. Every frame goes through the transmission of
+// the first rule matching its flow, and through the default transmission
+// if none does, so each rule brings its own loss, delay and bottleneck.
+// The receiver and the switch are shared by all of them.
+class ClassifiedTransmission : public Transmission {
+ public:
+  explicit ClassifiedTransmission(
+      std::shared_ptr<Transmission> default_transmission);
+  void AddRule(const FlowMatch& match,
+               std::shared_ptr<Transmission> transmission);
+
+  void SendToNetwork(std::shared_ptr<Packet> packet) override;
+  // Frames are received by the transmission they were sent through.
+  void ReceiveFromNetwork(std::shared_ptr<Packet> packet) override;
+  void SwitchOn() override;
+  void SwitchOff() override;
+  void SetReceiver(std::shared_ptr<Device> receiver) override;
+
+  const FlowClassifier<std::shared_ptr<Transmission>>& GetClassifier() const {
+    return classifier_;
+  }
+
+ private:
+  std::shared_ptr<Transmission> default_transmission_;
+  FlowClassifier<std::shared_ptr<Transmission>> classifier_;
+  // Every transmission of the rules, to pass on the switch and receiver.
+  std::mutex transmissions_mutex_;
+  std::vector<std::shared_ptr<Transmission>> transmissions_;
 };
 
 }  // namespace araneid
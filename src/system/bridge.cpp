@@ -3,73 +3,264 @@
 #include <fcntl.h>         // For O_RDWR
 #include <linux/if_tun.h>  // For IFF_TAP and IFF_NO_PI
 #include <net/if.h>        // For struct ifreq
+#include <netinet/in.h>    // For IPPROTO_TCP and IPPROTO_UDP
 #include <sys/ioctl.h>     // For ioctl
 #include <unistd.h>        // For close()
 
-#include <cstring>  // For strcpy
+#include <cerrno>
+#include <cstring>  // For strncpy
 
 #include "base/log.hpp"
+#include "io-reactor.hpp"
+#include "network/latency-profiler.hpp"
 #include "network/packet.hpp"
 namespace araneid {
 
-TapBridge::TapBridge(std::string tap_device_name)
-    : tap_device_name_(tap_device_name) {
-  write_buffer_ = new uint8_t[65536];  // 64kB buffer
-  sock_ = FindTapDeviceAndOpenSocket();
+static_assert(sizeof(VirtioNetHeader) == 10, "Unexpected virtio net header");
+constexpr uint8_t kVirtioNeedsChecksum = 1;
+constexpr uint8_t kVirtioGsoNone = 0;
+constexpr uint8_t kVirtioGsoTcpv4 = 1;
+
+bool ApplyVirtioNetHeader(const VirtioNetHeader &header, Packet *packet) {
+  if (header.flags == 0 && header.gso_type == kVirtioGsoNone) {
+    return true;
+  }
+  Offload offload;
+  if (header.flags & kVirtioNeedsChecksum) {
+    offload.partial_checksum = true;
+    offload.checksum_start = header.csum_start;
+    offload.checksum_offset = header.csum_offset;
+  }
+  if (header.gso_type == kVirtioGsoTcpv4) {
+    offload.tcp_segmentation = true;
+    offload.segment_bytes = header.gso_size;
+    offload.header_bytes = header.hdr_len;
+  }
+  packet->SetOffload(offload);
+  return header.gso_type == kVirtioGsoNone ||
+         header.gso_type == kVirtioGsoTcpv4;
 }
 
-TapBridge::~TapBridge() {
-  if (fd_reader_) {
-    fd_reader_->Stop();
+VirtioNetHeader MakeVirtioNetHeader(const Packet &packet) {
+  const Offload &offload = packet.GetOffload();
+  VirtioNetHeader header = {};
+  if (offload.partial_checksum) {
+    header.flags = kVirtioNeedsChecksum;
+    header.csum_start = offload.checksum_start;
+    header.csum_offset = offload.checksum_offset;
+  }
+  if (offload.tcp_segmentation) {
+    header.gso_type = kVirtioGsoTcpv4;
+    header.gso_size = offload.segment_bytes;
+    header.hdr_len = offload.header_bytes;
   }
-  if (sock_ != -1) {
-    close(sock_);
-    sock_ = -1;
+  return header;
+}
+
+// Hash of the IPv4 5-tuple, so every frame of a flow leaves through the
+// same queue. Other frames go to the first queue.
+static uint32_t FlowHash(const uint8_t *frame, size_t len) {
+  constexpr size_t kEthernetBytes = 14;
+  if (len < kEthernetBytes + 20 || frame[12] != 0x08 || frame[13] != 0x00) {
+    return 0;
+  }
+  const uint8_t *ip = frame + kEthernetBytes;
+  size_t ip_header_bytes = (ip[0] & 0x0f) * 4;
+  uint8_t protocol = ip[9];
+  // FNV-1a over the addresses, the protocol and the ports.
+  uint32_t hash = 2166136261u;
+  auto mix = [&hash](const uint8_t *data, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      hash = (hash ^ data[i]) * 16777619u;
+    }
+  };
+  mix(ip + 12, 8);
+  mix(&protocol, 1);
+  bool first_fragment = (ip[6] & 0x1f) == 0 && ip[7] == 0;
+  if ((protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) &&
+      first_fragment && len >= kEthernetBytes + ip_header_bytes + 4) {
+    mix(ip + ip_header_bytes, 4);
   }
-  delete[] write_buffer_;
-  write_buffer_ = nullptr;
+  return hash;
 }
 
-int TapBridge::FindTapDeviceAndOpenSocket() {
+TapBridge::TapBridge(std::string tap_device_name, size_t queues)
+    : tap_device_name_(tap_device_name), started_(false) {
+  // Attaching as a multi queue fails on a device created without
+  // multi_queue, and the other way round.
+  int sock = OpenQueue(true);
+  bool multi_queue = sock != -1;
+  if (!multi_queue) {
+    sock = OpenQueue(false);
+    if (sock == -1) {
+      ALOG_ERROR << "Failed to attach TAP device: " << tap_device_name_;
+    }
+    if (queues > 1) {
+      ALOG_WARNING << "TAP device " << tap_device_name_
+                   << " has no multi_queue, using one queue";
+    }
+  }
+  queues_.push_back(std::make_unique<Queue>());
+  queues_.back()->sock = sock;
+  queues_.back()->reactor.store(nullptr);
+  // Let the kernel hand over TCP superframes of up to 64 KiB with partial
+  // checksums, they are only segmented where a frame is handled on its own.
+  if (ioctl(sock, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4) < 0) {
+    ALOG_WARNING << "Failed to enable offloads of TAP device "
+                 << tap_device_name_ << ": " << std::strerror(errno);
+  }
+  while (multi_queue && queues_.size() < queues) {
+    sock = OpenQueue(true);
+    if (sock == -1) {
+      ALOG_WARNING << "Only " << queues_.size() << " queues of TAP device "
+                   << tap_device_name_ << " are attached";
+      break;
+    }
+    queues_.push_back(std::make_unique<Queue>());
+    queues_.back()->sock = sock;
+    queues_.back()->reactor.store(nullptr);
+  }
+  ALOG_INFO << "TAP device name: " << tap_device_name_ << ", "
+            << queues_.size() << " queues";
+}
+
+TapBridge::~TapBridge() {
+  Stop();
+  for (auto &queue : queues_) {
+    if (queue->sock != -1) {
+      close(queue->sock);
+      queue->sock = -1;
+    }
+  }
+}
+
+int TapBridge::OpenQueue(bool multi_queue) {
   // Creating and managing the TAP device needs the help of TUN device.
   int tap_fd = open("/dev/net/tun", O_RDWR);
   if (tap_fd < 0) {
     ALOG_ERROR << "Failed to open /dev/net/tun";
   }
 
-  // Get the TAP device, which is created before this program is run.
+  // Get the TAP device, which is created before this program is run. Every
+  // TUNSETIFF with IFF_MULTI_QUEUE attaches one more queue.
   struct ifreq ifr;
-  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
-  strcpy(ifr.ifr_name, tap_device_name_.c_str());
+  std::memset(&ifr, 0, sizeof(ifr));
+  // Every frame is preceded by a virtio net header carrying its offloads.
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+  if (multi_queue) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+  std::strncpy(ifr.ifr_name, tap_device_name_.c_str(), IFNAMSIZ - 1);
   if (ioctl(tap_fd, TUNSETIFF, &ifr) < 0) {
-    ALOG_ERROR << "Failed to set TAP device flags";
+    ALOG_DEBUG << "Failed to set TAP device flags: " << std::strerror(errno);
+    close(tap_fd);
+    return -1;
   }
   tap_device_name_ = std::string((char *)ifr.ifr_name);
-  ALOG_INFO << "TAP device name: " << tap_device_name_;
   return tap_fd;
 }
 
 void TapBridge::Start() {
-  fd_reader_ = std::make_unique<FdReader>();
-  fd_reader_->Start(sock_, std::shared_ptr<Bridge>(this));
+  if (started_.exchange(true)) {
+    return;
+  }
+  // Queues of one device are spread over different reactors.
+  std::vector<IoReactor *> used;
+  for (auto &queue : queues_) {
+    IoReactor *reactor = IoReactorPool::Instance().Add(queue->sock, this, used);
+    if (reactor == nullptr) {
+      ALOG_ERROR << "Failed to watch TAP device: " << tap_device_name_;
+    }
+    used.push_back(reactor);
+    queue->reactor.store(reactor);
+  }
+}
+
+void TapBridge::Stop() {
+  if (!started_.exchange(false)) {
+    return;
+  }
+  for (auto &queue : queues_) {
+    queue->reactor.store(nullptr);
+    IoReactorPool::Instance().Remove(queue->sock);
+  }
+}
+
+std::shared_ptr<Packet> TapBridge::CreatePacket(const uint8_t *data,
+                                                size_t len,
+                                                int64_t read_at_ns) {
+  VirtioNetHeader header;
+  if (len <= sizeof(header)) {
+    ALOG_WARNING << "Truncated frame from " << tap_device_name_;
+    return nullptr;
+  }
+  std::memcpy(&header, data, sizeof(header));
+  // This packet is completed with all headers, that is, the ethernet header.
+  std::shared_ptr<Packet> packet = Packet::Create(
+      data + sizeof(header), DataSize::Bytes(len - sizeof(header)));
+  if (!ApplyVirtioNetHeader(header, packet.get())) {
+    ALOG_WARNING << "Unexpected GSO type " << int(header.gso_type) << " from "
+                 << tap_device_name_;
+  }
+  LatencyProfiler::Instance().Stamp(packet.get(), PipelineStage::kRead,
+                                    read_at_ns);
+  return packet;
 }
 
 void TapBridge::ForwardOut(uint8_t *data, size_t len) {
   // Create a packet from the data and send it to the bridged device.
-  // This packet is completed with all headers, that is, the ethernet header.
-  std::shared_ptr<Packet> packet = Packet::Create(data, DataSize::Bytes(len));
-  std::free(data);
-  data = nullptr;
-  bridged_device_->Send(packet);
+  if (bridged_device_ == nullptr) {
+    ALOG_WARNING << "No bridged device, dropping packet from "
+                 << tap_device_name_;
+    return;
+  }
+  std::shared_ptr<Packet> packet = CreatePacket(data, len);
+  if (packet != nullptr) {
+    bridged_device_->Send(std::move(packet));
+  }
+}
+
+void TapBridge::ForwardOutBatch(const Frame *frames, size_t count) {
+  if (bridged_device_ == nullptr) {
+    ALOG_WARNING << "No bridged device, dropping " << count
+                 << " packets from " << tap_device_name_;
+    return;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    std::shared_ptr<Packet> packet =
+        CreatePacket(frames[i].data, frames[i].len, frames[i].read_at_ns);
+    if (packet != nullptr) {
+      bridged_device_->Send(std::move(packet));
+    }
+  }
 }
 
 void TapBridge::ForwardIn(std::shared_ptr<Packet> packet) {
-  // Bridged device sends a packet to the TAP device.
-  if (!packet->CopyData(write_buffer_, packet->GetSize().Bytes())) {
+  // Bridged device sends a packet to the TAP device. A superframe or a
+  // partial checksum that survived the network is left to the kernel.
+  VirtioNetHeader header = MakeVirtioNetHeader(*packet);
+  packet->SetWireHeader(&header, sizeof(header));
+
+  Queue *queue = queues_.front().get();
+  if (queues_.size() > 1) {
+    uint32_t hash = FlowHash(packet->GetData(), packet->GetSize().Bytes());
+    queue = queues_[hash % queues_.size()].get();
+  }
+  // The reactor coalesces the frames that arrive before it wakes up into one
+  // flush, and keeps them queued while the TAP device is full.
+  IoReactor *reactor = queue->reactor.load();
+  if (reactor != nullptr) {
+    reactor->Write(queue->sock, std::move(packet));
     return;
   }
   ssize_t bytes_written =
-      write(sock_, write_buffer_, packet->GetSize().Bytes());
+      write(queue->sock, packet->GetWireData(), packet->GetWireBytes());
+  if (bytes_written < 0) {
+    ALOG_DEBUG << "Failed to write to " << tap_device_name_ << ": "
+               << std::strerror(errno);
+    return;
+  }
+  LatencyProfiler::Instance().Stamp(packet.get(), PipelineStage::kWritten);
 }
 
-}  // namespace araneid
\ No newline at end of file
+}  // namespace araneid
@@ -1,41 +1,106 @@
 #ifndef ARANEID_SYSTEM_TAP_BRIDGE_HPP
 #define ARANEID_SYSTEM_TAP_BRIDGE_HPP
 
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
 
-#include "fd-reader.hpp"
 #include "network/device.hpp"
 
 namespace araneid {
+class Device;
+class IoReactor;
 class Packet;
 
+// A frame borrowed from a reader, see Bridge::ForwardOut().
+struct Frame {
+  uint8_t *data;
+  size_t len;
+  // When the frame was read, see LatencyProfiler::NowIfEnabled().
+  int64_t read_at_ns = 0;
+};
+
+// struct virtio_net_hdr, which precedes every frame of a TAP device with
+// IFF_VNET_HDR or a packet socket with PACKET_VNET_HDR. <linux/virtio_net.h>
+// doesn't compile as C++. The fields are in host byte order.
+struct VirtioNetHeader {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+// Set the offload state of the packet from the header, returns false if it
+// asks for an offload that is not supported.
+bool ApplyVirtioNetHeader(const VirtioNetHeader &header, Packet *packet);
+VirtioNetHeader MakeVirtioNetHeader(const Packet &packet);
+
 class Bridge {
  public:
+  virtual ~Bridge() = default;
+  // The data is only borrowed for the duration of the call, the bridge
+  // copies what it keeps.
   virtual void ForwardOut(uint8_t *data, size_t len) = 0;
+  // Readers drain several frames per wakeup and hand them over at once,
+  // in the order they were read.
+  virtual void ForwardOutBatch(const Frame *frames, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      ForwardOut(frames[i].data, frames[i].len);
+    }
+  }
   virtual void ForwardIn(std::shared_ptr<Packet> packet) = 0;
+
+  // Frames from the machine are sent to this device.
+  virtual void SetBridgedDevice(std::shared_ptr<Device> device) = 0;
+  virtual void Start() = 0;
+  virtual void Stop() = 0;
 };
 
-class Device;
 class TapBridge : public Bridge {
  public:
-  TapBridge(std::string tap_device_name);
+  // With more than one queue the TAP device should be created with
+  // multi_queue. Each queue is served by a different reactor, and the kernel
+  // steers each flow to one queue, so flows keep their order while a busy
+  // device uses several cores. A device without multi_queue gets one queue.
+  TapBridge(std::string tap_device_name, size_t queues = 1);
   ~TapBridge();
   // Deliver the packet to the bridged device, and it will decide where to send
   // it.
   void ForwardOut(uint8_t *data, size_t len) override;
+  void ForwardOutBatch(const Frame *frames, size_t count) override;
   // We make sure that the TAP device is in promiscuous mode, so the MAC address
-  // is not important. Just deliver the packet to TAP device.
+  // is not important. Just deliver the packet to TAP device, along with its
+  // offload state.
   void ForwardIn(std::shared_ptr<Packet> packet) override;
 
-  void Start();
+  void SetBridgedDevice(std::shared_ptr<Device> device) override {
+    bridged_device_ = device;
+  }
+  // Frames from the TAP device are read by the shared IoReactorPool.
+  void Start() override;
+  void Stop() override;
 
  private:
-  int FindTapDeviceAndOpenSocket();
-  int sock_;
-  uint8_t *write_buffer_;
+  struct Queue {
+    int sock;
+    // The reactor serving the queue, egress frames are written through it
+    // once the bridge is started.
+    std::atomic<IoReactor *> reactor;
+  };
+  // Returns -1 if the queue can't be attached.
+  int OpenQueue(bool multi_queue);
+  // Frames from the TAP device start with a virtio net header, which is
+  // turned into the offload state of the packet. Returns nullptr if the
+  // frame is truncated.
+  std::shared_ptr<Packet> CreatePacket(const uint8_t *data, size_t len,
+                                       int64_t read_at_ns = 0);
+  std::vector<std::unique_ptr<Queue>> queues_;
   std::string tap_device_name_;
-  std::unique_ptr<FdReader> fd_reader_;
+  std::atomic<bool> started_;
   std::shared_ptr<Device> bridged_device_;
 };
 }  // namespace araneid
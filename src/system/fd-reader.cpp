@@ -7,11 +7,15 @@
 #include <cstring>
 
 #include "base/log.hpp"
+#include "base/tracer.hpp"
 #include "bridge.hpp"
+#include "network/latency-profiler.hpp"
 #include "network/packet.hpp"
 
 namespace araneid {
 
+constexpr size_t kMaxFramesPerBatch = 32;
+
 FdReader::FdReader() : fd_(-1), stop_(false) {
   event_pipe_[0] = -1;
   event_pipe_[1] = -1;
@@ -22,6 +26,12 @@ FdReader::~FdReader() { Stop(); }
 void FdReader::Start(int fd, std::shared_ptr<Bridge> data_bridge) {
   fd_ = fd;
   data_bridge_ = data_bridge;
+  // Several frames are drained per wakeup, the last read must not block.
+  int flags = fcntl(fd_, F_GETFL);
+  if (flags == -1 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) == -1) {
+    ALOG_WARNING << "Failed to set fd " << fd_
+                 << " to non-blocking: " << std::strerror(errno);
+  }
 
   int ret = pipe(event_pipe_);
   if (ret == -1) {
@@ -67,16 +77,22 @@ FdReader::Data FdReader::Read() {
     ALOG_ERROR << "Failed to allocate buffer for reading data";
   }
   ssize_t bytes = read(fd_, buf, 65536);
-  if (bytes <= 0) {
-    ALOG_INFO << "FdReader::Read() read done";
-    std::free(buf);
-    buf = nullptr;
-    bytes = 0;
+  if (bytes > 0) {
+    return Data(buf, bytes);
+  }
+  std::free(buf);
+  Data data;
+  if (bytes < 0 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return data;
   }
-  return Data(buf, bytes);
+  ALOG_INFO << "FdReader::Read() read done";
+  data.closed = true;
+  return data;
 }
 
 void FdReader::Run() {
+  Tracer::Instance().SetThreadName("fd_reader " + std::to_string(fd_));
   int nfds = 0;
   fd_set read_fds;
   nfds = (fd_ > event_pipe_[0] ? fd_ : event_pipe_[0]) + 1;
@@ -110,13 +126,29 @@ void FdReader::Run() {
       break;
     }
     if (FD_ISSET(fd_, &readfds)) {
-      Data data = Read();
-      if (data.bytes == 0) {
-        break;
-      } else if (data.bytes > 0) {
-        if (data_bridge_) {
-          data_bridge_->ForwardIn(Packet::Create(data.buffer,DataSize::Bytes(data.bytes)));
+      // Drain a batch of frames and hand them over at once.
+      TraceSpan span("fd_read");
+      Frame frames[kMaxFramesPerBatch];
+      size_t count = 0;
+      bool closed = false;
+      while (count < kMaxFramesPerBatch) {
+        Data data = Read();
+        if (data.bytes == 0) {
+          closed = data.closed;
+          break;
         }
+        frames[count++] = {data.buffer, data.bytes,
+                           LatencyProfiler::Instance().NowIfEnabled()};
+      }
+      span.SetArg("frames", count);
+      if (count > 0 && data_bridge_) {
+        data_bridge_->ForwardOutBatch(frames, count);
+      }
+      for (size_t i = 0; i < count; ++i) {
+        std::free(frames[i].data);
+      }
+      if (closed) {
+        break;
       }
     }
   }
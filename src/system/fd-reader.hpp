@@ -18,10 +18,13 @@ class FdReader {
   struct Data {
     uint8_t* buffer;
     size_t bytes;
-    Data() : buffer(nullptr), bytes(0) {}
-    Data(uint8_t* buf, size_t b) : buffer(buf), bytes(b) {}
+    bool closed;  // the fd hit EOF or an error, nothing more to read
+    Data() : buffer(nullptr), bytes(0), closed(false) {}
+    Data(uint8_t* buf, size_t b) : buffer(buf), bytes(b), closed(false) {}
   };
 
+  // The fd is non-blocking, an empty Data that is not closed means there
+  // is nothing to read right now.
   Data Read();
 
  private:
@@ -0,0 +1,461 @@
+#include "io-reactor.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "base/log.hpp"
+#include "base/metrics.hpp"
+#include "base/tracer.hpp"
+#include "bridge.hpp"
+#include "io-uring-reactor.hpp"
+#include "network/latency-profiler.hpp"
+#include "network/packet.hpp"
+
+namespace araneid {
+
+constexpr int kMaxEvents = 64;
+// A TAP frame never exceeds this, even a 64 KiB superframe with its virtio
+// net header, so every read needs this much room.
+constexpr size_t kMaxFrameBytes = 65536 + 4096;
+constexpr size_t kMaxFramesPerBatch = 32;
+// Room for a full batch of MTU sized frames.
+constexpr size_t kReadBufferBytes = kMaxFrameBytes + kMaxFramesPerBatch * 2048;
+// Frames waiting for a full fd, further frames are dropped.
+constexpr size_t kMaxBacklogFrames = 4096;
+
+void PinThreadToCpu(std::thread& thread, int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int ret = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+  if (ret != 0) {
+    ALOG_WARNING << "Failed to pin thread to cpu " << cpu << ": "
+                 << std::strerror(ret);
+  }
+}
+
+EpollReactor::EpollReactor(int cpu)
+    : cpu_(cpu),
+      epoll_fd_(-1),
+      wake_fd_(-1),
+      stop_(true),
+      wake_posted_(false),
+      read_buffer_(new uint8_t[kReadBufferBytes]) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1) {
+    ALOG_ERROR << "Failed to create epoll: " << std::strerror(errno);
+  }
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ == -1) {
+    ALOG_ERROR << "Failed to create eventfd: " << std::strerror(errno);
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = wake_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) == -1) {
+    ALOG_ERROR << "Failed to watch eventfd: " << std::strerror(errno);
+  }
+}
+
+EpollReactor::~EpollReactor() {
+  Stop();
+  if (wake_fd_ != -1) {
+    close(wake_fd_);
+    wake_fd_ = -1;
+  }
+  if (epoll_fd_ != -1) {
+    close(epoll_fd_);
+    epoll_fd_ = -1;
+  }
+}
+
+void EpollReactor::Start() {
+  if (!stop_.exchange(false)) {
+    return;
+  }
+  thread_ = std::thread(&EpollReactor::Run, this);
+  PinThreadToCpu(thread_, cpu_);
+}
+
+void EpollReactor::Stop() {
+  if (stop_.exchange(true)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    ALOG_WARNING << "Failed to wake up reactor: " << std::strerror(errno);
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+bool EpollReactor::Add(int fd, Bridge* bridge) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    ALOG_WARNING << "Failed to set fd " << fd
+                 << " to non-blocking: " << std::strerror(errno);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(handlers_mutex_);
+    handlers_[fd] = bridge;
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+    ALOG_WARNING << "Failed to watch fd " << fd << ": "
+                 << std::strerror(errno);
+    std::lock_guard<std::mutex> lock(handlers_mutex_);
+    handlers_.erase(fd);
+    return false;
+  }
+  return true;
+}
+
+void EpollReactor::Remove(int fd) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  // A bridge may remove itself from a callback on the reactor thread, which
+  // already holds the lock.
+  if (std::this_thread::get_id() == thread_.get_id()) {
+    handlers_.erase(fd);
+    egress_.erase(fd);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(handlers_mutex_);
+  handlers_.erase(fd);
+  egress_.erase(fd);
+}
+
+size_t EpollReactor::Size() const {
+  std::lock_guard<std::mutex> lock(handlers_mutex_);
+  return handlers_.size();
+}
+
+void EpollReactor::Write(int fd, std::shared_ptr<Packet> packet) {
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_writes_.emplace_back(fd, std::move(packet));
+  }
+  Wake();
+}
+
+void EpollReactor::Wake() {
+  // One wakeup covers every frame queued before the reactor takes them.
+  if (wake_posted_.exchange(true)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    ALOG_WARNING << "Failed to wake up reactor: " << std::strerror(errno);
+  }
+}
+
+void EpollReactor::Run() {
+  Tracer::Instance().SetThreadName("epoll_reactor");
+  struct epoll_event events[kMaxEvents];
+  std::vector<int> readable;
+  while (!stop_.load()) {
+    // Don't sleep while a fd still has frames left from its last batch.
+    int timeout = readable_.empty() ? -1 : 0;
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ALOG_ERROR << "epoll_wait error: " << std::strerror(errno);
+    }
+    std::lock_guard<std::mutex> lock(handlers_mutex_);
+    bool woken = false;
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd_) {
+        uint64_t value;
+        if (read(wake_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+          ALOG_WARNING << "Failed to read eventfd: " << std::strerror(errno);
+        }
+        woken = true;
+        continue;
+      }
+      auto it = handlers_.find(fd);
+      if (it == handlers_.end()) {
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        ALOG_WARNING << "fd " << fd << " is closed, stop watching it";
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        handlers_.erase(it);
+        egress_.erase(fd);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        auto egress = egress_.find(fd);
+        if (egress != egress_.end()) {
+          Flush(fd, egress->second);
+        }
+      }
+      if (events[i].events & EPOLLIN) {
+        readable_.push_back(fd);
+      }
+    }
+
+    // Every readable fd gets one batch per round, so a busy fd can't
+    // starve the others. Fds with frames left are served again next round.
+    readable.swap(readable_);
+    readable_.clear();
+    std::sort(readable.begin(), readable.end());
+    readable.erase(std::unique(readable.begin(), readable.end()),
+                   readable.end());
+    for (int fd : readable) {
+      auto it = handlers_.find(fd);
+      if (it != handlers_.end() && Drain(fd, it->second)) {
+        readable_.push_back(fd);
+      }
+    }
+    readable.clear();
+
+    if (woken) {
+      TakePendingWrites();
+    }
+  }
+}
+
+bool EpollReactor::Drain(int fd, Bridge* bridge) {
+  TraceSpan span("tap_read");
+  Frame frames[kMaxFramesPerBatch];
+  size_t count = 0;
+  size_t used = 0;
+  bool more = true;
+  // Edge triggered, so the fd is only left alone once it would block,
+  // otherwise it is kept on the readable list.
+  while (count < kMaxFramesPerBatch &&
+         kReadBufferBytes - used >= kMaxFrameBytes) {
+    uint8_t* data = read_buffer_.get() + used;
+    ssize_t bytes = read(fd, data, kMaxFrameBytes);
+    if (bytes > 0) {
+      frames[count++] = {data, static_cast<size_t>(bytes),
+                         LatencyProfiler::Instance().NowIfEnabled()};
+      used += bytes;
+      continue;
+    }
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      ALOG_WARNING << "Failed to read fd " << fd << ": "
+                   << std::strerror(errno);
+    }
+    more = false;
+    break;
+  }
+  span.SetArg("frames", count);
+  counters_.frames_read.fetch_add(count, std::memory_order_relaxed);
+  counters_.bytes_read.fetch_add(used, std::memory_order_relaxed);
+  if (count > 0) {
+    bridge->ForwardOutBatch(frames, count);
+  }
+  return more;
+}
+
+void EpollReactor::TakePendingWrites() {
+  // Clear the flag first, a frame queued from now on posts a new wakeup.
+  wake_posted_.store(false);
+  std::vector<std::pair<int, std::shared_ptr<Packet>>> writes;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    writes.swap(pending_writes_);
+  }
+  std::vector<int> touched;
+  for (auto& write : writes) {
+    int fd = write.first;
+    if (handlers_.find(fd) == handlers_.end()) {
+      continue;
+    }
+    Egress& egress = egress_[fd];
+    if (egress.backlog.size() >= kMaxBacklogFrames) {
+      Tracer::Instance().Instant("drop_backlog", "fd", fd);
+      counters_.dropped_frames.fetch_add(1, std::memory_order_relaxed);
+      if (egress.dropped++ == 0) {
+        ALOG_WARNING << "Egress backlog of fd " << fd
+                     << " is full, dropping frames";
+      }
+      continue;
+    }
+    if (egress.backlog.empty()) {
+      touched.push_back(fd);
+    }
+    egress.backlog.push_back(std::move(write.second));
+  }
+  for (int fd : touched) {
+    auto egress = egress_.find(fd);
+    // A fd waiting for EPOLLOUT is flushed when it becomes writable.
+    if (egress != egress_.end() && !egress->second.waiting_writable) {
+      Flush(fd, egress->second);
+    }
+  }
+}
+
+void EpollReactor::Flush(int fd, Egress& egress) {
+  TraceSpan span("tap_write");
+  uint64_t written = 0;
+  while (!egress.backlog.empty()) {
+    const std::shared_ptr<Packet>& packet = egress.backlog.front();
+    ssize_t bytes = write(fd, packet->GetWireData(), packet->GetWireBytes());
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+      if (!egress.waiting_writable) {
+        WatchWritable(fd, true);
+        egress.waiting_writable = true;
+      }
+      return;
+    }
+    if (bytes < 0) {
+      counters_.write_errors.fetch_add(1, std::memory_order_relaxed);
+      ALOG_DEBUG << "Failed to write fd " << fd << ": "
+                 << std::strerror(errno);
+    } else {
+      LatencyProfiler::Instance().Stamp(packet.get(), PipelineStage::kWritten);
+      counters_.frames_written.fetch_add(1, std::memory_order_relaxed);
+      counters_.bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+      written++;
+    }
+    egress.backlog.pop_front();
+    span.SetArg("frames", written);
+  }
+  if (egress.waiting_writable) {
+    WatchWritable(fd, false);
+    egress.waiting_writable = false;
+  }
+  if (egress.dropped > 0) {
+    ALOG_WARNING << "Egress backlog of fd " << fd << " dropped "
+                 << egress.dropped << " frames";
+    egress.dropped = 0;
+  }
+}
+
+void EpollReactor::WatchWritable(int fd, bool writable) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLET;
+  if (writable) {
+    event.events |= EPOLLOUT;
+  }
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) == -1) {
+    ALOG_WARNING << "Failed to modify events of fd " << fd << ": "
+                 << std::strerror(errno);
+  }
+}
+
+IoBackend IoReactorPool::backend_ = IoBackend::kEpoll;
+
+IoReactorPool::IoReactorPool() : active_backend_(backend_) {
+  if (active_backend_ == IoBackend::kIoUring &&
+      !IoUringReactor::IsSupported()) {
+    ALOG_WARNING << "io_uring is not available, falling back to epoll";
+    active_backend_ = IoBackend::kEpoll;
+  }
+  unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned int cpu = 0; cpu < cores; ++cpu) {
+    IoBackend backend = active_backend_;
+    if (backend == IoBackend::kIoUring) {
+      auto reactor = std::make_unique<IoUringReactor>(cpu);
+      if (reactor->IsReady()) {
+        reactors_.push_back(std::move(reactor));
+      } else {
+        // Every ring pins memory, so one may fail where the others didn't.
+        ALOG_WARNING << "Reactor " << cpu << " falls back to epoll";
+        backend = IoBackend::kEpoll;
+      }
+    }
+    if (backend == IoBackend::kEpoll) {
+      reactors_.push_back(std::make_unique<EpollReactor>(cpu));
+    }
+    backends_.push_back(backend);
+    reactors_.back()->Start();
+  }
+  metrics_collector_ = Metrics::Instance().AddCollector(
+      [this](MetricsWriter* writer) { Collect(writer); });
+}
+
+void IoReactorPool::Collect(MetricsWriter* writer) const {
+  for (size_t i = 0; i < reactors_.size(); ++i) {
+    const char* backend =
+        backends_[i] == IoBackend::kIoUring ? "io_uring" : "epoll";
+    const IoReactorCounters& counters = reactors_[i]->GetCounters();
+    MetricLabels labels = {{"reactor", std::to_string(i)},
+                           {"backend", backend}};
+    writer->Counter("araneid_tap_read_frames_total",
+                    "Frames read from TAP devices.",
+                    counters.frames_read.load(), labels);
+    writer->Counter("araneid_tap_read_bytes_total",
+                    "Bytes read from TAP devices.", counters.bytes_read.load(),
+                    labels);
+    writer->Counter("araneid_tap_written_frames_total",
+                    "Frames written to TAP devices.",
+                    counters.frames_written.load(), labels);
+    writer->Counter("araneid_tap_written_bytes_total",
+                    "Bytes written to TAP devices.",
+                    counters.bytes_written.load(), labels);
+    writer->Counter("araneid_tap_write_errors_total",
+                    "Frames TAP devices failed to take.",
+                    counters.write_errors.load(), labels);
+    writer->Counter("araneid_tap_dropped_frames_total",
+                    "Frames dropped before a TAP device write, because a "
+                    "backlog or queue was full.",
+                    counters.dropped_frames.load(), labels);
+  }
+}
+
+IoReactorPool::~IoReactorPool() {
+  Metrics::Instance().RemoveCollector(metrics_collector_);
+  for (auto& reactor : reactors_) {
+    reactor->Stop();
+  }
+}
+
+IoReactor* IoReactorPool::Add(int fd, Bridge* bridge,
+                              const std::vector<IoReactor*>& avoid) {
+  std::lock_guard<std::mutex> lock(owners_mutex_);
+  IoReactor* least_loaded = nullptr;
+  bool least_avoided = true;
+  for (auto& reactor : reactors_) {
+    bool avoided = std::find(avoid.begin(), avoid.end(), reactor.get()) !=
+                   avoid.end();
+    if (least_loaded == nullptr || (least_avoided && !avoided) ||
+        (least_avoided == avoided && reactor->Size() < least_loaded->Size())) {
+      least_loaded = reactor.get();
+      least_avoided = avoided;
+    }
+  }
+  if (!least_loaded->Add(fd, bridge)) {
+    return nullptr;
+  }
+  owners_[fd] = least_loaded;
+  return least_loaded;
+}
+
+void IoReactorPool::Remove(int fd) {
+  std::lock_guard<std::mutex> lock(owners_mutex_);
+  auto it = owners_.find(fd);
+  if (it == owners_.end()) {
+    return;
+  }
+  it->second->Remove(fd);
+  owners_.erase(it);
+}
+
+}  // namespace araneid
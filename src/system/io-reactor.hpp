@@ -0,0 +1,158 @@
+#ifndef ARANEID_SYSTEM_IO_REACTOR_HPP
+#define ARANEID_SYSTEM_IO_REACTOR_HPP
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace araneid {
+class Bridge;
+class MetricsWriter;
+class Packet;
+
+// Totals of a reactor, updated by the reactor thread and readable from any
+// thread.
+struct IoReactorCounters {
+  std::atomic<uint64_t> frames_read{0};
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> frames_written{0};
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> write_errors{0};
+  // Frames not written because a backlog or queue was full.
+  std::atomic<uint64_t> dropped_frames{0};
+};
+
+// Pin the thread to the core, -1 for no pinning.
+void PinThreadToCpu(std::thread& thread, int cpu);
+
+// An IoReactor serves many fds on one thread. Every frame read from a fd is
+// handed to the bridge registered with it, and frames written through the
+// reactor are sent on the reactor's own schedule. It replaces one FdReader
+// thread per TAP device.
+// Only for Linux.
+class IoReactor {
+ public:
+  virtual ~IoReactor() = default;
+  virtual void Start() = 0;
+  virtual void Stop() = 0;
+
+  // The bridge must stay alive until Remove() returns.
+  virtual bool Add(int fd, Bridge* bridge) = 0;
+  // When Remove() returns, the bridge is not used by the reactor any more.
+  virtual void Remove(int fd) = 0;
+  virtual size_t Size() const = 0;
+
+  // Write a frame to a fd served by this reactor, it can be called from
+  // any thread.
+  virtual void Write(int fd, std::shared_ptr<Packet> packet) = 0;
+
+  const IoReactorCounters& GetCounters() const { return counters_; }
+
+ protected:
+  IoReactorCounters counters_;
+};
+
+// Readiness based reactor on an edge triggered epoll set. Fds are switched
+// to non-blocking mode. Each readable fd is served with at most one batch
+// of frames per round, and egress frames are written by the reactor thread
+// in one flush per wakeup. Frames that don't fit into a full fd wait in a
+// bounded backlog until it is writable again.
+class EpollReactor : public IoReactor {
+ public:
+  // `cpu` is the core the reactor thread is pinned to, -1 for no pinning.
+  explicit EpollReactor(int cpu = -1);
+  ~EpollReactor() override;
+  EpollReactor(const EpollReactor&) = delete;
+  EpollReactor& operator=(const EpollReactor&) = delete;
+
+  void Start() override;
+  void Stop() override;
+  bool Add(int fd, Bridge* bridge) override;
+  void Remove(int fd) override;
+  size_t Size() const override;
+  void Write(int fd, std::shared_ptr<Packet> packet) override;
+
+ private:
+  struct Egress {
+    std::deque<std::shared_ptr<Packet>> backlog;
+    bool waiting_writable = false;  // EPOLLOUT is armed
+    uint64_t dropped = 0;           // since the backlog overflowed
+  };
+  void Run();
+  // Read one batch of frames, returns true if the fd may have more.
+  bool Drain(int fd, Bridge* bridge);
+  void Wake();
+  void TakePendingWrites();
+  void Flush(int fd, Egress& egress);
+  void WatchWritable(int fd, bool writable);
+  int cpu_;
+  int epoll_fd_;
+  int wake_fd_;  // eventfd to wake up the reactor for flushes and shutdown
+  std::atomic<bool> stop_;
+  std::atomic<bool> wake_posted_;
+  std::thread thread_;
+  // Held by the reactor thread while it dispatches events.
+  mutable std::mutex handlers_mutex_;
+  std::unordered_map<int, Bridge*> handlers_;
+  std::unordered_map<int, Egress> egress_;
+  // Fds whose last batch was full, so they are served again without
+  // waiting for a new edge.
+  std::vector<int> readable_;
+  // Frames are read into this buffer, bridges copy what they keep.
+  std::unique_ptr<uint8_t[]> read_buffer_;
+  std::mutex pending_mutex_;
+  std::vector<std::pair<int, std::shared_ptr<Packet>>> pending_writes_;
+};
+
+enum class IoBackend {
+  kEpoll,
+  // Falls back to epoll when io_uring is not available at runtime.
+  kIoUring,
+};
+
+// A pool of reactors, one pinned to each core. New fds go to the reactor
+// serving the fewest fds.
+class IoReactorPool {
+ public:
+  static IoReactorPool& Instance() {
+    static IoReactorPool instance;
+    return instance;
+  }
+  IoReactorPool(const IoReactorPool&) = delete;
+  IoReactorPool& operator=(const IoReactorPool&) = delete;
+  ~IoReactorPool();
+
+  // Only takes effect if called before the first Instance().
+  static void SetBackend(IoBackend backend) { backend_ = backend; }
+  // The backend actually in use. With io_uring, a reactor whose ring could
+  // not be set up uses epoll instead.
+  IoBackend GetBackend() const { return active_backend_; }
+
+  // Returns the reactor serving the fd, nullptr on failure. Frames for the
+  // fd should be written through it. Reactors in `avoid` are only chosen
+  // when every reactor is in it, so the queues of one device can be spread
+  // over cores.
+  IoReactor* Add(int fd, Bridge* bridge,
+                 const std::vector<IoReactor*>& avoid = {});
+  void Remove(int fd);
+
+ private:
+  IoReactorPool();
+  void Collect(MetricsWriter* writer) const;
+  static IoBackend backend_;
+  IoBackend active_backend_;
+  std::vector<std::unique_ptr<IoReactor>> reactors_;
+  // The backend of each reactor.
+  std::vector<IoBackend> backends_;
+  std::mutex owners_mutex_;
+  std::unordered_map<int, IoReactor*> owners_;
+  uint64_t metrics_collector_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_IO_REACTOR_HPP
@@ -0,0 +1,732 @@
+#include "io-uring-reactor.hpp"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "base/log.hpp"
+#include "base/tracer.hpp"
+#include "bridge.hpp"
+#include "network/latency-profiler.hpp"
+#include "network/packet.hpp"
+
+namespace araneid {
+
+constexpr unsigned int kRingEntries = 1024;
+// Size of the sparse registered buffer table.
+constexpr uint32_t kMaxRegisteredBuffers = 4096;
+// Reads kept posted on every fd, the kernel can queue this many frames
+// before the reactor gets to run.
+constexpr uint32_t kReadsPerSource = 8;
+// Large enough for a 64 KiB superframe with its virtio net header.
+constexpr size_t kRegisteredBufferBytes = 65536 + 4096;
+// Linked writes submitted for an fd at once, the rest wait for them.
+constexpr size_t kMaxLinkedWrites = kRingEntries / 4;
+
+// The kind of an operation is kept in the top byte of its user data.
+enum OperationKind : uint64_t {
+  kWakeOperation = 1,
+  kReadOperation = 2,
+  kWriteOperation = 3,
+  kCancelOperation = 4,
+};
+
+namespace {
+uint64_t MakeUserData(OperationKind kind, uint64_t value) {
+  return (static_cast<uint64_t>(kind) << 56) | value;
+}
+
+OperationKind KindOf(uint64_t user_data) {
+  return static_cast<OperationKind>(user_data >> 56);
+}
+
+uint64_t ValueOf(uint64_t user_data) {
+  return user_data & ((1ull << 56) - 1);
+}
+
+int IoUringSetup(unsigned int entries, struct io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IoUringEnter(int ring_fd, unsigned int to_submit,
+                 unsigned int min_complete, unsigned int flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+int IoUringRegister(int ring_fd, unsigned int opcode, void* arg,
+                    unsigned int nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+bool ProbeKernel() {
+  struct io_uring_params params = {};
+  int ring_fd = IoUringSetup(8, &params);
+  if (ring_fd < 0) {
+    return false;
+  }
+  bool supported = (params.features & IORING_FEAT_NODROP) != 0;
+
+  const unsigned int kProbeOps = 256;
+  size_t probe_bytes = sizeof(struct io_uring_probe) +
+                       kProbeOps * sizeof(struct io_uring_probe_op);
+  std::unique_ptr<uint8_t[]> probe_buffer(new uint8_t[probe_bytes]());
+  auto* probe = reinterpret_cast<struct io_uring_probe*>(probe_buffer.get());
+  if (supported &&
+      IoUringRegister(ring_fd, IORING_REGISTER_PROBE, probe, kProbeOps) == 0) {
+    for (uint8_t op : {IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE,
+                       IORING_OP_ASYNC_CANCEL}) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        supported = false;
+      }
+    }
+  } else {
+    supported = false;
+  }
+
+  // Sparse buffer tables need Linux 5.13.
+  struct io_uring_rsrc_register reg = {};
+  reg.nr = 1;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+  if (supported && IoUringRegister(ring_fd, IORING_REGISTER_BUFFERS2, &reg,
+                                   sizeof(reg)) != 0) {
+    supported = false;
+  }
+  close(ring_fd);
+  return supported;
+}
+}  // namespace
+
+bool IoUringReactor::IsSupported() {
+  static const bool supported = ProbeKernel();
+  return supported;
+}
+
+IoUringReactor::IoUringReactor(int cpu)
+    : cpu_(cpu),
+      ready_(false),
+      stop_(true),
+      size_(0),
+      ring_fd_(-1),
+      sq_entries_(0),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      cq_ring_(MAP_FAILED),
+      cq_ring_size_(0),
+      sqes_(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+      sq_local_tail_(0),
+      to_submit_(0),
+      buffer_owners_(kMaxRegisteredBuffers, nullptr),
+      next_write_id_(0),
+      wake_fd_(-1),
+      wake_value_(0),
+      wake_posted_(false),
+      wake_read_posted_(false),
+      running_(false) {
+  for (uint32_t group = kMaxRegisteredBuffers / kReadsPerSource; group > 0;
+       --group) {
+    free_groups_.push_back(group - 1);
+  }
+  wake_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd_ == -1) {
+    ALOG_WARNING << "Failed to create eventfd: " << std::strerror(errno);
+    return;
+  }
+  if (!SetupRing()) {
+    ALOG_WARNING << "Failed to set up io_uring: " << std::strerror(errno);
+    TeardownRing();
+    return;
+  }
+  ready_ = true;
+}
+
+IoUringReactor::~IoUringReactor() {
+  Stop();
+  TeardownRing();
+  if (wake_fd_ != -1) {
+    close(wake_fd_);
+    wake_fd_ = -1;
+  }
+}
+
+bool IoUringReactor::SetupRing() {
+  struct io_uring_params params = {};
+  ring_fd_ = IoUringSetup(kRingEntries, &params);
+  if (ring_fd_ < 0) {
+    return false;
+  }
+  sq_entries_ = params.sq_entries;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return false;
+    }
+  }
+  sqes_ = static_cast<struct io_uring_sqe*>(
+      mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+           IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    return false;
+  }
+  auto* sq = static_cast<uint8_t*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+  auto* cq = static_cast<uint8_t*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  sq_local_tail_ = *sq_tail_;
+
+  struct io_uring_rsrc_register reg = {};
+  reg.nr = kMaxRegisteredBuffers;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+  return IoUringRegister(ring_fd_, IORING_REGISTER_BUFFERS2, &reg,
+                         sizeof(reg)) == 0;
+}
+
+void IoUringReactor::TeardownRing() {
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sq_entries_ * sizeof(struct io_uring_sqe));
+    sqes_ = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = MAP_FAILED;
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = MAP_FAILED;
+  }
+  // Registered buffers are pinned by the kernel until the ring is gone, so
+  // the slabs can be freed afterwards.
+  if (ring_fd_ != -1) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+  sources_.clear();
+  active_sources_.clear();
+}
+
+struct io_uring_sqe* IoUringReactor::GetSqe() {
+  unsigned int head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sq_local_tail_ - head >= sq_entries_) {
+    // The submission queue is full, hand it over to the kernel first.
+    Enter(0);
+    head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_local_tail_ - head >= sq_entries_) {
+      return nullptr;
+    }
+  }
+  unsigned int index = sq_local_tail_ & *sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  sq_local_tail_++;
+  to_submit_++;
+  return sqe;
+}
+
+int IoUringReactor::Enter(unsigned int min_complete) {
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  int ret = IoUringEnter(ring_fd_, to_submit_, min_complete, flags);
+  if (ret < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      ALOG_WARNING << "io_uring_enter failed: " << std::strerror(errno);
+    }
+    return ret;
+  }
+  to_submit_ -= std::min<unsigned int>(to_submit_, ret);
+  return ret;
+}
+
+void IoUringReactor::Start() {
+  if (!ready_) {
+    ALOG_WARNING << "io_uring reactor is not set up, not starting it";
+    return;
+  }
+  if (!stop_.exchange(false)) {
+    return;
+  }
+  wake_read_posted_ = PostWakeRead();
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    running_ = true;
+  }
+  thread_ = std::thread(&IoUringReactor::Run, this);
+  PinThreadToCpu(thread_, cpu_);
+}
+
+void IoUringReactor::Stop() {
+  if (stop_.exchange(true)) {
+    return;
+  }
+  Wake();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void IoUringReactor::Wake() {
+  if (wake_posted_.exchange(true)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    ALOG_WARNING << "Failed to wake up reactor: " << std::strerror(errno);
+  }
+}
+
+bool IoUringReactor::SendCommand(bool add, int fd, Bridge* bridge) {
+  Command command{add, fd, bridge, std::promise<bool>()};
+  std::future<bool> done = command.done.get_future();
+  {
+    // Checked under the lock, so the reactor thread either takes the
+    // command or fails it when it exits.
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    if (stop_.load() || !running_) {
+      ALOG_WARNING << "io_uring reactor is not running";
+      return false;
+    }
+    pending_commands_.push_back(&command);
+  }
+  Wake();
+  return done.get();
+}
+
+bool IoUringReactor::Add(int fd, Bridge* bridge) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+    ALOG_WARNING << "Failed to set fd " << fd
+                 << " to blocking: " << std::strerror(errno);
+    return false;
+  }
+  return SendCommand(true, fd, bridge);
+}
+
+void IoUringReactor::Remove(int fd) {
+  if (std::this_thread::get_id() == thread_.get_id()) {
+    RemoveSource(fd);
+    return;
+  }
+  SendCommand(false, fd, nullptr);
+}
+
+void IoUringReactor::Write(int fd, std::shared_ptr<Packet> packet) {
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_writes_.push_back({fd, std::move(packet)});
+  }
+  // Frames queued before the reactor wakes up are submitted together.
+  Wake();
+}
+
+bool IoUringReactor::PostWakeRead() {
+  struct io_uring_sqe* sqe = GetSqe();
+  if (sqe == nullptr) {
+    // The kernel may have been busy, try once more after submitting.
+    Enter(0);
+    sqe = GetSqe();
+  }
+  if (sqe == nullptr) {
+    ALOG_WARNING << "io_uring submission queue is full, eventfd read is not "
+                    "posted";
+    return false;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wake_fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&wake_value_);
+  sqe->len = sizeof(wake_value_);
+  sqe->user_data = MakeUserData(kWakeOperation, 0);
+  return true;
+}
+
+void IoUringReactor::PostRead(Source* source, uint32_t buffer) {
+  struct io_uring_sqe* sqe = GetSqe();
+  if (sqe == nullptr) {
+    ALOG_WARNING << "io_uring submission queue is full, read is not posted";
+    source->reads_in_flight--;
+    return;
+  }
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = source->fd;
+  sqe->addr = reinterpret_cast<uint64_t>(
+      source->slab.get() +
+      (buffer - source->first_buffer) * kRegisteredBufferBytes);
+  sqe->len = kRegisteredBufferBytes;
+  sqe->buf_index = static_cast<uint16_t>(buffer);
+  sqe->user_data = MakeUserData(kReadOperation, buffer);
+}
+
+bool IoUringReactor::UpdateBuffers(uint32_t offset,
+                                   const struct iovec* iovecs,
+                                   uint32_t count) {
+  struct io_uring_rsrc_update2 update = {};
+  update.offset = offset;
+  update.data = reinterpret_cast<uint64_t>(iovecs);
+  update.nr = count;
+  int ret = IoUringRegister(ring_fd_, IORING_REGISTER_BUFFERS_UPDATE, &update,
+                            sizeof(update));
+  if (ret < 0 || static_cast<uint32_t>(ret) != count) {
+    ALOG_WARNING << "Failed to update registered buffers: "
+                 << std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool IoUringReactor::AddSource(int fd, Bridge* bridge) {
+  if (active_sources_.count(fd) > 0) {
+    ALOG_WARNING << "fd " << fd << " is already served by the reactor";
+    return false;
+  }
+  if (free_groups_.empty()) {
+    ALOG_WARNING << "Out of registered buffers for fd " << fd;
+    return false;
+  }
+  auto source = std::make_unique<Source>();
+  source->fd = fd;
+  source->bridge = bridge;
+  source->first_buffer = free_groups_.back() * kReadsPerSource;
+  source->reads_in_flight = 0;
+  source->slab.reset(new uint8_t[kReadsPerSource * kRegisteredBufferBytes]);
+  struct iovec iovecs[kReadsPerSource];
+  for (uint32_t i = 0; i < kReadsPerSource; ++i) {
+    iovecs[i].iov_base = source->slab.get() + i * kRegisteredBufferBytes;
+    iovecs[i].iov_len = kRegisteredBufferBytes;
+  }
+  if (!UpdateBuffers(source->first_buffer, iovecs, kReadsPerSource)) {
+    return false;
+  }
+  free_groups_.pop_back();
+  Source* raw = source.get();
+  active_sources_[fd] = raw;
+  sources_[raw] = std::move(source);
+  for (uint32_t i = 0; i < kReadsPerSource; ++i) {
+    buffer_owners_[raw->first_buffer + i] = raw;
+    raw->reads_in_flight++;
+    PostRead(raw, raw->first_buffer + i);
+  }
+  size_.store(active_sources_.size());
+  return true;
+}
+
+void IoUringReactor::RemoveSource(int fd) {
+  auto it = active_sources_.find(fd);
+  if (it == active_sources_.end()) {
+    return;
+  }
+  Source* source = it->second;
+  active_sources_.erase(it);
+  size_.store(active_sources_.size());
+  source->bridge = nullptr;
+  // The buffers are released once every posted read has completed.
+  for (uint32_t buffer = source->first_buffer;
+       buffer < source->first_buffer + kReadsPerSource; ++buffer) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) {
+      break;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MakeUserData(kReadOperation, buffer);
+    sqe->user_data = MakeUserData(kCancelOperation, 0);
+  }
+  if (source->reads_in_flight == 0) {
+    ReleaseSource(source);
+  }
+}
+
+void IoUringReactor::ReleaseSource(Source* source) {
+  struct iovec empty[kReadsPerSource] = {};
+  UpdateBuffers(source->first_buffer, empty, kReadsPerSource);
+  for (uint32_t i = 0; i < kReadsPerSource; ++i) {
+    buffer_owners_[source->first_buffer + i] = nullptr;
+  }
+  free_groups_.push_back(source->first_buffer / kReadsPerSource);
+  sources_.erase(source);
+}
+
+void IoUringReactor::HandleCommands() {
+  std::deque<Command*> commands;
+  std::deque<PendingWrite> writes;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    commands.swap(pending_commands_);
+    writes.swap(pending_writes_);
+  }
+  for (Command* command : commands) {
+    if (command->add) {
+      command->done.set_value(AddSource(command->fd, command->bridge));
+    } else {
+      RemoveSource(command->fd);
+      command->done.set_value(true);
+    }
+  }
+  for (PendingWrite& write : writes) {
+    write_queues_[write.fd].waiting.push_back(std::move(write.packet));
+  }
+  for (auto it = write_queues_.begin(); it != write_queues_.end();) {
+    if (it->second.in_flight == 0) {
+      SubmitWrites(it->first, &it->second);
+    }
+    // Nothing went out if the submission queue was full.
+    if (it->second.in_flight == 0) {
+      counters_.dropped_frames.fetch_add(it->second.waiting.size(),
+                                         std::memory_order_relaxed);
+      it = write_queues_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void IoUringReactor::SubmitWrites(int fd, WriteQueue* queue) {
+  // A chain must not be split by GetSqe() handing a full queue over to the
+  // kernel, so it only takes the room left.
+  size_t batch = std::min(queue->waiting.size(), kMaxLinkedWrites);
+  unsigned int head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sq_entries_ - (sq_local_tail_ - head) < batch) {
+    Enter(0);
+    head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    batch = std::max<size_t>(
+        1, std::min<size_t>(batch, sq_entries_ - (sq_local_tail_ - head)));
+  }
+  // Hard links keep the frames in order, and unlike plain links a failed
+  // write doesn't cancel the ones after it, as with write().
+  struct io_uring_sqe* previous = nullptr;
+  for (size_t i = 0; i < batch; ++i) {
+    std::shared_ptr<Packet>& packet = queue->waiting[i];
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) {
+      counters_.dropped_frames.fetch_add(1, std::memory_order_relaxed);
+      ALOG_DEBUG << "io_uring submission queue is full, dropping frame";
+      continue;
+    }
+    if (previous != nullptr) {
+      previous->flags |= IOSQE_IO_HARDLINK;
+    }
+    uint64_t id = next_write_id_++ & ((1ull << 56) - 1);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(packet->GetWireData());
+    sqe->len = packet->GetWireBytes();
+    sqe->user_data = MakeUserData(kWriteOperation, id);
+    writes_in_flight_[id] = {fd, std::move(packet)};
+    queue->in_flight++;
+    previous = sqe;
+  }
+  queue->waiting.erase(queue->waiting.begin(), queue->waiting.begin() + batch);
+}
+
+void IoUringReactor::HandleCompletion(const struct io_uring_cqe& cqe) {
+  uint64_t value = ValueOf(cqe.user_data);
+  switch (KindOf(cqe.user_data)) {
+    case kWakeOperation:
+      // Clear the flag before looking at the queues, so work queued from
+      // now on wakes us up again.
+      wake_posted_.store(false);
+      wake_read_posted_ = false;
+      HandleCommands();
+      // Posted again by Run() once the round is done.
+      break;
+    case kReadOperation: {
+      Source* source = buffer_owners_[value];
+      if (source == nullptr) {
+        break;
+      }
+      if (cqe.res > 0 && source->bridge != nullptr && !stop_.load()) {
+        // Delivered together with the other frames of this round.
+        completed_reads_.push_back(
+            {source, static_cast<uint32_t>(value), cqe.res,
+             LatencyProfiler::Instance().NowIfEnabled()});
+        break;
+      }
+      bool retry = cqe.res > 0 || cqe.res == -EAGAIN || cqe.res == -EINTR;
+      if (source->bridge != nullptr && retry && !stop_.load()) {
+        PostRead(source, value);
+        break;
+      }
+      if (cqe.res < 0 && !retry && cqe.res != -ECANCELED) {
+        ALOG_WARNING << "Failed to read fd " << source->fd << ": "
+                     << std::strerror(-cqe.res);
+      }
+      source->reads_in_flight--;
+      if (source->bridge == nullptr && source->reads_in_flight == 0) {
+        ReleaseSource(source);
+      }
+      break;
+    }
+    case kWriteOperation: {
+      auto it = writes_in_flight_.find(value);
+      if (it == writes_in_flight_.end()) {
+        break;
+      }
+      if (cqe.res < 0) {
+        counters_.write_errors.fetch_add(1, std::memory_order_relaxed);
+        ALOG_DEBUG << "Failed to write frame: " << std::strerror(-cqe.res);
+      } else {
+        counters_.frames_written.fetch_add(1, std::memory_order_relaxed);
+        counters_.bytes_written.fetch_add(cqe.res, std::memory_order_relaxed);
+        LatencyProfiler::Instance().Stamp(it->second.packet.get(),
+                                          PipelineStage::kWritten);
+        Tracer::Instance().Instant("tap_write", "bytes", cqe.res);
+      }
+      int fd = it->second.fd;
+      writes_in_flight_.erase(it);
+      // The batch is done, the frames queued behind it go next.
+      auto queue = write_queues_.find(fd);
+      if (queue != write_queues_.end() && --queue->second.in_flight == 0) {
+        if (queue->second.waiting.empty() || stop_.load()) {
+          write_queues_.erase(queue);
+        } else {
+          SubmitWrites(fd, &queue->second);
+        }
+      }
+      break;
+    }
+    case kCancelOperation:
+      break;
+  }
+}
+
+void IoUringReactor::DeliverReads() {
+  if (completed_reads_.empty()) {
+    return;
+  }
+  TraceSpan span("tap_read");
+  span.SetArg("frames", completed_reads_.size());
+  counters_.frames_read.fetch_add(completed_reads_.size(),
+                                  std::memory_order_relaxed);
+  // Hand the frames of each source to its bridge as one batch, in the
+  // order they completed.
+  std::stable_sort(completed_reads_.begin(), completed_reads_.end(),
+                   [](const CompletedRead& a, const CompletedRead& b) {
+                     return a.source < b.source;
+                   });
+  std::vector<Frame> frames;
+  for (size_t first = 0; first < completed_reads_.size();) {
+    Source* source = completed_reads_[first].source;
+    size_t last = first;
+    frames.clear();
+    for (; last < completed_reads_.size() &&
+           completed_reads_[last].source == source;
+         ++last) {
+      const CompletedRead& read = completed_reads_[last];
+      uint32_t index = read.buffer - source->first_buffer;
+      frames.push_back({source->slab.get() + index * kRegisteredBufferBytes,
+                        static_cast<size_t>(read.bytes), read.read_at_ns});
+      counters_.bytes_read.fetch_add(read.bytes, std::memory_order_relaxed);
+    }
+    // The source may have been removed after its frames were reaped.
+    if (source->bridge != nullptr) {
+      source->bridge->ForwardOutBatch(frames.data(), frames.size());
+    }
+    for (size_t i = first; i < last; ++i) {
+      if (source->bridge != nullptr && !stop_.load()) {
+        PostRead(source, completed_reads_[i].buffer);
+        continue;
+      }
+      source->reads_in_flight--;
+      if (source->bridge == nullptr && source->reads_in_flight == 0) {
+        ReleaseSource(source);
+      }
+    }
+    first = last;
+  }
+  completed_reads_.clear();
+}
+
+void IoUringReactor::Run() {
+  Tracer::Instance().SetThreadName("io_uring_reactor");
+  while (true) {
+    // Submit everything prepared since the last round and wait for at
+    // least one completion in the same syscall.
+    if (Enter(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      break;
+    }
+    unsigned int head = *cq_head_;
+    unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe cqe = cqes_[head & *cq_mask_];
+      head++;
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      HandleCompletion(cqe);
+      tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    }
+    // Retried every round if the submission queue was full, the other
+    // operations in flight complete meanwhile.
+    if (!wake_read_posted_ && !stop_.load()) {
+      wake_read_posted_ = PostWakeRead();
+    }
+    DeliverReads();
+    if (stop_.load()) {
+      break;
+    }
+  }
+  // No command is taken from now on, fail the ones nobody will handle.
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    running_ = false;
+    for (Command* command : pending_commands_) {
+      command->done.set_value(false);
+    }
+    pending_commands_.clear();
+  }
+  // Cancel the posted reads and wait for the writes in flight, the kernel
+  // must be done with all buffers before they are freed.
+  while (!active_sources_.empty()) {
+    RemoveSource(active_sources_.begin()->first);
+  }
+  for (const auto& [id, write] : writes_in_flight_) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) {
+      break;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MakeUserData(kWriteOperation, id);
+    sqe->user_data = MakeUserData(kCancelOperation, 0);
+  }
+  while (!sources_.empty() || !writes_in_flight_.empty()) {
+    if (Enter(1) < 0 && errno != EINTR) {
+      break;
+    }
+    unsigned int head = *cq_head_;
+    unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      struct io_uring_cqe cqe = cqes_[head & *cq_mask_];
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      HandleCompletion(cqe);
+    }
+  }
+}
+
+}  // namespace araneid
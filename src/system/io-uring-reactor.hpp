@@ -0,0 +1,163 @@
+#ifndef ARANEID_SYSTEM_IO_URING_REACTOR_HPP
+#define ARANEID_SYSTEM_IO_URING_REACTOR_HPP
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "io-reactor.hpp"
+
+namespace araneid {
+
+// Completion based reactor on io_uring. Every fd keeps a few reads posted
+// into registered buffers, and egress frames are queued and submitted
+// together, so one io_uring_enter() both reaps a batch of received frames
+// and sends a batch of frames, instead of one read() or write() per frame.
+// liburing is not required, the ring is driven with raw syscalls.
+class IoUringReactor : public IoReactor {
+ public:
+  // `cpu` is the core the reactor thread is pinned to, -1 for no pinning.
+  // Check IsReady() before using it, setting up the ring may fail for lack
+  // of memory even if the kernel supports io_uring.
+  explicit IoUringReactor(int cpu = -1);
+  ~IoUringReactor() override;
+  IoUringReactor(const IoUringReactor&) = delete;
+  IoUringReactor& operator=(const IoUringReactor&) = delete;
+
+  // Whether the running kernel supports everything this reactor needs,
+  // the result is cached.
+  static bool IsSupported();
+  // Whether the ring was set up, a reactor that isn't can't be started.
+  bool IsReady() const { return ready_; }
+
+  void Start() override;
+  void Stop() override;
+  // The fd is switched to blocking mode, io_uring polls it internally.
+  bool Add(int fd, Bridge* bridge) override;
+  void Remove(int fd) override;
+  size_t Size() const override { return size_.load(); }
+  void Write(int fd, std::shared_ptr<Packet> packet) override;
+
+ private:
+  struct Source {
+    int fd;
+    Bridge* bridge;  // nullptr once the source is being removed
+    // The source owns kReadsPerSource consecutive registered buffers.
+    uint32_t first_buffer;
+    std::unique_ptr<uint8_t[]> slab;  // memory of the registered buffers
+    int reads_in_flight;
+  };
+  struct Command {
+    bool add;
+    int fd;
+    Bridge* bridge;
+    std::promise<bool> done;
+  };
+  struct PendingWrite {
+    int fd;
+    std::shared_ptr<Packet> packet;
+  };
+  struct InFlightWrite {
+    int fd;
+    std::shared_ptr<Packet> packet;
+  };
+  // io_uring doesn't order independent writes, so an fd has one batch of
+  // linked writes in flight at a time, and the frames queued meanwhile go
+  // out as the next batch.
+  struct WriteQueue {
+    std::deque<std::shared_ptr<Packet>> waiting;
+    uint32_t in_flight = 0;
+  };
+  struct CompletedRead {
+    Source* source;
+    uint32_t buffer;
+    int bytes;
+    int64_t read_at_ns;
+  };
+
+  bool SetupRing();
+  void TeardownRing();
+  struct io_uring_sqe* GetSqe();
+  int Enter(unsigned int min_complete);
+  void Run();
+  void Wake();
+  // Returns false if the submission queue stays full.
+  bool PostWakeRead();
+  void PostRead(Source* source, uint32_t buffer);
+  void HandleCommands();
+  void SubmitWrites(int fd, WriteQueue* queue);
+  void HandleCompletion(const struct io_uring_cqe& cqe);
+  // Deliver the frames reaped in this round and post the reads again.
+  void DeliverReads();
+  bool AddSource(int fd, Bridge* bridge);
+  void RemoveSource(int fd);
+  void ReleaseSource(Source* source);
+  bool UpdateBuffers(uint32_t offset, const struct iovec* iovecs,
+                     uint32_t count);
+  bool SendCommand(bool add, int fd, Bridge* bridge);
+
+  int cpu_;
+  bool ready_;
+  std::atomic<bool> stop_;
+  std::thread thread_;
+  std::atomic<size_t> size_;
+
+  // The ring, only touched by the reactor thread once it is started.
+  int ring_fd_;
+  unsigned int sq_entries_;
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  struct io_uring_sqe* sqes_;
+  unsigned int* sq_head_;
+  unsigned int* sq_tail_;
+  unsigned int* sq_mask_;
+  unsigned int* sq_array_;
+  unsigned int* cq_head_;
+  unsigned int* cq_tail_;
+  unsigned int* cq_mask_;
+  struct io_uring_cqe* cqes_;
+  unsigned int sq_local_tail_;
+  unsigned int to_submit_;
+
+  // The sparse registered buffer table is handed out in groups of
+  // kReadsPerSource slots.
+  std::vector<uint32_t> free_groups_;
+  std::vector<Source*> buffer_owners_;
+  std::unordered_map<int, Source*> active_sources_;
+  std::unordered_map<Source*, std::unique_ptr<Source>> sources_;
+  std::vector<CompletedRead> completed_reads_;
+
+  // Writes in flight are kept alive until they complete.
+  uint64_t next_write_id_;
+  std::unordered_map<uint64_t, InFlightWrite> writes_in_flight_;
+  std::unordered_map<int, WriteQueue> write_queues_;
+
+  // Other threads hand over work through these queues and wake the
+  // reactor with the eventfd.
+  int wake_fd_;
+  uint64_t wake_value_;
+  std::atomic<bool> wake_posted_;
+  // Whether a read of the eventfd is posted, only touched by the reactor
+  // thread once it is started.
+  bool wake_read_posted_;
+  std::mutex pending_mutex_;
+  // Commands are only taken while the reactor thread runs, the ones left
+  // when it exits are failed.
+  bool running_;
+  std::deque<PendingWrite> pending_writes_;
+  std::deque<Command*> pending_commands_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_IO_URING_REACTOR_HPP
@@ -0,0 +1,162 @@
+#include "loopback-harness.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "base/log.hpp"
+#include "network/packet.hpp"
+#include "network/traffic.hpp"
+
+namespace araneid {
+
+constexpr size_t kPullBatch = 64;
+
+LoopbackHarness::LoopbackHarness() : LoopbackHarness(Config()) {}
+
+LoopbackHarness::LoopbackHarness(const Config& config)
+    : bridge_a_(std::make_shared<MemoryBridge>(config.ring_capacity)),
+      bridge_b_(std::make_shared<MemoryBridge>(config.ring_capacity)),
+      device_a_(std::make_shared<CommonDevice>()),
+      device_b_(std::make_shared<CommonDevice>()),
+      a_to_b_(std::make_shared<CommonTransmission>(
+          std::make_unique<RandomPacketLoss>(config.loss_rate), config.delay,
+          config.bandwidth, config.buffer_size)),
+      b_to_a_(std::make_shared<CommonTransmission>(
+          std::make_unique<RandomPacketLoss>(config.loss_rate), config.delay,
+          config.bandwidth, config.buffer_size)) {
+  device_a_->SetBridge(bridge_a_);
+  device_b_->SetBridge(bridge_b_);
+  bridge_a_->SetBridgedDevice(device_a_);
+  bridge_b_->SetBridgedDevice(device_b_);
+  a_to_b_->SetReceiver(device_b_);
+  b_to_a_->SetReceiver(device_a_);
+  device_a_->AddTransmission(kAddressB, a_to_b_);
+  device_b_->AddTransmission(kAddressA, b_to_a_);
+  a_to_b_->SwitchOn();
+  b_to_a_->SwitchOn();
+  bridge_a_->Start();
+  bridge_b_->Start();
+}
+
+LoopbackHarness::~LoopbackHarness() {
+  bridge_a_->Stop();
+  bridge_b_->Stop();
+  // Frames still scheduled on the simulator are dropped by the switched off
+  // links instead of reaching the bridges.
+  a_to_b_->SwitchOff();
+  b_to_a_->SwitchOff();
+}
+
+LoopbackHarness::Result LoopbackHarness::Run(uint64_t frames,
+                                             size_t frame_bytes,
+                                             DataRate offered_rate,
+                                             TimeDelta drain_timeout) {
+  FrameTemplate frame(kAddressA, kAddressB);
+  frame_bytes = std::clamp(frame_bytes, FrameTemplate::kMinFrameBytes,
+                           FrameTemplate::kMaxFrameBytes);
+  TimeDelta interval = TimeDelta::Zero();
+  if (offered_rate > DataRate::Zero()) {
+    interval = DataSize::Bytes(frame_bytes) / offered_rate;
+  }
+
+  // Drop whatever an earlier run left behind.
+  while (bridge_b_->Pull() != nullptr) {
+  }
+
+  std::atomic<uint64_t> sent(0);
+  std::atomic<bool> sending(true);
+  std::atomic<int64_t> deadline_ns(0);
+  std::vector<int64_t> delays_ns;
+  delays_ns.reserve(frames);
+  uint64_t received_bytes = 0;
+  TimePoint last_arrival;
+
+  // Pulls from B on its own thread, so the pusher is never held up.
+  std::thread collector([&]() {
+    std::vector<std::shared_ptr<Packet>> batch;
+    batch.reserve(kPullBatch);
+    while (true) {
+      batch.clear();
+      bridge_b_->PullBatch(&batch, kPullBatch);
+      TimePoint now = Clock::Now();
+      for (const auto& packet : batch) {
+        ProbeHeader probe;
+        if (packet->GetSize().Bytes() < FrameTemplate::kMinFrameBytes) {
+          continue;
+        }
+        std::memcpy(&probe, packet->GetData() + FrameTemplate::kHeaderBytes,
+                    sizeof(probe));
+        if (probe.magic != kProbeMagic) {
+          continue;
+        }
+        delays_ns.push_back((now - TimePoint()).Nanos() - probe.sent_at);
+        received_bytes += packet->GetSize().Bytes();
+        last_arrival = now;
+      }
+      if (!sending.load()) {
+        if (delays_ns.size() >= sent.load() ||
+            (now - TimePoint()).Nanos() > deadline_ns.load()) {
+          return;
+        }
+      }
+      if (batch.empty()) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  TimePoint start = Clock::Now();
+  for (uint64_t i = 0; i < frames; ++i) {
+    if (interval > TimeDelta::Zero()) {
+      TimePoint due = start + TimeDelta::Nanos(interval.Nanos() * i);
+      while (Clock::Now() < due) {
+        std::this_thread::yield();
+      }
+    }
+    ProbeHeader probe;
+    probe.magic = kProbeMagic;
+    probe.source = 0;
+    probe.sequence = i;
+    probe.sent_at = (Clock::Now() - TimePoint()).Nanos();
+    std::shared_ptr<Packet> packet = frame.Build(frame_bytes, 0, probe);
+    // A full ring is back pressure, the frame is not lost.
+    while (!bridge_a_->Push(packet)) {
+      std::this_thread::yield();
+    }
+    sent++;
+  }
+  deadline_ns.store((Clock::Now() + drain_timeout - TimePoint()).Nanos());
+  sending.store(false);
+  collector.join();
+
+  Result result;
+  result.sent = sent.load();
+  result.received = delays_ns.size();
+  result.lost = result.sent > result.received ? result.sent - result.received
+                                              : 0;
+  if (delays_ns.empty()) {
+    ALOG_WARNING << "No frame made it through the loopback harness";
+    return result;
+  }
+  TimeDelta elapsed = last_arrival - start;
+  if (elapsed > TimeDelta::Zero()) {
+    result.throughput = DataSize::Bytes(received_bytes) / elapsed;
+  }
+  std::sort(delays_ns.begin(), delays_ns.end());
+  int64_t sum = 0;
+  for (int64_t delay : delays_ns) {
+    sum += delay;
+  }
+  size_t count = delays_ns.size();
+  result.min_delay = TimeDelta::Nanos(delays_ns.front());
+  result.max_delay = TimeDelta::Nanos(delays_ns.back());
+  result.mean_delay = TimeDelta::Nanos(sum / static_cast<int64_t>(count));
+  result.p50_delay = TimeDelta::Nanos(delays_ns[count / 2]);
+  result.p99_delay = TimeDelta::Nanos(delays_ns[(count - 1) * 99 / 100]);
+  return result;
+}
+
+}  // namespace araneid
@@ -0,0 +1,78 @@
+#ifndef ARANEID_SYSTEM_LOOPBACK_HARNESS_HPP
+#define ARANEID_SYSTEM_LOOPBACK_HARNESS_HPP
+
+#include <memory>
+
+#include "base/time.hpp"
+#include "base/units.hpp"
+#include "memory-bridge.hpp"
+#include "network/device.hpp"
+#include "network/transmission.hpp"
+
+namespace araneid {
+
+// LoopbackHarness wires two memory bridges through their own CommonDevice
+// and a CommonTransmission in each direction, exactly the path frames of
+// two machines take, so the network can be driven and measured by an
+// unprivileged process. Endpoint A is kAddressA and endpoint B is
+// kAddressB. Frames scheduled on the simulator refer to the links, so the
+// harness must outlive the simulation it runs on.
+class LoopbackHarness {
+ public:
+  static constexpr const char* kAddressA = "10.0.0.1";
+  static constexpr const char* kAddressB = "10.0.0.2";
+
+  struct Config {
+    TimeDelta delay = TimeDelta::Millis(1);
+    DataRate bandwidth = DataRate::MegaBytesPerSecond(125);
+    DataSize buffer_size = DataSize::MegaBytes(1);
+    double loss_rate = 0;
+    size_t ring_capacity = 4096;
+  };
+
+  struct Result {
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    // Frames that were sent but never pulled, in the network or the rings.
+    uint64_t lost = 0;
+    // Delivered bytes between the first push and the last arrival.
+    DataRate throughput = DataRate::Zero();
+    TimeDelta min_delay = TimeDelta::Zero();
+    TimeDelta mean_delay = TimeDelta::Zero();
+    TimeDelta p50_delay = TimeDelta::Zero();
+    TimeDelta p99_delay = TimeDelta::Zero();
+    TimeDelta max_delay = TimeDelta::Zero();
+  };
+
+  LoopbackHarness();
+  explicit LoopbackHarness(const Config& config);
+  ~LoopbackHarness();
+  LoopbackHarness(const LoopbackHarness&) = delete;
+  LoopbackHarness& operator=(const LoopbackHarness&) = delete;
+
+  // For drivers of their own: frames pushed into one bridge are pulled from
+  // the other one. The bridges are started with the harness.
+  MemoryBridge& GetBridgeA() { return *bridge_a_; }
+  MemoryBridge& GetBridgeB() { return *bridge_b_; }
+
+  // Push `frames` probe frames of `frame_bytes` from A to B at
+  // `offered_rate`, or as fast as the ring takes them if it is zero, and
+  // pull them from B on another thread. Frames still missing
+  // `drain_timeout` after the last push are counted as lost. The simulator
+  // must be running, and only one Run() at a time.
+  Result Run(uint64_t frames, size_t frame_bytes,
+             DataRate offered_rate = DataRate::Zero(),
+             TimeDelta drain_timeout = TimeDelta::Seconds(1));
+
+ private:
+  std::shared_ptr<MemoryBridge> bridge_a_;
+  std::shared_ptr<MemoryBridge> bridge_b_;
+  std::shared_ptr<CommonDevice> device_a_;
+  std::shared_ptr<CommonDevice> device_b_;
+  std::shared_ptr<CommonTransmission> a_to_b_;
+  std::shared_ptr<CommonTransmission> b_to_a_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_LOOPBACK_HARNESS_HPP
@@ -0,0 +1,135 @@
+#include "memory-bridge.hpp"
+
+#include <chrono>
+
+#include "base/log.hpp"
+#include "base/tracer.hpp"
+#include "network/device.hpp"
+#include "network/latency-profiler.hpp"
+#include "network/packet.hpp"
+
+namespace araneid {
+
+// Empty rounds before the bridge thread goes to sleep.
+constexpr int kSpinRounds = 256;
+// A push racing with the bridge thread falling asleep is picked up after at
+// most this long.
+constexpr auto kMaxSleep = std::chrono::milliseconds(1);
+// Frames sent per round, so Stop() is noticed under a constant stream.
+constexpr size_t kMaxFramesPerRound = 256;
+
+MemoryBridge::MemoryBridge(size_t ring_capacity)
+    : ingress_(ring_capacity),
+      egress_(ring_capacity),
+      ingress_dropped_(0),
+      egress_dropped_(0),
+      stop_(true),
+      sleeping_(false) {}
+
+MemoryBridge::~MemoryBridge() { Stop(); }
+
+bool MemoryBridge::Push(std::shared_ptr<Packet> packet) {
+  if (packet == nullptr) {
+    return false;
+  }
+  if (!ingress_.TryPush(std::move(packet))) {
+    ingress_dropped_++;
+    Tracer::Instance().Instant("drop_ingress_ring");
+    return false;
+  }
+  if (sleeping_.load()) {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    sleep_cv_.notify_one();
+  }
+  return true;
+}
+
+bool MemoryBridge::Push(const uint8_t* data, size_t len) {
+  return Push(Packet::Create(data, DataSize::Bytes(len)));
+}
+
+std::shared_ptr<Packet> MemoryBridge::Pull() {
+  std::shared_ptr<Packet> packet;
+  egress_.TryPop(&packet);
+  return packet;
+}
+
+size_t MemoryBridge::PullBatch(std::vector<std::shared_ptr<Packet>>* packets,
+                               size_t max_count) {
+  size_t count = 0;
+  std::shared_ptr<Packet> packet;
+  while (count < max_count && egress_.TryPop(&packet)) {
+    packets->push_back(std::move(packet));
+    count++;
+  }
+  return count;
+}
+
+void MemoryBridge::ForwardOut(uint8_t* data, size_t len) { Push(data, len); }
+
+void MemoryBridge::ForwardIn(std::shared_ptr<Packet> packet) {
+  // Delivered as soon as the consumer can pull it.
+  LatencyProfiler::Instance().Stamp(packet.get(), PipelineStage::kWritten);
+  std::lock_guard<std::mutex> lock(egress_mutex_);
+  if (!egress_.TryPush(std::move(packet))) {
+    egress_dropped_++;
+    Tracer::Instance().Instant("drop_egress_ring");
+  }
+}
+
+void MemoryBridge::Start() {
+  if (!stop_.exchange(false)) {
+    return;
+  }
+  thread_ = std::thread(&MemoryBridge::Run, this);
+}
+
+void MemoryBridge::Stop() {
+  if (stop_.exchange(true)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    sleep_cv_.notify_one();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+size_t MemoryBridge::DrainIngress() {
+  size_t count = 0;
+  std::shared_ptr<Packet> packet;
+  while (count < kMaxFramesPerRound && ingress_.TryPop(&packet)) {
+    count++;
+    if (bridged_device_ == nullptr) {
+      ALOG_WARNING << "No bridged device, dropping packet from memory bridge";
+      continue;
+    }
+    bridged_device_->Send(std::move(packet));
+  }
+  return count;
+}
+
+void MemoryBridge::Run() {
+  int idle_rounds = 0;
+  while (!stop_.load()) {
+    if (DrainIngress() > 0) {
+      idle_rounds = 0;
+      continue;
+    }
+    if (++idle_rounds < kSpinRounds) {
+      std::this_thread::yield();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    sleeping_.store(true);
+    if (ingress_.Empty() && !stop_.load()) {
+      sleep_cv_.wait_for(lock, kMaxSleep);
+    }
+    sleeping_.store(false);
+    idle_rounds = 0;
+  }
+}
+
+}  // namespace araneid
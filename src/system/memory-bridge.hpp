@@ -0,0 +1,79 @@
+#ifndef ARANEID_SYSTEM_MEMORY_BRIDGE_HPP
+#define ARANEID_SYSTEM_MEMORY_BRIDGE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/spsc-ring.hpp"
+#include "bridge.hpp"
+
+namespace araneid {
+class Device;
+class Packet;
+
+// A bridge to the application itself instead of a machine, so frames can be
+// pushed into the network and pulled out of it without root or a TAP
+// device. Frames pushed by the application wait in a lock-free ring until
+// the bridge thread sends them to the bridged device; frames delivered by
+// the network wait in another ring until the application pulls them.
+// Push() must be called from one thread, and Pull() from one thread. The
+// network delivers from many simulator threads, so they take turns on the
+// producer side of the egress ring.
+class MemoryBridge : public Bridge {
+ public:
+  explicit MemoryBridge(size_t ring_capacity = 4096);
+  ~MemoryBridge() override;
+  MemoryBridge(const MemoryBridge&) = delete;
+  MemoryBridge& operator=(const MemoryBridge&) = delete;
+
+  // Returns false if the ingress ring is full, the frame is not queued then.
+  bool Push(std::shared_ptr<Packet> packet);
+  bool Push(const uint8_t* data, size_t len);
+  // Returns nullptr if no frame has been delivered.
+  std::shared_ptr<Packet> Pull();
+  // Appends at most `max_count` frames, returns how many were appended.
+  size_t PullBatch(std::vector<std::shared_ptr<Packet>>* packets,
+                   size_t max_count);
+
+  // Frames that found a ring full.
+  uint64_t GetIngressDropped() const { return ingress_dropped_.load(); }
+  uint64_t GetEgressDropped() const { return egress_dropped_.load(); }
+
+  // Same as Push() but the frame is dropped if the ring is full.
+  void ForwardOut(uint8_t* data, size_t len) override;
+  void ForwardIn(std::shared_ptr<Packet> packet) override;
+
+  void SetBridgedDevice(std::shared_ptr<Device> device) override {
+    bridged_device_ = device;
+  }
+  void Start() override;
+  void Stop() override;
+
+ private:
+  void Run();
+  // Send the queued frames to the device, returns how many were sent.
+  size_t DrainIngress();
+
+  SpscRing<std::shared_ptr<Packet>> ingress_;
+  SpscRing<std::shared_ptr<Packet>> egress_;
+  std::mutex egress_mutex_;
+  std::atomic<uint64_t> ingress_dropped_;
+  std::atomic<uint64_t> egress_dropped_;
+
+  std::atomic<bool> stop_;
+  std::thread thread_;
+  // The bridge thread spins for a while on an empty ring, then sleeps until
+  // a push wakes it up.
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+  std::atomic<bool> sleeping_;
+  std::shared_ptr<Device> bridged_device_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_MEMORY_BRIDGE_HPP
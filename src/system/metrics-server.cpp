@@ -0,0 +1,213 @@
+#include "metrics-server.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "base/log.hpp"
+#include "base/metrics.hpp"
+#include "base/tracer.hpp"
+
+namespace araneid {
+
+// A client that sends its request or reads the response slower is cut off,
+// the next scrape waits for it otherwise.
+constexpr int kRequestTimeoutMs = 1000;
+constexpr int kResponseTimeoutMs = 5000;
+constexpr size_t kMaxRequestBytes = 8192;
+
+MetricsServer::MetricsServer(uint16_t port, const std::string& address)
+    : port_(port),
+      address_(address),
+      listen_fd_(-1),
+      wake_fd_(-1),
+      stop_(false) {}
+
+MetricsServer::~MetricsServer() { Stop(); }
+
+bool MetricsServer::Start() {
+  if (thread_.joinable()) {
+    ALOG_WARNING << "Metrics server is already listening on port " << port_;
+    return true;
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_);
+  if (inet_pton(AF_INET, address_.c_str(), &addr.sin_addr) != 1) {
+    ALOG_WARNING << "Invalid metrics address " << address_;
+    return false;
+  }
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ == -1) {
+    ALOG_WARNING << "Failed to create socket: " << std::strerror(errno);
+    return false;
+  }
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  socklen_t addr_len = sizeof(addr);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) == -1 ||
+      listen(listen_fd_, 16) == -1 ||
+      getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+                  &addr_len) == -1) {
+    ALOG_WARNING << "Failed to listen on " << address_ << ":" << port_
+                 << ": " << std::strerror(errno);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  port_ = ntohs(addr.sin_port);
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ == -1) {
+    ALOG_ERROR << "Failed to create eventfd: " << std::strerror(errno);
+  }
+  stop_.store(false);
+  thread_ = std::thread(&MetricsServer::Run, this);
+  ALOG_INFO << "Serving metrics on http://" << address_ << ":" << port_
+            << "/metrics";
+  return true;
+}
+
+void MetricsServer::Stop() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  stop_.store(true);
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    ALOG_WARNING << "Failed to wake up metrics server: "
+                 << std::strerror(errno);
+  }
+  thread_.join();
+  close(listen_fd_);
+  close(wake_fd_);
+  listen_fd_ = -1;
+  wake_fd_ = -1;
+}
+
+void MetricsServer::Run() {
+  Tracer::Instance().SetThreadName("metrics_server");
+  struct pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+  while (!stop_.load()) {
+    int n = poll(fds, 2, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ALOG_ERROR << "poll error: " << std::strerror(errno);
+    }
+    if (fds[0].revents & POLLIN) {
+      // Non-blocking, so a client that stops reading can't keep Stop()
+      // waiting.
+      int client_fd = accept4(listen_fd_, nullptr, nullptr,
+                              SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (client_fd == -1) {
+        ALOG_DEBUG << "Failed to accept: " << std::strerror(errno);
+        continue;
+      }
+      Serve(client_fd);
+      close(client_fd);
+    }
+  }
+}
+
+static int64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+bool MetricsServer::WaitForClient(int client_fd, short events,
+                                  int64_t deadline_ms) {
+  struct pollfd fds[2] = {{client_fd, events, 0}, {wake_fd_, POLLIN, 0}};
+  while (!stop_.load()) {
+    int64_t timeout_ms = deadline_ms - NowMs();
+    if (timeout_ms <= 0) {
+      ALOG_DEBUG << "Metrics client timed out";
+      return false;
+    }
+    int n = poll(fds, 2, static_cast<int>(timeout_ms));
+    if (n == -1 && errno != EINTR) {
+      return false;
+    }
+    if (n > 0 && fds[0].revents != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MetricsServer::WriteAll(int client_fd, const std::string& data,
+                             int64_t deadline_ms) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t bytes = send(client_fd, data.data() + sent, data.size() - sent,
+                         MSG_NOSIGNAL);
+    if (bytes > 0) {
+      sent += bytes;
+      continue;
+    }
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+        !WaitForClient(client_fd, POLLOUT, deadline_ms)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MetricsServer::Serve(int client_fd) {
+  TraceSpan span("scrape");
+  // Only the request line matters, the rest of the request is ignored.
+  std::string request;
+  char buffer[1024];
+  int64_t deadline_ms = NowMs() + kRequestTimeoutMs;
+  while (request.find("\r\n") == std::string::npos &&
+         request.size() < kMaxRequestBytes) {
+    if (!WaitForClient(client_fd, POLLIN, deadline_ms)) {
+      return;
+    }
+    ssize_t bytes = recv(client_fd, buffer, sizeof(buffer), 0);
+    if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+    if (bytes <= 0) {
+      return;
+    }
+    request.append(buffer, bytes);
+  }
+  std::string status = "200 OK";
+  std::string body;
+  std::string request_line = request.substr(0, request.find("\r\n"));
+  if (request_line.rfind("GET /metrics ", 0) == 0 ||
+      request_line.rfind("GET /metrics?", 0) == 0) {
+    body = Metrics::Instance().Render();
+  } else if (request_line.rfind("GET ", 0) != 0) {
+    status = "405 Method Not Allowed";
+  } else {
+    status = "404 Not Found";
+  }
+  std::string response = "HTTP/1.1 " + status +
+                         "\r\n"
+                         "Content-Type: text/plain; version=0.0.4; "
+                         "charset=utf-8\r\n"
+                         "Content-Length: " +
+                         std::to_string(body.size()) +
+                         "\r\n"
+                         "Connection: close\r\n\r\n" +
+                         body;
+  if (!WriteAll(client_fd, response, NowMs() + kResponseTimeoutMs)) {
+    ALOG_DEBUG << "Failed to send metrics: " << std::strerror(errno);
+  }
+}
+
+}  // namespace araneid
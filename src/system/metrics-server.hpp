@@ -0,0 +1,49 @@
+#ifndef ARANEID_SYSTEM_METRICS_SERVER_HPP
+#define ARANEID_SYSTEM_METRICS_SERVER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace araneid {
+
+// MetricsServer serves the metrics of araneid to Prometheus over HTTP at
+// /metrics. It listens on the loopback address unless told otherwise, and
+// answers one scrape at a time on a thread of its own, so a scrape never
+// runs on the data path.
+// Only for UNIX-like systems
+class MetricsServer {
+ public:
+  // Port 0 picks a free port, see GetPort().
+  explicit MetricsServer(uint16_t port = 9464,
+                         const std::string& address = "127.0.0.1");
+  ~MetricsServer();
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  // Returns false if the address can't be listened on.
+  bool Start();
+  void Stop();
+  // The port listened on once started.
+  uint16_t GetPort() const { return port_; }
+
+ private:
+  void Run();
+  void Serve(int client_fd);
+  // Wait until the client is ready for `events`, returns false once
+  // `deadline_ms` of the steady clock passes or the server stops.
+  bool WaitForClient(int client_fd, short events, int64_t deadline_ms);
+  bool WriteAll(int client_fd, const std::string& data, int64_t deadline_ms);
+
+  uint16_t port_;
+  std::string address_;
+  int listen_fd_;
+  int wake_fd_;  // eventfd to wake up the server for shutdown
+  std::atomic<bool> stop_;
+  std::thread thread_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_METRICS_SERVER_HPP
@@ -0,0 +1,270 @@
+#include "netlink.hpp"
+
+#include <fcntl.h>
+#include <linux/if_link.h>
+#include <linux/if_tun.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>  // For if_nametoindex
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "base/log.hpp"
+
+namespace araneid {
+
+// Requests are sent in chunks of this size, below the socket buffers, so
+// neither the batch nor its acknowledgements are dropped.
+constexpr size_t kMaxChunkBytes = 64 * 1024;
+constexpr int kAckTimeoutSeconds = 5;
+
+static std::string Join(const std::vector<std::string>& failures) {
+  std::string joined;
+  for (const auto& failure : failures) {
+    if (!joined.empty()) {
+      joined += "; ";
+    }
+    joined += failure;
+  }
+  return joined;
+}
+
+Netlink::Netlink()
+    : sock_(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)),
+      next_sequence_(1) {
+  if (sock_ == -1) {
+    ALOG_WARNING << "Failed to open rtnetlink socket: "
+                 << std::strerror(errno);
+    return;
+  }
+  // Acknowledgements carry only the header of the request, and failures
+  // an explanation from the kernel.
+  int one = 1;
+  setsockopt(sock_, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+  setsockopt(sock_, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+  struct timeval timeout = {kAckTimeoutSeconds, 0};
+  setsockopt(sock_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_nl local = {};
+  local.nl_family = AF_NETLINK;
+  if (bind(sock_, reinterpret_cast<struct sockaddr*>(&local),
+           sizeof(local)) == -1) {
+    ALOG_WARNING << "Failed to bind rtnetlink socket: "
+                 << std::strerror(errno);
+    close(sock_);
+    sock_ = -1;
+  }
+}
+
+Netlink::~Netlink() {
+  if (sock_ != -1) {
+    close(sock_);
+  }
+}
+
+size_t Netlink::BeginLink(uint16_t type, uint16_t flags, uint32_t link_flags,
+                          uint32_t link_change, const std::string& what) {
+  size_t offset = batch_.size();
+  batch_.resize(offset + NLMSG_SPACE(sizeof(struct ifinfomsg)));
+  auto* header = reinterpret_cast<struct nlmsghdr*>(batch_.data() + offset);
+  header->nlmsg_type = type;
+  header->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+  header->nlmsg_seq = next_sequence_;
+  auto* link = static_cast<struct ifinfomsg*>(NLMSG_DATA(header));
+  link->ifi_family = AF_UNSPEC;
+  link->ifi_flags = link_flags;
+  link->ifi_change = link_change;
+  requests_.push_back({next_sequence_++, what});
+  return offset;
+}
+
+void Netlink::AddAttribute(uint16_t type, const void* data, size_t bytes) {
+  size_t offset = batch_.size();
+  batch_.resize(offset + RTA_SPACE(bytes));
+  auto* attribute = reinterpret_cast<struct rtattr*>(batch_.data() + offset);
+  attribute->rta_type = type;
+  attribute->rta_len = RTA_LENGTH(bytes);
+  if (bytes > 0) {
+    std::memcpy(RTA_DATA(attribute), data, bytes);
+  }
+}
+
+size_t Netlink::BeginNested(uint16_t type) {
+  size_t offset = batch_.size();
+  AddAttribute(type, nullptr, 0);
+  return offset;
+}
+
+void Netlink::EndNested(size_t offset) {
+  reinterpret_cast<struct rtattr*>(batch_.data() + offset)->rta_len =
+      batch_.size() - offset;
+}
+
+void Netlink::EndMessage(size_t offset) {
+  reinterpret_cast<struct nlmsghdr*>(batch_.data() + offset)->nlmsg_len =
+      batch_.size() - offset;
+}
+
+void Netlink::AddBridge(const std::string& name) {
+  size_t message = BeginLink(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, 0, 0,
+                             "create bridge " + name);
+  AddAttribute(IFLA_IFNAME, name.c_str(), name.size() + 1);
+  size_t info = BeginNested(IFLA_LINKINFO);
+  AddAttribute(IFLA_INFO_KIND, "bridge", sizeof("bridge"));
+  EndNested(info);
+  EndMessage(message);
+}
+
+void Netlink::SetLink(const std::string& name, bool up, bool promisc,
+                      const std::string& master) {
+  uint32_t master_index = 0;
+  if (!master.empty()) {
+    master_index = if_nametoindex(master.c_str());
+    if (master_index == 0) {
+      failures_.push_back("set master of " + name + ": no such device " +
+                          master);
+      return;
+    }
+  }
+  uint32_t flags = (up ? IFF_UP : 0) | (promisc ? IFF_PROMISC : 0);
+  size_t message = BeginLink(RTM_SETLINK, 0, flags, IFF_UP | IFF_PROMISC,
+                             "set up " + name);
+  AddAttribute(IFLA_IFNAME, name.c_str(), name.size() + 1);
+  if (master_index != 0) {
+    AddAttribute(IFLA_MASTER, &master_index, sizeof(master_index));
+  }
+  EndMessage(message);
+}
+
+void Netlink::DeleteLink(const std::string& name) {
+  size_t message = BeginLink(RTM_DELLINK, 0, 0, 0, "delete " + name);
+  AddAttribute(IFLA_IFNAME, name.c_str(), name.size() + 1);
+  EndMessage(message);
+}
+
+bool Netlink::Commit(std::string* error) {
+  std::vector<std::string> failures = std::move(failures_);
+  failures_.clear();
+  if (!requests_.empty() && !IsOpen()) {
+    failures.push_back("no rtnetlink socket");
+  } else if (!requests_.empty()) {
+    // Cut the batch at message boundaries.
+    size_t begin = 0;
+    size_t count = 0;
+    size_t offset = 0;
+    while (offset < batch_.size()) {
+      auto* header =
+          reinterpret_cast<struct nlmsghdr*>(batch_.data() + offset);
+      size_t next = offset + NLMSG_ALIGN(header->nlmsg_len);
+      if (next - begin > kMaxChunkBytes && count > 0) {
+        if (!SendChunk(begin, offset, count, &failures)) {
+          break;
+        }
+        begin = offset;
+        count = 0;
+      }
+      count++;
+      offset = next;
+    }
+    if (offset == batch_.size() && count > 0) {
+      SendChunk(begin, offset, count, &failures);
+    }
+  }
+  batch_.clear();
+  requests_.clear();
+  if (failures.empty()) {
+    return true;
+  }
+  if (error != nullptr) {
+    *error = Join(failures);
+  }
+  return false;
+}
+
+bool Netlink::SendChunk(size_t begin, size_t end, size_t requests,
+                        std::vector<std::string>* failures) {
+  struct sockaddr_nl kernel = {};
+  kernel.nl_family = AF_NETLINK;
+  if (sendto(sock_, batch_.data() + begin, end - begin, 0,
+             reinterpret_cast<struct sockaddr*>(&kernel),
+             sizeof(kernel)) == -1) {
+    failures->push_back(std::string("send rtnetlink requests: ") +
+                        std::strerror(errno));
+    return false;
+  }
+  uint32_t first_sequence = requests_.front().sequence;
+  alignas(struct nlmsghdr) uint8_t buffer[8192];
+  while (requests > 0) {
+    ssize_t bytes = recv(sock_, buffer, sizeof(buffer), 0);
+    if (bytes == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes == -1) {
+      failures->push_back(
+          std::string("receive rtnetlink acknowledgements: ") +
+          std::strerror(errno));
+      return false;
+    }
+    int remaining = static_cast<int>(bytes);
+    for (auto* header = reinterpret_cast<struct nlmsghdr*>(buffer);
+         NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+      if (header->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+      auto* ack = static_cast<struct nlmsgerr*>(NLMSG_DATA(header));
+      uint32_t index = header->nlmsg_seq - first_sequence;
+      if (index >= requests_.size()) {
+        continue;
+      }
+      requests--;
+      if (ack->error == 0) {
+        continue;
+      }
+      std::string failure =
+          requests_[index].description + ": " + std::strerror(-ack->error);
+      // The explanation of the kernel follows the header of the request.
+      if (header->nlmsg_flags & NLM_F_ACK_TLVS) {
+        size_t offset = NLMSG_LENGTH(sizeof(*ack));
+        int length = header->nlmsg_len - offset;
+        for (auto* attribute = reinterpret_cast<struct rtattr*>(
+                 reinterpret_cast<uint8_t*>(header) + offset);
+             RTA_OK(attribute, length);
+             attribute = RTA_NEXT(attribute, length)) {
+          if (attribute->rta_type == NLMSGERR_ATTR_MSG) {
+            failure += std::string(" (") +
+                       static_cast<const char*>(RTA_DATA(attribute)) + ")";
+          }
+        }
+      }
+      failures->push_back(failure);
+    }
+  }
+  return true;
+}
+
+bool Netlink::CreateTap(const std::string& name, bool multi_queue,
+                        std::string* error) {
+  int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    if (error != nullptr) {
+      *error = std::string("open /dev/net/tun: ") + std::strerror(errno);
+    }
+    return false;
+  }
+  struct ifreq ifr = {};
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI | (multi_queue ? IFF_MULTI_QUEUE : 0);
+  std::strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+  bool created = ioctl(fd, TUNSETIFF, &ifr) == 0 &&
+                 ioctl(fd, TUNSETPERSIST, 1) == 0;
+  if (!created && error != nullptr) {
+    *error = "create tap device " + name + ": " + std::strerror(errno);
+  }
+  close(fd);
+  return created;
+}
+
+}  // namespace araneid
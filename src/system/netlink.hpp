@@ -0,0 +1,70 @@
+#ifndef ARANEID_SYSTEM_NETLINK_HPP
+#define ARANEID_SYSTEM_NETLINK_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace araneid {
+
+// Link provisioning through rtnetlink instead of forking `ip`. Requests are
+// queued and sent together by Commit() in one message, and the kernel
+// acknowledges each of them, so provisioning many links costs one round
+// trip. Requests are applied in the order they were queued.
+// Only for Linux, and it must be executed with root privilege.
+class Netlink {
+ public:
+  Netlink();
+  ~Netlink();
+  Netlink(const Netlink&) = delete;
+  Netlink& operator=(const Netlink&) = delete;
+
+  // False if the socket couldn't be opened, Commit() always fails then.
+  bool IsOpen() const { return sock_ != -1; }
+
+  void AddBridge(const std::string& name);
+  // Set the link up and, if `promisc`, in promiscuous mode. A non-empty
+  // `master` enslaves the link to it, the master must already exist when
+  // the request is queued.
+  void SetLink(const std::string& name, bool up, bool promisc,
+               const std::string& master = "");
+  void DeleteLink(const std::string& name);
+  size_t Size() const { return requests_.size(); }
+
+  // Send the queued requests and wait for their acknowledgements. Returns
+  // false if any of them failed, `error` then describes every failure.
+  // The queue is empty afterwards either way.
+  bool Commit(std::string* error = nullptr);
+
+  // A persistent TAP device, TUN/TAP devices can't be created through
+  // rtnetlink.
+  static bool CreateTap(const std::string& name, bool multi_queue,
+                        std::string* error = nullptr);
+
+ private:
+  struct Request {
+    uint32_t sequence;
+    std::string description;
+  };
+  // Append a link message, returns its offset in the batch.
+  size_t BeginLink(uint16_t type, uint16_t flags, uint32_t link_flags,
+                   uint32_t link_change, const std::string& what);
+  void AddAttribute(uint16_t type, const void* data, size_t bytes);
+  size_t BeginNested(uint16_t type);
+  void EndNested(size_t offset);
+  void EndMessage(size_t offset);
+  // Send one chunk of the batch and collect its acknowledgements.
+  bool SendChunk(size_t begin, size_t end, size_t requests,
+                 std::vector<std::string>* failures);
+
+  int sock_;
+  uint32_t next_sequence_;
+  std::vector<uint8_t> batch_;
+  std::vector<Request> requests_;
+  // Requests that failed before they were sent.
+  std::vector<std::string> failures_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_NETLINK_HPP
@@ -0,0 +1,389 @@
+#include "packet-ring-bridge.hpp"
+
+#include <arpa/inet.h>        // For htons
+#include <linux/if_ether.h>   // For ETH_P_ALL
+#include <linux/if_packet.h>  // For TPACKET_V3
+#include <net/if.h>           // For if_nametoindex
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "base/log.hpp"
+#include "network/device.hpp"
+#include "network/packet.hpp"
+
+namespace araneid {
+
+// Large enough for a 64 KiB superframe.
+constexpr uint32_t kRxBlockBytes = 1 << 20;
+constexpr uint32_t kRxBlocks = 32;
+// Nominal, TPACKET_V3 packs frames of any size into a block.
+constexpr uint32_t kRxFrameBytes = 2048;
+// A block is handed out at the latest this many ms after its first frame.
+constexpr uint32_t kBlockTimeout = 1;
+// A block is only lent to packets while this many blocks after it are with
+// the kernel, otherwise its frames are copied.
+constexpr uint32_t kFreeBlocksAhead = kRxBlocks / 2;
+// Slots fit an MTU sized frame, larger superframes are segmented.
+constexpr uint32_t kTxFrameBytes = 2048;
+constexpr uint32_t kTxBlockBytes = 1 << 20;
+constexpr uint32_t kTxFrames = 4096;
+// Where the frame starts in a TX slot, see tpacket_parse_header().
+constexpr size_t kTxDataOffset = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+struct PacketRingBridge::Ring {
+  uint8_t *map = nullptr;
+  size_t map_bytes = 0;
+  uint8_t *rx = nullptr;
+  uint8_t *tx = nullptr;
+  // Blocks viewed by packets, they are returned to the kernel with the
+  // last of them and never read again until then.
+  std::atomic<bool> lent[kRxBlocks] = {};
+
+  ~Ring() {
+    if (map != nullptr) {
+      munmap(map, map_bytes);
+    }
+  }
+  struct tpacket_block_desc *Block(uint32_t block) {
+    return reinterpret_cast<struct tpacket_block_desc *>(
+        rx + size_t(block) * kRxBlockBytes);
+  }
+  struct tpacket3_hdr *TxFrame(uint32_t frame) {
+    return reinterpret_cast<struct tpacket3_hdr *>(
+        tx + size_t(frame) * kTxFrameBytes);
+  }
+  void ReturnBlock(uint32_t block) {
+    __atomic_store_n(&Block(block)->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+  }
+  // The kernel fills blocks strictly in order and stops at the first one we
+  // still own, so a block is lent only if the kernel has room after it.
+  bool CanLend(uint32_t block) const {
+    for (uint32_t i = 1; i <= kFreeBlocksAhead; ++i) {
+      if (lent[(block + i) % kRxBlocks].load(std::memory_order_acquire)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  // Whether the block is ours to read, the kernel has filled it and no
+  // packet views it from the last lap.
+  bool IsReadable(uint32_t block) {
+    return !lent[block].load(std::memory_order_acquire) &&
+           (__atomic_load_n(&Block(block)->hdr.bh1.block_status,
+                            __ATOMIC_ACQUIRE) &
+            TP_STATUS_USER);
+  }
+};
+
+PacketRingBridge::PacketRingBridge(std::string interface_name)
+    : interface_name_(interface_name),
+      sock_(-1),
+      wake_fd_(-1),
+      ring_(std::make_shared<Ring>()),
+      stop_(true),
+      wake_posted_(false),
+      next_rx_block_(0),
+      next_tx_frame_(0),
+      tx_dropped_(0) {
+  unsigned int index = if_nametoindex(interface_name_.c_str());
+  if (index == 0) {
+    ALOG_ERROR << "No such interface: " << interface_name_;
+  }
+  sock_ = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+  if (sock_ == -1) {
+    ALOG_ERROR << "Failed to open packet socket: " << std::strerror(errno);
+  }
+  int version = TPACKET_V3;
+  if (setsockopt(sock_, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) == -1) {
+    ALOG_ERROR << "TPACKET_V3 is not supported: " << std::strerror(errno);
+  }
+  // Room in front of every received frame for the headroom of a packet.
+  unsigned int reserve = Packet::kHeadroomBytes;
+  if (setsockopt(sock_, SOL_PACKET, PACKET_RESERVE, &reserve,
+                 sizeof(reserve)) == -1) {
+    ALOG_ERROR << "Failed to reserve headroom: " << std::strerror(errno);
+  }
+  // Superframes and partial checksums are described by a virtio net header,
+  // the same way as on a TAP device.
+  int one = 1;
+  if (setsockopt(sock_, SOL_PACKET, PACKET_VNET_HDR, &one, sizeof(one)) ==
+      -1) {
+    ALOG_ERROR << "Failed to enable virtio net headers: "
+               << std::strerror(errno);
+  }
+  // A malformed frame in the TX ring is skipped instead of stopping it.
+  if (setsockopt(sock_, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) == -1) {
+    ALOG_WARNING << "Failed to set TX ring loss: " << std::strerror(errno);
+  }
+  // Only frames coming from the container, not the ones going to it.
+  if (setsockopt(sock_, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+                 sizeof(one)) == -1) {
+    ALOG_WARNING << "Failed to ignore outgoing frames: "
+                 << std::strerror(errno);
+  }
+
+  struct tpacket_req3 rx_request = {};
+  rx_request.tp_block_size = kRxBlockBytes;
+  rx_request.tp_block_nr = kRxBlocks;
+  rx_request.tp_frame_size = kRxFrameBytes;
+  rx_request.tp_frame_nr = kRxBlockBytes / kRxFrameBytes * kRxBlocks;
+  rx_request.tp_retire_blk_tov = kBlockTimeout;
+  if (setsockopt(sock_, SOL_PACKET, PACKET_RX_RING, &rx_request,
+                 sizeof(rx_request)) == -1) {
+    ALOG_ERROR << "Failed to set up RX ring: " << std::strerror(errno);
+  }
+  struct tpacket_req3 tx_request = {};
+  tx_request.tp_block_size = kTxBlockBytes;
+  tx_request.tp_block_nr = kTxFrames / (kTxBlockBytes / kTxFrameBytes);
+  tx_request.tp_frame_size = kTxFrameBytes;
+  tx_request.tp_frame_nr = kTxFrames;
+  if (setsockopt(sock_, SOL_PACKET, PACKET_TX_RING, &tx_request,
+                 sizeof(tx_request)) == -1) {
+    ALOG_ERROR << "Failed to set up TX ring: " << std::strerror(errno);
+  }
+  // Both rings are mapped at once, RX first.
+  size_t rx_bytes = size_t(kRxBlockBytes) * kRxBlocks;
+  size_t tx_bytes = size_t(kTxFrameBytes) * kTxFrames;
+  void *map = mmap(nullptr, rx_bytes + tx_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, sock_, 0);
+  if (map == MAP_FAILED) {
+    ALOG_ERROR << "Failed to map rings: " << std::strerror(errno);
+  }
+  ring_->map = static_cast<uint8_t *>(map);
+  ring_->map_bytes = rx_bytes + tx_bytes;
+  ring_->rx = ring_->map;
+  ring_->tx = ring_->map + rx_bytes;
+
+  struct sockaddr_ll address = {};
+  address.sll_family = AF_PACKET;
+  address.sll_protocol = htons(ETH_P_ALL);
+  address.sll_ifindex = index;
+  if (bind(sock_, reinterpret_cast<struct sockaddr *>(&address),
+           sizeof(address)) == -1) {
+    ALOG_ERROR << "Failed to bind to " << interface_name_ << ": "
+               << std::strerror(errno);
+  }
+  // Like the TAP device, the interface is in promiscuous mode.
+  struct packet_mreq membership = {};
+  membership.mr_ifindex = index;
+  membership.mr_type = PACKET_MR_PROMISC;
+  if (setsockopt(sock_, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) == -1) {
+    ALOG_WARNING << "Failed to set " << interface_name_
+                 << " to promiscuous mode: " << std::strerror(errno);
+  }
+
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ == -1) {
+    ALOG_ERROR << "Failed to create eventfd: " << std::strerror(errno);
+  }
+  ALOG_INFO << "Packet ring bridge on " << interface_name_;
+}
+
+PacketRingBridge::~PacketRingBridge() {
+  Stop();
+  // Packets still viewing the RX ring keep the mapping alive, so it is only
+  // unmapped with the last of them. The socket is closed now, and returned
+  // blocks are just never refilled.
+  ring_.reset();
+  if (wake_fd_ != -1) {
+    close(wake_fd_);
+    wake_fd_ = -1;
+  }
+  if (sock_ != -1) {
+    close(sock_);
+    sock_ = -1;
+  }
+}
+
+void PacketRingBridge::Start() {
+  if (!stop_.exchange(false)) {
+    return;
+  }
+  thread_ = std::thread(&PacketRingBridge::Run, this);
+}
+
+void PacketRingBridge::Stop() {
+  if (stop_.exchange(true)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    ALOG_WARNING << "Failed to wake up packet ring bridge: "
+                 << std::strerror(errno);
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void PacketRingBridge::Run() {
+  struct pollfd fds[2] = {};
+  fds[0].fd = sock_;
+  fds[0].events = POLLIN | POLLERR;
+  fds[1].fd = wake_fd_;
+  fds[1].events = POLLIN;
+  while (!stop_.load()) {
+    // Every block the kernel has handed out since the last round.
+    while (ring_->IsReadable(next_rx_block_)) {
+      ReceiveBlock(next_rx_block_);
+      next_rx_block_ = (next_rx_block_ + 1) % kRxBlocks;
+    }
+    // The kernel waits for the next block while packets still view it,
+    // nothing wakes us when the last of them goes, so look again soon.
+    bool lent = ring_->lent[next_rx_block_].load(std::memory_order_acquire);
+    if (poll(fds, 2, lent ? int(kBlockTimeout) : -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ALOG_ERROR << "poll error: " << std::strerror(errno);
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t value;
+      if (read(wake_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        ALOG_WARNING << "Failed to read eventfd: " << std::strerror(errno);
+      }
+      Kick();
+    }
+  }
+}
+
+void PacketRingBridge::ReceiveBlock(uint32_t block) {
+  struct tpacket_block_desc *desc = ring_->Block(block);
+  uint32_t count = desc->hdr.bh1.num_pkts;
+  if (bridged_device_ == nullptr) {
+    ALOG_WARNING << "No bridged device, dropping " << count
+                 << " packets from " << interface_name_;
+    ring_->ReturnBlock(block);
+    return;
+  }
+  // Packets view the block while the kernel has room after it, and the
+  // block is returned to the kernel with the last of them.
+  std::shared_ptr<void> owner;
+  if (ring_->CanLend(block)) {
+    ring_->lent[block].store(true, std::memory_order_release);
+    std::shared_ptr<Ring> ring = ring_;
+    owner = std::shared_ptr<void>(ring.get(), [ring, block](void *) {
+      // Returned first, so the bridge never sees the block readable and
+      // not lent before the kernel has it back.
+      ring->ReturnBlock(block);
+      ring->lent[block].store(false, std::memory_order_release);
+    });
+  }
+  uint8_t *frame = reinterpret_cast<uint8_t *>(desc) +
+                   desc->hdr.bh1.offset_to_first_pkt;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto *header = reinterpret_cast<struct tpacket3_hdr *>(frame);
+    uint8_t *data = frame + header->tp_mac;
+    if (header->tp_snaplen < header->tp_len) {
+      ALOG_WARNING << "Truncated frame of " << header->tp_len
+                   << " bytes from " << interface_name_;
+    } else {
+      VirtioNetHeader vnet;
+      std::memcpy(&vnet, data - sizeof(vnet), sizeof(vnet));
+      DataSize size = DataSize::Bytes(header->tp_snaplen);
+      std::shared_ptr<Packet> packet = owner != nullptr
+                                           ? Packet::Wrap(data, size, owner)
+                                           : Packet::Create(data, size);
+      if (!ApplyVirtioNetHeader(vnet, packet.get())) {
+        ALOG_WARNING << "Unexpected GSO type " << int(vnet.gso_type)
+                     << " from " << interface_name_;
+      }
+      bridged_device_->Send(std::move(packet));
+    }
+    frame += header->tp_next_offset;
+  }
+  if (owner == nullptr) {
+    ring_->ReturnBlock(block);
+  }
+}
+
+void PacketRingBridge::ForwardOut(uint8_t *data, size_t len) {
+  if (bridged_device_ == nullptr) {
+    ALOG_WARNING << "No bridged device, dropping packet from "
+                 << interface_name_;
+    return;
+  }
+  bridged_device_->Send(Packet::Create(data, DataSize::Bytes(len)));
+}
+
+void PacketRingBridge::ForwardIn(std::shared_ptr<Packet> packet) {
+  VirtioNetHeader header = MakeVirtioNetHeader(*packet);
+  packet->SetWireHeader(&header, sizeof(header));
+  if (packet->GetWireBytes() > kTxFrameBytes - kTxDataOffset) {
+    if (packet->GetSegmentCount() == 1) {
+      ALOG_WARNING << "Frame of " << packet->GetSize().Bytes()
+                   << " bytes is too large for " << interface_name_;
+      return;
+    }
+    for (auto &segment : Packet::Segment(std::move(packet))) {
+      ForwardIn(std::move(segment));
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(tx_mutex_);
+    struct tpacket3_hdr *slot = ring_->TxFrame(next_tx_frame_);
+    if (__atomic_load_n(&slot->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_AVAILABLE) {
+      // The ring is full of frames not kicked yet, send them right away.
+      send(sock_, nullptr, 0, MSG_DONTWAIT);
+    }
+    if (__atomic_load_n(&slot->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_AVAILABLE) {
+      // The kernel hasn't sent the frames of a full ring yet, just like a
+      // NIC the frame is dropped.
+      tx_dropped_++;
+      ALOG_DEBUG << "TX ring of " << interface_name_ << " is full";
+    } else {
+      size_t bytes = packet->GetWireBytes();
+      std::memcpy(reinterpret_cast<uint8_t *>(slot) + kTxDataOffset,
+                  packet->GetWireData(), bytes);
+      slot->tp_len = bytes;
+      slot->tp_snaplen = bytes;
+      slot->tp_next_offset = 0;
+      __atomic_store_n(&slot->tp_status, TP_STATUS_SEND_REQUEST,
+                       __ATOMIC_RELEASE);
+      next_tx_frame_ = (next_tx_frame_ + 1) % kTxFrames;
+    }
+  }
+  Wake();
+}
+
+void PacketRingBridge::Wake() {
+  // One kick covers every frame queued before the bridge thread wakes up.
+  if (wake_posted_.exchange(true)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    ALOG_WARNING << "Failed to wake up packet ring bridge: "
+                 << std::strerror(errno);
+  }
+}
+
+void PacketRingBridge::Kick() {
+  // Clear the flag first, a frame queued from now on posts a new wakeup.
+  wake_posted_.store(false);
+  if (send(sock_, nullptr, 0, MSG_DONTWAIT) == -1 && errno != EAGAIN &&
+      errno != ENOBUFS) {
+    ALOG_WARNING << "Failed to send TX ring of " << interface_name_ << ": "
+                 << std::strerror(errno);
+  }
+  std::lock_guard<std::mutex> lock(tx_mutex_);
+  if (tx_dropped_ > 0) {
+    ALOG_WARNING << "TX ring of " << interface_name_ << " dropped "
+                 << tx_dropped_ << " frames";
+    tx_dropped_ = 0;
+  }
+}
+
+}  // namespace araneid
@@ -0,0 +1,73 @@
+#ifndef ARANEID_SYSTEM_PACKET_RING_BRIDGE_HPP
+#define ARANEID_SYSTEM_PACKET_RING_BRIDGE_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "bridge.hpp"
+
+namespace araneid {
+class Device;
+class Packet;
+
+// A bridge to a network interface, usually the host end of a container's
+// veth, through an AF_PACKET socket with TPACKET_V3 rings mapped into our
+// memory.
+// Received frames are handed out a block at a time as packets viewing the
+// ring, so they are neither copied nor read one syscall each, and a block
+// goes back to the kernel once every packet in it is released. The kernel
+// fills blocks strictly in order and stops at the first one still viewed,
+// so a block is only lent while the half of the ring after it is with the
+// kernel, otherwise its frames are copied and it goes back at once. Packets
+// held in the network longer than the kernel takes to fill half the ring
+// still stop receiving until they are released. A block is handed out when
+// it is full or after kBlockTimeout, which bounds the extra latency under
+// light load.
+// Frames to send are copied into the TX ring, and the kernel is kicked once
+// for all frames queued since the last kick.
+// Only for Linux.
+class PacketRingBridge : public Bridge {
+ public:
+  explicit PacketRingBridge(std::string interface_name);
+  ~PacketRingBridge() override;
+  PacketRingBridge(const PacketRingBridge &) = delete;
+  PacketRingBridge &operator=(const PacketRingBridge &) = delete;
+
+  // Copies the frame, frames from the ring are sent without a copy.
+  void ForwardOut(uint8_t *data, size_t len) override;
+  void ForwardIn(std::shared_ptr<Packet> packet) override;
+
+  void SetBridgedDevice(std::shared_ptr<Device> device) override {
+    bridged_device_ = device;
+  }
+  void Start() override;
+  void Stop() override;
+
+ private:
+  // The mapped rings, kept alive by the packets viewing them.
+  struct Ring;
+  void Run();
+  void ReceiveBlock(uint32_t block);
+  void Wake();
+  void Kick();
+
+  std::string interface_name_;
+  int sock_;
+  int wake_fd_;
+  std::shared_ptr<Ring> ring_;
+  std::atomic<bool> stop_;
+  std::atomic<bool> wake_posted_;
+  std::thread thread_;
+  uint32_t next_rx_block_;
+  std::mutex tx_mutex_;
+  uint32_t next_tx_frame_;
+  uint64_t tx_dropped_;
+  std::shared_ptr<Device> bridged_device_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_PACKET_RING_BRIDGE_HPP
@@ -0,0 +1,413 @@
+#include "pcap-bridge.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
+#include "base/log.hpp"
+#include "base/time.hpp"
+#include "network/device.hpp"
+#include "network/packet.hpp"
+
+namespace araneid {
+
+constexpr uint32_t kPcapMagicMicros = 0xa1b2c3d4;
+constexpr uint32_t kPcapMagicNanos = 0xa1b23c4d;
+constexpr size_t kPcapHeaderBytes = 24;
+constexpr size_t kPcapRecordBytes = 16;
+constexpr uint32_t kPcapngSectionHeader = 0x0a0d0d0a;
+constexpr uint32_t kPcapngByteOrderMagic = 0x1a2b3c4d;
+constexpr uint32_t kPcapngInterface = 1;
+constexpr uint32_t kPcapngSimplePacket = 3;
+constexpr uint32_t kPcapngEnhancedPacket = 6;
+constexpr uint16_t kPcapngTimestampResolution = 9;
+constexpr uint32_t kLinkTypeEthernet = 1;
+// Frames due within this are sent right away, the rest is slept for.
+constexpr int64_t kMinSleepNs = 50000;
+// Sleeps are cut into slices, so Stop() doesn't wait for a quiet trace.
+constexpr int64_t kMaxSleepNs = 10000000;
+
+static int64_t NowNs() { return (Clock::Now() - TimePoint()).Nanos(); }
+
+PcapWriter::PcapWriter(const std::string& path)
+    : file_(std::fopen(path.c_str(), "wb")), written_frames_(0) {
+  if (file_ == nullptr) {
+    ALOG_WARNING << "Failed to open " << path << ": " << std::strerror(errno);
+    return;
+  }
+  uint32_t header[6] = {kPcapMagicNanos, 2 | (4 << 16), 0, 0, 262144,
+                        kLinkTypeEthernet};
+  std::fwrite(header, sizeof(header), 1, file_);
+}
+
+PcapWriter::~PcapWriter() {
+  if (file_ != nullptr) {
+    std::fclose(file_);
+  }
+}
+
+void PcapWriter::Write(const uint8_t* data, size_t len, int64_t timestamp_ns) {
+  uint32_t record[4] = {static_cast<uint32_t>(timestamp_ns / 1000000000),
+                        static_cast<uint32_t>(timestamp_ns % 1000000000),
+                        static_cast<uint32_t>(len), static_cast<uint32_t>(len)};
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr) {
+    return;
+  }
+  if (std::fwrite(record, sizeof(record), 1, file_) != 1 ||
+      std::fwrite(data, len, 1, file_) != 1) {
+    ALOG_WARNING << "Failed to write capture: " << std::strerror(errno);
+    return;
+  }
+  written_frames_++;
+}
+
+struct PcapReplayBridge::Mapping {
+  uint8_t* map = nullptr;
+  size_t bytes = 0;
+  // Fields of the file are byte swapped.
+  bool swapped = false;
+
+  ~Mapping() {
+    if (map != nullptr) {
+      munmap(map, bytes);
+    }
+  }
+  uint16_t U16(size_t offset) const {
+    uint16_t value;
+    std::memcpy(&value, map + offset, sizeof(value));
+    return swapped ? __builtin_bswap16(value) : value;
+  }
+  uint32_t U32(size_t offset) const {
+    uint32_t value;
+    std::memcpy(&value, map + offset, sizeof(value));
+    return swapped ? __builtin_bswap32(value) : value;
+  }
+};
+
+PcapReplayBridge::PcapReplayBridge(const std::string& trace_path,
+                                   double speed,
+                                   const std::string& capture_path)
+    : trace_path_(trace_path),
+      speed_(speed),
+      open_(false),
+      mapping_(std::make_shared<Mapping>()),
+      first_timestamp_ns_(0),
+      stop_(true),
+      finished_(false),
+      replayed_frames_(0),
+      replay_start_ns_(0) {
+  open_ = Open();
+  if (!open_) {
+    records_.clear();
+    return;
+  }
+  if (!records_.empty()) {
+    first_timestamp_ns_ = records_.front().timestamp_ns;
+    for (auto& record : records_) {
+      record.timestamp_ns -= first_timestamp_ns_;
+    }
+  }
+  if (!capture_path.empty()) {
+    capture_ = std::make_unique<PcapWriter>(capture_path);
+    if (!capture_->IsOpen()) {
+      capture_.reset();
+    }
+  }
+  ALOG_INFO << "Replaying " << records_.size() << " frames from "
+            << trace_path_;
+}
+
+bool PcapReplayBridge::Open() {
+  int fd = open(trace_path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    ALOG_WARNING << "Failed to open " << trace_path_ << ": "
+                 << std::strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < 12) {
+    close(fd);
+    ALOG_WARNING << trace_path_ << " is not a trace";
+    return false;
+  }
+  // Private and writable, so a packet may modify its frame, and only the
+  // touched pages are copied.
+  void* map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ALOG_WARNING << "Failed to map " << trace_path_ << ": "
+                 << std::strerror(errno);
+    return false;
+  }
+  mapping_->map = static_cast<uint8_t*>(map);
+  mapping_->bytes = st.st_size;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  uint32_t magic;
+  std::memcpy(&magic, mapping_->map, sizeof(magic));
+  bool indexed = magic == kPcapngSectionHeader ? IndexPcapng() : IndexPcap();
+  if (!indexed) {
+    ALOG_WARNING << trace_path_ << " is neither an ethernet pcap nor pcapng";
+    return false;
+  }
+  return true;
+}
+
+PcapReplayBridge::~PcapReplayBridge() {
+  Stop();
+  // Packets still viewing the trace keep the mapping alive.
+  mapping_.reset();
+}
+
+bool PcapReplayBridge::IndexPcap() {
+  Mapping& file = *mapping_;
+  if (file.bytes < kPcapHeaderBytes) {
+    return false;
+  }
+  uint32_t magic = file.U32(0);
+  if (magic != kPcapMagicMicros && magic != kPcapMagicNanos) {
+    file.swapped = true;
+    magic = file.U32(0);
+  }
+  if (magic != kPcapMagicMicros && magic != kPcapMagicNanos) {
+    return false;
+  }
+  // The upper bits describe the FCS, which we don't care about.
+  if ((file.U32(20) & 0x0fffffff) != kLinkTypeEthernet) {
+    return false;
+  }
+  int64_t fraction_ns = magic == kPcapMagicNanos ? 1 : 1000;
+  uint64_t malformed = 0;
+  size_t offset = kPcapHeaderBytes;
+  while (offset + kPcapRecordBytes <= file.bytes) {
+    uint32_t len = file.U32(offset + 8);
+    size_t data = offset + kPcapRecordBytes;
+    if (data + len > file.bytes) {
+      ALOG_WARNING << trace_path_ << " is truncated";
+      break;
+    }
+    if (!Packet::IsWellFormed(file.map + data, len)) {
+      malformed++;
+    } else {
+      records_.push_back(
+          {file.map + data, len,
+           int64_t(file.U32(offset)) * 1000000000 +
+               int64_t(file.U32(offset + 4)) * fraction_ns,
+           false});
+    }
+    offset = data + len;
+  }
+  if (malformed > 0) {
+    ALOG_WARNING << "Skipped " << malformed << " malformed frames in "
+                 << trace_path_;
+  }
+  return true;
+}
+
+bool PcapReplayBridge::IndexPcapng() {
+  Mapping& file = *mapping_;
+  struct Interface {
+    bool ethernet;
+    uint64_t ticks_per_second;
+  };
+  std::vector<Interface> interfaces;
+  uint64_t skipped = 0;
+  uint64_t malformed = 0;
+  int64_t last_timestamp_ns = 0;
+  size_t offset = 0;
+  while (offset + 12 <= file.bytes) {
+    uint32_t type;
+    std::memcpy(&type, file.map + offset, sizeof(type));
+    if (type == kPcapngSectionHeader) {
+      uint32_t byte_order;
+      std::memcpy(&byte_order, file.map + offset + 8, sizeof(byte_order));
+      if (byte_order == kPcapngByteOrderMagic) {
+        file.swapped = false;
+      } else if (byte_order == __builtin_bswap32(kPcapngByteOrderMagic)) {
+        file.swapped = true;
+      } else {
+        return false;
+      }
+      // Interface ids are per section.
+      interfaces.clear();
+    }
+    type = file.U32(offset);
+    uint32_t block_len = file.U32(offset + 4);
+    if (block_len < 12 || block_len % 4 != 0 ||
+        offset + block_len > file.bytes) {
+      ALOG_WARNING << trace_path_ << " is truncated";
+      break;
+    }
+    size_t body = offset + 8;
+    size_t end = offset + block_len - 4;
+    if (type == kPcapngInterface && body + 8 <= end) {
+      Interface interface{file.U16(body) == kLinkTypeEthernet, 1000000};
+      size_t option = body + 8;
+      while (option + 4 <= end) {
+        uint16_t code = file.U16(option);
+        uint16_t len = file.U16(option + 2);
+        if (code == 0 || option + 4 + len > end) {
+          break;
+        }
+        if (code == kPcapngTimestampResolution && len >= 1) {
+          uint8_t resolution = file.map[option + 4];
+          uint8_t exponent = resolution & 0x7f;
+          uint64_t base = resolution & 0x80 ? 2 : 10;
+          interface.ticks_per_second = 1;
+          for (uint8_t i = 0; i < exponent; ++i) {
+            interface.ticks_per_second *= base;
+          }
+        }
+        option += 4 + ((len + 3) & ~3);
+      }
+      interfaces.push_back(interface);
+    } else if (type == kPcapngEnhancedPacket && body + 20 <= end) {
+      uint32_t id = file.U32(body);
+      uint32_t len = file.U32(body + 12);
+      if (id >= interfaces.size() || !interfaces[id].ethernet ||
+          body + 20 + len > end) {
+        skipped++;
+      } else if (!Packet::IsWellFormed(file.map + body + 20, len)) {
+        malformed++;
+      } else {
+        uint64_t ticks = (uint64_t(file.U32(body + 4)) << 32) |
+                         file.U32(body + 8);
+        uint64_t tps = interfaces[id].ticks_per_second;
+        last_timestamp_ns =
+            int64_t(ticks / tps * 1000000000 +
+                    static_cast<unsigned __int128>(ticks % tps) * 1000000000 /
+                        tps);
+        records_.push_back(
+            {file.map + body + 20, len, last_timestamp_ns, false});
+      }
+    } else if (type == kPcapngSimplePacket && body + 4 <= end) {
+      // No timestamp, it is sent right after the previous frame.
+      uint32_t len = std::min<uint32_t>(file.U32(body), end - body - 4);
+      if (interfaces.empty() || !interfaces[0].ethernet) {
+        skipped++;
+      } else if (!Packet::IsWellFormed(file.map + body + 4, len)) {
+        malformed++;
+      } else {
+        // Only the 12 bytes of the block header are in front of the frame,
+        // less than the headroom a wrapped packet needs.
+        records_.push_back(
+            {file.map + body + 4, len, last_timestamp_ns, true});
+      }
+    }
+    offset += block_len;
+  }
+  if (skipped > 0) {
+    ALOG_WARNING << "Skipped " << skipped << " frames of other link types in "
+                 << trace_path_;
+  }
+  if (malformed > 0) {
+    ALOG_WARNING << "Skipped " << malformed << " malformed frames in "
+                 << trace_path_;
+  }
+  return true;
+}
+
+uint64_t PcapReplayBridge::GetCapturedFrames() const {
+  return capture_ != nullptr ? capture_->GetWrittenFrames() : 0;
+}
+
+void PcapReplayBridge::ForwardOut(uint8_t* data, size_t len) {
+  if (bridged_device_ == nullptr) {
+    ALOG_WARNING << "No bridged device, dropping packet for " << trace_path_;
+    return;
+  }
+  bridged_device_->Send(Packet::Create(data, DataSize::Bytes(len)));
+}
+
+void PcapReplayBridge::ForwardIn(std::shared_ptr<Packet> packet) {
+  if (capture_ == nullptr) {
+    return;
+  }
+  int64_t timestamp_ns = TraceTime();
+  // The capture shows the frames as they would be on the wire.
+  for (auto& frame : Packet::Segment(std::move(packet))) {
+    if (frame->GetOffload().partial_checksum) {
+      frame->FinishChecksum();
+    }
+    capture_->Write(frame->GetData(), frame->GetSize().Bytes(), timestamp_ns);
+  }
+}
+
+int64_t PcapReplayBridge::TraceTime() const {
+  int64_t start = replay_start_ns_.load();
+  int64_t now = NowNs();
+  if (start == 0) {
+    return now;
+  }
+  double speed = speed_ > kAsFastAsPossible ? speed_ : 1;
+  return first_timestamp_ns_ + int64_t((now - start) * speed);
+}
+
+void PcapReplayBridge::Start() {
+  if (!open_) {
+    ALOG_WARNING << trace_path_ << " could not be opened, not replaying it";
+    return;
+  }
+  if (!stop_.exchange(false)) {
+    return;
+  }
+  finished_.store(false);
+  replayed_frames_.store(0);
+  thread_ = std::thread(&PcapReplayBridge::Run, this);
+}
+
+void PcapReplayBridge::Stop() {
+  if (stop_.exchange(true)) {
+    return;
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void PcapReplayBridge::Run() {
+  if (bridged_device_ == nullptr) {
+    ALOG_WARNING << "No bridged device, not replaying " << trace_path_;
+    finished_.store(true);
+    return;
+  }
+  int64_t start = NowNs();
+  replay_start_ns_.store(start);
+  size_t next = 0;
+  while (next < records_.size() && !stop_.load()) {
+    const Record& record = records_[next];
+    if (speed_ > kAsFastAsPossible) {
+      int64_t wait =
+          start + int64_t(record.timestamp_ns / speed_) - NowNs();
+      if (wait > kMinSleepNs) {
+        std::this_thread::sleep_for(
+            std::chrono::nanoseconds(std::min(wait, kMaxSleepNs)));
+        continue;
+      }
+    }
+    if (record.copy) {
+      bridged_device_->Send(
+          Packet::Create(record.data, DataSize::Bytes(record.len)));
+    } else {
+      bridged_device_->Send(Packet::Wrap(
+          record.data, DataSize::Bytes(record.len), mapping_));
+    }
+    replayed_frames_++;
+    next++;
+  }
+  if (next == records_.size()) {
+    finished_.store(true);
+    ALOG_INFO << "Replayed " << next << " frames from " << trace_path_;
+  }
+}
+
+}  // namespace araneid
@@ -0,0 +1,119 @@
+#ifndef ARANEID_SYSTEM_PCAP_BRIDGE_HPP
+#define ARANEID_SYSTEM_PCAP_BRIDGE_HPP
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bridge.hpp"
+
+namespace araneid {
+class Device;
+class Packet;
+
+// Writes ethernet frames to a pcap file with nanosecond timestamps. It can
+// be used from any thread.
+class PcapWriter {
+ public:
+  explicit PcapWriter(const std::string& path);
+  ~PcapWriter();
+  PcapWriter(const PcapWriter&) = delete;
+  PcapWriter& operator=(const PcapWriter&) = delete;
+
+  // `timestamp_ns` is nanoseconds since the epoch.
+  void Write(const uint8_t* data, size_t len, int64_t timestamp_ns);
+  bool IsOpen() const { return file_ != nullptr; }
+  uint64_t GetWrittenFrames() const { return written_frames_.load(); }
+
+ private:
+  std::mutex mutex_;
+  FILE* file_;
+  std::atomic<uint64_t> written_frames_;
+};
+
+// A bridge to a recorded trace instead of a machine: the frames of a pcap or
+// pcapng file are sent to the bridged device on the schedule they were
+// captured with, so a production trace can be pushed through a topology
+// again and again.
+// The file is mapped privately and the frames are handed out as packets
+// viewing the mapping, so a frame is only copied by the kernel if somebody
+// modifies it. Only ethernet captures are supported.
+// Frames the network delivers to the bridge are written to the capture file
+// if one is given, stamped with the trace time they arrived at, so input and
+// output can be compared directly.
+class PcapReplayBridge : public Bridge {
+ public:
+  // Frames are sent as fast as the device takes them.
+  static constexpr double kAsFastAsPossible = 0;
+
+  // `speed` is a multiple of the original pace, 2 replays a trace in half of
+  // its duration.
+  PcapReplayBridge(const std::string& trace_path, double speed = 1,
+                   const std::string& capture_path = "");
+  ~PcapReplayBridge() override;
+  PcapReplayBridge(const PcapReplayBridge&) = delete;
+  PcapReplayBridge& operator=(const PcapReplayBridge&) = delete;
+
+  // False if the trace could not be opened or is not an ethernet pcap or
+  // pcapng, the bridge then has no frames and doesn't start.
+  bool IsOpen() const { return open_; }
+
+  size_t GetTraceFrames() const { return records_.size(); }
+  uint64_t GetReplayedFrames() const { return replayed_frames_.load(); }
+  // All frames of the trace have been sent.
+  bool IsFinished() const { return finished_.load(); }
+  // Frames written to the capture file.
+  uint64_t GetCapturedFrames() const;
+
+  // Copies the frame and sends it to the device, as from a machine.
+  void ForwardOut(uint8_t* data, size_t len) override;
+  void ForwardIn(std::shared_ptr<Packet> packet) override;
+
+  void SetBridgedDevice(std::shared_ptr<Device> device) override {
+    bridged_device_ = device;
+  }
+  // Starts the replay from the first frame of the trace.
+  void Start() override;
+  void Stop() override;
+
+ private:
+  // The mapped trace, kept alive by the packets viewing it.
+  struct Mapping;
+  struct Record {
+    uint8_t* data;
+    uint32_t len;
+    int64_t timestamp_ns;  // since the first frame of the trace
+    // Sent as a copy, there is no room in front of it for a packet header.
+    bool copy;
+  };
+  // Map and index the trace.
+  bool Open();
+  bool IndexPcap();
+  bool IndexPcapng();
+  void Run();
+  // Trace time of now, in nanoseconds since the epoch.
+  int64_t TraceTime() const;
+
+  std::string trace_path_;
+  double speed_;
+  bool open_;
+  std::shared_ptr<Mapping> mapping_;
+  std::vector<Record> records_;
+  int64_t first_timestamp_ns_;
+  std::unique_ptr<PcapWriter> capture_;
+
+  std::atomic<bool> stop_;
+  std::atomic<bool> finished_;
+  std::atomic<uint64_t> replayed_frames_;
+  std::atomic<int64_t> replay_start_ns_;
+  std::thread thread_;
+  std::shared_ptr<Device> bridged_device_;
+};
+
+}  // namespace araneid
+
+#endif  // ARANEID_SYSTEM_PCAP_BRIDGE_HPP
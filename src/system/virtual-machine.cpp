@@ -1,97 +1,919 @@
 #include "virtual-machine.hpp"
 
+#include <glob.h>
+#include <net/if.h>  // For if_nametoindex
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+
 #include "base/log.hpp"
+#include "bridge.hpp"
+#include "packet-ring-bridge.hpp"
 namespace araneid {
 
+// Queues of a machine's TAP device, each served by its own reactor.
+constexpr size_t kTapQueues = 4;
+// Containers started at once by StartMachines().
+constexpr size_t kStartWorkers = 8;
+
 MachineManager::LinuxContainer::LinuxContainer(std::string name) {
-  container_ =
-      std::shared_ptr<lxc_container>(lxc_container_new(name.c_str(), nullptr));
+  container_ = std::shared_ptr<lxc_container>(
+      lxc_container_new(name.c_str(), nullptr), lxc_container_put);
   if (!container_) {
     ALOG_ERROR << "Failed to create LXC container: " << name;
   }
 }
 
-void MachineManager::LinuxContainer::SetConfig(const std::string& key,
+MachineManager::LinuxContainer::LinuxContainer(lxc_container* container)
+    : container_(container, lxc_container_put) {}
+
+bool MachineManager::LinuxContainer::SetConfig(const std::string& key,
                                                const std::string& value) {
   if (!container_->set_config_item(container_.get(), key.c_str(),
                                    value.c_str())) {
-    ALOG_ERROR << "Failed to set config item: " << key << " = " << value;
+    ALOG_WARNING << "Failed to set config item: " << key << " = " << value;
+    return false;
   }
+  return true;
 }
 
-void MachineManager::LinuxContainer::Create(
+bool MachineManager::LinuxContainer::SaveConfig() {
+  if (!container_->save_config(container_.get(), nullptr)) {
+    ALOG_WARNING << "Failed to save config of LXC container: "
+                 << container_->name;
+    return false;
+  }
+  return true;
+}
+
+bool MachineManager::LinuxContainer::Create(
     const std::string& template_name, std::vector<std::string> template_args) {
-  char* args[template_args.size() + 1];
-  for (size_t i = 0; i < template_args.size(); ++i) {
-    args[i] = const_cast<char*>(template_args[i].c_str());
+  std::vector<char*> args;
+  for (auto& arg : template_args) {
+    args.push_back(const_cast<char*>(arg.c_str()));
   }
+  args.push_back(nullptr);
   if (!container_->create(container_.get(), template_name.c_str(), nullptr,
-                          nullptr, LXC_CREATE_QUIET, args)) {
-    ALOG_ERROR << "Failed to create LXC container: " << container_->name;
+                          nullptr, LXC_CREATE_QUIET, args.data())) {
+    ALOG_WARNING << "Failed to create LXC container: " << container_->name;
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<MachineManager::LinuxContainer>
+MachineManager::LinuxContainer::Clone(const std::string& name) {
+  // An overlay keeps only what the clone changes, whatever the backing
+  // store of the base. If overlayfs is not available, the backing store may
+  // still snapshot natively, like btrfs or zfs.
+  const char* backing_stores[] = {"overlay", nullptr};
+  for (const char* backing_store : backing_stores) {
+    lxc_container* clone =
+        container_->clone(container_.get(), name.c_str(), nullptr,
+                          LXC_CLONE_SNAPSHOT, backing_store, nullptr, 0,
+                          nullptr);
+    if (clone != nullptr) {
+      return std::make_shared<LinuxContainer>(clone);
+    }
   }
+  ALOG_WARNING << "Failed to clone LXC container " << container_->name
+               << " as " << name;
+  return nullptr;
 }
 
-void MachineManager::LinuxContainer::Start() {
+bool MachineManager::LinuxContainer::Start() {
   const char* args[] = {"/opt/run.sh", NULL};
   if (!container_->start(container_.get(), 0, const_cast<char**>(args))) {
-    ALOG_ERROR << "Failed to start LXC container: " << container_->name;
+    ALOG_WARNING << "Failed to start LXC container: " << container_->name;
+    return false;
+  }
+  return true;
+}
+
+bool MachineManager::LinuxContainer::Stop() {
+  if (container_->is_running(container_.get()) &&
+      !container_->stop(container_.get())) {
+    ALOG_WARNING << "Failed to stop LXC container: " << container_->name;
+    return false;
+  }
+  return true;
+}
+
+bool MachineManager::LinuxContainer::Destroy() {
+  if (!container_->destroy(container_.get())) {
+    ALOG_WARNING << "Failed to destroy LXC container: " << container_->name;
+    return false;
+  }
+  return true;
+}
+
+std::string MachineManager::LinuxContainer::GetConfig(const std::string& key) {
+  int len = container_->get_config_item(container_.get(), key.c_str(),
+                                        nullptr, 0);
+  if (len <= 0) {
+    return "";
+  }
+  std::string value(len, '\0');
+  container_->get_config_item(container_.get(), key.c_str(), &value[0],
+                              len + 1);
+  return value;
+}
+
+bool MachineManager::LinuxContainer::ReloadConfig() {
+  container_->clear_config(container_.get());
+  if (!container_->load_config(container_.get(), nullptr)) {
+    ALOG_WARNING << "Failed to load config of LXC container: "
+                 << container_->name;
+    return false;
   }
+  return true;
+}
+
+bool MachineManager::LinuxContainer::IsRunning() {
+  return container_->is_running(container_.get());
+}
+
+bool MachineManager::LinuxContainer::IsDefined() {
+  return container_->is_defined(container_.get());
 }
 
 MachineManager::MachineManager() {
   if (system("modprobe br_netfilter") != 0) {
-    ALOG_ERROR << "Failed to load br_netfilter module";
+    ALOG_WARNING << "Failed to load br_netfilter module";
   }
 }
 
 bool MachineManager::CreateMachine(
     std::string name, std::unordered_map<std::string, std::string> config,
-    std::string template_name, std::vector<std::string> template_args) {
-  // crate network bridge
-  if (system(("ip link add br-" + name + " type bridge").c_str()) != 0) {
-    ALOG_ERROR << "Failed to create network bridge: br-" << name;
+    std::string template_name, std::vector<std::string> template_args,
+    BridgeType bridge_type) {
+  MachineSpec spec;
+  spec.name = std::move(name);
+  spec.config = std::move(config);
+  spec.template_name = std::move(template_name);
+  spec.template_args = std::move(template_args);
+  spec.bridge_type = bridge_type;
+  return CreateMachines({std::move(spec)}, 1).front().success;
+}
+
+bool MachineManager::SetUpNetwork(MachineSpec* spec, std::string* error) {
+  std::lock_guard<std::mutex> lock(Instance().netlink_mutex_);
+  Netlink& netlink = Instance().netlink_;
+  std::string bridge_name = "br-" + spec->name;
+  std::string tap_name = "tap-" + spec->name;
+  // create network bridge, the TAP device is enslaved to it by index, so it
+  // has to exist first
+  netlink.AddBridge(bridge_name);
+  if (!netlink.Commit(error)) {
     return false;
   }
-  // create tap device
-  if (system(("ip tuntap add mode tap tap-" + name).c_str()) != 0) {
-    ALOG_ERROR << "Failed to create tap device: tap-" << name;
-    return false;
+  if (spec->bridge_type == BridgeType::kTap) {
+    // create tap device, with multi_queue so the bridge can serve it from
+    // several cores
+    if (!Netlink::CreateTap(tap_name, true, error)) {
+      netlink.DeleteLink(bridge_name);
+      netlink.Commit();
+      return false;
+    }
+    // set tap device to promisc mode and connect it to the bridge
+    netlink.SetLink(tap_name, true, true, bridge_name);
+  } else {
+    // the packet rings attach to the host end of the veth, which needs a
+    // known name
+    spec->config["lxc.net.0.veth.pair"] = "veth-" + spec->name;
   }
-  // set tap device to promisc mode
-  if (system(("ip link set dev tap-" + name + " promisc on up").c_str()) != 0) {
-    ALOG_ERROR << "Failed to set tap device to promisc mode: tap-" << name;
+  // set bridge to up
+  netlink.SetLink(bridge_name, true, false);
+  if (!netlink.Commit(error)) {
+    if (spec->bridge_type == BridgeType::kTap) {
+      netlink.DeleteLink(tap_name);
+    }
+    netlink.DeleteLink(bridge_name);
+    netlink.Commit();
     return false;
   }
-  // connect tap device to bridge
-  if (system(("ip link set dev tap-" + name + " master br-" + name).c_str()) !=
-      0) {
-    ALOG_ERROR << "Failed to connect tap device to bridge: tap-" << name;
-    return false;
+  return true;
+}
+
+void MachineManager::TearDownNetwork(const MachineSpec& spec) {
+  std::lock_guard<std::mutex> lock(Instance().netlink_mutex_);
+  Netlink& netlink = Instance().netlink_;
+  for (const std::string& link : {"tap-" + spec.name, "br-" + spec.name}) {
+    if (if_nametoindex(link.c_str()) != 0) {
+      netlink.DeleteLink(link);
+    }
   }
-  // set bridge to up
-  if (system(("ip link set dev br-" + name + " up").c_str()) != 0) {
-    ALOG_ERROR << "Failed to set bridge to up: br-" << name;
-    return false;
+  std::string failure;
+  if (!netlink.Commit(&failure)) {
+    ALOG_WARNING << "Failed to remove links of " << spec.name << ": "
+                 << failure;
   }
+}
 
+std::shared_ptr<MachineManager::LinuxContainer>
+MachineManager::GetBaseContainer(const MachineSpec& spec, std::string* error) {
+  std::string key = spec.template_name;
+  for (const auto& arg : spec.template_args) {
+    key += " " + arg;
+  }
+  std::shared_ptr<BaseContainer> base;
+  {
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    auto& slot = Instance().bases_[key];
+    if (slot == nullptr) {
+      slot = std::make_shared<BaseContainer>();
+    }
+    base = slot;
+  }
+  // Machines of the same template wait here while the first one creates
+  // the base.
+  std::lock_guard<std::mutex> lock(base->mutex);
+  if (base->container != nullptr) {
+    return base->container;
+  }
+  // FNV-1a, so the name is the same for every run and a base created by an
+  // earlier run is reused.
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : key) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "araneid-base-%016llx",
+           static_cast<unsigned long long>(hash));
   auto container = std::make_shared<LinuxContainer>(name);
-  for (const auto& [key, value] : config) {
-    container->SetConfig(key, value);
+  if (!container->IsDefined()) {
+    ALOG_INFO << "Creating base container " << name << " from " << key;
+    if (!container->Create(spec.template_name, spec.template_args)) {
+      *error = "failed to create the base container from " + key;
+      return nullptr;
+    }
+  }
+  base->container = container;
+  return container;
+}
+
+bool MachineManager::CreateContainer(const MachineSpec& spec,
+                                     std::string* error) {
+  // Whatever a failed create or clone left on disk is destroyed, so the
+  // name can be used again, but never a container that was there before.
+  auto container = std::make_shared<LinuxContainer>(spec.name);
+  bool existed = container->IsDefined();
+  auto discard = [&]() {
+    if (!existed && container->IsDefined()) {
+      container->Destroy();
+    }
+    return false;
+  };
+  if (spec.clone_from_base) {
+    std::shared_ptr<LinuxContainer> base = GetBaseContainer(spec, error);
+    if (base == nullptr) {
+      return false;
+    }
+    std::shared_ptr<LinuxContainer> clone = base->Clone(spec.name);
+    if (clone == nullptr) {
+      *error = "failed to clone the base container";
+      return discard();
+    }
+    container = clone;
+  }
+  for (const auto& [key, value] : spec.config) {
+    if (!container->SetConfig(key, value)) {
+      *error = "failed to set " + key + " = " + value;
+      return discard();
+    }
+  }
+  if (spec.time_dilation > 1.0) {
+    // Every process of the machine inherits the slowed clocks of run.sh,
+    // instead of slowing them down from its own start.
+    std::ostringstream rate;
+    rate << "FAKETIME=+0 x" << 1.0 / spec.time_dilation;
+    for (const std::string& variable :
+         {"LD_PRELOAD=" + spec.faketime_library, rate.str(),
+          std::string("FAKETIME_DONT_RESET=1")}) {
+      if (!container->SetConfig("lxc.environment", variable)) {
+        *error = "failed to set lxc.environment = " + variable;
+        return discard();
+      }
+    }
+  }
+  // a clone already exists on disk, only its config changed
+  if (spec.clone_from_base && !container->SaveConfig()) {
+    *error = "failed to save the config";
+    return discard();
   }
-  container->Create(template_name, template_args);
-  container->Start();
-  Instance().containers_[name] = container;
+  if (!spec.clone_from_base &&
+      !container->Create(spec.template_name, spec.template_args)) {
+    *error = "failed to create the container from " + spec.template_name;
+    return discard();
+  }
+  std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+  Instance().created_[spec.name] = container;
   return true;
 }
 
+bool MachineManager::StartContainer(const MachineSpec& spec,
+                                    std::string* error) {
+  std::shared_ptr<LinuxContainer> container;
+  {
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    container = Instance().created_[spec.name];
+  }
+  // A machine that fails to start stays in created_, so it is still
+  // destroyed with the others.
+  if (spec.start && !container->Start()) {
+    *error = "failed to start the container";
+    return false;
+  }
+  // the veth only exists once the container is started
+  std::shared_ptr<Bridge> bridge;
+  if (spec.bridge_type == BridgeType::kTap) {
+    bridge = std::make_shared<TapBridge>("tap-" + spec.name, kTapQueues);
+  } else if (spec.start) {
+    bridge = std::make_shared<PacketRingBridge>("veth-" + spec.name);
+  }
+  std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+  Instance().created_.erase(spec.name);
+  Instance().containers_[spec.name] = container;
+  if (bridge != nullptr) {
+    Instance().bridges_[spec.name] = bridge;
+  }
+  return true;
+}
+
+namespace {
+
+// Run `task` for every index in [0, count) on at most `workers` threads.
+void ForEachConcurrently(size_t count, size_t workers,
+                         const std::function<void(size_t)>& task) {
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < std::min(workers, count); ++i) {
+    threads.emplace_back([&]() {
+      for (size_t k = next++; k < count; k = next++) {
+        task(k);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Schedules the steps of provisioning. A machine is created (network and
+// container) and then started, and each step is a job for the workers.
+class ProvisionPipeline {
+ public:
+  // Run a step of a machine, the times it took and the reason of a failure
+  // go to `report`.
+  using Step = std::function<bool(MachineSpec* spec, bool start,
+                                  ProvisionReport* report)>;
+
+  ProvisionPipeline(std::vector<MachineSpec> specs, Step step)
+      : specs_(std::move(specs)),
+        step_(step),
+        machines_(specs_.size()),
+        reports_(specs_.size()),
+        finished_(0) {}
+
+  std::vector<ProvisionReport> Run(size_t workers) {
+    begin_ = Clock::Now();
+    Plan();
+    workers = std::max<size_t>(1, std::min(workers, specs_.size()));
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; ++i) {
+      threads.emplace_back(&ProvisionPipeline::Work, this);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    return std::move(reports_);
+  }
+
+ private:
+  enum class State { kPending, kCreated, kFinished };
+  struct Machine {
+    State state = State::kPending;
+    size_t unstarted_dependencies = 0;
+    std::string failed_dependency;
+    std::vector<size_t> dependents;
+    // Machines of the same template waiting for this one to be created.
+    std::vector<size_t> same_template;
+  };
+  struct Job {
+    size_t machine;
+    bool start;
+  };
+
+  // Link the machines, fail the ones that can never start and queue the
+  // first machine of every template. Called before the workers start.
+  void Plan() {
+    std::unordered_map<std::string, size_t> index;
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      reports_[i].name = specs_[i].name;
+      if (!index.emplace(specs_[i].name, i).second) {
+        Fail(i, "duplicate machine name");
+      }
+    }
+    // Every edge is linked before any machine fails, so the failure
+    // reaches all of its dependents.
+    std::vector<std::pair<size_t, std::string>> unknown;
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      for (const auto& dependency : specs_[i].depends_on) {
+        auto it = index.find(dependency);
+        if (it == index.end()) {
+          // machines provisioned earlier are already started
+          if (MachineManager::GetBridge(dependency) == nullptr) {
+            unknown.emplace_back(i, dependency);
+          }
+          continue;
+        }
+        machines_[i].unstarted_dependencies++;
+        machines_[it->second].dependents.push_back(i);
+      }
+    }
+    for (const auto& [machine, dependency] : unknown) {
+      Fail(machine, "unknown dependency " + dependency);
+    }
+    // Machines left over by a topological sort are on a cycle.
+    std::vector<size_t> remaining(specs_.size());
+    std::vector<size_t> order;
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      remaining[i] = machines_[i].unstarted_dependencies;
+      if (remaining[i] == 0) {
+        order.push_back(i);
+      }
+    }
+    for (size_t k = 0; k < order.size(); ++k) {
+      for (size_t dependent : machines_[order[k]].dependents) {
+        if (--remaining[dependent] == 0) {
+          order.push_back(dependent);
+        }
+      }
+    }
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      if (remaining[i] > 0) {
+        Fail(i, "dependency cycle");
+      }
+    }
+    std::unordered_map<std::string, size_t> first_of_template;
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      if (machines_[i].state == State::kFinished) {
+        continue;
+      }
+      std::string key = specs_[i].template_name;
+      for (const auto& arg : specs_[i].template_args) {
+        key += " " + arg;
+      }
+      auto [it, first] = first_of_template.emplace(key, i);
+      if (first) {
+        jobs_.push_back({i, false});
+      } else {
+        machines_[it->second].same_template.push_back(i);
+      }
+    }
+  }
+
+  void Work() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {
+          return !jobs_.empty() || finished_ == specs_.size();
+        });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = jobs_.front();
+        jobs_.pop_front();
+      }
+      ProvisionReport step;
+      bool success = step_(&specs_[job.machine], job.start, &step);
+      std::lock_guard<std::mutex> lock(mutex_);
+      ProvisionReport& report = reports_[job.machine];
+      report.network_time += step.network_time;
+      report.create_time += step.create_time;
+      report.start_time += step.start_time;
+      if (job.start) {
+        Started(job.machine, success, step.error);
+      } else {
+        Created(job.machine, success, step.error);
+      }
+      cv_.notify_all();
+    }
+  }
+
+  // All called with the mutex held, or before the workers start.
+  void Created(size_t machine, bool success, const std::string& error) {
+    Machine& m = machines_[machine];
+    // the image is in the cache now, or the others find out on their own
+    // why it can't be created
+    for (size_t other : m.same_template) {
+      jobs_.push_back({other, false});
+    }
+    m.same_template.clear();
+    if (!success) {
+      Fail(machine, error);
+    } else if (!m.failed_dependency.empty()) {
+      Fail(machine, "dependency " + m.failed_dependency + " failed");
+    } else {
+      m.state = State::kCreated;
+      if (m.unstarted_dependencies == 0) {
+        jobs_.push_back({machine, true});
+      }
+    }
+  }
+
+  void Started(size_t machine, bool success, const std::string& error) {
+    if (!success) {
+      Fail(machine, error);
+      return;
+    }
+    Finish(machine, true);
+    for (size_t dependent : machines_[machine].dependents) {
+      Machine& d = machines_[dependent];
+      if (--d.unstarted_dependencies == 0 && d.state == State::kCreated &&
+          d.failed_dependency.empty()) {
+        jobs_.push_back({dependent, true});
+      }
+    }
+  }
+
+  void Fail(size_t machine, const std::string& error) {
+    if (machines_[machine].state == State::kFinished) {
+      return;
+    }
+    reports_[machine].error = error;
+    ALOG_WARNING << "Failed to provision " << specs_[machine].name << ": "
+                 << error;
+    Finish(machine, false);
+    // Dependents being created fail once they are, created ones now.
+    for (size_t dependent : machines_[machine].dependents) {
+      Machine& d = machines_[dependent];
+      if (d.failed_dependency.empty()) {
+        d.failed_dependency = specs_[machine].name;
+      }
+      if (d.state == State::kCreated) {
+        Fail(dependent, "dependency " + specs_[machine].name + " failed");
+      }
+    }
+  }
+
+  void Finish(size_t machine, bool success) {
+    machines_[machine].state = State::kFinished;
+    reports_[machine].success = success;
+    reports_[machine].ready_after = Clock::Now() - begin_;
+    finished_++;
+  }
+
+  std::vector<MachineSpec> specs_;
+  Step step_;
+  TimePoint begin_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> jobs_;
+  std::vector<Machine> machines_;
+  std::vector<ProvisionReport> reports_;
+  size_t finished_;
+};
+
+}  // namespace
+
+std::vector<ProvisionReport> MachineManager::CreateMachines(
+    std::vector<MachineSpec> specs, size_t workers) {
+  size_t count = specs.size();
+  ProvisionPipeline pipeline(
+      std::move(specs),
+      [](MachineSpec* spec, bool start, ProvisionReport* report) {
+        TimePoint begin = Clock::Now();
+        if (start) {
+          bool started = StartContainer(*spec, &report->error);
+          report->start_time = Clock::Now() - begin;
+          return started;
+        }
+        if (!SetUpNetwork(spec, &report->error)) {
+          return false;
+        }
+        TimePoint networked = Clock::Now();
+        report->network_time = networked - begin;
+        bool created = CreateContainer(*spec, &report->error);
+        report->create_time = Clock::Now() - networked;
+        if (!created) {
+          TearDownNetwork(*spec);
+        }
+        return created;
+      });
+  std::vector<ProvisionReport> reports = pipeline.Run(workers);
+  size_t succeeded = 0;
+  TimeDelta slowest = TimeDelta::Zero();
+  for (const auto& report : reports) {
+    if (!report.success) {
+      continue;
+    }
+    succeeded++;
+    slowest = std::max(slowest, report.ready_after);
+    ALOG_INFO << "Machine " << report.name << " ready after "
+              << report.ready_after.Millis() << " ms (network "
+              << report.network_time.Millis() << " ms, create "
+              << report.create_time.Millis() << " ms, start "
+              << report.start_time.Millis() << " ms)";
+  }
+  ALOG_INFO << "Provisioned " << succeeded << " of " << count
+            << " machines in " << slowest.Millis() << " ms";
+  return reports;
+}
+
+std::shared_ptr<Bridge> MachineManager::GetBridge(const std::string& name) {
+  std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+  auto it = Instance().bridges_.find(name);
+  if (it == Instance().bridges_.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
 void MachineManager::StartMachines() {
-  if (system("sh -c 'pushd /proc/sys/net/bridge && echo 0 | tee bridge-nf-* && "
-             "popd'") != 0) {
-    ALOG_ERROR << "Failed to set bridge-nf-call-iptables to 0";
+  // bridged frames must not go through iptables and friends
+  glob_t paths;
+  if (glob("/proc/sys/net/bridge/bridge-nf-*", 0, nullptr, &paths) != 0) {
+    ALOG_WARNING << "No bridge-nf-call-* settings, is br_netfilter loaded?";
+  } else {
+    for (size_t i = 0; i < paths.gl_pathc; ++i) {
+      std::ofstream setting(paths.gl_pathv[i]);
+      if (!(setting << "0" << std::endl)) {
+        ALOG_WARNING << "Failed to set " << paths.gl_pathv[i] << " to 0";
+      }
+    }
+    globfree(&paths);
+  }
+  std::vector<std::shared_ptr<LinuxContainer>> stopped;
+  {
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    for (const auto& [name, container] : Instance().containers_) {
+      auto pooled = Instance().pool_.find(name);
+      if (pooled != Instance().pool_.end() && !pooled->second.leased) {
+        continue;
+      }
+      if (!container->IsRunning()) {
+        stopped.push_back(container);
+      }
+    }
+  }
+  ForEachConcurrently(stopped.size(), kStartWorkers,
+                      [&](size_t i) { stopped[i]->Start(); });
+}
+
+std::vector<ProvisionReport> MachineManager::WarmUp(
+    const MachineSpec& prototype, size_t count, size_t workers) {
+  std::string mount_source;
+  std::string mount_rest;
+  auto mount = prototype.config.find("lxc.mount.entry");
+  if (mount != prototype.config.end()) {
+    size_t end = mount->second.find(' ');
+    mount_source = mount->second.substr(0, end);
+    mount_rest =
+        end == std::string::npos ? "" : mount->second.substr(end);
+  }
+  // Only the overlay of a clone can be dropped when a machine is reset.
+  if (!prototype.clone_from_base) {
+    ALOG_WARNING << "Pool machines of " << prototype.name
+                 << " are cloned from the base container anyway";
+  }
+  std::vector<MachineSpec> specs;
+  std::vector<PooledMachine> machines;
+  for (size_t i = 0; i < count; ++i) {
+    MachineSpec spec = prototype;
+    spec.name = prototype.name + std::to_string(i);
+    spec.clone_from_base = true;
+    spec.start = false;
+    spec.depends_on.clear();
+    PooledMachine machine;
+    machine.bridge_type = prototype.bridge_type;
+    if (!mount_source.empty()) {
+      machine.mount_source = mount_source;
+      machine.mount_copy =
+          (std::filesystem::temp_directory_path() / "araneid-pool" / spec.name)
+              .string();
+      spec.config["lxc.mount.entry"] = machine.mount_copy + mount_rest;
+    }
+    specs.push_back(std::move(spec));
+    machines.push_back(std::move(machine));
+  }
+  std::vector<ProvisionReport> reports = CreateMachines(specs, workers);
+  for (size_t i = 0; i < count; ++i) {
+    if (!reports[i].success) {
+      continue;
+    }
+    if (!ResetMachine(specs[i].name, machines[i])) {
+      DropFromPool(specs[i].name);
+      reports[i].success = false;
+      reports[i].error = "its rootfs cannot be reset";
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    Instance().pool_[specs[i].name] = machines[i];
+  }
+  return reports;
+}
+
+void MachineManager::DropFromPool(const std::string& name) {
+  std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+  auto it = Instance().containers_.find(name);
+  if (it != Instance().containers_.end()) {
+    Instance().created_[name] = it->second;
+    Instance().containers_.erase(it);
+  }
+  Instance().pool_.erase(name);
+}
+
+bool MachineManager::ResetMachine(const std::string& name,
+                                  const PooledMachine& machine) {
+  std::shared_ptr<LinuxContainer> container;
+  {
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    container = Instance().containers_[name];
+  }
+  container->Stop();
+  // An overlay clone keeps its changes in the upper directory, the last
+  // part of "overlay:<base rootfs>:<upper>".
+  // A native snapshot, the fallback of Clone(), has no upper directory.
+  std::string rootfs = container->GetConfig("lxc.rootfs.path");
+  if (rootfs.rfind("overlay", 0) != 0) {
+    ALOG_WARNING << "Not pooling " << name << ", its rootfs " << rootfs
+                 << " is not an overlay and cannot be reset";
+    return false;
+  }
+  std::error_code error;
+  std::filesystem::path upper = rootfs.substr(rootfs.rfind(':') + 1);
+  for (const auto& entry : std::filesystem::directory_iterator(upper, error)) {
+    std::filesystem::remove_all(entry.path(), error);
+  }
+  container->ReloadConfig();
+  if (!machine.mount_copy.empty()) {
+    std::filesystem::remove_all(machine.mount_copy, error);
+    std::filesystem::create_directories(machine.mount_copy, error);
+    std::filesystem::copy(machine.mount_source, machine.mount_copy,
+                          std::filesystem::copy_options::recursive |
+                              std::filesystem::copy_options::copy_symlinks,
+                          error);
+    if (error) {
+      ALOG_WARNING << "Failed to copy " << machine.mount_source << " for "
+                   << name << ": " << error.message();
+    }
+  }
+  return true;
+}
+
+std::vector<std::string> MachineManager::Lease(
+    const std::vector<std::unordered_map<std::string, std::string>>& configs,
+    size_t workers) {
+  std::vector<std::string> names;
+  std::vector<std::shared_ptr<LinuxContainer>> containers;
+  std::vector<BridgeType> bridge_types;
+  {
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    for (auto& [name, machine] : Instance().pool_) {
+      if (names.size() == configs.size()) {
+        break;
+      }
+      if (!machine.leased) {
+        names.push_back(name);
+        containers.push_back(Instance().containers_[name]);
+        bridge_types.push_back(machine.bridge_type);
+      }
+    }
+    if (names.size() < configs.size()) {
+      ALOG_WARNING << "Only " << names.size() << " of " << configs.size()
+                   << " machines are idle in the pool";
+      return {};
+    }
+    for (const auto& name : names) {
+      Instance().pool_[name].leased = true;
+    }
+  }
+  std::atomic<bool> failed(false);
+  ForEachConcurrently(names.size(), workers, [&](size_t i) {
+    for (const auto& [key, value] : configs[i]) {
+      if (!containers[i]->SetConfig(key, value)) {
+        failed.store(true);
+        return;
+      }
+    }
+    if (!containers[i]->Start()) {
+      failed.store(true);
+      return;
+    }
+    if (bridge_types[i] == BridgeType::kPacketRing) {
+      auto bridge = std::make_shared<PacketRingBridge>("veth-" + names[i]);
+      std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+      Instance().bridges_[names[i]] = bridge;
+    }
+  });
+  if (failed.load()) {
+    Release(names, workers);
+    return {};
+  }
+  return names;
+}
+
+void MachineManager::Release(const std::vector<std::string>& names,
+                             size_t workers) {
+  ForEachConcurrently(names.size(), workers, [&](size_t i) {
+    PooledMachine machine;
+    std::shared_ptr<Bridge> bridge;
+    {
+      std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+      auto it = Instance().pool_.find(names[i]);
+      if (it == Instance().pool_.end() || !it->second.leased) {
+        ALOG_WARNING << names[i] << " is not leased from the pool";
+        return;
+      }
+      machine = it->second;
+      auto found = Instance().bridges_.find(names[i]);
+      if (found != Instance().bridges_.end()) {
+        bridge = found->second;
+        // packet rings are bound to the veth of one run
+        if (machine.bridge_type == BridgeType::kPacketRing) {
+          Instance().bridges_.erase(found);
+        }
+      }
+    }
+    if (bridge != nullptr) {
+      bridge->Stop();
+      bridge->SetBridgedDevice(nullptr);
+    }
+    if (!ResetMachine(names[i], machine)) {
+      DropFromPool(names[i]);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    Instance().pool_[names[i]].leased = false;
+  });
+}
+
+void MachineManager::DestroyMachines() {
+  std::vector<std::string> names;
+  std::vector<std::shared_ptr<LinuxContainer>> containers;
+  std::vector<std::shared_ptr<Bridge>> bridges;
+  std::vector<std::string> mount_copies;
+  {
+    std::lock_guard<std::mutex> lock(Instance().machines_mutex_);
+    for (auto& [name, container] : Instance().containers_) {
+      names.push_back(name);
+      containers.push_back(container);
+    }
+    for (auto& [name, container] : Instance().created_) {
+      names.push_back(name);
+      containers.push_back(container);
+    }
+    for (auto& [name, bridge] : Instance().bridges_) {
+      bridges.push_back(bridge);
+    }
+    for (auto& [name, machine] : Instance().pool_) {
+      mount_copies.push_back(machine.mount_copy);
+    }
+    Instance().containers_.clear();
+    Instance().created_.clear();
+    Instance().bridges_.clear();
+    Instance().pool_.clear();
+  }
+  for (auto& bridge : bridges) {
+    bridge->Stop();
+  }
+  ForEachConcurrently(containers.size(), kStartWorkers, [&](size_t i) {
+    if (containers[i]->Stop()) {
+      containers[i]->Destroy();
+    }
+  });
+  std::error_code error;
+  for (const auto& copy : mount_copies) {
+    if (!copy.empty()) {
+      std::filesystem::remove_all(copy, error);
+    }
+  }
+  // Links of every machine are removed in one batch.
+  std::lock_guard<std::mutex> lock(Instance().netlink_mutex_);
+  Netlink& netlink = Instance().netlink_;
+  for (const auto& name : names) {
+    for (const std::string& link : {"tap-" + name, "br-" + name}) {
+      if (if_nametoindex(link.c_str()) != 0) {
+        netlink.DeleteLink(link);
+      }
+    }
   }
-  for (const auto& [name, container] : Instance().containers_) {
-    container->Start();
+  std::string failure;
+  if (!netlink.Commit(&failure)) {
+    ALOG_WARNING << "Failed to remove links: " << failure;
   }
+  ALOG_INFO << "Destroyed " << names.size() << " machines";
 }
 
 }  // namespace araneid
\ No newline at end of file
@@ -4,11 +4,63 @@
 #include <lxc/lxccontainer.h>
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "base/time.hpp"
+#include "netlink.hpp"
+
 namespace araneid {
+class Bridge;
+
+// How frames of a machine reach the simulated network.
+enum class BridgeType {
+  // A TAP device attached to the machine's network bridge.
+  kTap,
+  // AF_PACKET rings on the host end of the machine's veth, named
+  // "veth-" + name. Cheaper per frame, but frames wait up to 1 ms in the
+  // ring under light load.
+  kPacketRing,
+};
+
+// Everything needed to create a machine, see MachineManager::CreateMachine().
+struct MachineSpec {
+  std::string name;
+  std::unordered_map<std::string, std::string> config;
+  std::string template_name = "download";
+  std::vector<std::string> template_args = {"--dist", "ubuntu"};
+  BridgeType bridge_type = BridgeType::kTap;
+  // Clone the machine from a base container of its template instead of
+  // running the template for it, see MachineManager::CreateMachines().
+  bool clone_from_base = true;
+  // Leave the machine stopped after it is created, like the machines of a
+  // warm pool.
+  bool start = true;
+  // Machines that must be started before this one, like the server its
+  // clients connect to.
+  std::vector<std::string> depends_on;
+  // Run the clocks of the machine this many times slower, like those of a
+  // dilated simulator, see Simulator::SetTimeDilation(). Its processes are
+  // slowed down by libfaketime, which the rootfs must have at
+  // `faketime_library`.
+  double time_dilation = 1.0;
+  std::string faketime_library =
+      "/usr/lib/x86_64-linux-gnu/faketime/libfaketime.so.1";
+};
+
+// How provisioning a machine went, with the time spent in each step.
+struct ProvisionReport {
+  std::string name;
+  bool success = false;
+  std::string error;
+  TimeDelta network_time = TimeDelta::Zero();
+  TimeDelta create_time = TimeDelta::Zero();
+  TimeDelta start_time = TimeDelta::Zero();
+  // Since the pipeline began, until the machine was started or failed.
+  TimeDelta ready_after = TimeDelta::Zero();
+};
 
 // Pure static class to manage the virtual machine.
 // It must be executed with root privilege.
@@ -39,14 +91,58 @@ class MachineManager {
   // 0 0"
   // Note that the config["lxc.mount.entry"] directory will contain all files
   // you need in this LXC, and `run.sh` will be executed in this directory.
+  // The bridge of the machine is created along with it, see GetBridge().
+  // The machine is started as well.
   static bool CreateMachine(std::string name,
                             std::unordered_map<std::string, std::string> config,
                             std::string template_name = "download",
                             std::vector<std::string> template_args = {
-                                "--dist", "ubuntu"});
+                                "--dist", "ubuntu"},
+                            BridgeType bridge_type = BridgeType::kTap);
+  // Create and start the machines concurrently on at most `workers`
+  // threads, so the cold start is bounded by the slowest machine instead of
+  // the sum of all. The first machine of every template is created before
+  // the others using it, so the image is downloaded once and the others
+  // take it from the cache. A machine is started once all it depends on are
+  // started. The reports are in the order of `specs`.
+  // The template runs once, for a base container that is never started,
+  // and machines are copy-on-write snapshots of it, so an extra machine
+  // costs about the same time and disk whatever the template. Base
+  // containers are kept and reused by later runs.
+  static std::vector<ProvisionReport> CreateMachines(
+      std::vector<MachineSpec> specs, size_t workers = 8);
+  // A warm pool keeps stopped machines with their links and bridges in
+  // place, so a scenario only pays for starting them.
+  // Create `count` stopped machines for the pool, named prototype.name
+  // followed by their index. If the prototype has a lxc.mount.entry, every
+  // machine mounts its own copy of the directory. Machines are always cloned
+  // from the base container, and one whose rootfs is not an overlay is
+  // reported as failed and left out of the pool.
+  static std::vector<ProvisionReport> WarmUp(const MachineSpec& prototype,
+                                             size_t count, size_t workers = 8);
+  // Start one idle machine of the pool per config, with the config applied
+  // on top of the prototype's, like its IP address. Returns their names, or
+  // nothing if there are not enough idle machines or one failed to start.
+  static std::vector<std::string> Lease(
+      const std::vector<std::unordered_map<std::string, std::string>>&
+          configs,
+      size_t workers = 8);
+  // Reset leased machines and put them back into the pool: their processes
+  // are stopped, changes to their rootfs dropped, their config restored and
+  // their mount directory copied again. Their bridges are stopped and
+  // detached from their devices. A machine that cannot be reset is left out
+  // of the pool.
+  static void Release(const std::vector<std::string>& names,
+                      size_t workers = 8);
+  // Stop and destroy every machine, including the pool, and remove their
+  // links. Base containers are kept for later runs.
+  static void DestroyMachines();
+  // The bridge between the machine and the simulated network, nullptr for
+  // an unknown machine. It still has to be given a device and started.
+  static std::shared_ptr<Bridge> GetBridge(const std::string& name);
   // Before starting a machine, the related network bridge and tap
-  // device will be set up.
-  //
+  // device will be set up. Machines that are not running yet are started
+  // concurrently, except idle machines of the pool.
   static void StartMachines();
 
  private:
@@ -55,15 +151,73 @@ class MachineManager {
   class LinuxContainer {
    public:
     explicit LinuxContainer(std::string name);
-    void SetConfig(const std::string& key, const std::string& value);
-    void Create(const std::string& template_name,
+    // Takes over a container handle, which must not be nullptr.
+    explicit LinuxContainer(lxc_container* container);
+    bool SetConfig(const std::string& key, const std::string& value);
+    // Write the config set since the container was created to disk.
+    bool SaveConfig();
+    bool Create(const std::string& template_name,
                 std::vector<std::string> template_args);
-    void Start();
+    // A snapshot of this container, which must be stopped. Returns nullptr
+    // on failure.
+    std::shared_ptr<LinuxContainer> Clone(const std::string& name);
+    bool Start();
+    bool Stop();
+    bool Destroy();
+    bool IsRunning();
+    bool IsDefined();
+    std::string GetConfig(const std::string& key);
+    // Drop config set in memory and load the saved one again.
+    bool ReloadConfig();
 
    private:
     std::shared_ptr<lxc_container> container_;
   };
+  // A base container of a template, created by the first machine that needs
+  // it.
+  struct BaseContainer {
+    std::mutex mutex;
+    std::shared_ptr<LinuxContainer> container;
+  };
+  static std::shared_ptr<LinuxContainer> GetBaseContainer(
+      const MachineSpec& spec, std::string* error);
+  struct PooledMachine {
+    BridgeType bridge_type;
+    // The prototype's mount directory and this machine's copy of it, empty
+    // if it has none.
+    std::string mount_source;
+    std::string mount_copy;
+    bool leased = false;
+  };
+  // Put a stopped pool machine back into its initial state. Returns false
+  // if its rootfs is not an overlay, so its changes cannot be dropped.
+  static bool ResetMachine(const std::string& name,
+                           const PooledMachine& machine);
+  // Keep a machine out of the pool and never start it again, it is still
+  // destroyed with the others.
+  static void DropFromPool(const std::string& name);
+  // The steps of provisioning a machine, each returns false and describes
+  // the failure in `error`.
+  static bool SetUpNetwork(MachineSpec* spec, std::string* error);
+  // Delete the links of a machine that failed to be created.
+  static void TearDownNetwork(const MachineSpec& spec);
+  // Destroys what a failed create or clone left behind.
+  static bool CreateContainer(const MachineSpec& spec, std::string* error);
+  static bool StartContainer(const MachineSpec& spec, std::string* error);
+
+  // Guards the machines, provisioning runs on several threads.
+  std::mutex machines_mutex_;
   std::unordered_map<std::string, std::shared_ptr<LinuxContainer>> containers_;
+  // Created and waiting for their dependencies to be started. Machines that
+  // fail to be provisioned are left here, so they are never started.
+  std::unordered_map<std::string, std::shared_ptr<LinuxContainer>> created_;
+  // By template and template arguments.
+  std::unordered_map<std::string, std::shared_ptr<BaseContainer>> bases_;
+  std::unordered_map<std::string, PooledMachine> pool_;
+  std::unordered_map<std::string, std::shared_ptr<Bridge>> bridges_;
+  // Links are provisioned through it instead of `ip`.
+  std::mutex netlink_mutex_;
+  Netlink netlink_;
 };
 
 }  // namespace araneid